@@ -0,0 +1,33 @@
+// Ahead-of-time export, step one: builds the function and its gradient, and writes them as C code.
+// See `aot` in the Makefile for the whole workflow.
+
+#include <iostream>
+
+#ifndef FNCAS_JIT
+#define FNCAS_JIT CLANG
+#endif
+
+#include "../fncas/fncas.h"
+
+template <typename T> typename fncas::output<T>::type f(const T& x) {
+  return (x[0] + x[1] * 2) * (x[0] + x[1] * 2);
+}
+
+int main(int argc, char** argv) {
+  const std::string filebase = argc >= 2 ? argv[1] : "demo_f";
+  fncas::x x(2);
+  fncas::f_intermediate fi = f(x);
+  fncas::g_intermediate gi = fncas::g_intermediate(x, fi);
+  // The value and the gradient, as a single program with three roots.
+  std::vector<fncas::node_index_type> roots(1, fi.f_.index());
+  for (const fncas::node& d : gi.g_) {
+    roots.push_back(d.index());
+  }
+  try {
+    fncas::export_c_code(roots, "demo_f_", filebase);
+  } catch (const fncas::file_error& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  std::cout << "Exported " << filebase << ".c and " << filebase << ".h." << std::endl;
+}
@@ -0,0 +1,15 @@
+// Ahead-of-time export, step two: a binary using the exported function, linked against it as a static library.
+// It needs neither FNCAS nor a compiler at runtime.
+
+#include <iostream>
+#include <vector>
+
+#include "aot/demo_f.h"
+
+int main() {
+  const std::vector<double> x({3, 3});
+  std::vector<double> a(demo_f_dim());
+  std::cout << "AOT compiled:  f(3, 3) == " << demo_f_eval(&x[0], &a[0]) << std::endl;
+  std::cout << "AOT gradient: df(3, 3) == { " << a[demo_f_roots()[1]] << ", " << a[demo_f_roots()[2]] << " }."
+            << std::endl;
+}
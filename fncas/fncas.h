@@ -4,6 +4,7 @@
 // * c++11, use g++ --std=c++11
 // * Boost, sudo apt-get install libboost-dev
 // * -fno-strict-aliasing, to avoid warnings when compiling with g++.
+// * -pthread, for the multithreaded evaluator in fncas_parallel.h.
 
 #ifndef FNCAS_H
 #define FNCAS_H
@@ -11,6 +12,17 @@
 #include "fncas_base.h"
 #include "fncas_node.h"
 #include "fncas_differentiate.h"
+#include "fncas_optimize.h"
+#include "fncas_math.h"
+#include "fncas_tape.h"
+#include "fncas_parallel.h"
+#include "fncas_stream.h"
+#include "fncas_serialize.h"
+#include "fncas_storage.h"
+#include "fncas_checkpoint.h"
+#include "fncas_static.h"
+#include "fncas_counters.h"
+#include "fncas_profile.h"
 #include "fncas_jit.h"
 
 #endif
@@ -3,14 +3,56 @@
 #ifndef FNCAS_BASE_H
 #define FNCAS_BASE_H
 
-#include <vector>
+#include <algorithm>
+#include <cstdint>
 #include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
 
 namespace fncas {
 
 typedef int64_t node_index_type;  // Allow 4B+ nodes, keep the type signed for evaluation algorithms.
 typedef double fncas_value_type;
 
+// The precisions the functions can be evaluated in, the graph and its constants are always kept in double.
+// The evaluators templated on the precision take `float`, `double`, or `mixed_precision`, which keeps the values
+// in single precision and accumulates the sums of n-ary nodes and loops in double precision.
+// These are the tapes, their gradients, the code generated by either backend, and the streamed and checkpointed
+// reverse-mode passes. The interpreter and the forward-mode and symbolic differentiation work in double precision
+// only, keeping their values per node in the internals; the tapes evaluate the same graphs in the other precisions.
+struct mixed_precision {};
+
+template <typename P> struct precision_traits {
+  typedef P value_type;
+  typedef P accumulator_type;
+};
+template <> struct precision_traits<mixed_precision> {
+  typedef float value_type;
+  typedef double accumulator_type;
+};
+
+// converted_input() returns the input in the value type of an evaluator, copied into `buffer` if it is not double.
+template <typename T> const T* converted_input(const std::vector<fncas_value_type>& x, std::vector<T>& buffer) {
+  buffer.assign(x.begin(), x.end());
+  return buffer.data();
+}
+inline const fncas_value_type* converted_input(const std::vector<fncas_value_type>& x,
+                                               std::vector<fncas_value_type>&) {
+  return x.data();
+}
+
+// Thrown when a file FNCAS writes, reads or maps can not be used: missing, unreadable,
+// or not in the format expected.
+struct file_error : std::runtime_error {
+  explicit file_error(const std::string& what) : std::runtime_error(what) {
+  }
+};
+
 class noncopyable {
  public:
   noncopyable() = default;
@@ -20,13 +62,215 @@ class noncopyable {
   noncopyable& operator=(const noncopyable&) = default;
 };
 
-template <typename T> T& growing_vector_access(std::vector<T>& vector, node_index_type index, const T& fill) {
-  if (static_cast<node_index_type>(vector.size()) <= index) {
-    vector.resize(static_cast<size_t>(index + 1), fill);
+// Optional hard limits on the memory FNCAS holds, zero for no limit: the number of nodes, and the bytes reserved
+// by the structures of the internals, see memory_stats(), along with the vector about to grow. The limits are
+// checked before the growth, so that exceeding one fails cleanly rather than when the OOM killer steps in.
+// `on_exceeded` is called with the description of the limit exceeded, and should not return: by default
+// it reports the limit and exits, a service may throw instead, leaving the state as it was before the growth.
+struct memory_limits {
+  uint64_t max_nodes = 0;
+  uint64_t max_bytes = 0;
+  std::function<void(const std::string&)> on_exceeded;
+};
+
+inline memory_limits& memory_limits_singleton() {
+  static memory_limits limits;
+  return limits;
+}
+
+inline void memory_limit_exceeded(const std::string& what) {
+  const memory_limits& limits = memory_limits_singleton();
+  if (limits.on_exceeded) {
+    limits.on_exceeded(what);
+  }
+  std::cerr << "FNCAS memory limit exceeded: " << what << std::endl;
+  exit(-1);
+}
+
+// Where the chunks of a chunked_vector come from instead of the heap, such as a file, see fncas_storage.h.
+// The chunks are zero-filled, and their elements are trivially copyable.
+struct chunk_source : noncopyable {
+  virtual ~chunk_source() = default;
+  virtual void* allocate_chunk(size_t bytes) = 0;
+  virtual void release_chunk(void* chunk, size_t bytes) = 0;
+};
+
+// The allocator of a std::vector taking its buffer from a chunk_source, or from the heap if none is set,
+// for the structures that have to stay contiguous. The buffer is one chunk, allocated anew as the vector grows.
+template <typename T> struct source_allocator {
+  typedef T value_type;
+  typedef std::true_type propagate_on_container_copy_assignment;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+  std::shared_ptr<chunk_source> source_;
+
+  source_allocator() = default;
+  explicit source_allocator(std::shared_ptr<chunk_source> source) : source_(std::move(source)) {
+  }
+  template <typename U> source_allocator(const source_allocator<U>& rhs) : source_(rhs.source_) {
   }
-  return vector[index];
+  T* allocate(size_t n) {
+    return source_ ? static_cast<T*>(source_->allocate_chunk(n * sizeof(T))) : std::allocator<T>().allocate(n);
+  }
+  void deallocate(T* p, size_t n) {
+    if (source_) {
+      source_->release_chunk(p, n * sizeof(T));
+    } else {
+      std::allocator<T>().deallocate(p, n);
+    }
+  }
+  template <typename U> bool operator==(const source_allocator<U>& rhs) const {
+    return source_ == rhs.source_;
+  }
+  template <typename U> bool operator!=(const source_allocator<U>& rhs) const {
+    return source_ != rhs.source_;
+  }
+};
+
+// The chunk_source of the buffer of the vector, null for the heap.
+template <typename T, typename A> const chunk_source* source_of(const std::vector<T, A>&) {
+  return nullptr;
+}
+template <typename T> const chunk_source* source_of(const std::vector<T, source_allocator<T>>& vector) {
+  return vector.get_allocator().source_.get();
 }
 
+// Moves the elements of the vector to the `source`, or back to the heap if null.
+template <typename T>
+void set_source(std::vector<T, source_allocator<T>>& vector, std::shared_ptr<chunk_source> source) {
+  std::vector<T, source_allocator<T>> moved{source_allocator<T>(std::move(source))};
+  moved.reserve(vector.capacity());
+  moved.assign(vector.begin(), vector.end());
+  vector.swap(moved);
+}
+
+// A vector of elements kept in chunks of 2^CHUNK_BITS, which never move once allocated: appending is O(1)
+// without copying the elements, and the references to the elements stay valid while the vector grows.
+// The elements appended are value-initialized. clear() keeps the chunks for reuse,
+// as std::vector keeps its capacity.
+// The chunks are allocated on the heap, or from the chunk_source set, which moves the elements there once.
+template <typename T, int CHUNK_BITS = 16> class chunked_vector : noncopyable {
+ public:
+  enum : size_t { chunk_size = static_cast<size_t>(1) << CHUNK_BITS, chunk_mask = chunk_size - 1 };
+
+  template <typename V, typename C> class iterator_impl {
+   public:
+    iterator_impl(C* container, size_t index) : container_(container), index_(index) {
+    }
+    V& operator*() const {
+      return (*container_)[index_];
+    }
+    iterator_impl& operator++() {
+      ++index_;
+      return *this;
+    }
+    bool operator!=(const iterator_impl& rhs) const {
+      return index_ != rhs.index_;
+    }
+
+   private:
+    C* container_;
+    size_t index_;
+  };
+  typedef iterator_impl<T, chunked_vector> iterator;
+  typedef iterator_impl<const T, const chunked_vector> const_iterator;
+
+  size_t size() const {
+    return size_;
+  }
+  bool empty() const {
+    return !size_;
+  }
+  size_t capacity() const {
+    return chunks_.size() * chunk_size;
+  }
+  // The bytes of the table of the chunks, on top of the elements.
+  size_t chunk_table_bytes() const {
+    return chunks_.capacity() * sizeof(T*);
+  }
+  T& operator[](size_t index) {
+    return chunks_[index >> CHUNK_BITS][index & chunk_mask];
+  }
+  const T& operator[](size_t index) const {
+    return chunks_[index >> CHUNK_BITS][index & chunk_mask];
+  }
+  iterator begin() {
+    return iterator(this, 0);
+  }
+  iterator end() {
+    return iterator(this, size_);
+  }
+  const_iterator begin() const {
+    return const_iterator(this, 0);
+  }
+  const_iterator end() const {
+    return const_iterator(this, size_);
+  }
+  // Allocates the chunks for `size` elements at once.
+  void reserve(size_t size) {
+    if (size > capacity()) {
+      chunks_.reserve((size + chunk_mask) >> CHUNK_BITS);
+      while (size > capacity()) {
+        chunks_.push_back(allocate_chunk());
+      }
+    }
+  }
+  void resize(size_t size, const T& fill = T()) {
+    reserve(size);
+    for (size_t i = size_; i < size; ++i) {
+      (*this)[i] = fill;
+    }
+    size_ = size;
+  }
+  T& emplace_back() {
+    if (size_ == capacity()) {
+      chunks_.push_back(allocate_chunk());
+    }
+    T& result = (*this)[size_++];
+    result = T();
+    return result;
+  }
+  void clear() {
+    size_ = 0;
+  }
+  const std::shared_ptr<chunk_source>& source() const {
+    return source_;
+  }
+  // Moves the chunks to the `source`, or back to the heap if null. The elements keep their indexes, not addresses.
+  void set_source(std::shared_ptr<chunk_source> source) {
+    chunked_vector moved;
+    moved.source_ = std::move(source);
+    moved.reserve(capacity());
+    for (size_t c = 0; c < chunks_.size(); ++c) {
+      std::copy(chunks_[c], chunks_[c] + chunk_size, moved.chunks_[c]);
+    }
+    // The old chunks are released by `moved`.
+    chunks_.swap(moved.chunks_);
+    source_.swap(moved.source_);
+  }
+  ~chunked_vector() {
+    release_chunks();
+  }
+
+ private:
+  T* allocate_chunk() {
+    return source_ ? static_cast<T*>(source_->allocate_chunk(chunk_size * sizeof(T))) : new T[chunk_size];
+  }
+  void release_chunks() {
+    for (T* chunk : chunks_) {
+      if (source_) {
+        source_->release_chunk(chunk, chunk_size * sizeof(T));
+      } else {
+        delete[] chunk;
+      }
+    }
+  }
+
+  std::vector<T*> chunks_;
+  size_t size_ = 0;
+  std::shared_ptr<chunk_source> source_;
+};
+
 }  // namespace fncas
 
 #endif  // #ifndef FNCAS_BASE_H
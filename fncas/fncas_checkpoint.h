@@ -0,0 +1,319 @@
+// https://github.com/dkorolev/fncas
+
+// Reverse-mode differentiation within a memory budget, by checkpointing.
+//
+// g_streamed keeps the value and the adjoint of every node of the function, sixteen bytes per node in double
+// precision, twelve in mixed precision and eight in single precision, see `precision_traits`. g_checkpointed
+// splits the block of the nodes, see streamed_block, into aligned segments of 2^k nodes, and keeps the values and
+// the adjoints of one segment at a time, along with the checkpoints: the nodes referred to from the segments after
+// their own. The forward pass saves the values of the checkpoints segment by segment. The backward pass goes from
+// the last segment to the first one, evaluating each segment again from the checkpoints before its sweep.
+//
+// The segments are the largest ones within the budget: the extra compute goes from none, when the whole block fits,
+// to one more forward pass. The block is laid out in place, see streamed_block, so the nodes are not copied.
+// The budget covers what is held on the heap per node besides the nodes: the flags of the block, the byte per node
+// of the planning, and the copy of the nodes where the block is copied, none of which is on the heap once the nodes
+// are in a file. It does not cover the values of the row-dependent nodes of the loops outside the segment, which
+// are kept aside per node.
+
+#ifndef FNCAS_CHECKPOINT_H
+#define FNCAS_CHECKPOINT_H
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+#include "fncas_base.h"
+#include "fncas_node.h"
+#include "fncas_storage.h"
+
+namespace fncas {
+
+// The adjoints of the variables outside the segment: the gradient itself if the adjoints are kept in double,
+// otherwise `buffer`, added to the gradient once the backward pass is done.
+template <typename A> std::vector<A>* variable_adjoints(std::vector<fncas_value_type>& gradient,
+                                                        std::vector<A>& buffer) {
+  buffer.assign(gradient.size(), 0.0);
+  return &buffer;
+}
+inline std::vector<fncas_value_type>* variable_adjoints(std::vector<fncas_value_type>& gradient,
+                                                       std::vector<fncas_value_type>&) {
+  return &gradient;
+}
+template <typename A>
+void add_variable_adjoints(const std::vector<A>& buffer, std::vector<fncas_value_type>& gradient) {
+  for (size_t i = 0; i < gradient.size(); ++i) {
+    gradient[i] += buffer[i];
+  }
+}
+inline void add_variable_adjoints(const std::vector<fncas_value_type>&, std::vector<fncas_value_type>&) {
+}
+
+// The values and the adjoints of the nodes of the segment [segment_begin_, segment_end_), and of the checkpoints,
+// the values kept in the precision `P`, the adjoints in its accumulator type.
+template <typename P> struct checkpoint_state {
+  typedef typename precision_traits<P>::value_type T;
+  typedef typename precision_traits<P>::accumulator_type A;
+  const std::vector<fncas_value_type>* x_ = nullptr;
+  std::vector<A>* gradient_ = nullptr;
+  node_index_type segment_begin_ = 0;
+  node_index_type segment_end_ = 0;
+  std::vector<T> values_;
+  std::vector<A> adjoints_;
+  // The indexes of the checkpoints, sorted, and their values and adjoints.
+  std::vector<node_index_type> checkpoints_;
+  std::vector<T> checkpoint_values_;
+  std::vector<A> checkpoint_adjoints_;
+  std::unordered_map<node_index_type, T> row_values_;
+  std::unordered_map<node_index_type, A> row_adjoints_;
+  // Where the adjoints of the constants outside the segment go.
+  A ignored_adjoint_ = 0.0;
+  // Unused if the adjoints are kept in double, see variable_adjoints().
+  std::vector<A> variable_adjoints_;
+
+  bool in_segment(node_index_type i) const {
+    return i >= segment_begin_ && i < segment_end_;
+  }
+  // The position of the node among the checkpoints, or -1.
+  int64_t checkpoint(node_index_type i) const {
+    const auto it = std::lower_bound(checkpoints_.begin(), checkpoints_.end(), i);
+    return (it != checkpoints_.end() && *it == i) ? (it - checkpoints_.begin()) : -1;
+  }
+};
+
+// The values, as streamed_block reads and writes them. The variables and the constants outside the segment
+// are read from the input and from the nodes.
+template <typename P> struct checkpoint_values {
+  typedef typename precision_traits<P>::value_type T;
+  checkpoint_state<P>& state_;
+  T& operator[](node_index_type i) {
+    if (state_.in_segment(i)) {
+      return state_.values_[static_cast<size_t>(i - state_.segment_begin_)];
+    }
+    const int64_t c = state_.checkpoint(i);
+    return c >= 0 ? state_.checkpoint_values_[static_cast<size_t>(c)] : state_.row_values_[i];
+  }
+  T operator[](node_index_type i) const {
+    if (state_.in_segment(i)) {
+      return state_.values_[static_cast<size_t>(i - state_.segment_begin_)];
+    }
+    const int64_t c = state_.checkpoint(i);
+    if (c >= 0) {
+      return state_.checkpoint_values_[static_cast<size_t>(c)];
+    }
+    const node_impl& f = node_vector_singleton()[i];
+    if (f.type() == type_t::variable) {
+      return static_cast<T>((*state_.x_)[f.variable()]);
+    } else if (f.type() == type_t::value) {
+      return static_cast<T>(f.value());
+    } else {
+      return state_.row_values_.at(i);
+    }
+  }
+};
+
+// The adjoints, as streamed_block accumulates them. The ones of the variables outside the segment go straight
+// to the gradient.
+template <typename P> struct checkpoint_adjoints {
+  checkpoint_state<P>& state_;
+  typename precision_traits<P>::accumulator_type& operator[](node_index_type i) {
+    if (state_.in_segment(i)) {
+      return state_.adjoints_[static_cast<size_t>(i - state_.segment_begin_)];
+    }
+    const int64_t c = state_.checkpoint(i);
+    if (c >= 0) {
+      return state_.checkpoint_adjoints_[static_cast<size_t>(c)];
+    }
+    const node_impl& f = node_vector_singleton()[i];
+    if (f.type() == type_t::variable) {
+      return (*state_.gradient_)[f.variable()];
+    } else if (f.type() == type_t::value) {
+      return state_.ignored_adjoint_;
+    } else {
+      return state_.row_adjoints_[i];
+    }
+  }
+};
+
+// The gradient by reverse-mode differentiation keeping what it holds on the heap within `budget_bytes`,
+// or within the least memory possible if the budget is below it, see peak_bytes(). Matches g_streamed up to
+// the rounding of the order of the summation, the adjoints of the variables outside the segment being added
+// to the gradient one by one. The values are kept in the precision `P`, the adjoints in its accumulator type.
+template <typename P = fncas_value_type> struct basic_g_checkpointed : g {
+  const streamed_block block_;
+  const node_index_type root_;
+  node_index_type segment_size_;
+  // The bytes held on the heap per node while planning the segments.
+  uint64_t plan_bytes_ = 0;
+  mutable checkpoint_state<P> state_;
+
+  basic_g_checkpointed(const x& x_ref, const node& f, uint64_t budget_bytes)
+      : block_(std::vector<node_index_type>(1, f.index())), root_(block_.roots_.front()) {
+    assert(&x_ref == internals_singleton().x_ptr_);
+    plan(budget_bytes);
+    // Once the bytes per node of the planning are freed.
+    state_.checkpoint_values_.resize(state_.checkpoints_.size());
+    state_.checkpoint_adjoints_.resize(state_.checkpoints_.size());
+    state_.values_.resize(static_cast<size_t>(segment_size_));
+    state_.adjoints_.resize(static_cast<size_t>(segment_size_));
+  }
+
+  // The bytes held on the heap at most: the ones of the block, and the ones of the planning, or of the values
+  // and the adjoints kept while computing the gradient.
+  uint64_t peak_bytes() const {
+    return total_bytes(static_cast<uint64_t>(segment_size_), state_.checkpoints_.size());
+  }
+  node_index_type segment_size() const {
+    return segment_size_;
+  }
+  size_t checkpoints() const {
+    return state_.checkpoints_.size();
+  }
+
+  virtual result operator()(const std::vector<fncas_value_type>& x) const {
+    assert(static_cast<int32_t>(x.size()) == block_.dim_);
+    checkpoint_state<P>& s = state_;
+    checkpoint_values<P> V{s};
+    checkpoint_adjoints<P> A{s};
+    result r;
+    r.gradient.assign(dim(), 0.0);
+    s.x_ = &x;
+    s.gradient_ = variable_adjoints(r.gradient, s.variable_adjoints_);
+    node_index_type last = block_.begin_;
+    for (node_index_type b = block_.begin_; b <= root_; b += segment_size_) {
+      forward(b, V);
+      for (size_t c = first_checkpoint(s.segment_begin_); c < first_checkpoint(s.segment_end_); ++c) {
+        s.checkpoint_values_[c] = V[s.checkpoints_[c]];
+      }
+      last = b;
+    }
+    r.value = V[root_];
+    std::fill(s.checkpoint_adjoints_.begin(), s.checkpoint_adjoints_.end(), 0.0);
+    for (node_index_type b = last; b >= block_.begin_; b -= segment_size_) {
+      if (b != last) {
+        forward(b, V);
+      }
+      std::fill(s.adjoints_.begin(), s.adjoints_.end(), 0.0);
+      // The adjoints the segments after this one have accumulated, the nodes before the segment keep accumulating.
+      for (size_t c = first_checkpoint(s.segment_begin_); c < first_checkpoint(s.segment_end_); ++c) {
+        s.adjoints_[static_cast<size_t>(s.checkpoints_[c] - b)] = s.checkpoint_adjoints_[c];
+      }
+      if (b == last) {
+        A[root_] = 1.0;
+      }
+      block_.backward<P>(V, A, r.gradient, s.segment_begin_, s.segment_end_);
+    }
+    add_variable_adjoints(s.variable_adjoints_, r.gradient);
+    s.x_ = nullptr;
+    s.gradient_ = nullptr;
+    return r;
+  }
+  virtual int32_t dim() const {
+    return block_.dim_;
+  }
+
+ private:
+  static uint64_t bytes(uint64_t segment_size, uint64_t checkpoints) {
+    const uint64_t node_bytes = sizeof(typename precision_traits<P>::value_type) +
+                                sizeof(typename precision_traits<P>::accumulator_type);
+    return segment_size * node_bytes + checkpoints * (sizeof(node_index_type) + node_bytes);
+  }
+  uint64_t total_bytes(uint64_t segment_size, uint64_t checkpoints) const {
+    return block_.heap_bytes() +
+           std::max(plan_bytes_ + checkpoints * sizeof(node_index_type), bytes(segment_size, checkpoints));
+  }
+
+  size_t first_checkpoint(node_index_type i) const {
+    return std::lower_bound(state_.checkpoints_.begin(), state_.checkpoints_.end(), i) - state_.checkpoints_.begin();
+  }
+
+  void forward(node_index_type b, checkpoint_values<P>& V) const {
+    state_.segment_begin_ = b;
+    state_.segment_end_ = std::min(b + segment_size_, root_ + 1);
+    block_.forward<P>(*state_.x_, V, state_.segment_begin_, state_.segment_end_);
+  }
+
+  // Picks the largest segments within the budget. A node is a checkpoint for the segments of 2^k nodes if the last
+  // node referring to it is in another segment, that is, if their offsets in the block differ in the bits from k up.
+  // The number of the highest such bit, plus one, is kept per node, so that one pass counts the checkpoints for
+  // every k. The segments being aligned, the checkpoints for 2^k nodes are among the ones for fewer nodes.
+  void plan(uint64_t budget_bytes) {
+    const node_index_type begin = block_.begin_;
+    const node_index_type end = root_ + 1;
+    chunked_vector<int8_t> levels;
+    levels.set_source(node_vector_singleton().source());
+    levels.resize(static_cast<size_t>(end - begin));
+    if (!levels.source()) {
+      plan_bytes_ = levels.capacity() * sizeof(int8_t);
+    }
+    for (node_index_type i = begin; i < end; ++i) {
+      if (!block_.streamed(i)) {
+        // Not in the subgraph, or only refers to the nodes of the body of its loop, which the loop lists as
+        // its invariant ones.
+        continue;
+      }
+      const auto refer = [&levels, begin, i](node_index_type c) {
+        uint64_t bits = static_cast<uint64_t>(c - begin) ^ static_cast<uint64_t>(i - begin);
+        int8_t level = 0;
+        while (bits) {
+          ++level;
+          bits >>= 1;
+        }
+        int8_t& l = levels[static_cast<size_t>(c - begin)];
+        l = std::max(l, level);
+      };
+      const node_impl& f = node_vector_singleton()[i];
+      if (f.type() == type_t::loop) {
+        for (node_index_type c : block_.loops_.at(i).invariant_) {
+          refer(c);
+        }
+      } else {
+        for_each_child(f, refer);
+      }
+    }
+    // The variables and the constants are not checkpointed, their values are at hand.
+    const auto checkpointed = [&levels, begin](node_index_type i, int k) {
+      const type_t type = node_vector_singleton()[i].type();
+      return levels[static_cast<size_t>(i - begin)] > k && type != type_t::variable && type != type_t::value;
+    };
+    std::vector<uint64_t> checkpoints_by_level(66, 0);
+    for (node_index_type i = begin; i < end; ++i) {
+      if (checkpointed(i, 0)) {
+        ++checkpoints_by_level[static_cast<size_t>(levels[static_cast<size_t>(i - begin)])];
+      }
+    }
+    int max_k = 0;
+    while ((static_cast<node_index_type>(1) << max_k) < end - begin) {
+      ++max_k;
+    }
+    int best_k = max_k;
+    uint64_t best_bytes = 0;
+    uint64_t checkpoints = 0;
+    for (int k = max_k; k >= 0; --k) {
+      // The checkpoints for 2^k nodes are the ones with the levels above k.
+      checkpoints += checkpoints_by_level[static_cast<size_t>(k + 1)];
+      const uint64_t segment_size = std::min(static_cast<uint64_t>(1) << k, static_cast<uint64_t>(end - begin));
+      const uint64_t total = total_bytes(segment_size, checkpoints);
+      if (total <= budget_bytes) {
+        best_k = k;
+        break;
+      }
+      if (k == max_k || total < best_bytes) {
+        best_k = k;
+        best_bytes = total;
+      }
+    }
+    segment_size_ = std::min(static_cast<node_index_type>(1) << best_k, end - begin);
+    for (node_index_type i = begin; i < end; ++i) {
+      if (checkpointed(i, best_k)) {
+        state_.checkpoints_.push_back(i);
+      }
+    }
+  }
+};
+
+typedef basic_g_checkpointed<> g_checkpointed;
+
+}  // namespace fncas
+
+#endif  // #ifndef FNCAS_CHECKPOINT_H
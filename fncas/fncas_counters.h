@@ -0,0 +1,166 @@
+// https://github.com/dkorolev/fncas
+
+// Hardware performance counters around a scope, read through perf_event_open(2). Linux only.
+//
+// The counters count the user space of the calling thread, and of the threads and processes it starts while
+// counting, such as the external compiler. Where the kernel does not allow counting, for perf_event_paranoid
+// or within a container, the counters are unavailable and read as zeros, so instrumented code runs either way.
+// The counters are opened as one group, so that they count the same instructions. When the kernel multiplexes
+// more events than the hardware has counters, the counts are scaled up by the time enabled over the time counted.
+// Synopsis:
+//   perf_counters counters;
+//   counter_values values;
+//   { scoped_counters scope(&counters, values); f(x); }
+//   values[counter_t::cycles] ...
+
+#ifndef FNCAS_COUNTERS_H
+#define FNCAS_COUNTERS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "fncas_base.h"
+
+namespace fncas {
+
+enum class counter_t : int8_t { cycles = 0, instructions = 1, cache_misses = 2, branch_misses = 3, end = 4 };
+
+inline const char* counter_as_string(counter_t counter) {
+  static const char* representation[static_cast<size_t>(counter_t::end)] = {
+      "cycles", "instructions", "cache_misses", "branch_misses"};
+  return representation[static_cast<size_t>(counter)];
+}
+
+struct counter_values {
+  uint64_t value[static_cast<size_t>(counter_t::end)];
+  counter_values() {
+    std::fill(value, value + static_cast<size_t>(counter_t::end), 0);
+  }
+  uint64_t& operator[](counter_t counter) {
+    return value[static_cast<size_t>(counter)];
+  }
+  uint64_t operator[](counter_t counter) const {
+    return value[static_cast<size_t>(counter)];
+  }
+  counter_values& operator+=(const counter_values& rhs) {
+    for (size_t i = 0; i < static_cast<size_t>(counter_t::end); ++i) {
+      value[i] += rhs.value[i];
+    }
+    return *this;
+  }
+};
+
+// The set of the counters. Counting is started and stopped explicitly, the scopes counted can not be nested.
+class perf_counters : noncopyable {
+ public:
+  perf_counters() {
+    static const uint64_t config[static_cast<size_t>(counter_t::end)] = {PERF_COUNT_HW_CPU_CYCLES,
+                                                                          PERF_COUNT_HW_INSTRUCTIONS,
+                                                                          PERF_COUNT_HW_CACHE_MISSES,
+                                                                          PERF_COUNT_HW_BRANCH_MISSES};
+    for (size_t i = 0; i < static_cast<size_t>(counter_t::end); ++i) {
+      struct perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = config[i];
+      attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      // The first counter opened leads the group, and the others are enabled and disabled along with it.
+      attr.disabled = leader_ < 0;
+      attr.inherit = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      fd_[i] = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, leader_, 0));
+      if (fd_[i] >= 0 && leader_ < 0) {
+        leader_ = fd_[i];
+      }
+    }
+  }
+  ~perf_counters() {
+    for (int fd : fd_) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+  }
+  bool available(counter_t counter) const {
+    return fd_[static_cast<size_t>(counter)] >= 0;
+  }
+  bool any_available() const {
+    return leader_ >= 0;
+  }
+  void start() {
+    for (size_t i = 0; i < static_cast<size_t>(counter_t::end); ++i) {
+      started_[i] = read_counter(fd_[i]);
+    }
+    if (leader_ >= 0) {
+      ioctl(leader_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+  }
+  counter_values stop() {
+    if (leader_ >= 0) {
+      ioctl(leader_, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    }
+    counter_values result;
+    for (size_t i = 0; i < static_cast<size_t>(counter_t::end); ++i) {
+      const reading stopped = read_counter(fd_[i]);
+      const uint64_t value = stopped.value - started_[i].value;
+      const uint64_t enabled = stopped.time_enabled - started_[i].time_enabled;
+      const uint64_t running = stopped.time_running - started_[i].time_running;
+      if (running) {
+        result.value[i] = running < enabled
+                              ? static_cast<uint64_t>(static_cast<double>(value) * enabled / running + 0.5)
+                              : value;
+      }
+    }
+    return result;
+  }
+
+ private:
+  // The layout read(2) fills for PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING.
+  struct reading {
+    uint64_t value = 0;
+    uint64_t time_enabled = 0;
+    uint64_t time_running = 0;
+  };
+  static reading read_counter(int fd) {
+    reading result;
+    if (fd < 0 || read(fd, &result, sizeof(result)) != static_cast<ssize_t>(sizeof(result))) {
+      result = reading();
+    }
+    return result;
+  }
+
+  int fd_[static_cast<size_t>(counter_t::end)];
+  int leader_ = -1;
+  reading started_[static_cast<size_t>(counter_t::end)];
+};
+
+// Adds the counts of the scope to `sink`. Does nothing if `counters` is null, so that counting is optional.
+class scoped_counters : noncopyable {
+ public:
+  scoped_counters(perf_counters* counters, counter_values& sink) : counters_(counters), sink_(sink) {
+    if (counters_) {
+      counters_->start();
+    }
+  }
+  ~scoped_counters() {
+    if (counters_) {
+      sink_ += counters_->stop();
+    }
+  }
+
+ private:
+  perf_counters* counters_;
+  counter_values& sink_;
+};
+
+}  // namespace fncas
+
+#endif  // #ifndef FNCAS_COUNTERS_H
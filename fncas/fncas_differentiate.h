@@ -5,6 +5,8 @@
 #ifndef FNCAS_DIFFERENTIATE_H
 #define FNCAS_DIFFERENTIATE_H
 
+#include <algorithm>
+
 #include "fncas_base.h"
 #include "fncas_node.h"
 
@@ -42,13 +44,51 @@ std::vector<fncas_value_type> approximate_gradient(F f,
   return g;
 }
 
+inline bool is_zero_value_node(node_index_type index) {
+  node_impl& f = node_vector_singleton()[index];
+  return f.type() == type_t::value && f.value() == 0.0;
+}
+
+// The derivative of pow() by the exponent is pow(a, b) * log(|a|) in every pass: for the negative bases, where pow()
+// is only defined at the integer exponents, this is the derivative of |a|^b with the sign of pow(a, b), so that
+// a constant exponent computed from the variables, such as `x1 * 0`, contributes zero rather than NaN.
+// The term is left out where the exponent is a value node.
+inline bool pow_differentiates_exponent(node_index_type exponent) {
+  return node_vector_singleton()[exponent].type() != type_t::value;
+}
+
+// The derivatives of min() and max() are the derivative of the smaller or the larger argument respectively,
+// and their average where the arguments are equal.
 node_index_type d_op(operation_t operation, const node& a, const node& b, const node& da, const node& db) {
   static const size_t n = static_cast<size_t>(operation_t::end);
   static const std::function<node(const node&, const node&, const node&, const node&)> differentiator[n] = {
       [](const node& a, const node& b, const node& da, const node& db) { return da + db; },
       [](const node& a, const node& b, const node& da, const node& db) { return da - db; },
       [](const node& a, const node& b, const node& da, const node& db) { return a * db + b * da; },
-      [](const node& a, const node& b, const node& da, const node& db) { return (b * da - a * db) / (b * b); }};
+      [](const node& a, const node& b, const node& da, const node& db) { return (b * da - a * db) / (b * b); },
+      // pow(), see pow_differentiates_exponent().
+      [](const node& a, const node& b, const node& da, const node& db) {
+        if (pow_differentiates_exponent(b.index())) {
+          return pow(a, b) * (db * log(fabs(a)) + b * da / a);
+        } else {
+          return b * pow(a, b - node(1.0)) * da;
+        }
+      },
+      // powi(), the exponent is a value node.
+      [](const node& a, const node& b, const node& da, const node& db) {
+        const int32_t exponent = static_cast<int32_t>(b.value());
+        return exponent ? node(b.value()) * pow(a, exponent - 1) * da : node(0.0);
+      },
+      // min().
+      [](const node& a, const node& b, const node& da, const node& db) {
+        return (da + db - sign(a - b) * (da - db)) * node(0.5);
+      },
+      // max().
+      [](const node& a, const node& b, const node& da, const node& db) {
+        return (da + db + sign(a - b) * (da - db)) * node(0.5);
+      },
+      // fma() is an n-ary node, see d_nary().
+      [](const node& a, const node& b, const node& da, const node& db) { return node(0.0); }};
   return operation < operation_t::end ? differentiator[static_cast<size_t>(operation)](a, b, da, db).index() : 0;
 }
 
@@ -64,7 +104,7 @@ node_index_type d_f(function_t function, const node& original, const node& x, co
       // sin().
       [](const node& original, const node& x, const node& dx) { return dx * cos(x); },
       // cos().
-      [](const node& original, const node& x, const node& dx) { return node(-1.0) * dx * sin(x); },
+      [](const node& original, const node& x, const node& dx) { return -(dx * sin(x)); },
       // tan().
       [](const node& original, const node& x, const node& dx) {
         node a = node(4.0) * dx * cos(x) * cos(x);
@@ -74,23 +114,454 @@ node_index_type d_f(function_t function, const node& original, const node& x, co
       // asin().
       [](const node& original, const node& x, const node& dx) { return dx / sqrt(node(1.0) - x * x); },
       // acos().
-      [](const node& original, const node& x, const node& dx) { return node(-1.0) * dx / sqrt(node(1.0) - x * x); },
+      [](const node& original, const node& x, const node& dx) { return -(dx / sqrt(node(1.0) - x * x)); },
       // atan().
       [](const node& original, const node& x, const node& dx) { return dx / (x * x + 1); },
+      // neg().
+      [](const node& original, const node& x, const node& dx) { return -dx; },
+      // sqr().
+      [](const node& original, const node& x, const node& dx) { return node(2.0) * x * dx; },
+      // abs().
+      [](const node& original, const node& x, const node& dx) { return sign(x) * dx; },
+      // sign().
+      [](const node& original, const node& x, const node& dx) { return node(0.0); },
   };
   return function < function_t::end ? differentiator[static_cast<size_t>(function)](original, x, dx).index() : 0;
 }
 
+// apply_function_derivative() returns the value of f'(x), given x and f(x).
+template <typename T> T apply_function_derivative(function_t function, T x, T fx) {
+  static std::function<T(T, T)> evaluator[static_cast<size_t>(function_t::end)] = {
+      // sqrt().
+      [](T x, T fx) { return 0.5 / fx; },
+      // exp().
+      [](T x, T fx) { return fx; },
+      // log().
+      [](T x, T fx) { return 1.0 / x; },
+      // sin().
+      [](T x, T fx) { return std::cos(x); },
+      // cos().
+      [](T x, T fx) { return -std::sin(x); },
+      // tan().
+      [](T x, T fx) { return 1.0 + fx * fx; },
+      // asin().
+      [](T x, T fx) { return 1.0 / std::sqrt(1.0 - x * x); },
+      // acos().
+      [](T x, T fx) { return -1.0 / std::sqrt(1.0 - x * x); },
+      // atan().
+      [](T x, T fx) { return 1.0 / (1.0 + x * x); },
+      // neg().
+      [](T x, T fx) { return -1.0; },
+      // sqr().
+      [](T x, T fx) { return x + x; },
+      // abs().
+      [](T x, T fx) { return static_cast<T>((x > 0) - (x < 0)); },
+      // sign().
+      [](T x, T fx) { return 0.0; },
+  };
+  return function < function_t::end ? evaluator[static_cast<size_t>(function)](x, fx)
+                                    : std::numeric_limits<T>::quiet_NaN();
+}
+
+// eval_node_forward() computes the value of the node along with its directional derivatives
+// along each of the `directions`, propagating (value, tangents) pairs through the graph in a single pass.
+// Unlike differentiate_node(), it creates no new nodes: the tangents of all the directions
+// are kept in a scratch buffer, contiguous per node, so that the inner loops over directions vectorize.
+// The buffer only holds the nodes reached, each at the slot assigned to it as it is computed.
+struct forward_result {
+  fncas_value_type value;
+  std::vector<fncas_value_type> derivative;
+};
+
+// The tangents of a node reached, see assign_tangent_slot().
+inline fncas_value_type* node_tangents(node_index_type i, size_t k) {
+  internals_impl& internals = internals_singleton();
+  return internals.node_tangent_.data() + internals.node_tangent_slot_[i] * static_cast<node_index_type>(k);
+}
+
+// Assigns the next slot of the tangents to the node, unless it has one already, counting the slots in `slots`.
+// Invalidates the pointers to the tangents of the other nodes.
+inline fncas_value_type* assign_tangent_slot(node_index_type i, size_t k, node_index_type& slots) {
+  internals_impl& internals = internals_singleton();
+  node_index_type& slot = growing_vector_access(internals.node_tangent_slot_, i, static_cast<node_index_type>(-1));
+  if (slot < 0) {
+    slot = slots++;
+    std::vector<fncas_value_type>& D = internals.node_tangent_;
+    reserve_within_limits(D, static_cast<size_t>(slots) * k);
+    D.resize(static_cast<size_t>(slots) * k);
+  }
+  return node_tangents(i, k);
+}
+
+// eval_node_forward_computed() computes the value and the tangents of an operation, function, n-ary
+// or row element node, given the ones of its children. The node should have its slot assigned.
+inline void eval_node_forward_computed(node_index_type i, size_t k, const fncas_value_type* row) {
+  std::vector<fncas_value_type>& V = internals_singleton().node_value_;
+  node_impl& f = node_vector_singleton()[i];
+  fncas_value_type* di = node_tangents(i, k);
+  if (f.type() == type_t::operation) {
+    const fncas_value_type a = V[f.lhs_index()];
+    const fncas_value_type b = V[f.rhs_index()];
+    const fncas_value_type* da = node_tangents(f.lhs_index(), k);
+    const fncas_value_type* db = node_tangents(f.rhs_index(), k);
+    const fncas_value_type r = apply_operation<fncas_value_type>(f.operation(), a, b);
+    growing_vector_access(V, i, 0.0) = r;
+    if (f.operation() == operation_t::add) {
+      for (size_t j = 0; j < k; ++j) {
+        di[j] = da[j] + db[j];
+      }
+    } else if (f.operation() == operation_t::subtract) {
+      for (size_t j = 0; j < k; ++j) {
+        di[j] = da[j] - db[j];
+      }
+    } else if (f.operation() == operation_t::multiply) {
+      for (size_t j = 0; j < k; ++j) {
+        di[j] = a * db[j] + b * da[j];
+      }
+    } else if (f.operation() == operation_t::divide) {
+      for (size_t j = 0; j < k; ++j) {
+        di[j] = (da[j] - r * db[j]) / b;
+      }
+    } else if (f.operation() == operation_t::pow) {
+      // See pow_differentiates_exponent().
+      const fncas_value_type wa = b * std::pow(a, b - 1.0);
+      if (pow_differentiates_exponent(f.rhs_index())) {
+        const fncas_value_type wb = r * std::log(std::fabs(a));
+        for (size_t j = 0; j < k; ++j) {
+          di[j] = wa * da[j] + wb * db[j];
+        }
+      } else {
+        for (size_t j = 0; j < k; ++j) {
+          di[j] = wa * da[j];
+        }
+      }
+    } else if (f.operation() == operation_t::powi) {
+      const int32_t exponent = static_cast<int32_t>(b);
+      const fncas_value_type w = exponent ? b * integer_power(a, exponent - 1) : 0.0;
+      for (size_t j = 0; j < k; ++j) {
+        di[j] = w * da[j];
+      }
+    } else if (f.operation() == operation_t::min || f.operation() == operation_t::max) {
+      const fncas_value_type s = static_cast<fncas_value_type>((a > b) - (a < b));
+      const fncas_value_type w = f.operation() == operation_t::min ? -s : s;
+      for (size_t j = 0; j < k; ++j) {
+        di[j] = (da[j] + db[j] + w * (da[j] - db[j])) * 0.5;
+      }
+    } else {
+      assert(false);
+    }
+  } else if (f.type() == type_t::function) {
+    const fncas_value_type a = V[f.argument_index()];
+    const fncas_value_type* da = node_tangents(f.argument_index(), k);
+    const fncas_value_type r = apply_function<fncas_value_type>(f.function(), a);
+    growing_vector_access(V, i, 0.0) = r;
+    const fncas_value_type d = apply_function_derivative<fncas_value_type>(f.function(), a, r);
+    for (size_t j = 0; j < k; ++j) {
+      di[j] = d * da[j];
+    }
+  } else if (f.type() == type_t::nary) {
+    const size_t n = static_cast<size_t>(f.children_count());
+    const node_index_type* children = &internals_singleton().nary_children_[f.children_begin()];
+    const fncas_value_type r = apply_nary_operation<fncas_value_type>(
+        f.operation(), n, [&V, children](size_t c) { return V[children[c]]; });
+    growing_vector_access(V, i, 0.0) = r;
+    std::fill(di, di + k, 0.0);
+    if (f.operation() == operation_t::add) {
+      for (size_t c = 0; c < n; ++c) {
+        const fncas_value_type* dc = node_tangents(children[c], k);
+        for (size_t j = 0; j < k; ++j) {
+          di[j] += dc[j];
+        }
+      }
+    } else if (f.operation() == operation_t::fma) {
+      const fncas_value_type a = V[children[0]];
+      const fncas_value_type b = V[children[1]];
+      const fncas_value_type* da = node_tangents(children[0], k);
+      const fncas_value_type* db = node_tangents(children[1], k);
+      const fncas_value_type* dc = node_tangents(children[2], k);
+      for (size_t j = 0; j < k; ++j) {
+        di[j] = da[j] * b + a * db[j] + dc[j];
+      }
+    } else {
+      // d(c_0 * ... * c_{n-1}) = sum over c of (c_0 * ... * c_{c-1}) * (c_{c+1} * ... * c_{n-1}) * dc.
+      std::vector<fncas_value_type> suffix(n + 1, 1.0);
+      for (size_t c = n; c > 0; --c) {
+        suffix[c - 1] = suffix[c] * V[children[c - 1]];
+      }
+      fncas_value_type prefix = 1.0;
+      for (size_t c = 0; c < n; ++c) {
+        const fncas_value_type w = prefix * suffix[c + 1];
+        const fncas_value_type* dc = node_tangents(children[c], k);
+        for (size_t j = 0; j < k; ++j) {
+          di[j] += w * dc[j];
+        }
+        prefix *= V[children[c]];
+      }
+    }
+  } else if (f.type() == type_t::row_element) {
+    assert(row);
+    growing_vector_access(V, i, 0.0) = row[f.column()];
+    std::fill(di, di + k, 0.0);
+  } else {
+    assert(false);
+  }
+}
+
+forward_result eval_node_forward(node_index_type index,
+                                 const std::vector<fncas_value_type>& x,
+                                 const std::vector<std::vector<fncas_value_type>>& directions) {
+  const size_t k = directions.size();
+  for (const std::vector<fncas_value_type>& direction : directions) {
+    assert(direction.size() == x.size());
+    static_cast<void>(direction);
+  }
+  std::vector<fncas_value_type>& V = internals_singleton().node_value_;
+  // The values are written by node index here, the ones kept by eval_node() are dropped.
+  internals_singleton().node_computed_.clear();
+  // The slots of the nodes computed, -1 for the ones not computed yet.
+  std::vector<node_index_type>& S = internals_singleton().node_tangent_slot_;
+  std::vector<fncas_value_type>& D = internals_singleton().node_tangent_;
+  S.clear();
+  D.clear();
+  node_index_type slots = 0;
+  std::stack<node_index_type> stack;
+  stack.push(index);
+  while (!stack.empty()) {
+    const node_index_type i = stack.top();
+    stack.pop();
+    const node_index_type dependent_i = ~i;
+    if (i > dependent_i) {
+      if (growing_vector_access(S, i, static_cast<node_index_type>(-1)) < 0) {
+        node_impl& f = node_vector_singleton()[i];
+        if (f.type() == type_t::variable) {
+          int32_t v = f.variable();
+          assert(v >= 0 && v < static_cast<int32_t>(x.size()));
+          growing_vector_access(V, i, 0.0) = x[v];
+          fncas_value_type* di = assign_tangent_slot(i, k, slots);
+          for (size_t j = 0; j < k; ++j) {
+            di[j] = directions[j][v];
+          }
+        } else if (f.type() == type_t::value) {
+          growing_vector_access(V, i, 0.0) = f.value();
+          fncas_value_type* di = assign_tangent_slot(i, k, slots);
+          std::fill(di, di + k, 0.0);
+        } else if (f.type() == type_t::operation) {
+          stack.push(~i);
+          stack.push(f.lhs_index());
+          stack.push(f.rhs_index());
+        } else if (f.type() == type_t::function) {
+          stack.push(~i);
+          stack.push(f.argument_index());
+        } else if (f.type() == type_t::nary) {
+          stack.push(~i);
+          for (node_index_type c = 0; c < f.children_count(); ++c) {
+            stack.push(f.child_index(c));
+          }
+        } else if (f.type() == type_t::loop) {
+          stack.push(~i);
+          for (node_index_type c : loop_program_of(i).invariant_) {
+            stack.push(c);
+          }
+        } else {
+          row_element_outside_loop();
+        }
+      }
+    } else {
+      node_impl& f = node_vector_singleton()[dependent_i];
+      if (f.type() == type_t::loop) {
+        // The tangents of the sum over the rows are the sums of the tangents of the body, same order as eval_loop().
+        const loop_program& program = loop_program_of(dependent_i);
+        const table_impl& t = internals_singleton().tables_[f.table()];
+        const node_index_type body = f.body_index();
+        growing_vector_access(V, program.max_index_, 0.0);
+        for (node_index_type v : program.variant_) {
+          assign_tangent_slot(v, k, slots);
+        }
+        fncas_value_type value = 0.0;
+        std::vector<fncas_value_type> tangent(k, 0.0);
+        for (int64_t r = 0; r < t.rows; ++r) {
+          const fncas_value_type* row = t.data + r * t.cols;
+          for (node_index_type v : program.variant_) {
+            eval_node_forward_computed(v, k, row);
+          }
+          value += V[body];
+          const fncas_value_type* db = node_tangents(body, k);
+          for (size_t j = 0; j < k; ++j) {
+            tangent[j] += db[j];
+          }
+        }
+        growing_vector_access(V, dependent_i, 0.0) = value;
+        std::copy(tangent.begin(), tangent.end(), assign_tangent_slot(dependent_i, k, slots));
+      } else {
+        assign_tangent_slot(dependent_i, k, slots);
+        eval_node_forward_computed(dependent_i, k, nullptr);
+      }
+    }
+  }
+  assert(S[index] >= 0);
+  forward_result result;
+  result.value = V[index];
+  const fncas_value_type* di = node_tangents(index, k);
+  result.derivative.assign(di, di + k);
+  return result;
+}
+
+// backpropagate_node() adds the `adjoint` of an operation, function or n-ary node, the value of which is `r`,
+// to the adjoints `A` of its children, each multiplied by the partial derivative of the node by the child.
+// The partial derivatives are the ones eval_node_forward_computed() uses, at the values `V` of the children.
+// Both `V` and `A` are indexed by node, and are usually std::vector-s.
+template <typename VALUES, typename ADJOINTS>
+void backpropagate_node(const node_impl& f,
+                        fncas_value_type r,
+                        fncas_value_type adjoint,
+                        const VALUES& V,
+                        ADJOINTS& A) {
+  if (adjoint == 0.0) {
+    // Same as the zero tangents of eval_node_forward(), nothing flows back, not even a NaN of a partial derivative.
+    return;
+  }
+  if (f.type() == type_t::operation) {
+    const node_index_type ia = f.lhs_index();
+    const node_index_type ib = f.rhs_index();
+    const fncas_value_type a = V[ia];
+    const fncas_value_type b = V[ib];
+    if (f.operation() == operation_t::add) {
+      A[ia] += adjoint;
+      A[ib] += adjoint;
+    } else if (f.operation() == operation_t::subtract) {
+      A[ia] += adjoint;
+      A[ib] -= adjoint;
+    } else if (f.operation() == operation_t::multiply) {
+      A[ia] += adjoint * b;
+      A[ib] += adjoint * a;
+    } else if (f.operation() == operation_t::divide) {
+      A[ia] += adjoint / b;
+      A[ib] -= adjoint * r / b;
+    } else if (f.operation() == operation_t::pow) {
+      A[ia] += adjoint * b * std::pow(a, b - 1.0);
+      // See pow_differentiates_exponent().
+      if (pow_differentiates_exponent(ib)) {
+        A[ib] += adjoint * r * std::log(std::fabs(a));
+      }
+    } else if (f.operation() == operation_t::powi) {
+      const int32_t exponent = static_cast<int32_t>(b);
+      if (exponent) {
+        A[ia] += adjoint * b * integer_power(a, exponent - 1);
+      }
+    } else if (f.operation() == operation_t::min || f.operation() == operation_t::max) {
+      const fncas_value_type s = static_cast<fncas_value_type>((a > b) - (a < b));
+      const fncas_value_type w = f.operation() == operation_t::min ? -s : s;
+      A[ia] += adjoint * (1.0 + w) * 0.5;
+      A[ib] += adjoint * (1.0 - w) * 0.5;
+    } else {
+      assert(false);
+    }
+  } else if (f.type() == type_t::function) {
+    const node_index_type ia = f.argument_index();
+    A[ia] += adjoint * apply_function_derivative<fncas_value_type>(f.function(), V[ia], r);
+  } else if (f.type() == type_t::nary) {
+    const size_t n = static_cast<size_t>(f.children_count());
+    const node_index_type* children = &internals_singleton().nary_children_[f.children_begin()];
+    if (f.operation() == operation_t::add) {
+      for (size_t c = 0; c < n; ++c) {
+        A[children[c]] += adjoint;
+      }
+    } else if (f.operation() == operation_t::fma) {
+      const fncas_value_type a = V[children[0]];
+      const fncas_value_type b = V[children[1]];
+      A[children[0]] += adjoint * b;
+      A[children[1]] += adjoint * a;
+      A[children[2]] += adjoint;
+    } else {
+      // The partial derivative by each child is the product of the prefix and the suffix around it.
+      std::vector<fncas_value_type> suffix(n + 1, 1.0);
+      for (size_t c = n; c > 0; --c) {
+        suffix[c - 1] = suffix[c] * V[children[c - 1]];
+      }
+      fncas_value_type prefix = 1.0;
+      for (size_t c = 0; c < n; ++c) {
+        A[children[c]] += adjoint * prefix * suffix[c + 1];
+        prefix *= V[children[c]];
+      }
+    }
+  } else {
+    assert(false);
+  }
+}
+
+// The derivative of an n-ary sum is the n-ary sum of the derivatives of its children.
+// The derivative of an n-ary product is the n-ary sum of the derivative of each child multiplied by
+// the prefix and suffix products of the other children, which keeps the number of new nodes linear.
+// The derivative of fma(a, b, c) is fma(da, b, fma(a, db, dc)).
+// Children with zero derivatives are skipped in all cases.
+node_index_type d_nary(operation_t operation,
+                       const std::vector<node_index_type>& children,
+                       const std::vector<node_index_type>& derivatives,
+                       node_index_type zero_index) {
+  const size_t n = children.size();
+  std::vector<node_index_type> terms;
+  if (operation == operation_t::fma) {
+    node_index_type result = derivatives[2];
+    for (size_t c = 2; c > 0; --c) {
+      // The child `c - 1` is multiplied by the other one of the first two.
+      const node_index_type dc = derivatives[c - 1];
+      const node other = from_index(children[2 - c]);
+      if (!is_zero_value_node(dc)) {
+        result = is_zero_value_node(result) ? (node(from_index(dc)) * other).index()
+                                            : fma(from_index(dc), other, from_index(result)).index();
+      }
+    }
+    return result;
+  } else if (operation == operation_t::add) {
+    for (size_t c = 0; c < n; ++c) {
+      if (!is_zero_value_node(derivatives[c])) {
+        terms.push_back(derivatives[c]);
+      }
+    }
+  } else {
+    // suffix[c] is the product of children[c + 1 ... n - 1], -1 if empty.
+    std::vector<node_index_type> suffix(n, -1);
+    for (size_t c = n - 1; c > 0; --c) {
+      suffix[c - 1] =
+          (suffix[c] == -1) ? children[c] : (node(from_index(children[c])) * node(from_index(suffix[c]))).index();
+    }
+    node_index_type prefix = -1;
+    for (size_t c = 0; c < n; ++c) {
+      if (!is_zero_value_node(derivatives[c])) {
+        node term = node(from_index(derivatives[c]));
+        if (prefix != -1) {
+          term = node(from_index(prefix)) * term;
+        }
+        if (suffix[c] != -1) {
+          term = term * node(from_index(suffix[c]));
+        }
+        terms.push_back(term.index());
+      }
+      prefix = (prefix == -1) ? children[c] : (node(from_index(prefix)) * node(from_index(children[c]))).index();
+    }
+  }
+  if (terms.empty()) {
+    return zero_index;
+  } else if (terms.size() == 1) {
+    return terms.front();
+  } else {
+    return node::nary(operation_t::add, terms).index();
+  }
+}
+
 // differentiate_node() should use manual stack implementation to avoid SEGFAULT. Using plain recursion
 // will overflow the stack for every formula containing repeated operation on the top level.
 node_index_type differentiate_node(node_index_type index, int32_t var_index, int32_t number_of_variables) {
   assert(var_index < number_of_variables);
-  std::vector<std::vector<node_index_type>>& df_container = internals_singleton().df_;
+  std::vector<node_index_vector>& df_container = internals_singleton().df_;
   if (df_container.empty()) {
-    df_container.resize(number_of_variables);
+    reserve_within_limits(df_container, number_of_variables);
+    // Allocated the same way as the nodes are.
+    const source_allocator<node_index_type> allocator(node_vector_singleton().source());
+    df_container.resize(number_of_variables, node_index_vector(allocator));
   }
   assert(static_cast<int32_t>(df_container.size()) == number_of_variables);
-  std::vector<node_index_type>& df = df_container[var_index];
+  node_index_vector& df = df_container[var_index];
   if (growing_vector_access(df, index, static_cast<node_index_type>(-1)) == -1) {
     const node_index_type zero_index = node(0.0).index();
     const node_index_type one_index = node(1.0).index();
@@ -104,8 +575,19 @@ node_index_type differentiate_node(node_index_type index, int32_t var_index, int
         node_impl& f = node_vector_singleton()[i];
         if (f.type() == type_t::variable && f.variable() == var_index) {
           growing_vector_access(df, i, static_cast<node_index_type>(-1)) = one_index;
-        } else if (f.type() == type_t::variable || f.type() == type_t::value) {
+        } else if (f.type() == type_t::variable || f.type() == type_t::value || f.type() == type_t::row_element) {
           growing_vector_access(df, i, static_cast<node_index_type>(-1)) = zero_index;
+        } else if (f.type() == type_t::loop) {
+          // The derivative of the sum over the rows is the sum of the derivative of the body over the rows.
+          // The bodies are small, so recursion is safe here. Each loop costs a pass over the data, so its
+          // derivative is only created once.
+          if (growing_vector_access(df, i, static_cast<node_index_type>(-1)) != -1) {
+            continue;
+          }
+          const int32_t table = f.table();
+          const node_index_type d_body = differentiate_node(f.body_index(), var_index, number_of_variables);
+          growing_vector_access(df, i, static_cast<node_index_type>(-1)) =
+              is_zero_value_node(d_body) ? zero_index : node::loop(table, from_index(d_body)).index();
         } else if (f.type() == type_t::operation) {
           stack.push(~i);
           stack.push(f.lhs_index());
@@ -113,6 +595,11 @@ node_index_type differentiate_node(node_index_type index, int32_t var_index, int
         } else if (f.type() == type_t::function) {
           stack.push(~i);
           stack.push(f.argument_index());
+        } else if (f.type() == type_t::nary) {
+          stack.push(~i);
+          for (node_index_type c = 0; c < f.children_count(); ++c) {
+            stack.push(f.child_index(c));
+          }
         } else {
           assert(false);
           return 0;
@@ -134,6 +621,17 @@ node_index_type differentiate_node(node_index_type index, int32_t var_index, int
           assert(dx != -1);
           growing_vector_access(df, dependent_i, static_cast<node_index_type>(-1)) =
               d_f(f.function(), from_index(dependent_i), from_index(x), from_index(dx));
+        } else if (f.type() == type_t::nary) {
+          const operation_t operation = f.operation();
+          std::vector<node_index_type> children(f.children_count());
+          std::vector<node_index_type> derivatives(children.size());
+          for (size_t c = 0; c < children.size(); ++c) {
+            children[c] = f.child_index(c);
+            derivatives[c] = growing_vector_access(df, children[c], static_cast<node_index_type>(-1));
+            assert(derivatives[c] != -1);
+          }
+          growing_vector_access(df, dependent_i, static_cast<node_index_type>(-1)) =
+              d_nary(operation, children, derivatives, zero_index);
         } else {
           assert(false);
           return 0;
@@ -181,6 +679,41 @@ struct g_approximate : g {
   }
 };
 
+// Gradient computed by forward-mode differentiation, a batch of unit directions per pass.
+// Adds no nodes to the graph, at the cost of ceil(dim / batch) passes per evaluation.
+struct g_forward : g {
+  enum { DEFAULT_BATCH = 8 };
+  node f_;
+  int32_t d_;
+  size_t batch_;
+  g_forward(const x& x_ref, const node& f, size_t batch = DEFAULT_BATCH)
+      : f_(f), d_(internals_singleton().dim_), batch_(batch) {
+    assert(&x_ref == internals_singleton().x_ptr_);
+    assert(batch_ > 0);
+  }
+  explicit g_forward(const x& x_ref, const f_intermediate& fi) : g_forward(x_ref, fi.f_) {
+  }
+  virtual result operator()(const std::vector<fncas_value_type>& x) const {
+    result r;
+    r.gradient.resize(d_);
+    std::vector<std::vector<fncas_value_type>> directions;
+    for (int32_t begin = 0; begin < d_; begin += batch_) {
+      const int32_t end = std::min(d_, static_cast<int32_t>(begin + batch_));
+      directions.assign(end - begin, std::vector<fncas_value_type>(d_, 0.0));
+      for (int32_t i = begin; i < end; ++i) {
+        directions[i - begin][i] = 1.0;
+      }
+      const forward_result fr = eval_node_forward(f_.index(), x, directions);
+      r.value = fr.value;
+      std::copy(fr.derivative.begin(), fr.derivative.end(), r.gradient.begin() + begin);
+    }
+    return r;
+  }
+  virtual int32_t dim() const {
+    return d_;
+  }
+};
+
 struct g_intermediate : g {
   node f_;
   std::vector<node> g_;
@@ -216,6 +749,103 @@ struct g_intermediate : g {
   }
 };
 
+// node_variables() returns the sorted list of the variables the value of the node depends on.
+std::vector<int32_t> node_variables(node_index_type index) {
+  std::vector<int8_t> visited;
+  std::vector<int32_t> result;
+  std::stack<node_index_type> stack;
+  stack.push(index);
+  while (!stack.empty()) {
+    const node_index_type i = stack.top();
+    stack.pop();
+    if (!growing_vector_access(visited, i, static_cast<int8_t>(false))) {
+      visited[i] = true;
+      node_impl& f = node_vector_singleton()[i];
+      if (f.type() == type_t::variable) {
+        result.push_back(f.variable());
+      } else if (f.type() == type_t::operation) {
+        stack.push(f.lhs_index());
+        stack.push(f.rhs_index());
+      } else if (f.type() == type_t::function) {
+        stack.push(f.argument_index());
+      } else if (f.type() == type_t::nary) {
+        for (node_index_type c = 0; c < f.children_count(); ++c) {
+          stack.push(f.child_index(c));
+        }
+      } else if (f.type() == type_t::loop) {
+        stack.push(f.body_index());
+      }
+    }
+  }
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+// Class "j" is the placeholder for sparse Jacobian evaluators of vector-valued functions.
+// The derivatives of value[i] are stored in derivative[row_begin[i] ... row_begin[i + 1] - 1],
+// with respect to the variables column[row_begin[i] ... row_begin[i + 1] - 1].
+// Only the variables each output actually depends on are listed.
+struct j : noncopyable {
+  struct result {
+    std::vector<fncas_value_type> value;
+    std::vector<size_t> row_begin;
+    std::vector<int32_t> column;
+    std::vector<fncas_value_type> derivative;
+  };
+  virtual ~j() {
+  }
+  virtual result operator()(const std::vector<fncas_value_type>& x) const = 0;
+  virtual int32_t dim() const = 0;
+  virtual size_t size() const = 0;
+};
+
+struct j_intermediate : j {
+  std::vector<node> f_;
+  std::vector<size_t> row_begin_;
+  std::vector<int32_t> column_;
+  std::vector<node> d_;
+  j_intermediate(const x& x_ref, const std::vector<node>& f) : f_(f) {
+    assert(&x_ref == internals_singleton().x_ptr_);
+    row_begin_.push_back(0);
+    for (const node& fi : f_) {
+      for (int32_t v : node_variables(fi.index())) {
+        column_.push_back(v);
+        d_.push_back(fi.differentiate(x_ref, v));
+      }
+      row_begin_.push_back(column_.size());
+    }
+  }
+  explicit j_intermediate(const x& x_ref, const f_vector_intermediate& fi) : j_intermediate(x_ref, fi.f_) {
+  }
+  // The values of the function followed by the values of the non-zero derivatives, in row-major order.
+  std::vector<node_index_type> indexes() const {
+    std::vector<node_index_type> result;
+    result.reserve(f_.size() + d_.size());
+    for (const node& fi : f_) {
+      result.push_back(fi.index());
+    }
+    for (const node& di : d_) {
+      result.push_back(di.index());
+    }
+    return result;
+  }
+  virtual result operator()(const std::vector<fncas_value_type>& x) const {
+    const std::vector<fncas_value_type> values = eval_nodes(indexes(), x);
+    result r;
+    r.value.assign(values.begin(), values.begin() + f_.size());
+    r.row_begin = row_begin_;
+    r.column = column_;
+    r.derivative.assign(values.begin() + f_.size(), values.end());
+    return r;
+  }
+  virtual int32_t dim() const {
+    return internals_singleton().dim_;
+  }
+  virtual size_t size() const {
+    return f_.size();
+  }
+};
+
 }  // namespace fncas
 
 #endif  // #ifndef FNCAS_DIFFERENTIATE_H
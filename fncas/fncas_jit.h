@@ -8,66 +8,201 @@
 
 #ifdef FNCAS_JIT
 
+#include <cctype>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <random>
 #include <sstream>
 #include <stack>
 #include <string>
 #include <vector>
 
 #include <dlfcn.h>
+#include <elf.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <boost/format.hpp>
 
 #include "fncas_base.h"
 #include "fncas_node.h"
+#include "fncas_differentiate.h"
+#include "fncas_optimize.h"
+#include "fncas_math.h"
 
 namespace fncas {
 
 // Linux-friendly code to compile into .so and link against it at runtime.
 // Not portable.
 
-struct compiled_expression : noncopyable {
+// What compiling the expressions took, stage by stage, and what it produced, to tell where the time goes
+// for large functions. The stages a backend does not have are zero: C is compiled and linked in one step.
+struct compile_stats {
+  // Writing the source, running the assembler or the compiler, running the linker, and dlopen()-ing the library.
+  double generate_seconds = 0.0;
+  double compile_seconds = 0.0;
+  double link_seconds = 0.0;
+  double load_seconds = 0.0;
+  uint64_t source_bytes = 0;
+  // The instructions of the NASM source, or the statements of the C source.
+  uint64_t instructions = 0;
+  uint64_t object_bytes = 0;
+  uint64_t library_bytes = 0;
+  // The machine code of the library, its .text section.
+  uint64_t text_bytes = 0;
+  // The values of the scratch array `eval` takes.
+  uint64_t scratch_size = 0;
+  double total_seconds() const {
+    return generate_seconds + compile_seconds + link_seconds + load_seconds;
+  }
+};
+
+inline double compile_seconds_since(std::chrono::steady_clock::time_point begin) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+}
+
+inline uint64_t compile_file_bytes(const std::string& filename) {
+  struct stat st;
+  return stat(filename.c_str(), &st) ? 0 : static_cast<uint64_t>(st.st_size);
+}
+
+// The size of the .text section of the ELF64 shared library, zero if it can not be read.
+inline uint64_t compile_text_bytes(const std::string& filename) {
+  FILE* f = fopen(filename.c_str(), "rb");
+  if (!f) {
+    return 0;
+  }
+  uint64_t result = 0;
+  Elf64_Ehdr header;
+  if (fread(&header, sizeof(header), 1, f) == 1 && !memcmp(header.e_ident, ELFMAG, SELFMAG) &&
+      header.e_ident[EI_CLASS] == ELFCLASS64 && header.e_shentsize == sizeof(Elf64_Shdr) &&
+      header.e_shstrndx < header.e_shnum) {
+    std::vector<Elf64_Shdr> sections(header.e_shnum);
+    if (!fseek(f, static_cast<long>(header.e_shoff), SEEK_SET) &&
+        fread(&sections[0], sizeof(Elf64_Shdr), sections.size(), f) == sections.size()) {
+      const Elf64_Shdr& names = sections[header.e_shstrndx];
+      std::vector<char> strings(names.sh_size + 1, '\0');
+      if (!fseek(f, static_cast<long>(names.sh_offset), SEEK_SET) &&
+          fread(&strings[0], 1, names.sh_size, f) == names.sh_size) {
+        for (const Elf64_Shdr& section : sections) {
+          if (section.sh_name < names.sh_size && !strcmp(&strings[section.sh_name], ".text")) {
+            result = section.sh_size;
+          }
+        }
+      }
+    }
+  }
+  fclose(f);
+  return result;
+}
+
+// Counts the lines of the generated source the predicate accepts.
+template <typename PREDICATE> uint64_t compile_count_lines(const std::string& filename, PREDICATE predicate) {
+  FILE* f = fopen(filename.c_str(), "r");
+  if (!f) {
+    return 0;
+  }
+  uint64_t result = 0;
+  std::string line;
+  for (int c = fgetc(f); c != EOF; c = fgetc(f)) {
+    if (c == '\n') {
+      result += predicate(line);
+      line.clear();
+    } else {
+      line += static_cast<char>(c);
+    }
+  }
+  fclose(f);
+  return result;
+}
+
+template <typename P = fncas_value_type> struct basic_compiled_expression : noncopyable {
+  typedef typename precision_traits<P>::value_type value_type;
   typedef long long (*DIM)();
-  typedef double (*EVAL)(const double* x, double* a);
+  typedef value_type (*EVAL)(const value_type* x, value_type* a);
+  typedef void* (*TABLES)();
   void* lib_;
   DIM dim_;
   EVAL eval_;
   const std::string lib_filename_;
-  explicit compiled_expression(const std::string& lib_filename) : lib_filename_(lib_filename) {
+  // The indexes of the nodes computed by `eval`. Their values are left in the scratch array, which starts
+  // from the node `base_`.
+  const std::vector<node_index_type> roots_;
+  node_index_type base_;
+  mutable std::vector<value_type> ram_;
+  // Filled by compile(), only the load stage and the library if loaded directly.
+  compile_stats stats_;
+  explicit basic_compiled_expression(const std::string& lib_filename, const std::vector<node_index_type>& roots)
+      : lib_filename_(lib_filename), roots_(roots) {
+    const auto begin = std::chrono::steady_clock::now();
     lib_ = dlopen(lib_filename.c_str(), RTLD_LAZY);
     assert(lib_);
     dim_ = reinterpret_cast<DIM>(dlsym(lib_, "dim"));
     eval_ = reinterpret_cast<EVAL>(dlsym(lib_, "eval"));
+    DIM base = reinterpret_cast<DIM>(dlsym(lib_, "base"));
     assert(dim_);
     assert(eval_);
+    assert(base);
+    base_ = static_cast<node_index_type>(base());
+    // Bind the data tables the loops of the generated code iterate over.
+    TABLES tables = reinterpret_cast<TABLES>(dlsym(lib_, "tables"));
+    assert(tables);
+    const std::vector<table_impl>& registered = internals_singleton().tables_;
+    if (!registered.empty()) {
+      memcpy(tables(), &registered[0], registered.size() * sizeof(table_impl));
+    }
+    // Bind the math kernels the NASM code calls, if it was generated with math_t::kernels.
+    TABLES kernels = reinterpret_cast<TABLES>(dlsym(lib_, "kernels"));
+    if (kernels) {
+      memcpy(kernels(),
+             math_kernel_table<value_type>::kernels(),
+             static_cast<size_t>(function_t::end) * sizeof(typename math_kernel_table<value_type>::kernel_t));
+    }
+    ram_.resize(static_cast<size_t>(dim_()));
+    stats_.load_seconds = compile_seconds_since(begin);
+    stats_.library_bytes = compile_file_bytes(lib_filename);
+    stats_.text_bytes = compile_text_bytes(lib_filename);
+    stats_.scratch_size = ram_.size();
   }
-  ~compiled_expression() {
+  ~basic_compiled_expression() {
     if (lib_) {
       dlclose(lib_);
     }
   }
-  compiled_expression(const compiled_expression&) = delete;
-  void operator=(const compiled_expression&) = delete;
-  compiled_expression(compiled_expression&& rhs)
+  basic_compiled_expression(const basic_compiled_expression&) = delete;
+  void operator=(const basic_compiled_expression&) = delete;
+  basic_compiled_expression(basic_compiled_expression&& rhs)
       : lib_(std::move(rhs.lib_)),
         dim_(std::move(rhs.dim_)),
         eval_(std::move(rhs.eval_)),
-        lib_filename_(std::move(rhs.lib_filename_)) {
+        lib_filename_(std::move(rhs.lib_filename_)),
+        roots_(std::move(rhs.roots_)),
+        base_(rhs.base_),
+        ram_(std::move(rhs.ram_)),
+        stats_(rhs.stats_) {
     rhs.lib_ = nullptr;
   }
-  double operator()(const double* x) const {
-    std::vector<double>& tmp = internals_singleton().ram_for_compiled_evaluations_;
-    node_index_type dim = static_cast<node_index_type>(dim_());
-    if (tmp.size() < dim) {
-      tmp.resize(dim);
-    }
-    return eval_(x, &tmp[0]);
+  value_type operator()(const value_type* x) const {
+    return eval_(x, &ram_[0]);
   }
-  double operator()(const std::vector<double>& x) const {
+  value_type operator()(const std::vector<value_type>& x) const {
     return operator()(&x[0]);
   }
+  // Computes all the roots in one call, `output` should be of the size of `roots()`.
+  void operator()(const value_type* x, value_type* output) const {
+    operator()(x);
+    for (size_t i = 0; i < roots_.size(); ++i) {
+      output[i] = ram_[roots_[i] - base_];
+    }
+  }
   node_index_type dim() const {
     return dim_ ? static_cast<node_index_type>(dim_()) : 0;
   }
+  const std::vector<node_index_type>& roots() const {
+    return roots_;
+  }
   static void syscall(const std::string& command) {
     int retval = system(command.c_str());
     if (retval) {
@@ -78,146 +213,994 @@ struct compiled_expression : noncopyable {
   const std::string& lib_filename() const {
     return lib_filename_;
   }
+  const compile_stats& stats() const {
+    return stats_;
+  }
 };
 
-// generate_c_code_for_node() writes C code to evaluate the expression to the file.
-void generate_c_code_for_node(node_index_type index, FILE* f) {
-  fprintf(f, "#include <math.h>\n");
-  fprintf(f, "double eval(const double* x, double* a) {\n");
-  node_index_type max_dim = index;
+typedef basic_compiled_expression<> compiled_expression;
+
+// Re-rolling of repetitive chains. Functions such as `r += f(x[i])` over `i` record a left-deep chain
+// c_k = c_{k-1} op_k t_k, where the terms t_k are of the same shape for consecutive variables.
+// The code generators find the runs of the chain in which the (op_k, t_k) pairs repeat with some period,
+// with the variables of each next repetition shifted by the same stride, and generate such runs as loops
+// over the repetitions, the terms of the first repetition being the body of the loop.
+// The order of operations is preserved, so the re-rolled code computes the very same value, bit for bit.
+// Only the chains and the terms not referred to from elsewhere are re-rolled, as their values are not kept.
+enum { REROLL_MAX_PERIOD = 16, REROLL_MIN_REPEATS = 4 };
+
+struct reroll_run {
+  // The node holding the value of the chain before the run, and the chain node to hold the value after it.
+  node_index_type before;
+  node_index_type after;
+  int64_t repeats;
+  // The shift of the variable indexes from one repetition to the next.
+  int64_t stride;
+  // The operations and the terms of the first repetition.
+  std::vector<operation_t> operations;
+  std::vector<node_index_type> terms;
+};
+
+struct reroll_plan {
+  // The value the chain starts from.
+  node_index_type base;
+  // The chain nodes to generate one by one, `node` != -1, and the re-rolled runs, `node` == -1, bottom to top.
+  struct segment {
+    node_index_type node;
+    reroll_run run;
+  };
+  std::vector<segment> segments;
+};
+
+// is_shifted_term() returns whether the term `b` is the term `a` with each variable index shifted by `stride`.
+// The stride is deduced from the first pair of variables, unless it is already `known`.
+inline bool is_shifted_term(node_index_type a,
+                            node_index_type b,
+                            const std::vector<node_index_type>& count,
+                            int64_t& stride,
+                            bool& known) {
+  std::stack<std::pair<node_index_type, node_index_type>> stack;
+  stack.emplace(a, b);
+  while (!stack.empty()) {
+    const node_index_type p = stack.top().first;
+    const node_index_type q = stack.top().second;
+    stack.pop();
+    const node_impl& u = node_vector_singleton()[p];
+    const node_impl& v = node_vector_singleton()[q];
+    if (count[p] != 1 || count[q] != 1 || u.type() != v.type()) {
+      return false;
+    }
+    if (u.type() == type_t::variable) {
+      const int64_t delta = static_cast<int64_t>(v.variable()) - u.variable();
+      if (known && delta != stride) {
+        return false;
+      }
+      stride = delta;
+      known = true;
+    } else if (u.type() == type_t::value) {
+      if (memcmp(&u.data_[2], &v.data_[2], sizeof(fncas_value_type))) {
+        return false;
+      }
+    } else if (u.type() == type_t::operation) {
+      if (u.operation() != v.operation()) {
+        return false;
+      }
+      stack.emplace(u.lhs_index(), v.lhs_index());
+      stack.emplace(u.rhs_index(), v.rhs_index());
+    } else if (u.type() == type_t::function) {
+      if (u.function() != v.function()) {
+        return false;
+      }
+      stack.emplace(u.argument_index(), v.argument_index());
+    } else if (u.type() == type_t::nary) {
+      if (u.operation() != v.operation() || u.children_count() != v.children_count()) {
+        return false;
+      }
+      for (node_index_type j = 0; j < u.children_count(); ++j) {
+        stack.emplace(u.child_index(j), v.child_index(j));
+      }
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+// plan_reroll() splits the chain ending at `top` into segments, preferring the longest runs, and returns
+// whether there is anything to re-roll. The nodes of the chain are returned in `chain` either way.
+inline bool plan_reroll(node_index_type top,
+                        const std::vector<node_index_type>& count,
+                        reroll_plan& plan,
+                        std::vector<node_index_type>& chain) {
+  chain.clear();
+  node_index_type c = top;
+  while (node_vector_singleton()[c].type() == type_t::operation &&
+         is_arithmetic_operation(node_vector_singleton()[c].operation()) && (c == top || count[c] == 1)) {
+    chain.push_back(c);
+    c = node_vector_singleton()[c].lhs_index();
+  }
+  std::reverse(chain.begin(), chain.end());
+  const size_t n = chain.size();
+  if (n < REROLL_MIN_REPEATS) {
+    return false;
+  }
+  std::vector<operation_t> operations(n);
+  std::vector<node_index_type> terms(n);
+  for (size_t k = 0; k < n; ++k) {
+    operations[k] = node_vector_singleton()[chain[k]].operation();
+    terms[k] = node_vector_singleton()[chain[k]].rhs_index();
+  }
+  plan.base = c;
+  plan.segments.clear();
+  bool rerolled = false;
+  for (size_t pos = 0; pos < n;) {
+    size_t best_period = 0;
+    size_t best_repeats = 0;
+    int64_t best_stride = 0;
+    for (size_t period = 1; period <= REROLL_MAX_PERIOD && pos + period * REROLL_MIN_REPEATS <= n; ++period) {
+      int64_t stride = 0;
+      bool known = false;
+      size_t repeats = 1;
+      bool same = true;
+      while (same && pos + (repeats + 1) * period <= n) {
+        for (size_t j = 0; same && j < period; ++j) {
+          const size_t k = pos + (repeats - 1) * period + j;
+          same = operations[k] == operations[k + period] &&
+                 is_shifted_term(terms[k], terms[k + period], count, stride, known);
+        }
+        if (same) {
+          ++repeats;
+        }
+      }
+      if (repeats >= REROLL_MIN_REPEATS && repeats * period > best_repeats * best_period) {
+        best_period = period;
+        best_repeats = repeats;
+        best_stride = stride;
+      }
+    }
+    reroll_plan::segment segment;
+    if (best_period) {
+      segment.node = -1;
+      segment.run.before = pos ? chain[pos - 1] : plan.base;
+      segment.run.after = chain[pos + best_repeats * best_period - 1];
+      segment.run.repeats = best_repeats;
+      segment.run.stride = best_stride;
+      segment.run.operations.assign(operations.begin() + pos, operations.begin() + pos + best_period);
+      segment.run.terms.assign(terms.begin() + pos, terms.begin() + pos + best_period);
+      pos += best_repeats * best_period;
+      rerolled = true;
+    } else {
+      segment.node = chain[pos];
+      ++pos;
+    }
+    plan.segments.push_back(segment);
+  }
+  return rerolled;
+}
+
+// for_each_term_node() calls `callback` for each node of the term in evaluation order.
+// The terms of the re-rolled runs are trees, as each of their nodes is referred to once.
+template <typename F> void for_each_term_node(node_index_type term, F callback) {
   std::stack<node_index_type> stack;
-  stack.push(index);
+  stack.push(term);
   while (!stack.empty()) {
     const node_index_type i = stack.top();
     stack.pop();
     const node_index_type dependent_i = ~i;
     if (i > dependent_i) {
-      max_dim = std::max(max_dim, static_cast<node_index_type>(i));
+      stack.push(~i);
+      for_each_child(node_vector_singleton()[i], [&stack](node_index_type c) { stack.push(c); });
+    } else {
+      callback(dependent_i);
+    }
+  }
+}
+
+// The slot of the node in the scratch array of the generated code, which starts from the lowest index of the nodes
+// of the expressions, the `base`, so that the nodes before them, such as the originals of the nodes reordered,
+// see reorder_nodes(), take no space.
+inline long long scratch_slot(node_index_type i, node_index_type base) {
+  return static_cast<long long>(i - base);
+}
+
+// code_generator<CODE> walks the graph in evaluation order and calls CODE to write the code for each node.
+// All the expressions share the scratch array, and their common subexpressions are computed once.
+// The scratch array starts from `base_`, which the generator passes to CODE along with each node.
+template <class CODE> struct code_generator {
+  FILE* f_;
+  const std::vector<node_index_type> count_;
+  std::vector<int8_t> generated_;
+  // The chain nodes known to have nothing to re-roll, so that long chains are only analyzed once.
+  std::vector<int8_t> plain_;
+  std::map<node_index_type, reroll_plan> plans_;
+  node_index_type base_;
+  node_index_type max_dim_;
+
+  code_generator(const std::vector<node_index_type>& indexes, FILE* f)
+      : f_(f), count_(node_reference_counts(indexes)), base_(0), max_dim_(0) {
+    while (!count_[base_]) {
+      ++base_;
+    }
+  }
+  // The size of the scratch array.
+  node_index_type dim() const {
+    return max_dim_ + 1 - base_;
+  }
+
+  void generate(node_index_type index) {
+    std::stack<node_index_type> stack;
+    stack.push(index);
+    while (!stack.empty()) {
+      const node_index_type i = stack.top();
+      stack.pop();
+      const node_index_type dependent_i = ~i;
+      if (i > dependent_i) {
+        if (!growing_vector_access(generated_, i, static_cast<int8_t>(false))) {
+          max_dim_ = std::max(max_dim_, static_cast<node_index_type>(i));
+          node_impl& node = node_vector_singleton()[i];
+          if (node.type() == type_t::variable) {
+            CODE::variable(i, node, base_, f_);
+            generated_[i] = true;
+          } else if (node.type() == type_t::value) {
+            CODE::value(i, node, base_, f_);
+            generated_[i] = true;
+          } else if (node.type() == type_t::operation) {
+            stack.push(~i);
+            if (!plans_.count(i) && !growing_vector_access(plain_, i, static_cast<int8_t>(false))) {
+              reroll_plan plan;
+              std::vector<node_index_type> chain;
+              if (plan_reroll(i, count_, plan, chain)) {
+                // The nodes of the terms of the runs are only generated within the loops, yet need their slots.
+                for (const reroll_plan::segment& segment : plan.segments) {
+                  for (node_index_type term : segment.run.terms) {
+                    for_each_term_node(term, [this](node_index_type t) { max_dim_ = std::max(max_dim_, t); });
+                  }
+                }
+                plans_[i] = plan;
+              } else {
+                for (node_index_type c : chain) {
+                  growing_vector_access(plain_, c, static_cast<int8_t>(false)) = true;
+                }
+              }
+            }
+            if (plans_.count(i)) {
+              // The terms of the runs are generated within the loops, the rest is generated as usual.
+              const reroll_plan& plan = plans_[i];
+              for (const reroll_plan::segment& segment : plan.segments) {
+                if (segment.node != -1) {
+                  stack.push(node_vector_singleton()[segment.node].rhs_index());
+                }
+              }
+              stack.push(plan.base);
+            } else {
+              stack.push(node.lhs_index());
+              stack.push(node.rhs_index());
+            }
+          } else if (node.type() == type_t::function) {
+            stack.push(~i);
+            stack.push(node.argument_index());
+          } else if (node.type() == type_t::nary) {
+            stack.push(~i);
+            for (node_index_type j = 0; j < node.children_count(); ++j) {
+              stack.push(node.child_index(j));
+            }
+          } else if (node.type() == type_t::loop) {
+            stack.push(~i);
+            for (node_index_type c : loop_program_of(i).invariant_) {
+              stack.push(c);
+            }
+          } else {
+            row_element_outside_loop();
+          }
+        }
+      } else if (!generated_[dependent_i]) {
+        node_impl& node = node_vector_singleton()[dependent_i];
+        if (plans_.count(dependent_i)) {
+          for (const reroll_plan::segment& segment : plans_[dependent_i].segments) {
+            if (segment.node != -1) {
+              CODE::computed(segment.node, node_vector_singleton()[segment.node], base_, f_);
+            } else {
+              CODE::reroll(segment.run, base_, f_);
+            }
+          }
+          plans_.erase(dependent_i);
+        } else if (node.type() == type_t::loop) {
+          CODE::loop(dependent_i, node, base_, f_);
+        } else {
+          CODE::computed(dependent_i, node, base_, f_);
+        }
+        generated_[dependent_i] = true;
+      }
+    }
+  }
+};
+
+// The names of the value types in the generated C code. The code generators are templated on the precision,
+// see `precision_traits`: the values are kept in its value type, the sums of n-ary nodes and loops
+// are accumulated in its accumulator type, the same as tape_view::eval() does.
+template <typename T> struct c_type;
+template <> struct c_type<double> {
+  static const char* name() {
+    return "double";
+  }
+};
+template <> struct c_type<float> {
+  static const char* name() {
+    return "float";
+  }
+};
+
+// The multiplications integer_power() makes, in order: `true` for `r *= p`, `false` for `p *= p`.
+inline std::vector<bool> integer_power_steps(int32_t n) {
+  std::vector<bool> steps;
+  uint32_t m = n < 0 ? 0u - static_cast<uint32_t>(n) : static_cast<uint32_t>(n);
+  while (m) {
+    if (m & 1u) {
+      steps.push_back(true);
+    }
+    m >>= 1;
+    if (m) {
+      steps.push_back(false);
+    }
+  }
+  return steps;
+}
+
+// The power to an integer exponent is generated as the multiplications of integer_power().
+template <typename P = fncas_value_type>
+void generate_c_code_for_powi(node_index_type index, node_impl& node, node_index_type base, FILE* f) {
+  const char* value_type = c_type<typename precision_traits<P>::value_type>::name();
+  const int32_t n = static_cast<int32_t>(node_vector_singleton()[node.rhs_index()].value());
+  fprintf(f, "  {\n");
+  fprintf(f, "    %s r = 1;\n", value_type);
+  fprintf(f, "    %s p = a[%lld];\n", value_type, scratch_slot(node.lhs_index(), base));
+  for (bool step : integer_power_steps(n)) {
+    fprintf(f, step ? "    r *= p;\n" : "    p *= p;\n");
+  }
+  fprintf(f, "    a[%lld] = %sr;\n", scratch_slot(index, base), n < 0 ? "1 / " : "");
+  fprintf(f, "  }\n");
+}
+
+// N-ary nodes are generated following the order of operations of apply_nary_operation().
+template <typename P = fncas_value_type>
+void generate_c_code_for_nary(node_index_type index, node_impl& node, node_index_type base, FILE* f) {
+  if (node.operation() == operation_t::fma) {
+    fprintf(f,
+            "  a[%lld] = fma(a[%lld], a[%lld], a[%lld]);\n",
+            scratch_slot(index, base),
+            scratch_slot(node.child_index(0), base),
+            scratch_slot(node.child_index(1), base),
+            scratch_slot(node.child_index(2), base));
+    return;
+  }
+  const char* op = operation_as_string(node.operation());
+  const node_index_type n = node.children_count();
+  const node_index_type m = std::min(n, static_cast<node_index_type>(NARY_ACCUMULATORS));
+  fprintf(f, "  {\n");
+  for (node_index_type j = 0; j < n; ++j) {
+    const long long child = scratch_slot(node.child_index(j), base);
+    if (j < m) {
+      fprintf(f,
+              "    %s s%d = a[%lld];\n",
+              c_type<typename precision_traits<P>::accumulator_type>::name(),
+              static_cast<int>(j),
+              child);
+    } else {
+      fprintf(f, "    s%d %s= a[%lld];\n", static_cast<int>(j % m), op, child);
+    }
+  }
+  if (m == 1) {
+    fprintf(f, "    a[%lld] = s0;\n", scratch_slot(index, base));
+  } else if (m == 2) {
+    fprintf(f, "    a[%lld] = s0 %s s1;\n", scratch_slot(index, base), op);
+  } else if (m == 3) {
+    fprintf(f, "    a[%lld] = (s0 %s s1) %s s2;\n", scratch_slot(index, base), op, op);
+  } else {
+    fprintf(f, "    a[%lld] = (s0 %s s1) %s (s2 %s s3);\n", scratch_slot(index, base), op, op, op);
+  }
+  fprintf(f, "  }\n");
+}
+
+// generate_c_code_for_value() writes the C statement computing the node from its children,
+// or, for the nodes within the body of a loop, from the current row `d`.
+template <typename P = fncas_value_type>
+void generate_c_code_for_value(node_index_type index, node_impl& node, node_index_type base, FILE* f) {
+  if (node.type() == type_t::operation && node.operation() == operation_t::powi) {
+    generate_c_code_for_powi<P>(index, node, base, f);
+  } else if (node.type() == type_t::operation && !is_arithmetic_operation(node.operation())) {
+    fprintf(f,
+            "  a[%lld] = %s(a[%lld], a[%lld]);\n",
+            scratch_slot(index, base),
+            operation_as_string(node.operation()),
+            scratch_slot(node.lhs_index(), base),
+            scratch_slot(node.rhs_index(), base));
+  } else if (node.type() == type_t::operation) {
+    fprintf(f,
+            "  a[%lld] = a[%lld] %s a[%lld];\n",
+            scratch_slot(index, base),
+            scratch_slot(node.lhs_index(), base),
+            operation_as_string(node.operation()),
+            scratch_slot(node.rhs_index(), base));
+  } else if (node.type() == type_t::function && node.function() == function_t::neg) {
+    const long long x = scratch_slot(node.argument_index(), base);
+    fprintf(f, "  a[%lld] = -a[%lld];\n", scratch_slot(index, base), x);
+  } else if (node.type() == type_t::function && node.function() == function_t::sqr) {
+    const long long x = scratch_slot(node.argument_index(), base);
+    fprintf(f, "  a[%lld] = a[%lld] * a[%lld];\n", scratch_slot(index, base), x, x);
+  } else if (node.type() == type_t::function && node.function() == function_t::sign) {
+    const long long x = scratch_slot(node.argument_index(), base);
+    fprintf(f, "  a[%lld] = (a[%lld] > 0) - (a[%lld] < 0);\n", scratch_slot(index, base), x, x);
+  } else if (node.type() == type_t::function) {
+    fprintf(f,
+            "  a[%lld] = %s(a[%lld]);\n",
+            scratch_slot(index, base),
+            function_as_string(node.function()),
+            scratch_slot(node.argument_index(), base));
+  } else if (node.type() == type_t::nary) {
+    generate_c_code_for_nary<P>(index, node, base, f);
+  } else if (node.type() == type_t::row_element) {
+    fprintf(f, "  a[%lld] = d[%d];\n", scratch_slot(index, base), node.column());
+  } else {
+    assert(false);
+  }
+}
+
+// Loops are generated as real loops, following eval_loop(): the row-invariant part of the body
+// is computed once before the loop, and only the row-dependent part is computed per row.
+template <typename P = fncas_value_type>
+void generate_c_code_for_loop(node_index_type index, node_impl& node, node_index_type base, FILE* f) {
+  const loop_program& program = loop_program_of(index);
+  fprintf(f, "  {\n");
+  fprintf(f, "    const struct table* t = &fncas_tables[%d];\n", node.table());
+  fprintf(f, "    %s s = 0.0;\n", c_type<typename precision_traits<P>::accumulator_type>::name());
+  fprintf(f, "    for (long long r = 0; r < t->rows; ++r) {\n");
+  fprintf(f, "      const double* d = t->data + r * t->cols;\n");
+  for (node_index_type v : program.variant_) {
+    generate_c_code_for_value<P>(v, node_vector_singleton()[v], base, f);
+  }
+  fprintf(f, "      s += a[%lld];\n", scratch_slot(node.body_index(), base));
+  fprintf(f, "    }\n");
+  fprintf(f, "    a[%lld] = s;\n", scratch_slot(index, base));
+  fprintf(f, "  }\n");
+}
+
+// Re-rolled runs keep the value of the chain in a local variable, and the values of the terms
+// of the current repetition in the slots of the terms of the first one.
+template <typename P = fncas_value_type>
+void generate_c_code_for_reroll(const reroll_run& run, node_index_type base, FILE* f) {
+  fprintf(f, "  {\n");
+  fprintf(f,
+          "    %s r = a[%lld];\n",
+          c_type<typename precision_traits<P>::value_type>::name(),
+          scratch_slot(run.before, base));
+  fprintf(f, "    for (long long k = 0; k < %lld; ++k) {\n", static_cast<long long>(run.repeats));
+  for (size_t j = 0; j < run.terms.size(); ++j) {
+    for_each_term_node(run.terms[j], [&run, base, f](node_index_type i) {
       node_impl& node = node_vector_singleton()[i];
       if (node.type() == type_t::variable) {
-        int32_t v = node.variable();
-        fprintf(f, "  a[%lld] = x[%d];\n", static_cast<long long>(i), v);
+        fprintf(f,
+                "  a[%lld] = x[%d + k * %lld];\n",
+                scratch_slot(i, base),
+                node.variable(),
+                static_cast<long long>(run.stride));
       } else if (node.type() == type_t::value) {
-        fprintf(
-            f, "  a[%lld] = %a;\n", static_cast<long long>(i), node.value());  // "%a" is hexadecimal full precision.
-      } else if (node.type() == type_t::operation) {
-        stack.push(~i);
-        stack.push(node.lhs_index());
-        stack.push(node.rhs_index());
-      } else if (node.type() == type_t::function) {
-        stack.push(~i);
-        stack.push(node.argument_index());
+        fprintf(f, "  a[%lld] = %a;\n", scratch_slot(i, base), node.value());
       } else {
-        assert(false);
+        generate_c_code_for_value<P>(i, node, base, f);
       }
+    });
+    fprintf(f,
+            "      r = r %s a[%lld];\n",
+            operation_as_string(run.operations[j]),
+            scratch_slot(run.terms[j], base));
+  }
+  fprintf(f, "    }\n");
+  fprintf(f, "    a[%lld] = r;\n", scratch_slot(run.after, base));
+  fprintf(f, "  }\n");
+}
+
+template <typename P> struct c_code {
+  static void variable(node_index_type index, node_impl& node, node_index_type base, FILE* f) {
+    fprintf(f, "  a[%lld] = x[%d];\n", scratch_slot(index, base), node.variable());
+  }
+  static void value(node_index_type index, node_impl& node, node_index_type base, FILE* f) {
+    // "%a" is hexadecimal full precision.
+    fprintf(f, "  a[%lld] = %a;\n", scratch_slot(index, base), node.value());
+  }
+  static void computed(node_index_type index, node_impl& node, node_index_type base, FILE* f) {
+    generate_c_code_for_value<P>(index, node, base, f);
+  }
+  static void loop(node_index_type index, node_impl& node, node_index_type base, FILE* f) {
+    generate_c_code_for_loop<P>(index, node, base, f);
+  }
+  static void reroll(const reroll_run& run, node_index_type base, FILE* f) {
+    generate_c_code_for_reroll<P>(run, base, f);
+  }
+};
+
+// generate_c_code_for_nodes() writes C code to evaluate the expressions to the file.
+// All the expressions share the scratch array, and their common subexpressions are computed once.
+// The generated `eval` returns the value of the first expression, the rest are left in the scratch array.
+// The exported symbols are `eval`, `dim`, `base` and `tables`, each prefixed by `prefix`, see export_c_code().
+// The value of the node `i` is left in `a[i - base()]`, see scratch_slot(). Returns the base.
+// With math_t::kernels, the code carries the kernels of fncas_math.h and calls them instead of libm,
+// the ones of single precision if the values are kept in it.
+template <typename P = fncas_value_type>
+node_index_type generate_c_code_for_nodes(const std::vector<node_index_type>& indexes,
+                               FILE* f,
+                               const char* prefix = "",
+                               math_t math = math_t::libm) {
+  assert(!indexes.empty());
+  const char* value_type = c_type<typename precision_traits<P>::value_type>::name();
+  fprintf(f, "#include <math.h>\n");
+  if (math == math_t::kernels) {
+    const bool single = std::is_same<typename precision_traits<P>::value_type, float>::value;
+    fprintf(f, "#include <string.h>\n");
+    fprintf(f, "%s\n", math_kernels_source());
+    for (size_t i = 0; i < static_cast<size_t>(function_t::end); ++i) {
+      const char* name = function_as_string(static_cast<function_t>(i));
+      fprintf(f, "#define %s fncas_%s%s\n", name, name, single ? "f" : "");
+    }
+  }
+  // The data tables are bound by compiled_expression after loading the library, see `table_impl`.
+  fprintf(f, "struct table { const double* data; long long rows; long long cols; };\n");
+  fprintf(f,
+          "static struct table fncas_tables[%lld];\n",
+          static_cast<long long>(std::max(internals_singleton().tables_.size(), static_cast<size_t>(1))));
+  fprintf(f, "void* %stables() { return fncas_tables; }\n", prefix);
+  fprintf(f, "%s %seval(const %s* x, %s* a) {\n", value_type, prefix, value_type, value_type);
+  code_generator<c_code<P>> generator(indexes, f);
+  for (node_index_type index : indexes) {
+    generator.generate(index);
+  }
+  fprintf(f, "  return a[%lld];\n", scratch_slot(indexes.front(), generator.base_));
+  fprintf(f, "}\n");
+  fprintf(f, "long long %sdim() { return %lld; }\n", prefix, static_cast<long long>(generator.dim()));
+  fprintf(f, "long long %sbase() { return %lld; }\n", prefix, static_cast<long long>(generator.base_));
+  return generator.base_;
+}
+
+void generate_c_code_for_node(node_index_type index, FILE* f) {
+  generate_c_code_for_nodes(std::vector<node_index_type>(1, index), f);
+}
+
+// generate_asm_code_for_nodes() writes NASM code to evaluate the expressions to the file.
+// Same contract as generate_c_code_for_nodes(), templated on the precision and the math the same way.
+
+// The instructions of the NASM backend per value type, see `c_type`. The values are computed with the scalar
+// instructions of SSE2, and moved through `gpr()` when no computation is needed.
+template <typename T> struct asm_type;
+template <> struct asm_type<double> {
+  enum { bytes = 8 };
+  static const char* gpr() {
+    return "rax";
+  }
+  // Moves a value between memory and an xmm register.
+  static const char* move() {
+    return "movq";
+  }
+  // Converts a value of the other precision into this one.
+  static const char* convert() {
+    return "cvtss2sd";
+  }
+  // The suffix of the packed instructions used: the bitwise ones, and the moves between registers.
+  static const char* packed() {
+    return "pd";
+  }
+  static const char* less() {
+    return "cmpltsd";
+  }
+  static const char* arithmetic(operation_t operation) {
+    static const char* representation[static_cast<size_t>(operation_t::end)] = {
+        "addpd", "subpd", "mulpd", "divpd",
+    };
+    return is_arithmetic_operation(operation) ? representation[static_cast<size_t>(operation)] : "?";
+  }
+  static const char* sign_mask() {
+    return "0x8000000000000000";
+  }
+  static const char* abs_mask() {
+    return "0x7fffffffffffffff";
+  }
+  // The bits of `x`, as the immediate operand NASM takes.
+  static std::string bits(double x) {
+    int64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return std::to_string(bits);
+  }
+};
+template <> struct asm_type<float> {
+  enum { bytes = 4 };
+  static const char* gpr() {
+    return "eax";
+  }
+  static const char* move() {
+    return "movss";
+  }
+  static const char* convert() {
+    return "cvtsd2ss";
+  }
+  static const char* packed() {
+    return "ps";
+  }
+  static const char* less() {
+    return "cmpltss";
+  }
+  static const char* arithmetic(operation_t operation) {
+    static const char* representation[static_cast<size_t>(operation_t::end)] = {
+        "addss", "subss", "mulss", "divss",
+    };
+    return is_arithmetic_operation(operation) ? representation[static_cast<size_t>(operation)] : "?";
+  }
+  static const char* sign_mask() {
+    return "0x80000000";
+  }
+  static const char* abs_mask() {
+    return "0x7fffffff";
+  }
+  // Rounded to single precision first, as `a[i] = x;` of the C code does.
+  static std::string bits(double x) {
+    const float y = static_cast<float>(x);
+    uint32_t bits;
+    memcpy(&bits, &y, sizeof(bits));
+    return std::to_string(bits);
+  }
+};
+
+// Loads the value of the type M at [`pointer`+`offset`] into the register as the type R, converting it if needed.
+template <typename M, typename R = M>
+void generate_asm_code_for_load(int xmm, const char* pointer, long long offset, FILE* f) {
+  fprintf(f,
+          "  %s xmm%d, [%s+%lld]\n",
+          std::is_same<M, R>::value ? asm_type<M>::move() : asm_type<R>::convert(),
+          xmm,
+          pointer,
+          offset);
+}
+// Stores the register holding the type R as the type M, converting it if needed.
+template <typename M, typename R = M> void generate_asm_code_for_store(long long offset, int xmm, FILE* f) {
+  if (!std::is_same<M, R>::value) {
+    fprintf(f, "  %s xmm%d, xmm%d\n", asm_type<M>::convert(), xmm, xmm);
+  }
+  fprintf(f, "  %s [rsi+%lld], xmm%d\n", asm_type<M>::move(), offset, xmm);
+}
+// The math functions of libm take their arguments in xmm0 ... xmm2 and return the result in xmm0, in double
+// precision: the values of single precision are converted around the call, as the C code calling them does.
+// The pointers to the inputs and to the scratch array are saved around the call, which keeps the stack aligned.
+void generate_asm_code_for_call(const char* function, FILE* f) {
+  fprintf(f, "  push rdi\n");
+  fprintf(f, "  push rsi\n");
+  fprintf(f, "  call %s wrt ..plt\n", function);
+  fprintf(f, "  pop rsi\n");
+  fprintf(f, "  pop rdi\n");
+}
+// With math_t::kernels, the functions call the kernels of fncas_math.h through the table `fncas_kernels`, bound
+// after loading the library, see math_kernel_table. The kernels take and return the value type.
+void generate_asm_code_for_kernel_call(function_t function, FILE* f) {
+  fprintf(f, "  push rdi\n");
+  fprintf(f, "  push rsi\n");
+  fprintf(f, "  lea rax, [rel fncas_kernels]\n");
+  fprintf(f, "  call qword [rax+%d]\n", static_cast<int>(function) * 8);
+  fprintf(f, "  pop rsi\n");
+  fprintf(f, "  pop rdi\n");
+}
+// Loads `x` into the register, as the type T.
+template <typename T> void generate_asm_code_for_constant(double x, const char* xmm, FILE* f) {
+  fprintf(f, "  mov rax, %s\n", asm_type<T>::bits(x).c_str());
+  fprintf(f, "  movq %s, rax\n", xmm);
+}
+// N-ary nodes keep their accumulators in xmm0 ... xmm3, same order of operations as apply_nary_operation(),
+// in the accumulator type of the precision.
+template <typename P = fncas_value_type>
+void generate_asm_code_for_nary(node_index_type index, node_impl& node, node_index_type base, FILE* f) {
+  typedef typename precision_traits<P>::value_type T;
+  typedef typename precision_traits<P>::accumulator_type A;
+  if (node.operation() == operation_t::fma) {
+    fprintf(f,
+            "  ; a[%lld] = fma(a[%lld], a[%lld], a[%lld]);\n",
+            scratch_slot(index, base),
+            scratch_slot(node.child_index(0), base),
+            scratch_slot(node.child_index(1), base),
+            scratch_slot(node.child_index(2), base));
+    for (node_index_type j = 0; j < 3; ++j) {
+      generate_asm_code_for_load<T, double>(
+          static_cast<int>(j), "rsi", scratch_slot(node.child_index(j), base) * asm_type<T>::bytes, f);
+    }
+    generate_asm_code_for_call("fma", f);
+    generate_asm_code_for_store<T, double>(scratch_slot(index, base) * asm_type<T>::bytes, 0, f);
+    return;
+  }
+  const char* instruction = asm_type<A>::arithmetic(node.operation());
+  const node_index_type n = node.children_count();
+  const node_index_type m = std::min(n, static_cast<node_index_type>(NARY_ACCUMULATORS));
+  fprintf(f,
+          "  ; a[%lld] = %s of %lld nodes;\n",
+          scratch_slot(index, base),
+          node.operation() == operation_t::add ? "sum" : "product",
+          static_cast<long long>(n));
+  for (node_index_type j = 0; j < n; ++j) {
+    const long long offset = scratch_slot(node.child_index(j), base) * asm_type<T>::bytes;
+    if (j < m) {
+      generate_asm_code_for_load<T, A>(static_cast<int>(j), "rsi", offset, f);
     } else {
-      node_impl& node = node_vector_singleton()[dependent_i];
-      if (node.type() == type_t::operation) {
-        fprintf(f,
-                "  a[%lld] = a[%lld] %s a[%lld];\n",
-                static_cast<long long>(dependent_i),
-                static_cast<long long>(node.lhs_index()),
-                operation_as_string(node.operation()),
-                static_cast<long long>(node.rhs_index()));
-      } else if (node.type() == type_t::function) {
-        fprintf(f,
-                "  a[%lld] = %s(a[%lld]);\n",
-                static_cast<long long>(dependent_i),
-                function_as_string(node.function()),
-                static_cast<long long>(node.argument_index()));
+      generate_asm_code_for_load<T, A>(4, "rsi", offset, f);
+      fprintf(f, "  %s xmm%d, xmm4\n", instruction, static_cast<int>(j % m));
+    }
+  }
+  if (m >= 2) {
+    fprintf(f, "  %s xmm0, xmm1\n", instruction);
+  }
+  if (m == 3) {
+    fprintf(f, "  %s xmm0, xmm2\n", instruction);
+  } else if (m == 4) {
+    fprintf(f, "  %s xmm2, xmm3\n", instruction);
+    fprintf(f, "  %s xmm0, xmm2\n", instruction);
+  }
+  generate_asm_code_for_store<T, A>(scratch_slot(index, base) * asm_type<T>::bytes, 0, f);
+}
+
+// generate_asm_code_for_value() writes the code computing the node from its children,
+// or, for the nodes within the body of a loop, from the current row pointed to by r12.
+// Pow, min and max call libm, as NaNs and signed zeros make minsd and maxsd differ from fmin() and fmax().
+// The power to an integer exponent makes the multiplications of integer_power(), `r` in xmm1 and `p` in xmm0.
+template <typename P = fncas_value_type, math_t MATH = math_t::libm>
+void generate_asm_code_for_value(node_index_type index, node_impl& node, node_index_type base, FILE* f) {
+  typedef typename precision_traits<P>::value_type T;
+  const long long bytes = asm_type<T>::bytes;
+  if (node.type() == type_t::operation) {
+    fprintf(f,
+            "  ; a[%lld] = a[%lld] %s a[%lld];\n",
+            scratch_slot(index, base),
+            scratch_slot(node.lhs_index(), base),
+            operation_as_string(node.operation()),
+            scratch_slot(node.rhs_index(), base));
+    const long long lhs = scratch_slot(node.lhs_index(), base) * bytes;
+    const long long rhs = scratch_slot(node.rhs_index(), base) * bytes;
+    if (node.operation() == operation_t::powi) {
+      const int32_t n = static_cast<int32_t>(node_vector_singleton()[node.rhs_index()].value());
+      const char* multiply = asm_type<T>::arithmetic(operation_t::multiply);
+      generate_asm_code_for_load<T>(0, "rsi", lhs, f);
+      generate_asm_code_for_constant<T>(1.0, "xmm1", f);
+      for (bool step : integer_power_steps(n)) {
+        fprintf(f, step ? "  %s xmm1, xmm0\n" : "  %s xmm0, xmm0\n", multiply);
+      }
+      if (n < 0) {
+        generate_asm_code_for_constant<T>(1.0, "xmm0", f);
+        fprintf(f, "  %s xmm0, xmm1\n", asm_type<T>::arithmetic(operation_t::divide));
       } else {
-        assert(false);
+        fprintf(f, "  mova%s xmm0, xmm1\n", asm_type<T>::packed());
       }
+      generate_asm_code_for_store<T>(scratch_slot(index, base) * bytes, 0, f);
+    } else if (is_arithmetic_operation(node.operation())) {
+      generate_asm_code_for_load<T>(0, "rsi", lhs, f);
+      generate_asm_code_for_load<T>(1, "rsi", rhs, f);
+      fprintf(f, "  %s xmm0, xmm1\n", asm_type<T>::arithmetic(node.operation()));
+      generate_asm_code_for_store<T>(scratch_slot(index, base) * bytes, 0, f);
+    } else {
+      generate_asm_code_for_load<T, double>(0, "rsi", lhs, f);
+      generate_asm_code_for_load<T, double>(1, "rsi", rhs, f);
+      generate_asm_code_for_call(operation_as_string(node.operation()), f);
+      generate_asm_code_for_store<T, double>(scratch_slot(index, base) * bytes, 0, f);
+    }
+  } else if (node.type() == type_t::function) {
+    fprintf(f,
+            "  ; a[%lld] = %s(a[%lld]);\n",
+            scratch_slot(index, base),
+            function_as_string(node.function()),
+            scratch_slot(node.argument_index(), base));
+    const long long x = scratch_slot(node.argument_index(), base) * bytes;
+    if (node.function() == function_t::neg) {
+      generate_asm_code_for_load<T>(0, "rsi", x, f);
+      fprintf(f, "  mov rax, %s\n", asm_type<T>::sign_mask());
+      fprintf(f, "  movq xmm1, rax\n");
+      fprintf(f, "  xor%s xmm0, xmm1\n", asm_type<T>::packed());
+    } else if (node.function() == function_t::sqr) {
+      generate_asm_code_for_load<T>(0, "rsi", x, f);
+      fprintf(f, "  %s xmm0, xmm0\n", asm_type<T>::arithmetic(operation_t::multiply));
+    } else if (node.function() == function_t::abs) {
+      generate_asm_code_for_load<T>(0, "rsi", x, f);
+      fprintf(f, "  mov rax, %s\n", asm_type<T>::abs_mask());
+      fprintf(f, "  movq xmm1, rax\n");
+      fprintf(f, "  and%s xmm0, xmm1\n", asm_type<T>::packed());
+    } else if (node.function() == function_t::sign) {
+      // The masks of 0 < x and x < 0 select 1.0 each, NaN fails both comparisons.
+      generate_asm_code_for_load<T>(0, "rsi", x, f);
+      fprintf(f, "  xor%s xmm1, xmm1\n", asm_type<T>::packed());
+      fprintf(f, "  mova%s xmm2, xmm1\n", asm_type<T>::packed());
+      fprintf(f, "  %s xmm2, xmm0\n", asm_type<T>::less());
+      fprintf(f, "  %s xmm0, xmm1\n", asm_type<T>::less());
+      generate_asm_code_for_constant<T>(1.0, "xmm3", f);
+      fprintf(f, "  and%s xmm2, xmm3\n", asm_type<T>::packed());
+      fprintf(f, "  and%s xmm0, xmm3\n", asm_type<T>::packed());
+      fprintf(f, "  %s xmm2, xmm0\n", asm_type<T>::arithmetic(operation_t::subtract));
+      fprintf(f, "  mova%s xmm0, xmm2\n", asm_type<T>::packed());
+    } else if (MATH == math_t::kernels) {
+      generate_asm_code_for_load<T>(0, "rsi", x, f);
+      generate_asm_code_for_kernel_call(node.function(), f);
+    } else {
+      generate_asm_code_for_load<T, double>(0, "rsi", x, f);
+      generate_asm_code_for_call(function_as_string(node.function()), f);
+      generate_asm_code_for_store<T, double>(scratch_slot(index, base) * bytes, 0, f);
+      return;
     }
+    generate_asm_code_for_store<T>(scratch_slot(index, base) * bytes, 0, f);
+  } else if (node.type() == type_t::nary) {
+    generate_asm_code_for_nary<P>(index, node, base, f);
+  } else if (node.type() == type_t::row_element) {
+    // The data tables are kept in double.
+    fprintf(f, "  ; a[%lld] = d[%d];\n", scratch_slot(index, base), node.column());
+    generate_asm_code_for_load<double, T>(0, "r12", node.column() * 8, f);
+    generate_asm_code_for_store<T>(scratch_slot(index, base) * bytes, 0, f);
+  } else {
+    assert(false);
   }
-  fprintf(f, "  return a[%lld];\n", static_cast<long long>(index));
-  fprintf(f, "}\n");
-  fprintf(f, "long long dim() { return %lld; }\n", static_cast<long long>(max_dim + 1));
 }
 
-// generate_asm_code_for_node() writes NASM code to evaluate the expression to the file.
-const char* const operation_as_nasm_instruction(operation_t operation) {
-  static const char* representation[static_cast<size_t>(operation_t::end)] = {
-      "addpd", "subpd", "mulpd", "divpd",
-  };
-  return operation < operation_t::end ? representation[static_cast<size_t>(operation)] : "?";
+// Loops keep their state in callee-saved registers, which survive the calls to the math functions:
+// r12 points to the current row, r13 counts the rows left, r14 is the size of the row in bytes,
+// and rbx holds the bits of the sum, accumulated in the accumulator type in the same order as eval_loop().
+template <typename P = fncas_value_type, math_t MATH = math_t::libm>
+void generate_asm_code_for_loop(node_index_type index, node_impl& node, node_index_type base, FILE* f) {
+  typedef typename precision_traits<P>::value_type T;
+  typedef typename precision_traits<P>::accumulator_type A;
+  const loop_program& program = loop_program_of(index);
+  const long long i = scratch_slot(index, base);
+  const long long t = static_cast<long long>(node.table()) * static_cast<long long>(sizeof(table_impl));
+  fprintf(f,
+          "  ; a[%lld] = sum over the rows of table %d of a[%lld];\n",
+          i,
+          node.table(),
+          scratch_slot(node.body_index(), base));
+  fprintf(f, "  push rbx\n");
+  fprintf(f, "  push r12\n");
+  fprintf(f, "  push r13\n");
+  fprintf(f, "  push r14\n");
+  fprintf(f, "  lea rax, [rel fncas_tables]\n");
+  fprintf(f, "  mov r12, [rax+%lld]\n", t);
+  fprintf(f, "  mov r13, [rax+%lld]\n", t + 8);
+  fprintf(f, "  mov r14, [rax+%lld]\n", t + 16);
+  fprintf(f, "  shl r14, 3\n");
+  fprintf(f, "  xor rbx, rbx\n");
+  fprintf(f, "  test r13, r13\n");
+  fprintf(f, "  jz .loop_%lld_end\n", i);
+  fprintf(f, ".loop_%lld:\n", i);
+  for (node_index_type v : program.variant_) {
+    generate_asm_code_for_value<P, MATH>(v, node_vector_singleton()[v], base, f);
+  }
+  fprintf(f, "  movq xmm0, rbx\n");
+  generate_asm_code_for_load<T, A>(1, "rsi", scratch_slot(node.body_index(), base) * asm_type<T>::bytes, f);
+  fprintf(f, "  %s xmm0, xmm1\n", asm_type<A>::arithmetic(operation_t::add));
+  fprintf(f, "  movq rbx, xmm0\n");
+  fprintf(f, "  add r12, r14\n");
+  fprintf(f, "  dec r13\n");
+  fprintf(f, "  jnz .loop_%lld\n", i);
+  fprintf(f, ".loop_%lld_end:\n", i);
+  fprintf(f, "  movq xmm0, rbx\n");
+  generate_asm_code_for_store<T, A>(i * asm_type<T>::bytes, 0, f);
+  fprintf(f, "  pop r14\n");
+  fprintf(f, "  pop r13\n");
+  fprintf(f, "  pop r12\n");
+  fprintf(f, "  pop rbx\n");
 }
-void generate_asm_code_for_node(node_index_type index, FILE* f) {
+
+template <typename P, math_t MATH = math_t::libm> struct asm_code {
+  typedef typename precision_traits<P>::value_type T;
+  static void variable(node_index_type index, node_impl& node, node_index_type base, FILE* f) {
+    fprintf(f, "  ; a[%lld] = x[%d];\n", scratch_slot(index, base), node.variable());
+    fprintf(f, "  mov %s, [rdi+%d]\n", asm_type<T>::gpr(), node.variable() * asm_type<T>::bytes);
+    fprintf(f, "  mov [rsi+%lld], %s\n", scratch_slot(index, base) * asm_type<T>::bytes, asm_type<T>::gpr());
+  }
+  static void value(node_index_type index, node_impl& node, node_index_type base, FILE* f) {
+    // "%a" is hexadecimal full precision.
+    fprintf(f, "  ; a[%lld] = %a;\n", scratch_slot(index, base), node.value());
+    fprintf(f, "  mov %s, %s\n", asm_type<T>::gpr(), asm_type<T>::bits(node.value()).c_str());
+    fprintf(f, "  mov [rsi+%lld], %s\n", scratch_slot(index, base) * asm_type<T>::bytes, asm_type<T>::gpr());
+  }
+  static void computed(node_index_type index, node_impl& node, node_index_type base, FILE* f) {
+    generate_asm_code_for_value<P, MATH>(index, node, base, f);
+  }
+  static void loop(node_index_type index, node_impl& node, node_index_type base, FILE* f) {
+    generate_asm_code_for_loop<P, MATH>(index, node, base, f);
+  }
+  static void reroll(const reroll_run& run, node_index_type base, FILE* f);
+};
+
+// Re-rolled runs keep the state in the same registers as loops, see generate_asm_code_for_loop():
+// r12 points to the variables of the current repetition, r13 counts the repetitions left.
+// The value of the chain is kept in the slot of the node to hold it after the run, in the value type.
+template <typename P = fncas_value_type, math_t MATH = math_t::libm>
+void generate_asm_code_for_reroll(const reroll_run& run, node_index_type base, FILE* f) {
+  typedef typename precision_traits<P>::value_type T;
+  const long long after = scratch_slot(run.after, base) * asm_type<T>::bytes;
+  fprintf(f,
+          "  ; a[%lld] = a[%lld] followed by %lld repetitions of %lld terms;\n",
+          scratch_slot(run.after, base),
+          scratch_slot(run.before, base),
+          static_cast<long long>(run.repeats),
+          static_cast<long long>(run.terms.size()));
+  fprintf(f, "  push rbx\n");
+  fprintf(f, "  push r12\n");
+  fprintf(f, "  push r13\n");
+  fprintf(f, "  push r14\n");
+  fprintf(f, "  mov r12, rdi\n");
+  fprintf(f, "  mov r13, %lld\n", static_cast<long long>(run.repeats));
+  generate_asm_code_for_load<T>(0, "rsi", scratch_slot(run.before, base) * asm_type<T>::bytes, f);
+  generate_asm_code_for_store<T>(after, 0, f);
+  fprintf(f, ".reroll_%lld:\n", scratch_slot(run.after, base));
+  for (size_t j = 0; j < run.terms.size(); ++j) {
+    for_each_term_node(run.terms[j], [base, f](node_index_type i) {
+      node_impl& node = node_vector_singleton()[i];
+      if (node.type() == type_t::variable) {
+        fprintf(f, "  ; a[%lld] = x[%d + k * stride];\n", scratch_slot(i, base), node.variable());
+        fprintf(f, "  mov %s, [r12+%d]\n", asm_type<T>::gpr(), node.variable() * asm_type<T>::bytes);
+        fprintf(f, "  mov [rsi+%lld], %s\n", scratch_slot(i, base) * asm_type<T>::bytes, asm_type<T>::gpr());
+      } else if (node.type() == type_t::value) {
+        asm_code<P, MATH>::value(i, node, base, f);
+      } else {
+        generate_asm_code_for_value<P, MATH>(i, node, base, f);
+      }
+    });
+    generate_asm_code_for_load<T>(0, "rsi", after, f);
+    generate_asm_code_for_load<T>(1, "rsi", scratch_slot(run.terms[j], base) * asm_type<T>::bytes, f);
+    fprintf(f, "  %s xmm0, xmm1\n", asm_type<T>::arithmetic(run.operations[j]));
+    generate_asm_code_for_store<T>(after, 0, f);
+  }
+  fprintf(f, "  add r12, %lld\n", static_cast<long long>(run.stride) * asm_type<T>::bytes);
+  fprintf(f, "  dec r13\n");
+  fprintf(f, "  jnz .reroll_%lld\n", scratch_slot(run.after, base));
+  fprintf(f, "  pop r14\n");
+  fprintf(f, "  pop r13\n");
+  fprintf(f, "  pop r12\n");
+  fprintf(f, "  pop rbx\n");
+}
+
+template <typename P, math_t MATH>
+void asm_code<P, MATH>::reroll(const reroll_run& run, node_index_type base, FILE* f) {
+  generate_asm_code_for_reroll<P, MATH>(run, base, f);
+}
+
+template <typename P = fncas_value_type, math_t MATH = math_t::libm>
+node_index_type generate_asm_code_for_nodes(const std::vector<node_index_type>& indexes, FILE* f) {
+  typedef typename precision_traits<P>::value_type T;
+  assert(!indexes.empty());
   fprintf(f, "[bits 64]\n");
   fprintf(f, "\n");
-  fprintf(f, "global eval, dim\n");
-  fprintf(f, "extern sqrt, exp, log, sin, cos, tan, asin, acos, atan\n");
+  fprintf(f, "global eval, dim, base, tables%s\n", MATH == math_t::kernels ? ", kernels" : "");
+  fprintf(f, "extern sqrt, exp, log, sin, cos, tan, asin, acos, atan, pow, fmin, fmax, fma\n");
+  fprintf(f, "\n");
+  // The data tables are bound by compiled_expression after loading the library, see `table_impl`.
+  fprintf(f, "section .bss\n");
+  fprintf(f, "\n");
+  fprintf(f,
+          "fncas_tables: resq %lld\n",
+          static_cast<long long>(std::max(internals_singleton().tables_.size(), static_cast<size_t>(1)) *
+                                 sizeof(table_impl) / 8));
+  if (MATH == math_t::kernels) {
+    fprintf(f, "fncas_kernels: resq %d\n", static_cast<int>(function_t::end));
+  }
   fprintf(f, "\n");
   fprintf(f, "section .text\n");
   fprintf(f, "\n");
+  fprintf(f, "tables:\n");
+  fprintf(f, "  lea rax, [rel fncas_tables]\n");
+  fprintf(f, "  ret\n");
+  fprintf(f, "\n");
+  if (MATH == math_t::kernels) {
+    fprintf(f, "kernels:\n");
+    fprintf(f, "  lea rax, [rel fncas_kernels]\n");
+    fprintf(f, "  ret\n");
+    fprintf(f, "\n");
+  }
   fprintf(f, "eval:\n");
   fprintf(f, "  push rbp\n");
   fprintf(f, "  mov rbp, rsp\n");
-  node_index_type max_dim = index;
-  std::stack<node_index_type> stack;
-  stack.push(index);
-  while (!stack.empty()) {
-    const node_index_type i = stack.top();
-    stack.pop();
-    const node_index_type dependent_i = ~i;
-    if (i > dependent_i) {
-      max_dim = std::max(max_dim, static_cast<node_index_type>(i));
-      node_impl& node = node_vector_singleton()[i];
-      if (node.type() == type_t::variable) {
-        int32_t v = node.variable();
-        fprintf(f, "  ; a[%lld] = x[%d];\n", static_cast<long long>(i), v);
-        fprintf(f, "  mov rax, [rdi+%d]\n", v * 8);
-        fprintf(f, "  mov [rsi+%lld], rax\n", static_cast<long long>(i) * 8);
-      } else if (node.type() == type_t::value) {
-        fprintf(f,
-                "  ; a[%lld] = %a;\n",
-                static_cast<long long>(i),
-                node.value());  // "%a" is hexadecimal full precision.
-        fprintf(f, "  mov rax, %s\n", std::to_string(*reinterpret_cast<int64_t*>(&node.value())).c_str());
-        fprintf(f, "  mov [rsi+%lld], rax\n", static_cast<long long>(i) * 8);
-      } else if (node.type() == type_t::operation) {
-        stack.push(~i);
-        stack.push(node.lhs_index());
-        stack.push(node.rhs_index());
-      } else if (node.type() == type_t::function) {
-        stack.push(~i);
-        stack.push(node.argument_index());
-      } else {
-        assert(false);
-      }
-    } else {
-      node_impl& node = node_vector_singleton()[dependent_i];
-      if (node.type() == type_t::operation) {
-        fprintf(f,
-                "  ; a[%lld] = a[%lld] %s a[%lld];\n",
-                static_cast<long long>(dependent_i),
-                static_cast<long long>(node.lhs_index()),
-                operation_as_string(node.operation()),
-                static_cast<long long>(node.rhs_index()));
-        fprintf(f, "  movq xmm0, [rsi+%lld]\n", static_cast<long long>(node.lhs_index()) * 8);
-        fprintf(f, "  movq xmm1, [rsi+%lld]\n", static_cast<long long>(node.rhs_index()) * 8);
-        fprintf(f, "  %s xmm0, xmm1\n", operation_as_nasm_instruction(node.operation()));
-        fprintf(f, "  movq [rsi+%lld], xmm0\n", static_cast<long long>(dependent_i) * 8);
-      } else if (node.type() == type_t::function) {
-        fprintf(f,
-                "  ; a[%lld] = %s(a[%lld]);\n",
-                static_cast<long long>(dependent_i),
-                function_as_string(node.function()),
-                static_cast<long long>(node.argument_index()));
-        fprintf(f, "  movq xmm0, [rsi+%lld]\n", static_cast<long long>(node.argument_index()) * 8);
-        fprintf(f, "  push rdi\n");
-        fprintf(f, "  push rsi\n");
-        fprintf(f, "  call %s wrt ..plt\n", function_as_string(node.function()));
-        fprintf(f, "  pop rsi\n");
-        fprintf(f, "  pop rdi\n");
-        fprintf(f, "  movq [rsi+%lld], xmm0\n", static_cast<long long>(dependent_i) * 8);
-      } else {
-        assert(false);
-      }
-    }
+  code_generator<asm_code<P, MATH>> generator(indexes, f);
+  for (node_index_type index : indexes) {
+    generator.generate(index);
   }
-  fprintf(f, "  ; return a[%lld]\n", static_cast<long long>(index));
-  fprintf(f, "  movq xmm0, [rsi+%lld]\n", static_cast<long long>(index) * 8);
+  const long long root = scratch_slot(indexes.front(), generator.base_);
+  fprintf(f, "  ; return a[%lld]\n", root);
+  generate_asm_code_for_load<T>(0, "rsi", root * asm_type<T>::bytes, f);
   fprintf(f, "  mov rsp, rbp\n");
   fprintf(f, "  pop rbp\n");
   fprintf(f, "  ret\n");
@@ -225,37 +1208,115 @@ void generate_asm_code_for_node(node_index_type index, FILE* f) {
   fprintf(f, "dim:\n");
   fprintf(f, "  push rbp\n");
   fprintf(f, "  mov rbp, rsp\n");
-  fprintf(f, "  mov rax, %lld\n", static_cast<long long>(max_dim + 1));
+  fprintf(f, "  mov rax, %lld\n", static_cast<long long>(generator.dim()));
   fprintf(f, "  mov rsp, rbp\n");
   fprintf(f, "  pop rbp\n");
   fprintf(f, "  ret\n");
+  fprintf(f, "\n");
+  fprintf(f, "base:\n");
+  fprintf(f, "  push rbp\n");
+  fprintf(f, "  mov rbp, rsp\n");
+  fprintf(f, "  mov rax, %lld\n", static_cast<long long>(generator.base_));
+  fprintf(f, "  mov rsp, rbp\n");
+  fprintf(f, "  pop rbp\n");
+  fprintf(f, "  ret\n");
+  return generator.base_;
+}
+
+void generate_asm_code_for_node(node_index_type index, FILE* f) {
+  generate_asm_code_for_nodes(std::vector<node_index_type>(1, index), f);
 }
 
+// The backends split the compilation into the phases: generate() writes the source for the expressions,
+// build() runs the external tools turning it into `filebase.so`, which basic_compiled_expression then loads.
+// Both add what they did to `stats`, if given.
 struct compile_impl {
   struct NASM {
-    static void compile(const std::string& filebase, node_index_type index) {
+    template <typename P>
+    static void generate(const std::string& filebase,
+                         const std::vector<node_index_type>& indexes,
+                         math_t math = math_t::libm,
+                         compile_stats* stats = nullptr) {
+      const auto begin = std::chrono::steady_clock::now();
       FILE* f = fopen((filebase + ".asm").c_str(), "w");
       assert(f);
-      generate_asm_code_for_node(index, f);
+      if (math == math_t::kernels) {
+        generate_asm_code_for_nodes<P, math_t::kernels>(indexes, f);
+      } else {
+        generate_asm_code_for_nodes<P>(indexes, f);
+      }
       fclose(f);
-
+      if (stats) {
+        stats->generate_seconds = compile_seconds_since(begin);
+        stats->source_bytes = compile_file_bytes(filebase + ".asm");
+        // The instructions are indented, the labels and the directives are not.
+        stats->instructions = compile_count_lines(filebase + ".asm", [](const std::string& line) {
+          return line.size() > 2 && line[0] == ' ' && line[2] != ';';
+        });
+      }
+    }
+    static void build(const std::string& filebase, compile_stats* stats = nullptr) {
       const char* compile_cmdline = "nasm -f elf64 %1%.asm -o %1%.o";
       const char* link_cmdline = "ld -lm -shared -o %1%.so %1%.o";
 
+      const auto begin = std::chrono::steady_clock::now();
       compiled_expression::syscall((boost::format(compile_cmdline) % filebase).str());
+      const double compile_seconds = compile_seconds_since(begin);
       compiled_expression::syscall((boost::format(link_cmdline) % filebase).str());
+      if (stats) {
+        stats->compile_seconds = compile_seconds;
+        stats->link_seconds = compile_seconds_since(begin) - compile_seconds;
+        stats->object_bytes = compile_file_bytes(filebase + ".o");
+      }
+    }
+    template <typename P>
+    static void compile(const std::string& filebase,
+                        const std::vector<node_index_type>& indexes,
+                        math_t math = math_t::libm,
+                        compile_stats* stats = nullptr) {
+      generate<P>(filebase, indexes, math, stats);
+      build(filebase, stats);
     }
   };
   struct CLANG {
-    static void compile(const std::string& filebase, node_index_type index) {
+    template <typename P>
+    static void generate(const std::string& filebase,
+                         const std::vector<node_index_type>& indexes,
+                         math_t math = math_t::libm,
+                         compile_stats* stats = nullptr) {
+      const auto begin = std::chrono::steady_clock::now();
       FILE* f = fopen((filebase + ".c").c_str(), "w");
       assert(f);
-      generate_c_code_for_node(index, f);
+      generate_c_code_for_nodes<P>(indexes, f, "", math);
       fclose(f);
-
+      if (stats) {
+        stats->generate_seconds = compile_seconds_since(begin);
+        stats->source_bytes = compile_file_bytes(filebase + ".c");
+        stats->instructions = compile_count_lines(filebase + ".c", [](const std::string& line) {
+          return !line.empty() && line.back() == ';';
+        });
+      }
+    }
+    static void build(const std::string& filebase, math_t math = math_t::libm, compile_stats* stats = nullptr) {
       const char* compile_cmdline = "clang -fPIC -shared -nostartfiles %1%.c -o %1%.so";
-      std::string cmdline = (boost::format(compile_cmdline) % filebase).str();
+      // The kernels are only worth inlining optimized, and for the instruction set of the machine.
+      const char* kernels_cmdline =
+          "clang -O3 -march=native -ffp-contract=off -fno-math-errno -fPIC -shared -nostartfiles %1%.c -o %1%.so";
+      std::string cmdline =
+          (boost::format(math == math_t::kernels ? kernels_cmdline : compile_cmdline) % filebase).str();
+      const auto begin = std::chrono::steady_clock::now();
       compiled_expression::syscall(cmdline);
+      if (stats) {
+        stats->compile_seconds = compile_seconds_since(begin);
+      }
+    }
+    template <typename P>
+    static void compile(const std::string& filebase,
+                        const std::vector<node_index_type>& indexes,
+                        math_t math = math_t::libm,
+                        compile_stats* stats = nullptr) {
+      generate<P>(filebase, indexes, math, stats);
+      build(filebase, math, stats);
     }
   };
   // Confirm FNCAS_JIT is a valid identifier.
@@ -265,34 +1326,141 @@ struct compile_impl {
   typedef FNCAS_JIT selected;
 };
 
-compiled_expression compile(node_index_type index) {
+// The path, with no extension, of the files of a new compiled expression.
+inline std::string compile_filebase() {
   std::random_device random;
   std::uniform_int_distribution<int> distribution(1000000, 9999999);
   std::ostringstream os;
   os << "/tmp/" << distribution(random);
   const std::string filebase = os.str();
+  unlink((filebase + ".so").c_str());
+  return filebase;
+}
+
+template <typename P = fncas_value_type>
+basic_compiled_expression<P> compile(const std::vector<node_index_type>& indexes, math_t math = math_t::libm) {
+  const std::string filebase = compile_filebase();
   const std::string filename_so = filebase + ".so";
-  unlink(filename_so.c_str());
-  compile_impl::selected::compile(filebase, index);
-  return compiled_expression(filename_so);
+  compile_stats stats;
+  compile_impl::selected::compile<P>(filebase, indexes, math, &stats);
+  basic_compiled_expression<P> result(filename_so, indexes);
+  stats.load_seconds = result.stats_.load_seconds;
+  stats.library_bytes = result.stats_.library_bytes;
+  stats.text_bytes = result.stats_.text_bytes;
+  stats.scratch_size = result.stats_.scratch_size;
+  result.stats_ = stats;
+  return result;
 }
 
-compiled_expression compile(const node& node) {
-  return compile(node.index_);
+template <typename P = fncas_value_type>
+basic_compiled_expression<P> compile(node_index_type index, math_t math = math_t::libm) {
+  return compile<P>(std::vector<node_index_type>(1, index), math);
 }
 
-struct f_compiled : f {
-  fncas::compiled_expression c_;
-  explicit f_compiled(const node& node) : c_(compile(node)) {
+template <typename P = fncas_value_type>
+basic_compiled_expression<P> compile(const node& node, math_t math = math_t::libm) {
+  return compile<P>(node.index_, math);
+}
+
+// Ahead-of-time export: export_c_code() writes `filebase.c` and `filebase.h` with the code of the expressions,
+// to be compiled and linked into another binary, which then needs neither FNCAS nor a compiler at runtime.
+// The symbols are prefixed by `prefix`, so that several functions can be linked into one binary. Besides
+// `eval`, `dim` and `tables` of the JIT-compiled code, the source defines `roots`, the scratch array indexes
+// of the values of all the expressions. If the expressions contain loops, the data tables should be bound
+// through `tables` before calling `eval`, in the order they were created in.
+// Throws file_error if either file can not be created or written.
+void export_c_code(const std::vector<node_index_type>& indexes,
+                   const std::string& prefix,
+                   const std::string& filebase,
+                   math_t math = math_t::libm) {
+  const auto close = [](FILE* file, const std::string& filename) {
+    const bool failed = ferror(file);
+    if (fclose(file) || failed) {
+      throw file_error("Can not write the exported file `" + filename + "`.");
+    }
+  };
+  FILE* f = fopen((filebase + ".c").c_str(), "w");
+  if (!f) {
+    throw file_error("Can not create the exported file `" + filebase + ".c`.");
+  }
+  const node_index_type base = generate_c_code_for_nodes(indexes, f, prefix.c_str(), math);
+  fprintf(f, "static const long long fncas_roots[%lld] = {", static_cast<long long>(indexes.size()));
+  for (size_t i = 0; i < indexes.size(); ++i) {
+    fprintf(f, "%s%lld", i ? ", " : "", scratch_slot(indexes[i], base));
+  }
+  fprintf(f, "};\n");
+  fprintf(f, "const long long* %sroots() { return fncas_roots; }\n", prefix.c_str());
+  close(f, filebase + ".c");
+
+  const std::string basename = filebase.substr(filebase.find_last_of('/') + 1);
+  std::string guard;
+  for (char c : basename) {
+    guard += isalnum(c) ? toupper(c) : '_';
   }
-  explicit f_compiled(const f_intermediate& f) : c_(compile(f.f_)) {
+  FILE* h = fopen((filebase + ".h").c_str(), "w");
+  if (!h) {
+    throw file_error("Can not create the exported file `" + filebase + ".h`.");
   }
-  f_compiled(const f_compiled&) = delete;
-  void operator=(const f_compiled&) = delete;
-  f_compiled(f_compiled&& rhs) : c_(std::move(rhs.c_)) {
+  fprintf(h, "// Generated by fncas::export_c_code().\n");
+  fprintf(h, "\n");
+  fprintf(h, "#ifndef %s_H\n", guard.c_str());
+  fprintf(h, "#define %s_H\n", guard.c_str());
+  fprintf(h, "\n");
+  fprintf(h, "#ifdef __cplusplus\n");
+  fprintf(h, "extern \"C\" {\n");
+  fprintf(h, "#endif\n");
+  fprintf(h, "\n");
+  fprintf(h, "// The number of the input variables.\n");
+  fprintf(h, "#define %sINPUTS %d\n", prefix.c_str(), internals_singleton().dim_);
+  fprintf(h,
+          "// The number of the expressions, their values are `a[%sroots()[i]]` after `%seval(x, a)`.\n",
+          prefix.c_str(),
+          prefix.c_str());
+  fprintf(h, "#define %sROOTS %lld\n", prefix.c_str(), static_cast<long long>(indexes.size()));
+  fprintf(h, "\n");
+  fprintf(h,
+          "// Returns the value of the first expression, `a` is the scratch array of `%sdim()` doubles.\n",
+          prefix.c_str());
+  fprintf(h, "double %seval(const double* x, double* a);\n", prefix.c_str());
+  fprintf(h, "long long %sdim();\n", prefix.c_str());
+  fprintf(h, "// The index of the first node of the expressions, the scratch array starts from.\n");
+  fprintf(h, "long long %sbase();\n", prefix.c_str());
+  fprintf(h, "const long long* %sroots();\n", prefix.c_str());
+  fprintf(h, "// The array of `{ const double* data; long long rows; long long cols; }` the loops iterate over.\n");
+  fprintf(h, "void* %stables();\n", prefix.c_str());
+  fprintf(h, "\n");
+  fprintf(h, "#ifdef __cplusplus\n");
+  fprintf(h, "}\n");
+  fprintf(h, "#endif\n");
+  fprintf(h, "\n");
+  fprintf(h, "#endif  // #ifndef %s_H\n", guard.c_str());
+  close(h, filebase + ".h");
+}
+
+void export_c_code(const node& node,
+                   const std::string& prefix,
+                   const std::string& filebase,
+                   math_t math = math_t::libm) {
+  export_c_code(std::vector<node_index_type>(1, node.index_), prefix, filebase, math);
+}
+
+// The function compiled in the precision `P`, see `precision_traits`. The inputs and the result are converted
+// from and to double.
+template <typename P = fncas_value_type> struct basic_f_compiled : f {
+  typedef typename precision_traits<P>::value_type value_type;
+  fncas::basic_compiled_expression<P> c_;
+  // The input converted to the value type, unused for double.
+  mutable std::vector<value_type> x_;
+  explicit basic_f_compiled(const node& node, math_t math = math_t::libm) : c_(compile<P>(node, math)) {
+  }
+  explicit basic_f_compiled(const f_intermediate& f, math_t math = math_t::libm) : c_(compile<P>(f.f_, math)) {
+  }
+  basic_f_compiled(const basic_f_compiled&) = delete;
+  void operator=(const basic_f_compiled&) = delete;
+  basic_f_compiled(basic_f_compiled&& rhs) : c_(std::move(rhs.c_)) {
   }
   virtual double operator()(const std::vector<double>& x) const {
-    return c_(x);
+    return c_(converted_input(x, x_));
   }
   virtual int32_t dim() const {
     return c_.dim();
@@ -300,6 +1468,69 @@ struct f_compiled : f {
   const std::string& lib_filename() const {
     return c_.lib_filename();
   }
+  const compile_stats& stats() const {
+    return c_.stats();
+  }
+};
+
+typedef basic_f_compiled<> f_compiled;
+
+struct f_vector_compiled : f_vector {
+  fncas::compiled_expression c_;
+  const int32_t d_;
+  explicit f_vector_compiled(const f_vector_intermediate& f) : c_(compile(f.indexes())), d_(f.dim()) {
+  }
+  f_vector_compiled(const f_vector_compiled&) = delete;
+  void operator=(const f_vector_compiled&) = delete;
+  f_vector_compiled(f_vector_compiled&& rhs) : c_(std::move(rhs.c_)), d_(rhs.d_) {
+  }
+  virtual std::vector<double> operator()(const std::vector<double>& x) const {
+    std::vector<double> result(c_.roots().size());
+    c_(&x[0], &result[0]);
+    return result;
+  }
+  virtual int32_t dim() const {
+    return d_;
+  }
+  virtual size_t size() const {
+    return c_.roots().size();
+  }
+  const std::string& lib_filename() const {
+    return c_.lib_filename();
+  }
+};
+
+// Compiles the values and all the non-zero derivatives of a vector-valued function into a single program.
+struct j_compiled : j {
+  fncas::compiled_expression c_;
+  const int32_t d_;
+  const size_t n_;
+  const std::vector<size_t> row_begin_;
+  const std::vector<int32_t> column_;
+  explicit j_compiled(const j_intermediate& ji)
+      : c_(compile(ji.indexes())), d_(ji.dim()), n_(ji.size()), row_begin_(ji.row_begin_), column_(ji.column_) {
+  }
+  j_compiled(const j_compiled&) = delete;
+  void operator=(const j_compiled&) = delete;
+  j_compiled(j_compiled&& rhs)
+      : c_(std::move(rhs.c_)), d_(rhs.d_), n_(rhs.n_), row_begin_(rhs.row_begin_), column_(rhs.column_) {
+  }
+  virtual result operator()(const std::vector<double>& x) const {
+    std::vector<double> values(c_.roots().size());
+    c_(&x[0], &values[0]);
+    result r;
+    r.value.assign(values.begin(), values.begin() + n_);
+    r.row_begin = row_begin_;
+    r.column = column_;
+    r.derivative.assign(values.begin() + n_, values.end());
+    return r;
+  }
+  virtual int32_t dim() const {
+    return d_;
+  }
+  virtual size_t size() const {
+    return n_;
+  }
 };
 
 }  // namespace fncas
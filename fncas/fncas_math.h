@@ -0,0 +1,931 @@
+// https://github.com/dkorolev/fncas
+
+// Polynomial implementations of the math functions, branchless and free of library calls, so that the compiler
+// can inline and vectorize the loops applying them to arrays of values, see tape_view::eval_batch().
+//
+// The kernels are written once, as C source in the FNCAS_MATH_KERNELS macro. It is compiled into fncas here,
+// and pasted into the generated C code by the code generator when it is asked to use the kernels, see `math_t`.
+// Hence the C subset and the /* */ comments: each kernel should be valid C99 and C++11 and fit a macro.
+//
+// On x86-64 the arrays of values are computed by the packed kernels, the same kernels on the lanes of the SSE2
+// or AVX2 vectors, whichever the CPU supports, matching the scalar kernels bit for bit. Elsewhere, and in the
+// generated C code, the loops are vectorized by the compiler for the targets with 64-bit integer compares, SSE4.1
+// and AVX2, -march=native; sqrt, asin and acos also need -fno-math-errno. The generated C code is compiled with
+// both. The NASM code evaluates one input at a time, and calls the scalar kernels, see math_kernel_table.
+//
+// Each kernel `fncas_X` has a single precision counterpart `fncas_Xf`, which vectorizes twice as wide,
+// see apply_math_kernel(). Its error is against libm in double precision, rounded to single precision.
+//
+// The largest error against libm, measured on tens of millions of arguments and checked by the `test_math`
+// smoke test action, is listed in math_kernel_max_ulp(). sqrt() is the hardware instruction, exact as libm.
+// Trigonometric functions reduce their arguments with a three-part pi/2, which is only accurate up to
+// FNCAS_MATH_TRIG_LIMIT, the scalar kernels fall back to libm beyond it and so does apply_math_kernel().
+
+#ifndef FNCAS_MATH_H
+#define FNCAS_MATH_H
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
+#include "fncas_base.h"
+#include "fncas_node.h"
+
+#define FNCAS_MATH_TRIG_LIMIT 1e5
+
+// The packed kernels, see apply_packed_kernel(), are written for x86-64, SSE2 and AVX2.
+#if defined(__x86_64__) && defined(__GNUC__)
+#define FNCAS_MATH_PACKED
+#include <immintrin.h>
+#endif
+
+// clang-format off
+#define FNCAS_MATH_KERNELS                                                                                        \
+  static inline double fncas_from_bits(unsigned long long b) { double d; memcpy(&d, &b, 8); return d; }          \
+  static inline unsigned long long fncas_to_bits(double d) { unsigned long long b; memcpy(&b, &d, 8); return b; } \
+  /* The bitwise select of `a` if `c` is non-zero and `b` otherwise, the ternary operator is a branch to the   */\
+  /* compilers as long as the floating point operations may trap.                                             */\
+  static inline double fncas_select(long long c, double a, double b) {                                           \
+    const unsigned long long mask = (unsigned long long)(-c);                                                    \
+    return fncas_from_bits((fncas_to_bits(a) & mask) | (fncas_to_bits(b) & ~mask));                              \
+  }                                                                                                              \
+  /* Adding and subtracting 1.5 * 2^52 rounds to the nearest integer, which is kept in the low bits. */           \
+  static inline double fncas_round(double x) { return (x + 6755399441055744.0) - 6755399441055744.0; }            \
+  /* 2^n for an integer n in [-1022, 1023]. */                                                                    \
+  static inline double fncas_pow2(double n) {                                                                    \
+    return fncas_from_bits(fncas_to_bits(n + 1023.0 + 6755399441055744.0) << 52);                                \
+  }                                                                                                              \
+  static inline double fncas_sqrt(double x) { return sqrt(x); }                                                  \
+  /* exp(x) = 2^n * exp(r), |r| <= ln(2) / 2, 2^n applied in two steps to reach the subnormals. */                \
+  static inline double fncas_exp(double x) {                                                                     \
+    double n, r, p, n1;                                                                                          \
+    x = fncas_select(x < -746.0, -746.0, x);                                                                     \
+    x = fncas_select(x > 710.0, 710.0, x);                                                                       \
+    n = fncas_round(x * 1.4426950408889634);                                                                     \
+    r = (x - n * 6.93147180369123816490e-01) - n * 1.90821492927058770002e-10;                                   \
+    p = 1.0 / 6227020800.0;                                                                                      \
+    p = p * r + 1.0 / 479001600.0;                                                                               \
+    p = p * r + 1.0 / 39916800.0;                                                                                \
+    p = p * r + 1.0 / 3628800.0;                                                                                 \
+    p = p * r + 1.0 / 362880.0;                                                                                  \
+    p = p * r + 1.0 / 40320.0;                                                                                   \
+    p = p * r + 1.0 / 5040.0;                                                                                    \
+    p = p * r + 1.0 / 720.0;                                                                                     \
+    p = p * r + 1.0 / 120.0;                                                                                     \
+    p = p * r + 1.0 / 24.0;                                                                                      \
+    p = p * r + 1.0 / 6.0;                                                                                       \
+    p = p * r + 0.5;                                                                                             \
+    p = 1.0 + (r + r * r * p);                                                                                   \
+    n1 = fncas_round(n * 0.5);                                                                                   \
+    return p * fncas_pow2(n1) * fncas_pow2(n - n1);                                                              \
+  }                                                                                                              \
+  /* log(x) = e * ln(2) + 2 * atanh(f), f = (m - 1) / (m + 1), m in [sqrt(2) / 2, sqrt(2)]. */                    \
+  static inline double fncas_log(double x) {                                                                     \
+    unsigned long long b;                                                                                        \
+    double subnormal, e, m, f, s, p, result;                                                                     \
+    subnormal = fncas_select(x < 2.2250738585072014e-308, 1.0, 0.0);                                             \
+    b = fncas_to_bits(x * fncas_select(x < 2.2250738585072014e-308, 18014398509481984.0, 1.0));                  \
+    e = fncas_from_bits(((b >> 52) & 0x7ffULL) | 0x4330000000000000ULL) - 4503599627370496.0;                    \
+    e = e - 1023.0 - 54.0 * subnormal;                                                                           \
+    m = fncas_from_bits((b & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL);                                    \
+    e = e + fncas_select(m > 1.4142135623730951, 1.0, 0.0);                                                      \
+    m = m * fncas_select(m > 1.4142135623730951, 0.5, 1.0);                                                      \
+    f = (m - 1.0) / (m + 1.0);                                                                                   \
+    s = f * f;                                                                                                   \
+    p = 2.0 / 25.0;                                                                                              \
+    p = p * s + 2.0 / 23.0;                                                                                      \
+    p = p * s + 2.0 / 21.0;                                                                                      \
+    p = p * s + 2.0 / 19.0;                                                                                      \
+    p = p * s + 2.0 / 17.0;                                                                                      \
+    p = p * s + 2.0 / 15.0;                                                                                      \
+    p = p * s + 2.0 / 13.0;                                                                                      \
+    p = p * s + 2.0 / 11.0;                                                                                      \
+    p = p * s + 2.0 / 9.0;                                                                                       \
+    p = p * s + 2.0 / 7.0;                                                                                       \
+    p = p * s + 2.0 / 5.0;                                                                                       \
+    p = p * s + 2.0 / 3.0;                                                                                       \
+    result = e * 6.93147180369123816490e-01 + (2.0 * f + (f * s * p + e * 1.90821492927058770002e-10));         \
+    result = fncas_select(x == 0.0, -HUGE_VAL, result);                                                          \
+    result = fncas_select(x < 0.0, NAN, result);                                                                 \
+    result = fncas_select(x == HUGE_VAL, HUGE_VAL, result);                                                      \
+    return fncas_select(x != x, x, result);                                                                      \
+  }                                                                                                              \
+  /* x = n * pi / 2 + r, |r| <= pi / 4, with the quadrant n mod 4 in `q`. */                                     \
+  static inline double fncas_reduce(double x, unsigned long long* q) {                                          \
+    const double n = fncas_round(x * 0.63661977236758138);                                                       \
+    *q = fncas_to_bits(n + 6755399441055744.0) & 3ULL;                                                           \
+    return ((x - n * 1.57079632673412561417e+00) - n * 6.07710050630396597660e-11) -                             \
+           n * 2.02226624871116645580e-21;                                                                       \
+  }                                                                                                              \
+  static inline double fncas_sin_poly(double r) {                                                               \
+    const double s = r * r;                                                                                      \
+    double p = -1.0 / 121645100408832000.0;                                                                      \
+    p = p * s + 1.0 / 355687428096000.0;                                                                         \
+    p = p * s - 1.0 / 1307674368000.0;                                                                           \
+    p = p * s + 1.0 / 6227020800.0;                                                                              \
+    p = p * s - 1.0 / 39916800.0;                                                                                \
+    p = p * s + 1.0 / 362880.0;                                                                                  \
+    p = p * s - 1.0 / 5040.0;                                                                                    \
+    p = p * s + 1.0 / 120.0;                                                                                     \
+    p = p * s - 1.0 / 6.0;                                                                                       \
+    return r + r * s * p;                                                                                        \
+  }                                                                                                              \
+  static inline double fncas_cos_poly(double r) {                                                               \
+    const double s = r * r;                                                                                      \
+    double p = -1.0 / 6402373705728000.0;                                                                         \
+    p = p * s + 1.0 / 20922789888000.0;                                                                          \
+    p = p * s - 1.0 / 87178291200.0;                                                                             \
+    p = p * s + 1.0 / 479001600.0;                                                                               \
+    p = p * s - 1.0 / 3628800.0;                                                                                 \
+    p = p * s + 1.0 / 40320.0;                                                                                   \
+    p = p * s - 1.0 / 720.0;                                                                                     \
+    p = p * s + 1.0 / 24.0;                                                                                      \
+    return 1.0 - (0.5 * s - s * s * p);                                                                          \
+  }                                                                                                              \
+  static inline double fncas_sin_reduced(double x) {                                                            \
+    unsigned long long q;                                                                                        \
+    const double r = fncas_reduce(x, &q);                                                                        \
+    const double v = fncas_select((long long)(q & 1ULL), fncas_cos_poly(r), fncas_sin_poly(r));                  \
+    return fncas_from_bits(fncas_to_bits(v) ^ ((q & 2ULL) << 62));                                               \
+  }                                                                                                              \
+  static inline double fncas_cos_reduced(double x) {                                                            \
+    unsigned long long q;                                                                                        \
+    const double r = fncas_reduce(x, &q);                                                                        \
+    const double v = fncas_select((long long)(q & 1ULL), fncas_sin_poly(r), fncas_cos_poly(r));                  \
+    return fncas_from_bits(fncas_to_bits(v) ^ (((q + 1ULL) & 2ULL) << 62));                                      \
+  }                                                                                                              \
+  static inline double fncas_tan_reduced(double x) {                                                            \
+    unsigned long long q;                                                                                        \
+    const double r = fncas_reduce(x, &q);                                                                        \
+    const double s = fncas_sin_poly(r);                                                                          \
+    const double c = fncas_cos_poly(r);                                                                          \
+    return fncas_select((long long)(q & 1ULL), -c, s) / fncas_select((long long)(q & 1ULL), s, c);               \
+  }                                                                                                              \
+  static inline double fncas_sin(double x) {                                                                     \
+    return fabs(x) < FNCAS_MATH_TRIG_LIMIT ? fncas_sin_reduced(x) : sin(x);                                      \
+  }                                                                                                              \
+  static inline double fncas_cos(double x) {                                                                     \
+    return fabs(x) < FNCAS_MATH_TRIG_LIMIT ? fncas_cos_reduced(x) : cos(x);                                      \
+  }                                                                                                              \
+  static inline double fncas_tan(double x) {                                                                     \
+    return fabs(x) < FNCAS_MATH_TRIG_LIMIT ? fncas_tan_reduced(x) : tan(x);                                      \
+  }                                                                                                              \
+  /* atan(x) = atan(c) + atan((x - c) / (1 + x * c)), c = tan(j * pi / 8) the nearest one, j = 0 ... 4. */       \
+  static inline double fncas_atan(double x) {                                                                    \
+    const double a = fabs(x);                                                                                    \
+    double c, base, num, den, t, s, p, result;                                                                   \
+    c = fncas_select(a > 0.19891236737965800, 0.41421356237309505, 0.0);                                         \
+    base = fncas_select(a > 0.19891236737965800, 0.39269908169872414, 0.0);                                      \
+    c = fncas_select(a > 0.66817863791929892, 1.0, c);                                                           \
+    base = fncas_select(a > 0.66817863791929892, 0.78539816339744831, base);                                     \
+    c = fncas_select(a > 1.4966057626654890, 2.4142135623730950, c);                                             \
+    base = fncas_select(a > 1.4966057626654890, 1.1780972450961724, base);                                       \
+    num = fncas_select(a > 5.0273394921254000, -1.0, a - c);                                                     \
+    den = fncas_select(a > 5.0273394921254000, a, 1.0 + a * c);                                                  \
+    base = fncas_select(a > 5.0273394921254000, 1.5707963267948966, base);                                       \
+    t = num / den;                                                                                               \
+    s = t * t;                                                                                                   \
+    p = -1.0 / 25.0;                                                                                             \
+    p = p * s + 1.0 / 23.0;                                                                                      \
+    p = p * s - 1.0 / 21.0;                                                                                      \
+    p = p * s + 1.0 / 19.0;                                                                                      \
+    p = p * s - 1.0 / 17.0;                                                                                      \
+    p = p * s + 1.0 / 15.0;                                                                                      \
+    p = p * s - 1.0 / 13.0;                                                                                      \
+    p = p * s + 1.0 / 11.0;                                                                                      \
+    p = p * s - 1.0 / 9.0;                                                                                       \
+    p = p * s + 1.0 / 7.0;                                                                                       \
+    p = p * s - 1.0 / 5.0;                                                                                       \
+    p = p * s + 1.0 / 3.0;                                                                                       \
+    result = base + (t - t * s * p);                                                                             \
+    result = fncas_select(a != a, a, result);                                                                    \
+    return fncas_from_bits(fncas_to_bits(result) ^ (fncas_to_bits(x) & 0x8000000000000000ULL));                 \
+  }                                                                                                              \
+  static inline double fncas_asin(double x) {                                                                    \
+    return fncas_atan(x / sqrt((1.0 - x) * (1.0 + x)));                                                          \
+  }                                                                                                              \
+  static inline double fncas_acos(double x) {                                                                    \
+    return 2.0 * fncas_atan(sqrt((1.0 - x) / (1.0 + x)));                                                        \
+  }                                                                                                              \
+  /* The exact ones, for the generated code to refer to all the functions by the same names. */                  \
+  static inline double fncas_neg(double x) { return -x; }                                                        \
+  static inline double fncas_sqr(double x) { return x * x; }                                                     \
+  static inline double fncas_fabs(double x) { return fabs(x); }                                                  \
+  static inline double fncas_sign(double x) {                                                                    \
+    return fncas_select(x > 0.0, 1.0, 0.0) - fncas_select(x < 0.0, 1.0, 0.0);                                    \
+  }                                                                                                              \
+  /* The single precision kernels, fncas_Xf for each fncas_X: the same methods, with the constants and the */    \
+  /* polynomials of single precision, and libm in double precision beyond FNCAS_MATH_TRIG_LIMIT.           */    \
+  static inline float fncas_from_bitsf(unsigned int b) { float d; memcpy(&d, &b, 4); return d; }                 \
+  static inline unsigned int fncas_to_bitsf(float d) { unsigned int b; memcpy(&b, &d, 4); return b; }            \
+  static inline float fncas_selectf(int c, float a, float b) {                                                   \
+    const unsigned int mask = (unsigned int)(-c);                                                                \
+    return fncas_from_bitsf((fncas_to_bitsf(a) & mask) | (fncas_to_bitsf(b) & ~mask));                           \
+  }                                                                                                              \
+  /* Adding and subtracting 1.5 * 2^23 rounds to the nearest integer, which is kept in the low bits. */          \
+  static inline float fncas_roundf(float x) { return (x + 12582912.0f) - 12582912.0f; }                          \
+  /* 2^n for an integer n in [-126, 127]. */                                                                     \
+  static inline float fncas_pow2f(float n) {                                                                     \
+    return fncas_from_bitsf(fncas_to_bitsf(n + 127.0f + 12582912.0f) << 23);                                     \
+  }                                                                                                              \
+  static inline float fncas_sqrtf(float x) { return sqrtf(x); }                                                  \
+  static inline float fncas_expf(float x) {                                                                      \
+    float n, r, p, n1;                                                                                           \
+    x = fncas_selectf(x < -104.0f, -104.0f, x);                                                                  \
+    x = fncas_selectf(x > 89.0f, 89.0f, x);                                                                      \
+    n = fncas_roundf(x * 1.44269504f);                                                                           \
+    r = (x - n * 6.93145752e-01f) - n * 1.42860677e-06f;                                                         \
+    p = 1.0f / 40320.0f;                                                                                         \
+    p = p * r + 1.0f / 5040.0f;                                                                                  \
+    p = p * r + 1.0f / 720.0f;                                                                                   \
+    p = p * r + 1.0f / 120.0f;                                                                                   \
+    p = p * r + 1.0f / 24.0f;                                                                                    \
+    p = p * r + 1.0f / 6.0f;                                                                                     \
+    p = p * r + 0.5f;                                                                                            \
+    p = 1.0f + (r + r * r * p);                                                                                  \
+    n1 = fncas_roundf(n * 0.5f);                                                                                 \
+    return p * fncas_pow2f(n1) * fncas_pow2f(n - n1);                                                            \
+  }                                                                                                              \
+  static inline float fncas_logf(float x) {                                                                      \
+    unsigned int b;                                                                                              \
+    float subnormal, e, m, f, s, p, result;                                                                      \
+    subnormal = fncas_selectf(x < 1.17549435e-38f, 1.0f, 0.0f);                                                  \
+    b = fncas_to_bitsf(x * fncas_selectf(x < 1.17549435e-38f, 33554432.0f, 1.0f));                               \
+    e = fncas_from_bitsf(((b >> 23) & 0xffU) | 0x4b000000U) - 8388608.0f;                                        \
+    e = e - 127.0f - 25.0f * subnormal;                                                                          \
+    m = fncas_from_bitsf((b & 0x007fffffU) | 0x3f800000U);                                                       \
+    e = e + fncas_selectf(m > 1.41421356f, 1.0f, 0.0f);                                                          \
+    m = m * fncas_selectf(m > 1.41421356f, 0.5f, 1.0f);                                                          \
+    f = (m - 1.0f) / (m + 1.0f);                                                                                 \
+    s = f * f;                                                                                                   \
+    p = 2.0f / 11.0f;                                                                                            \
+    p = p * s + 2.0f / 9.0f;                                                                                     \
+    p = p * s + 2.0f / 7.0f;                                                                                     \
+    p = p * s + 2.0f / 5.0f;                                                                                     \
+    p = p * s + 2.0f / 3.0f;                                                                                     \
+    result = e * 6.93145752e-01f + (2.0f * f + (f * s * p + e * 1.42860677e-06f));                               \
+    result = fncas_selectf(x == 0.0f, -HUGE_VALF, result);                                                       \
+    result = fncas_selectf(x < 0.0f, NAN, result);                                                               \
+    result = fncas_selectf(x == HUGE_VALF, HUGE_VALF, result);                                                   \
+    return fncas_selectf(x != x, x, result);                                                                     \
+  }                                                                                                              \
+  /* In double precision: three parts of pi / 2 of single precision lose the accuracy near its multiples. */     \
+  static inline float fncas_reducef(float x, unsigned int* q) {                                                  \
+    unsigned long long q64;                                                                                      \
+    const double r = fncas_reduce(x, &q64);                                                                      \
+    *q = (unsigned int)q64;                                                                                      \
+    return (float)r;                                                                                             \
+  }                                                                                                              \
+  static inline float fncas_sin_polyf(float r) {                                                                 \
+    const float s = r * r;                                                                                       \
+    float p = 1.0f / 362880.0f;                                                                                  \
+    p = p * s - 1.0f / 5040.0f;                                                                                  \
+    p = p * s + 1.0f / 120.0f;                                                                                   \
+    p = p * s - 1.0f / 6.0f;                                                                                     \
+    return r + r * s * p;                                                                                        \
+  }                                                                                                              \
+  static inline float fncas_cos_polyf(float r) {                                                                 \
+    const float s = r * r;                                                                                       \
+    float p = 1.0f / 479001600.0f;                                                                               \
+    p = p * s - 1.0f / 3628800.0f;                                                                               \
+    p = p * s + 1.0f / 40320.0f;                                                                                 \
+    p = p * s - 1.0f / 720.0f;                                                                                   \
+    p = p * s + 1.0f / 24.0f;                                                                                    \
+    return 1.0f - (0.5f * s - s * s * p);                                                                        \
+  }                                                                                                              \
+  static inline float fncas_sin_reducedf(float x) {                                                              \
+    unsigned int q;                                                                                              \
+    const float r = fncas_reducef(x, &q);                                                                        \
+    const float v = fncas_selectf((int)(q & 1U), fncas_cos_polyf(r), fncas_sin_polyf(r));                        \
+    return fncas_from_bitsf(fncas_to_bitsf(v) ^ ((q & 2U) << 30));                                               \
+  }                                                                                                              \
+  static inline float fncas_cos_reducedf(float x) {                                                              \
+    unsigned int q;                                                                                              \
+    const float r = fncas_reducef(x, &q);                                                                        \
+    const float v = fncas_selectf((int)(q & 1U), fncas_sin_polyf(r), fncas_cos_polyf(r));                        \
+    return fncas_from_bitsf(fncas_to_bitsf(v) ^ (((q + 1U) & 2U) << 30));                                        \
+  }                                                                                                              \
+  static inline float fncas_tan_reducedf(float x) {                                                              \
+    unsigned int q;                                                                                              \
+    const float r = fncas_reducef(x, &q);                                                                        \
+    const float s = fncas_sin_polyf(r);                                                                          \
+    const float c = fncas_cos_polyf(r);                                                                          \
+    return fncas_selectf((int)(q & 1U), -c, s) / fncas_selectf((int)(q & 1U), s, c);                             \
+  }                                                                                                              \
+  static inline float fncas_sinf(float x) {                                                                      \
+    return fabsf(x) < FNCAS_MATH_TRIG_LIMIT ? fncas_sin_reducedf(x) : (float)sin(x);                             \
+  }                                                                                                              \
+  static inline float fncas_cosf(float x) {                                                                      \
+    return fabsf(x) < FNCAS_MATH_TRIG_LIMIT ? fncas_cos_reducedf(x) : (float)cos(x);                             \
+  }                                                                                                              \
+  static inline float fncas_tanf(float x) {                                                                      \
+    return fabsf(x) < FNCAS_MATH_TRIG_LIMIT ? fncas_tan_reducedf(x) : (float)tan(x);                             \
+  }                                                                                                              \
+  static inline float fncas_atanf(float x) {                                                                     \
+    const float a = fabsf(x);                                                                                    \
+    float c, base, num, den, t, s, p, result;                                                                    \
+    c = fncas_selectf(a > 0.198912367f, 0.414213562f, 0.0f);                                                     \
+    base = fncas_selectf(a > 0.198912367f, 0.392699082f, 0.0f);                                                  \
+    c = fncas_selectf(a > 0.668178638f, 1.0f, c);                                                                \
+    base = fncas_selectf(a > 0.668178638f, 0.785398163f, base);                                                  \
+    c = fncas_selectf(a > 1.49660576f, 2.41421356f, c);                                                          \
+    base = fncas_selectf(a > 1.49660576f, 1.17809725f, base);                                                    \
+    num = fncas_selectf(a > 5.02733949f, -1.0f, a - c);                                                          \
+    den = fncas_selectf(a > 5.02733949f, a, 1.0f + a * c);                                                       \
+    base = fncas_selectf(a > 5.02733949f, 1.57079633f, base);                                                    \
+    t = num / den;                                                                                               \
+    s = t * t;                                                                                                   \
+    p = 1.0f / 11.0f;                                                                                            \
+    p = p * s - 1.0f / 9.0f;                                                                                     \
+    p = p * s + 1.0f / 7.0f;                                                                                     \
+    p = p * s - 1.0f / 5.0f;                                                                                     \
+    p = p * s + 1.0f / 3.0f;                                                                                     \
+    result = base + (t - t * s * p);                                                                             \
+    result = fncas_selectf(a != a, a, result);                                                                   \
+    return fncas_from_bitsf(fncas_to_bitsf(result) ^ (fncas_to_bitsf(x) & 0x80000000U));                         \
+  }                                                                                                              \
+  static inline float fncas_asinf(float x) {                                                                     \
+    return fncas_atanf(x / sqrtf((1.0f - x) * (1.0f + x)));                                                      \
+  }                                                                                                              \
+  static inline float fncas_acosf(float x) {                                                                     \
+    return 2.0f * fncas_atanf(sqrtf((1.0f - x) / (1.0f + x)));                                                   \
+  }                                                                                                              \
+  static inline float fncas_negf(float x) { return -x; }                                                         \
+  static inline float fncas_sqrf(float x) { return x * x; }                                                      \
+  static inline float fncas_fabsf(float x) { return fabsf(x); }                                                  \
+  static inline float fncas_signf(float x) {                                                                     \
+    return fncas_selectf(x > 0.0f, 1.0f, 0.0f) - fncas_selectf(x < 0.0f, 1.0f, 0.0f);                            \
+  }
+// clang-format on
+
+namespace fncas {
+
+// The implementations of the math functions the evaluators and the generated code can use.
+// * libm: the standard library, the results match the native code bit for bit.
+// * kernels: the polynomial kernels of this file, inlined and vectorized by the C backend, a few ULPs off.
+enum class math_t : int8_t { libm = 0, kernels = 1 };
+
+namespace math {
+FNCAS_MATH_KERNELS
+}  // namespace math
+
+// The source of the kernels, for the generated C code.
+#define FNCAS_MATH_STRINGIFY(...) #__VA_ARGS__
+#define FNCAS_MATH_EXPANDED_STRINGIFY(...) FNCAS_MATH_STRINGIFY(__VA_ARGS__)
+inline const char* math_kernels_source() {
+  return FNCAS_MATH_EXPANDED_STRINGIFY(FNCAS_MATH_KERNELS);
+}
+
+// The largest difference of the kernel from libm, in units in the last place of `T`, over the domain
+// of the function.
+template <typename T = double> double math_kernel_max_ulp(function_t function) {
+  static const double max_ulp[static_cast<size_t>(function_t::end)] = {0, 1, 2, 2, 2, 4, 3, 3, 2, 0, 0, 0, 0};
+  static const double max_ulp_float[static_cast<size_t>(function_t::end)] = {0, 1, 2, 1, 1, 3, 4, 3, 2, 0, 0, 0, 0};
+  const double* table = std::is_same<T, float>::value ? max_ulp_float : max_ulp;
+  return function < function_t::end ? table[static_cast<size_t>(function)] : 0.0;
+}
+
+#ifdef FNCAS_MATH_PACKED
+
+// The packed kernels: the kernels of FNCAS_MATH_KERNELS on the lanes of a vector of BYTES bytes, written with
+// the vector extensions of GCC and Clang. Each one does the operations of its scalar kernel in the same order,
+// so that the two match bit for bit, and the comparisons give the masks the scalar kernels select with.
+// They are expanded twice, for SSE2 and 16 bytes, and for AVX2 and 32 bytes, compiled for that instruction set.
+
+#define FNCAS_MATH_PACKED_INLINE __attribute__((always_inline)) inline
+
+// Applies the packed kernel of the function to the values [0, n - n % lanes), returns that many. The kernels
+// of single precision are the ones suffixed by `f`, hence the suffix `S`. The trigonometric ones are applied
+// reduced, as the scalar loops of apply_math_kernel() are.
+#define FNCAS_MATH_PACKED_LOOP(F)                                      \
+  for (; i + sizeof(V) / sizeof(T) <= n; i += sizeof(V) / sizeof(T)) { \
+    V v;                                                               \
+    memcpy(&v, x + i, sizeof(V));                                      \
+    v = K::F(v);                                                       \
+    memcpy(y + i, &v, sizeof(V));                                      \
+  }                                                                    \
+  break
+#define FNCAS_MATH_PACKED_SWITCH(S)                 \
+  switch (function) {                               \
+    case function_t::sqrt:                          \
+      FNCAS_MATH_PACKED_LOOP(fncas_sqrt##S);        \
+    case function_t::exp:                           \
+      FNCAS_MATH_PACKED_LOOP(fncas_exp##S);         \
+    case function_t::log:                           \
+      FNCAS_MATH_PACKED_LOOP(fncas_log##S);         \
+    case function_t::sin:                           \
+      FNCAS_MATH_PACKED_LOOP(fncas_sin_reduced##S); \
+    case function_t::cos:                           \
+      FNCAS_MATH_PACKED_LOOP(fncas_cos_reduced##S); \
+    case function_t::tan:                           \
+      FNCAS_MATH_PACKED_LOOP(fncas_tan_reduced##S); \
+    case function_t::asin:                          \
+      FNCAS_MATH_PACKED_LOOP(fncas_asin##S);        \
+    case function_t::acos:                          \
+      FNCAS_MATH_PACKED_LOOP(fncas_acos##S);        \
+    case function_t::atan:                          \
+      FNCAS_MATH_PACKED_LOOP(fncas_atan##S);        \
+    case function_t::neg:                           \
+      FNCAS_MATH_PACKED_LOOP(fncas_neg##S);         \
+    case function_t::sqr:                           \
+      FNCAS_MATH_PACKED_LOOP(fncas_sqr##S);         \
+    case function_t::abs:                           \
+      FNCAS_MATH_PACKED_LOOP(fncas_fabs##S);        \
+    case function_t::sign:                          \
+      FNCAS_MATH_PACKED_LOOP(fncas_sign##S);        \
+    default:                                        \
+      assert(false);                                \
+  }                                                 \
+  return i
+// clang-format off
+#define FNCAS_MATH_PACKED_KERNELS(BYTES, SQRT_PD, SQRT_PS)                                                        \
+  template <typename T> struct packed_lanes {                                                                     \
+    typedef T V __attribute__((vector_size(BYTES)));                                                              \
+    /* The bits of the lanes, unsigned. */                                                                        \
+    typedef typename std::conditional<sizeof(T) == 8, unsigned long long, unsigned int>::type bits_lane;          \
+    typedef bits_lane U __attribute__((vector_size(BYTES)));                                                      \
+    static FNCAS_MATH_PACKED_INLINE U bits(V x) {                                                                 \
+      return reinterpret_cast<U>(x);                                                                              \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V from_bits(U b) {                                                            \
+      return reinterpret_cast<V>(b);                                                                              \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V broadcast(T x) {                                                            \
+      V v;                                                                                                        \
+      for (int i = 0; i < BYTES / static_cast<int>(sizeof(T)); ++i) {                                             \
+        v[i] = x;                                                                                                 \
+      }                                                                                                           \
+      return v;                                                                                                   \
+    }                                                                                                             \
+  };                                                                                                              \
+                                                                                                                  \
+  template <typename T> struct packed_kernels;                                                                    \
+                                                                                                                  \
+  template <> struct packed_kernels<double> : packed_lanes<double> {                                              \
+    typedef packed_lanes<double> L;                                                                               \
+    typedef L::V V;                                                                                               \
+    typedef L::U U;                                                                                               \
+    static FNCAS_MATH_PACKED_INLINE V fncas_round(V x) {                                                          \
+      return (x + 6755399441055744.0) - 6755399441055744.0;                                                       \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V fncas_pow2(V n) {                                                           \
+      return L::from_bits(L::bits(n + 1023.0 + 6755399441055744.0) << 52);                                        \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V fncas_sqrt(V x) {                                                           \
+      return SQRT_PD(x);                                                                                          \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V fncas_exp(V x) {                                                            \
+      x = x < -746.0 ? -746.0 : x;                                                                                \
+      x = x > 710.0 ? 710.0 : x;                                                                                  \
+      const V n = fncas_round(x * 1.4426950408889634);                                                            \
+      const V r = (x - n * 6.93147180369123816490e-01) - n * 1.90821492927058770002e-10;                          \
+      V p = L::broadcast(1.0 / 6227020800.0);                                                                     \
+      p = p * r + 1.0 / 479001600.0;                                                                              \
+      p = p * r + 1.0 / 39916800.0;                                                                               \
+      p = p * r + 1.0 / 3628800.0;                                                                                \
+      p = p * r + 1.0 / 362880.0;                                                                                 \
+      p = p * r + 1.0 / 40320.0;                                                                                  \
+      p = p * r + 1.0 / 5040.0;                                                                                   \
+      p = p * r + 1.0 / 720.0;                                                                                    \
+      p = p * r + 1.0 / 120.0;                                                                                    \
+      p = p * r + 1.0 / 24.0;                                                                                     \
+      p = p * r + 1.0 / 6.0;                                                                                      \
+      p = p * r + 0.5;                                                                                            \
+      p = 1.0 + (r + r * r * p);                                                                                  \
+      const V n1 = fncas_round(n * 0.5);                                                                          \
+      return p * fncas_pow2(n1) * fncas_pow2(n - n1);                                                             \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V fncas_log(V x) {                                                            \
+      const V subnormal = x < 2.2250738585072014e-308 ? 1.0 : 0.0;                                                \
+      const U b = L::bits(x * (x < 2.2250738585072014e-308 ? 18014398509481984.0 : 1.0));                         \
+      V e = L::from_bits(((b >> 52) & 0x7ffULL) | 0x4330000000000000ULL) - 4503599627370496.0;                    \
+      e = e - 1023.0 - 54.0 * subnormal;                                                                          \
+      V m = L::from_bits((b & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL);                                    \
+      e = e + (m > 1.4142135623730951 ? 1.0 : 0.0);                                                               \
+      m = m * (m > 1.4142135623730951 ? 0.5 : 1.0);                                                               \
+      const V f = (m - 1.0) / (m + 1.0);                                                                          \
+      const V s = f * f;                                                                                          \
+      V p = L::broadcast(2.0 / 25.0);                                                                             \
+      p = p * s + 2.0 / 23.0;                                                                                     \
+      p = p * s + 2.0 / 21.0;                                                                                     \
+      p = p * s + 2.0 / 19.0;                                                                                     \
+      p = p * s + 2.0 / 17.0;                                                                                     \
+      p = p * s + 2.0 / 15.0;                                                                                     \
+      p = p * s + 2.0 / 13.0;                                                                                     \
+      p = p * s + 2.0 / 11.0;                                                                                     \
+      p = p * s + 2.0 / 9.0;                                                                                      \
+      p = p * s + 2.0 / 7.0;                                                                                      \
+      p = p * s + 2.0 / 5.0;                                                                                      \
+      p = p * s + 2.0 / 3.0;                                                                                      \
+      V result = e * 6.93147180369123816490e-01 + (2.0 * f + (f * s * p + e * 1.90821492927058770002e-10));       \
+      result = x == 0.0 ? -HUGE_VAL : result;                                                                     \
+      result = x < 0.0 ? std::numeric_limits<double>::quiet_NaN() : result;                                       \
+      result = x == HUGE_VAL ? HUGE_VAL : result;                                                                 \
+      return x != x ? x : result;                                                                                 \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V fncas_reduce(V x, U* q) {                                                   \
+      const V n = fncas_round(x * 0.63661977236758138);                                                           \
+      *q = L::bits(n + 6755399441055744.0) & 3ULL;                                                                \
+      const V r = (x - n * 1.57079632673412561417e+00) - n * 6.07710050630396597660e-11;                          \
+      return r - n * 2.02226624871116645580e-21;                                                                  \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V fncas_sin_poly(V r) {                                                       \
+      const V s = r * r;                                                                                          \
+      V p = L::broadcast(-1.0 / 121645100408832000.0);                                                            \
+      p = p * s + 1.0 / 355687428096000.0;                                                                        \
+      p = p * s - 1.0 / 1307674368000.0;                                                                          \
+      p = p * s + 1.0 / 6227020800.0;                                                                             \
+      p = p * s - 1.0 / 39916800.0;                                                                               \
+      p = p * s + 1.0 / 362880.0;                                                                                 \
+      p = p * s - 1.0 / 5040.0;                                                                                   \
+      p = p * s + 1.0 / 120.0;                                                                                    \
+      p = p * s - 1.0 / 6.0;                                                                                      \
+      return r + r * s * p;                                                                                       \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V fncas_cos_poly(V r) {                                                       \
+      const V s = r * r;                                                                                          \
+      V p = L::broadcast(-1.0 / 6402373705728000.0);                                                              \
+      p = p * s + 1.0 / 20922789888000.0;                                                                         \
+      p = p * s - 1.0 / 87178291200.0;                                                                            \
+      p = p * s + 1.0 / 479001600.0;                                                                              \
+      p = p * s - 1.0 / 3628800.0;                                                                                \
+      p = p * s + 1.0 / 40320.0;                                                                                  \
+      p = p * s - 1.0 / 720.0;                                                                                    \
+      p = p * s + 1.0 / 24.0;                                                                                     \
+      return 1.0 - (0.5 * s - s * s * p);                                                                         \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V fncas_sin_reduced(V x) {                                                    \
+      U q;                                                                                                        \
+      const V r = fncas_reduce(x, &q);                                                                            \
+      const V v = (q & 1ULL) ? fncas_cos_poly(r) : fncas_sin_poly(r);                                             \
+      return L::from_bits(L::bits(v) ^ ((q & 2ULL) << 62));                                                       \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V fncas_cos_reduced(V x) {                                                    \
+      U q;                                                                                                        \
+      const V r = fncas_reduce(x, &q);                                                                            \
+      const V v = (q & 1ULL) ? fncas_sin_poly(r) : fncas_cos_poly(r);                                             \
+      return L::from_bits(L::bits(v) ^ (((q + 1ULL) & 2ULL) << 62));                                              \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V fncas_tan_reduced(V x) {                                                    \
+      U q;                                                                                                        \
+      const V r = fncas_reduce(x, &q);                                                                            \
+      const V s = fncas_sin_poly(r);                                                                              \
+      const V c = fncas_cos_poly(r);                                                                              \
+      return ((q & 1ULL) ? -c : s) / ((q & 1ULL) ? s : c);                                                        \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V fncas_atan(V x) {                                                           \
+      const V a = fncas_fabs(x);                                                                                  \
+      V c = a > 0.19891236737965800 ? 0.41421356237309505 : 0.0;                                                  \
+      V base = a > 0.19891236737965800 ? 0.39269908169872414 : 0.0;                                               \
+      c = a > 0.66817863791929892 ? 1.0 : c;                                                                      \
+      base = a > 0.66817863791929892 ? 0.78539816339744831 : base;                                                \
+      c = a > 1.4966057626654890 ? 2.4142135623730950 : c;                                                        \
+      base = a > 1.4966057626654890 ? 1.1780972450961724 : base;                                                  \
+      const V num = a > 5.0273394921254000 ? -1.0 : a - c;                                                        \
+      const V den = a > 5.0273394921254000 ? a : 1.0 + a * c;                                                     \
+      base = a > 5.0273394921254000 ? 1.5707963267948966 : base;                                                  \
+      const V t = num / den;                                                                                      \
+      const V s = t * t;                                                                                          \
+      V p = L::broadcast(-1.0 / 25.0);                                                                            \
+      p = p * s + 1.0 / 23.0;                                                                                     \
+      p = p * s - 1.0 / 21.0;                                                                                     \
+      p = p * s + 1.0 / 19.0;                                                                                     \
+      p = p * s - 1.0 / 17.0;                                                                                     \
+      p = p * s + 1.0 / 15.0;                                                                                     \
+      p = p * s - 1.0 / 13.0;                                                                                     \
+      p = p * s + 1.0 / 11.0;                                                                                     \
+      p = p * s - 1.0 / 9.0;                                                                                      \
+      p = p * s + 1.0 / 7.0;                                                                                      \
+      p = p * s - 1.0 / 5.0;                                                                                      \
+      p = p * s + 1.0 / 3.0;                                                                                      \
+      V result = base + (t - t * s * p);                                                                          \
+      result = a != a ? a : result;                                                                               \
+      return L::from_bits(L::bits(result) ^ (L::bits(x) & 0x8000000000000000ULL));                                \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V fncas_asin(V x) {                                                           \
+      return fncas_atan(x / fncas_sqrt((1.0 - x) * (1.0 + x)));                                                   \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V fncas_acos(V x) {                                                           \
+      return 2.0 * fncas_atan(fncas_sqrt((1.0 - x) / (1.0 + x)));                                                 \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V fncas_neg(V x) {                                                            \
+      return -x;                                                                                                  \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V fncas_sqr(V x) {                                                            \
+      return x * x;                                                                                               \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V fncas_fabs(V x) {                                                           \
+      return L::from_bits(L::bits(x) & 0x7fffffffffffffffULL);                                                    \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V fncas_sign(V x) {                                                           \
+      return (x > 0.0 ? 1.0 : 0.0) - (x < 0.0 ? 1.0 : 0.0);                                                       \
+    }                                                                                                             \
+  };                                                                                                              \
+                                                                                                                  \
+  template <> struct packed_kernels<float> : packed_lanes<float> {                                                \
+    typedef packed_lanes<float> L;                                                                                \
+    typedef L::V V;                                                                                               \
+    typedef L::U U;                                                                                               \
+    static FNCAS_MATH_PACKED_INLINE V fncas_roundf(V x) {                                                         \
+      return (x + 12582912.0f) - 12582912.0f;                                                                     \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V fncas_pow2f(V n) {                                                          \
+      return L::from_bits(L::bits(n + 127.0f + 12582912.0f) << 23);                                               \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V fncas_sqrtf(V x) {                                                          \
+      return SQRT_PS(x);                                                                                          \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V fncas_expf(V x) {                                                           \
+      x = x < -104.0f ? -104.0f : x;                                                                              \
+      x = x > 89.0f ? 89.0f : x;                                                                                  \
+      const V n = fncas_roundf(x * 1.44269504f);                                                                  \
+      const V r = (x - n * 6.93145752e-01f) - n * 1.42860677e-06f;                                                \
+      V p = L::broadcast(1.0f / 40320.0f);                                                                        \
+      p = p * r + 1.0f / 5040.0f;                                                                                 \
+      p = p * r + 1.0f / 720.0f;                                                                                  \
+      p = p * r + 1.0f / 120.0f;                                                                                  \
+      p = p * r + 1.0f / 24.0f;                                                                                   \
+      p = p * r + 1.0f / 6.0f;                                                                                    \
+      p = p * r + 0.5f;                                                                                           \
+      p = 1.0f + (r + r * r * p);                                                                                 \
+      const V n1 = fncas_roundf(n * 0.5f);                                                                        \
+      return p * fncas_pow2f(n1) * fncas_pow2f(n - n1);                                                           \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V fncas_logf(V x) {                                                           \
+      const V subnormal = x < 1.17549435e-38f ? 1.0f : 0.0f;                                                      \
+      const U b = L::bits(x * (x < 1.17549435e-38f ? 33554432.0f : 1.0f));                                        \
+      V e = L::from_bits(((b >> 23) & 0xffU) | 0x4b000000U) - 8388608.0f;                                         \
+      e = e - 127.0f - 25.0f * subnormal;                                                                         \
+      V m = L::from_bits((b & 0x007fffffU) | 0x3f800000U);                                                        \
+      e = e + (m > 1.41421356f ? 1.0f : 0.0f);                                                                    \
+      m = m * (m > 1.41421356f ? 0.5f : 1.0f);                                                                    \
+      const V f = (m - 1.0f) / (m + 1.0f);                                                                        \
+      const V s = f * f;                                                                                          \
+      V p = L::broadcast(2.0f / 11.0f);                                                                           \
+      p = p * s + 2.0f / 9.0f;                                                                                    \
+      p = p * s + 2.0f / 7.0f;                                                                                    \
+      p = p * s + 2.0f / 5.0f;                                                                                    \
+      p = p * s + 2.0f / 3.0f;                                                                                    \
+      V result = e * 6.93145752e-01f + (2.0f * f + (f * s * p + e * 1.42860677e-06f));                            \
+      result = x == 0.0f ? -HUGE_VALF : result;                                                                   \
+      result = x < 0.0f ? std::numeric_limits<float>::quiet_NaN() : result;                                       \
+      result = x == HUGE_VALF ? HUGE_VALF : result;                                                               \
+      return x != x ? x : result;                                                                                 \
+    }                                                                                                             \
+    /* In double precision, as fncas_reducef(), half of the lanes at a time. */                                   \
+    static FNCAS_MATH_PACKED_INLINE V fncas_reducef(V x, U* q) {                                                  \
+      typedef packed_kernels<double> D;                                                                           \
+      typedef float H __attribute__((vector_size(BYTES / 2)));                                                    \
+      typedef unsigned int HU __attribute__((vector_size(BYTES / 2)));                                            \
+      V r;                                                                                                        \
+      for (int i = 0; i < BYTES; i += BYTES / 2) {                                                                \
+        H h;                                                                                                      \
+        D::U q64;                                                                                                 \
+        memcpy(&h, reinterpret_cast<const char*>(&x) + i, BYTES / 2);                                             \
+        const H rh = __builtin_convertvector(D::fncas_reduce(__builtin_convertvector(h, D::V), &q64), H);         \
+        const HU qh = __builtin_convertvector(q64, HU);                                                           \
+        memcpy(reinterpret_cast<char*>(&r) + i, &rh, BYTES / 2);                                                  \
+        memcpy(reinterpret_cast<char*>(q) + i, &qh, BYTES / 2);                                                   \
+      }                                                                                                           \
+      return r;                                                                                                   \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V fncas_sin_polyf(V r) {                                                      \
+      const V s = r * r;                                                                                          \
+      V p = L::broadcast(1.0f / 362880.0f);                                                                       \
+      p = p * s - 1.0f / 5040.0f;                                                                                 \
+      p = p * s + 1.0f / 120.0f;                                                                                  \
+      p = p * s - 1.0f / 6.0f;                                                                                    \
+      return r + r * s * p;                                                                                       \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V fncas_cos_polyf(V r) {                                                      \
+      const V s = r * r;                                                                                          \
+      V p = L::broadcast(1.0f / 479001600.0f);                                                                    \
+      p = p * s - 1.0f / 3628800.0f;                                                                              \
+      p = p * s + 1.0f / 40320.0f;                                                                                \
+      p = p * s - 1.0f / 720.0f;                                                                                  \
+      p = p * s + 1.0f / 24.0f;                                                                                   \
+      return 1.0f - (0.5f * s - s * s * p);                                                                       \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V fncas_sin_reducedf(V x) {                                                   \
+      U q;                                                                                                        \
+      const V r = fncas_reducef(x, &q);                                                                           \
+      const V v = (q & 1U) ? fncas_cos_polyf(r) : fncas_sin_polyf(r);                                             \
+      return L::from_bits(L::bits(v) ^ ((q & 2U) << 30));                                                         \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V fncas_cos_reducedf(V x) {                                                   \
+      U q;                                                                                                        \
+      const V r = fncas_reducef(x, &q);                                                                           \
+      const V v = (q & 1U) ? fncas_sin_polyf(r) : fncas_cos_polyf(r);                                             \
+      return L::from_bits(L::bits(v) ^ (((q + 1U) & 2U) << 30));                                                  \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V fncas_tan_reducedf(V x) {                                                   \
+      U q;                                                                                                        \
+      const V r = fncas_reducef(x, &q);                                                                           \
+      const V s = fncas_sin_polyf(r);                                                                             \
+      const V c = fncas_cos_polyf(r);                                                                             \
+      return ((q & 1U) ? -c : s) / ((q & 1U) ? s : c);                                                            \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V fncas_atanf(V x) {                                                          \
+      const V a = fncas_fabsf(x);                                                                                 \
+      V c = a > 0.198912367f ? 0.414213562f : 0.0f;                                                               \
+      V base = a > 0.198912367f ? 0.392699082f : 0.0f;                                                            \
+      c = a > 0.668178638f ? 1.0f : c;                                                                            \
+      base = a > 0.668178638f ? 0.785398163f : base;                                                              \
+      c = a > 1.49660576f ? 2.41421356f : c;                                                                      \
+      base = a > 1.49660576f ? 1.17809725f : base;                                                                \
+      const V num = a > 5.02733949f ? -1.0f : a - c;                                                              \
+      const V den = a > 5.02733949f ? a : 1.0f + a * c;                                                           \
+      base = a > 5.02733949f ? 1.57079633f : base;                                                                \
+      const V t = num / den;                                                                                      \
+      const V s = t * t;                                                                                          \
+      V p = L::broadcast(1.0f / 11.0f);                                                                           \
+      p = p * s - 1.0f / 9.0f;                                                                                    \
+      p = p * s + 1.0f / 7.0f;                                                                                    \
+      p = p * s - 1.0f / 5.0f;                                                                                    \
+      p = p * s + 1.0f / 3.0f;                                                                                    \
+      V result = base + (t - t * s * p);                                                                          \
+      result = a != a ? a : result;                                                                               \
+      return L::from_bits(L::bits(result) ^ (L::bits(x) & 0x80000000U));                                          \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V fncas_asinf(V x) {                                                          \
+      return fncas_atanf(x / fncas_sqrtf((1.0f - x) * (1.0f + x)));                                               \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V fncas_acosf(V x) {                                                          \
+      return 2.0f * fncas_atanf(fncas_sqrtf((1.0f - x) / (1.0f + x)));                                            \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V fncas_negf(V x) {                                                           \
+      return -x;                                                                                                  \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V fncas_sqrf(V x) {                                                           \
+      return x * x;                                                                                               \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V fncas_fabsf(V x) {                                                          \
+      return L::from_bits(L::bits(x) & 0x7fffffffU);                                                              \
+    }                                                                                                             \
+    static FNCAS_MATH_PACKED_INLINE V fncas_signf(V x) {                                                          \
+      return (x > 0.0f ? 1.0f : 0.0f) - (x < 0.0f ? 1.0f : 0.0f);                                                 \
+    }                                                                                                             \
+  };                                                                                                              \
+  inline size_t apply_packed_kernel(function_t function, const double* x, double* y, size_t n) {                  \
+    typedef double T;                                                                                             \
+    typedef packed_kernels<T> K;                                                                                  \
+    typedef K::V V;                                                                                               \
+    size_t i = 0;                                                                                                 \
+    FNCAS_MATH_PACKED_SWITCH();                                                                                   \
+  }                                                                                                               \
+  inline size_t apply_packed_kernel(function_t function, const float* x, float* y, size_t n) {                    \
+    typedef float T;                                                                                              \
+    typedef packed_kernels<T> K;                                                                                  \
+    typedef K::V V;                                                                                               \
+    size_t i = 0;                                                                                                 \
+    FNCAS_MATH_PACKED_SWITCH(f);                                                                                  \
+  }
+// clang-format on
+
+namespace math {
+
+namespace sse2 {
+FNCAS_MATH_PACKED_KERNELS(16, _mm_sqrt_pd, _mm_sqrt_ps)
+}  // namespace sse2
+
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx2"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#endif
+namespace avx2 {
+FNCAS_MATH_PACKED_KERNELS(32, _mm256_sqrt_pd, _mm256_sqrt_ps)
+}  // namespace avx2
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+
+// The widest packed kernels the CPU supports, SSE2 being the baseline of x86-64. The results are the same.
+template <typename T> size_t apply_packed_kernel(function_t function, const T* x, T* y, size_t n) {
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  return has_avx2 ? avx2::apply_packed_kernel(function, x, y, n) : sse2::apply_packed_kernel(function, x, y, n);
+}
+
+}  // namespace math
+
+#undef FNCAS_MATH_PACKED_KERNELS
+#undef FNCAS_MATH_PACKED_LOOP
+#undef FNCAS_MATH_PACKED_SWITCH
+#undef FNCAS_MATH_PACKED_INLINE
+
+#endif  // #ifdef FNCAS_MATH_PACKED
+
+// apply_math_kernel() computes y[i] = F(x[i]) for i in [0, n). On x86-64 the packed kernels compute all but
+// the last few values, which the scalar kernels do, elsewhere the scalar loop is vectorized by the compiler.
+// The arguments the trigonometric kernels are not accurate for are recomputed by libm afterwards.
+// The kernels of single precision are used for `float`, the ones of double precision otherwise.
+template <typename T> void apply_math_kernel(function_t function, const T* x, T* y, size_t n) {
+#ifdef FNCAS_MATH_PACKED
+  const size_t packed = math::apply_packed_kernel(function, x, y, n);
+#else
+  const size_t packed = 0;
+#endif
+#define FNCAS_MATH_KERNEL_LOOP(F)                                          \
+  if (std::is_same<T, float>::value) {                                     \
+    for (size_t i = packed; i < n; ++i) {                                  \
+      y[i] = static_cast<T>(math::F##f(static_cast<float>(x[i])));         \
+    }                                                                      \
+  } else {                                                                 \
+    for (size_t i = packed; i < n; ++i) {                                  \
+      y[i] = static_cast<T>(math::F(static_cast<double>(x[i])));           \
+    }                                                                      \
+  }
+#define FNCAS_MATH_KERNEL_FIXUP(F)                                         \
+  for (size_t i = 0; i < n; ++i) {                                         \
+    if (!(std::fabs(static_cast<double>(x[i])) < FNCAS_MATH_TRIG_LIMIT)) { \
+      y[i] = static_cast<T>(std::F(static_cast<double>(x[i])));            \
+    }                                                                      \
+  }
+  switch (function) {
+    case function_t::sqrt:
+      FNCAS_MATH_KERNEL_LOOP(fncas_sqrt);
+      break;
+    case function_t::exp:
+      FNCAS_MATH_KERNEL_LOOP(fncas_exp);
+      break;
+    case function_t::log:
+      FNCAS_MATH_KERNEL_LOOP(fncas_log);
+      break;
+    case function_t::sin:
+      FNCAS_MATH_KERNEL_LOOP(fncas_sin_reduced);
+      FNCAS_MATH_KERNEL_FIXUP(sin);
+      break;
+    case function_t::cos:
+      FNCAS_MATH_KERNEL_LOOP(fncas_cos_reduced);
+      FNCAS_MATH_KERNEL_FIXUP(cos);
+      break;
+    case function_t::tan:
+      FNCAS_MATH_KERNEL_LOOP(fncas_tan_reduced);
+      FNCAS_MATH_KERNEL_FIXUP(tan);
+      break;
+    case function_t::asin:
+      FNCAS_MATH_KERNEL_LOOP(fncas_asin);
+      break;
+    case function_t::acos:
+      FNCAS_MATH_KERNEL_LOOP(fncas_acos);
+      break;
+    case function_t::atan:
+      FNCAS_MATH_KERNEL_LOOP(fncas_atan);
+      break;
+    case function_t::neg:
+      FNCAS_MATH_KERNEL_LOOP(fncas_neg);
+      break;
+    case function_t::sqr:
+      FNCAS_MATH_KERNEL_LOOP(fncas_sqr);
+      break;
+    case function_t::abs:
+      FNCAS_MATH_KERNEL_LOOP(fncas_fabs);
+      break;
+    case function_t::sign:
+      FNCAS_MATH_KERNEL_LOOP(fncas_sign);
+      break;
+    default:
+      assert(false);
+  }
+#undef FNCAS_MATH_KERNEL_LOOP
+#undef FNCAS_MATH_KERNEL_FIXUP
+}
+
+// The scalar kernel of the function, including the libm fallback of the trigonometric ones.
+inline double apply_math_kernel(function_t function, double x) {
+  double y;
+  apply_math_kernel(function, &x, &y, 1);
+  return y;
+}
+
+// The scalar kernels by function_t, the ones of single precision for `float`, for the code evaluating one input
+// at a time: the NASM code calls them through the table `kernels` of its library, filled when it is loaded.
+template <typename T> struct math_kernel_table;
+template <> struct math_kernel_table<double> {
+  typedef double (*kernel_t)(double);
+  static const kernel_t* kernels() {
+    static const kernel_t table[static_cast<size_t>(function_t::end)] = {
+        math::fncas_sqrt, math::fncas_exp, math::fncas_log, math::fncas_sin, math::fncas_cos, math::fncas_tan,
+        math::fncas_asin, math::fncas_acos, math::fncas_atan, math::fncas_neg, math::fncas_sqr, math::fncas_fabs,
+        math::fncas_sign};
+    return table;
+  }
+};
+template <> struct math_kernel_table<float> {
+  typedef float (*kernel_t)(float);
+  static const kernel_t* kernels() {
+    static const kernel_t table[static_cast<size_t>(function_t::end)] = {
+        math::fncas_sqrtf, math::fncas_expf, math::fncas_logf, math::fncas_sinf, math::fncas_cosf, math::fncas_tanf,
+        math::fncas_asinf, math::fncas_acosf, math::fncas_atanf, math::fncas_negf, math::fncas_sqrf,
+        math::fncas_fabsf, math::fncas_signf};
+    return table;
+  }
+};
+
+}  // namespace fncas
+
+#endif  // #ifndef FNCAS_MATH_H
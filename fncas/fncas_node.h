@@ -5,13 +5,17 @@
 #ifndef FNCAS_NODE_H
 #define FNCAS_NODE_H
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <functional>
 #include <limits>
 #include <map>
+#include <memory>
 #include <stack>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "fncas_base.h"
@@ -22,63 +26,189 @@ namespace fncas {
 // Instances of node_impl take 10 bytes each and are packed.
 // Each node_impl refers to a value, an input variable, an operation or math function invocation.
 // Singleton vector<node_impl> is the allocator, therefore the code is single-threaded.
+// N-ary nodes keep the indexes of their children in a separate singleton vector, see `nary_children_`.
+// Loop nodes sum their body over the rows of an external data table, see `tables_`. Within the body,
+// `row_element` nodes refer to the columns of the current row.
 
-enum type_t : uint8_t { variable, value, operation, function };
-enum struct operation_t : uint8_t { add, subtract, multiply, divide, end };
-enum struct function_t : uint8_t { sqrt, exp, log, sin, cos, tan, asin, acos, atan, end };
+// Besides the arithmetic, the operations are `pow`, `powi`, the power to the integer exponent kept in the value node
+// on the right, `min` and `max`. Fused multiply-add, `fma`, is an n-ary node with exactly three children.
+// `sign` is -1, 0 or 1, and 0 for NaN. Pow, min, max and fma are computed in double, as the generated C code does.
+enum type_t : uint8_t { variable, value, operation, function, nary, row_element, loop };
+enum struct operation_t : uint8_t { add, subtract, multiply, divide, pow, powi, min, max, fma, end };
+enum struct function_t : uint8_t { sqrt, exp, log, sin, cos, tan, asin, acos, atan, neg, sqr, abs, sign, end };
 
+// The operations written as infix operators in the generated code, the rest are function calls.
+inline bool is_arithmetic_operation(operation_t operation) {
+  return operation < operation_t::pow;
+}
+
+// For the arithmetic operations, the infix operators, for the rest, the names of the C functions.
 const char* const operation_as_string(operation_t operation) {
-  static const char* representation[static_cast<size_t>(operation_t::end)] = {"+", "-", "*", "/"};
+  static const char* representation[static_cast<size_t>(operation_t::end)] = {
+      "+", "-", "*", "/", "pow", "powi", "fmin", "fmax", "fma"};
   return operation < operation_t::end ? representation[static_cast<size_t>(operation)] : "?";
 }
 
 const char* const function_as_string(function_t function) {
   static const char* representation[static_cast<size_t>(function_t::end)] = {
-      "sqrt", "exp", "log", "sin", "cos", "tan", "asin", "acos", "atan"};
+      "sqrt", "exp", "log", "sin", "cos", "tan", "asin", "acos", "atan", "neg", "sqr", "fabs", "sign"};
   return function < function_t::end ? representation[static_cast<size_t>(function)] : "?";
 }
 
+// x^n by repeated squaring, from the lowest bit of n up. The code generators emit the very same multiplications.
+template <typename T> T integer_power(T x, int32_t n) {
+  uint32_t m = n < 0 ? 0u - static_cast<uint32_t>(n) : static_cast<uint32_t>(n);
+  T r = 1;
+  T p = x;
+  while (m) {
+    if (m & 1u) {
+      r *= p;
+    }
+    m >>= 1;
+    if (m) {
+      p *= p;
+    }
+  }
+  return n < 0 ? 1 / r : r;
+}
+
 template <typename T> T apply_operation(operation_t operation, T lhs, T rhs) {
   static std::function<T(T, T)> evaluator[static_cast<size_t>(operation_t::end)] = {
-      std::plus<T>(), std::minus<T>(), std::multiplies<T>(), std::divides<T>(),
+      std::plus<T>(),
+      std::minus<T>(),
+      std::multiplies<T>(),
+      std::divides<T>(),
+      [](T a, T b) { return static_cast<T>(std::pow(static_cast<double>(a), static_cast<double>(b))); },
+      [](T a, T b) { return integer_power<T>(a, static_cast<int32_t>(b)); },
+      [](T a, T b) { return static_cast<T>(std::fmin(static_cast<double>(a), static_cast<double>(b))); },
+      [](T a, T b) { return static_cast<T>(std::fmax(static_cast<double>(a), static_cast<double>(b))); },
+      [](T, T) { return std::numeric_limits<T>::quiet_NaN(); },
   };
   return operation < operation_t::end ? evaluator[static_cast<size_t>(operation)](lhs, rhs)
                                       : std::numeric_limits<T>::quiet_NaN();
 }
 
+// N-ary sums and products are evaluated using up to NARY_ACCUMULATORS independent accumulators:
+// the children are assigned to them round-robin, and the accumulators are combined pairwise at the end.
+// This breaks the dependency chain of long sums for the CPU. The code generators follow the very same order
+// of operations, so that all the evaluators agree on the result bit for bit.
+enum { NARY_ACCUMULATORS = 4 };
+
+template <typename T, typename F> T apply_nary_operation(operation_t operation, size_t n, F child) {
+  assert(n > 0);
+  if (operation == operation_t::fma) {
+    assert(n == 3);
+    return static_cast<T>(
+        std::fma(static_cast<double>(child(0)), static_cast<double>(child(1)), static_cast<double>(child(2))));
+  }
+  assert(operation == operation_t::add || operation == operation_t::multiply);
+  const size_t m = std::min(n, static_cast<size_t>(NARY_ACCUMULATORS));
+  T accumulator[NARY_ACCUMULATORS];
+  for (size_t j = 0; j < m; ++j) {
+    accumulator[j] = child(j);
+  }
+  if (operation == operation_t::add) {
+    for (size_t j = m; j < n; ++j) {
+      accumulator[j % m] += child(j);
+    }
+  } else {
+    for (size_t j = m; j < n; ++j) {
+      accumulator[j % m] *= child(j);
+    }
+  }
+  if (m == 1) {
+    return accumulator[0];
+  } else if (m == 2) {
+    return apply_operation<T>(operation, accumulator[0], accumulator[1]);
+  } else if (m == 3) {
+    return apply_operation<T>(
+        operation, apply_operation<T>(operation, accumulator[0], accumulator[1]), accumulator[2]);
+  } else {
+    return apply_operation<T>(operation,
+                              apply_operation<T>(operation, accumulator[0], accumulator[1]),
+                              apply_operation<T>(operation, accumulator[2], accumulator[3]));
+  }
+}
+
 template <typename T> T apply_function(function_t function, T argument) {
   static std::function<T(T)> evaluator[static_cast<size_t>(function_t::end)] = {
-      sqrt, exp, log, sin, cos, tan, asin, acos, atan};
+      sqrt,
+      exp,
+      log,
+      sin,
+      cos,
+      tan,
+      asin,
+      acos,
+      atan,
+      [](T x) { return -x; },
+      [](T x) { return x * x; },
+      [](T x) { return std::fabs(x); },
+      [](T x) { return static_cast<T>((x > 0) - (x < 0)); }};
   return function < function_t::end ? evaluator[static_cast<size_t>(function)](argument)
                                     : std::numeric_limits<T>::quiet_NaN();
 }
 
+// An external row-major table of data the loop nodes iterate over. The data is not owned.
+// The layout is shared with the generated code, see `generate_c_code_for_nodes()`.
+struct table_impl {
+  const fncas_value_type* data;
+  int64_t rows;
+  int64_t cols;
+};
+static_assert(sizeof(table_impl) == 24, "sizeof(table_impl) should be 24, the generated code relies on it.");
+
 struct node_impl;
+struct loop_program;
 struct x;
+
+// The node indexes kept per node or per n-ary child, moved into the file along with the nodes, see fncas_storage.h.
+typedef std::vector<node_index_type, source_allocator<node_index_type>> node_index_vector;
+
 struct internals_impl {
   // The dimensionality of the function that is currently being worked with.
   int32_t dim_;
   x* x_ptr_;
 
-  // All expression nodes created so far, with fixed indexes.
-  std::vector<node_impl> node_vector_;
+  // All expression nodes created so far, with fixed indexes, and fixed addresses: the chunks never move,
+  // so that a `node_impl&` stays valid while new nodes are created.
+  chunked_vector<node_impl> node_vector_;
+
+  // The indexes of the children of n-ary nodes, each n-ary node refers to a contiguous range of them.
+  node_index_vector nary_children_;
+
+  // The data tables registered so far, referred to by their indexes.
+  std::vector<table_impl> tables_;
 
-  // Values per node computed so far.
+  // Values per node computed so far, of the nodes from `node_value_base_` on, see eval_node().
   std::vector<fncas_value_type> node_value_;
   std::vector<int8_t> node_computed_;
+  node_index_type node_value_base_ = 0;
+  // The lowest index of the nodes each node evaluated depends on, see first_node_of().
+  std::unordered_map<node_index_type, node_index_type> first_nodes_;
 
-  // df_[var_index][node_index] => node index for d (node[node_index]) / d (x[variable_index]), -1 if unknown.
-  std::vector<std::vector<node_index_type>> df_;
+  // Tangents per node for forward-mode differentiation, one contiguous block of directions per node reached,
+  // at the slot of the node, -1 for the nodes not reached.
+  std::vector<fncas_value_type> node_tangent_;
+  std::vector<node_index_type> node_tangent_slot_;
+
+  // The loop_program-s of the loop nodes, see loop_program_of().
+  std::unordered_map<node_index_type, std::shared_ptr<const loop_program>> loop_programs_;
 
-  // A block of RAM to be used as the buffer for externally compiled functions.
-  std::vector<fncas_value_type> ram_for_compiled_evaluations_;
+  // df_[var_index][node_index] => node index for d (node[node_index]) / d (x[variable_index]), -1 if unknown.
+  std::vector<node_index_vector> df_;
 
   void reset() {
     dim_ = 0;
     x_ptr_ = nullptr;
     node_vector_.clear();
+    nary_children_.clear();
+    tables_.clear();
     df_.clear();
-    ram_for_compiled_evaluations_.clear();
+    node_tangent_.clear();
+    node_tangent_slot_.clear();
+    loop_programs_.clear();
+    first_nodes_.clear();
   }
 };
 
@@ -92,7 +222,7 @@ inline void reset_internals_singleton() {
   internals_singleton().reset();
 }
 
-inline std::vector<node_impl>& node_vector_singleton() {
+inline chunked_vector<node_impl>& node_vector_singleton() {
   return internals_singleton().node_vector_;
 }
 
@@ -101,6 +231,45 @@ struct node_impl {
   type_t& type() {
     return *reinterpret_cast<type_t*>(&data_[0]);
   }
+  type_t type() const {
+    return *reinterpret_cast<const type_t*>(&data_[0]);
+  }
+  int32_t variable() const {
+    assert(type() == type_t::variable);
+    return *reinterpret_cast<const int32_t*>(&data_[2]);
+  }
+  fncas_value_type value() const {
+    assert(type() == type_t::value);
+    return *reinterpret_cast<const fncas_value_type*>(&data_[2]);
+  }
+  operation_t operation() const {
+    assert(type() == type_t::operation || type() == type_t::nary);
+    return *reinterpret_cast<const operation_t*>(&data_[1]);
+  }
+  node_index_type lhs_index() const {
+    assert(type() == type_t::operation);
+    return *reinterpret_cast<const node_index_type*>(&data_[2]);
+  }
+  node_index_type rhs_index() const {
+    assert(type() == type_t::operation);
+    return *reinterpret_cast<const node_index_type*>(&data_[10]);
+  }
+  function_t function() const {
+    assert(type() == type_t::function);
+    return *reinterpret_cast<const function_t*>(&data_[1]);
+  }
+  node_index_type argument_index() const {
+    assert(type() == type_t::function);
+    return *reinterpret_cast<const node_index_type*>(&data_[2]);
+  }
+  node_index_type children_begin() const {
+    assert(type() == type_t::nary);
+    return *reinterpret_cast<const node_index_type*>(&data_[2]);
+  }
+  node_index_type children_count() const {
+    assert(type() == type_t::nary);
+    return *reinterpret_cast<const node_index_type*>(&data_[10]);
+  }
   int32_t& variable() {
     assert(type() == type_t::variable);
     return *reinterpret_cast<int32_t*>(&data_[2]);
@@ -110,7 +279,7 @@ struct node_impl {
     return *reinterpret_cast<fncas_value_type*>(&data_[2]);
   }
   operation_t& operation() {
-    assert(type() == type_t::operation);
+    assert(type() == type_t::operation || type() == type_t::nary);
     return *reinterpret_cast<operation_t*>(&data_[1]);
   }
   node_index_type& lhs_index() {
@@ -129,20 +298,413 @@ struct node_impl {
     assert(type() == type_t::function);
     return *reinterpret_cast<node_index_type*>(&data_[2]);
   }
+  node_index_type& children_begin() {
+    assert(type() == type_t::nary);
+    return *reinterpret_cast<node_index_type*>(&data_[2]);
+  }
+  node_index_type& children_count() {
+    assert(type() == type_t::nary);
+    return *reinterpret_cast<node_index_type*>(&data_[10]);
+  }
+  int32_t column() const {
+    assert(type() == type_t::row_element);
+    return *reinterpret_cast<const int32_t*>(&data_[2]);
+  }
+  node_index_type body_index() const {
+    assert(type() == type_t::loop);
+    return *reinterpret_cast<const node_index_type*>(&data_[2]);
+  }
+  int32_t table() const {
+    assert(type() == type_t::row_element || type() == type_t::loop);
+    return *reinterpret_cast<const int32_t*>(&data_[10]);
+  }
+  int32_t& column() {
+    assert(type() == type_t::row_element);
+    return *reinterpret_cast<int32_t*>(&data_[2]);
+  }
+  node_index_type& body_index() {
+    assert(type() == type_t::loop);
+    return *reinterpret_cast<node_index_type*>(&data_[2]);
+  }
+  int32_t& table() {
+    assert(type() == type_t::row_element || type() == type_t::loop);
+    return *reinterpret_cast<int32_t*>(&data_[10]);
+  }
+  node_index_type child_index(node_index_type j) const {
+    assert(j >= 0 && j < children_count());
+    return internals_singleton().nary_children_[children_begin() + j];
+  }
 };
 static_assert(sizeof(node_impl) == 18, "sizeof(node_impl) should be 18. Check struct alignment compilation flags.");
 
+// The bytes used, by the elements, and reserved, by the capacity, of a structure of the internals.
+// The capacity of the chunks allocated from a file, see fncas_storage.h, is `mapped_bytes` instead:
+// it is not held in memory, and not limited by `max_bytes`.
+struct memory_usage {
+  uint64_t used_bytes = 0;
+  uint64_t reserved_bytes = 0;
+  uint64_t mapped_bytes = 0;
+  template <typename T> void add(const std::vector<T>& vector) {
+    used_bytes += vector.size() * sizeof(T);
+    reserved_bytes += vector.capacity() * sizeof(T);
+  }
+  template <typename T> void add(const std::vector<T, source_allocator<T>>& vector) {
+    used_bytes += vector.size() * sizeof(T);
+    (source_of(vector) ? mapped_bytes : reserved_bytes) += vector.capacity() * sizeof(T);
+  }
+  template <typename T, int CHUNK_BITS> void add(const chunked_vector<T, CHUNK_BITS>& vector) {
+    used_bytes += vector.size() * sizeof(T);
+    (vector.source() ? mapped_bytes : reserved_bytes) += vector.capacity() * sizeof(T);
+    reserved_bytes += vector.chunk_table_bytes();
+  }
+};
+
+// The memory held by the internals, per structure, and the nodes by type, to be exported as metrics.
+struct memory_report {
+  memory_usage nodes;
+  memory_usage nary_children;
+  memory_usage tables;
+  // The values, computed flags and forward-mode tangents per node.
+  memory_usage node_values;
+  memory_usage node_computed;
+  memory_usage node_tangents;
+  // The indexes of the derivatives per variable per node, `df_`.
+  memory_usage derivatives;
+  uint64_t node_count = 0;
+  uint64_t nodes_by_type[static_cast<size_t>(type_t::loop) + 1] = {};
+  uint64_t total_used_bytes() const {
+    return nodes.used_bytes + nary_children.used_bytes + tables.used_bytes + node_values.used_bytes +
+           node_computed.used_bytes + node_tangents.used_bytes + derivatives.used_bytes;
+  }
+  uint64_t total_reserved_bytes() const {
+    return nodes.reserved_bytes + nary_children.reserved_bytes + tables.reserved_bytes +
+           node_values.reserved_bytes + node_computed.reserved_bytes + node_tangents.reserved_bytes +
+           derivatives.reserved_bytes;
+  }
+};
+
+// The sizes of the structures only, without walking the nodes, cheap enough to check on each growth.
+inline memory_report memory_sizes() {
+  const internals_impl& internals = internals_singleton();
+  memory_report report;
+  report.nodes.add(internals.node_vector_);
+  report.nary_children.add(internals.nary_children_);
+  report.tables.add(internals.tables_);
+  report.node_values.add(internals.node_value_);
+  report.node_computed.add(internals.node_computed_);
+  report.node_tangents.add(internals.node_tangent_);
+  report.node_tangents.add(internals.node_tangent_slot_);
+  report.derivatives.add(internals.df_);
+  for (const node_index_vector& df : internals.df_) {
+    report.derivatives.add(df);
+  }
+  report.node_count = internals.node_vector_.size();
+  return report;
+}
+
+// The bytes reserved by the structures of the internals.
+inline uint64_t memory_reserved_bytes() {
+  return memory_sizes().total_reserved_bytes();
+}
+
+// Checks the limit on the bytes before `bytes` more are reserved.
+inline void memory_check_growth(uint64_t bytes) {
+  const uint64_t max_bytes = memory_limits_singleton().max_bytes;
+  if (max_bytes) {
+    const uint64_t reserved = memory_reserved_bytes();
+    if (reserved + bytes > max_bytes) {
+      memory_limit_exceeded("max_bytes " + std::to_string(max_bytes) + ", " + std::to_string(reserved) +
+                            " reserved, " + std::to_string(bytes) + " more requested");
+    }
+  }
+}
+
+// Reserves the room for `size` elements, growing the capacity geometrically as the vector itself would,
+// within the limit on the bytes.
+template <typename T, typename A> void reserve_within_limits(std::vector<T, A>& vector, size_t size) {
+  if (size > vector.capacity()) {
+    const size_t capacity = std::max(size, vector.capacity() * 2);
+    // The buffers of a chunk_source are not held in memory, hence not limited.
+    if (!source_of(vector)) {
+      memory_check_growth(static_cast<uint64_t>(capacity - vector.capacity()) * sizeof(T));
+    }
+    vector.reserve(capacity);
+  }
+}
+
+// Allocates the chunks for `size` elements at once, within the limit on the bytes.
+template <typename T, int CHUNK_BITS>
+void reserve_within_limits(chunked_vector<T, CHUNK_BITS>& vector, size_t size) {
+  // The chunks of a chunk_source are not held in memory, hence not limited.
+  if (size > vector.capacity() && !vector.source()) {
+    const size_t chunk_size = chunked_vector<T, CHUNK_BITS>::chunk_size;
+    const size_t capacity = (size + chunk_size - 1) / chunk_size * chunk_size;
+    memory_check_growth(static_cast<uint64_t>(capacity - vector.capacity()) * sizeof(T));
+  }
+  vector.reserve(size);
+}
+
+template <typename T, typename A>
+T& growing_vector_access(std::vector<T, A>& vector, node_index_type index, const T& fill) {
+  if (static_cast<node_index_type>(vector.size()) <= index) {
+    reserve_within_limits(vector, static_cast<size_t>(index + 1));
+    vector.resize(static_cast<size_t>(index + 1), fill);
+  }
+  return vector[index];
+}
+
+// The sizes of the structures and the nodes by type. Walks the nodes.
+inline memory_report memory_stats() {
+  memory_report report = memory_sizes();
+  for (const node_impl& f : node_vector_singleton()) {
+    ++report.nodes_by_type[static_cast<size_t>(f.type())];
+  }
+  return report;
+}
+
+// Checks the limit on the number of nodes before `count` more are created.
+inline void memory_check_nodes(uint64_t count) {
+  const uint64_t max_nodes = memory_limits_singleton().max_nodes;
+  if (max_nodes && internals_singleton().node_vector_.size() + count > max_nodes) {
+    memory_limit_exceeded("max_nodes " + std::to_string(max_nodes) + ", " +
+                          std::to_string(internals_singleton().node_vector_.size()) + " created, " +
+                          std::to_string(count) + " more requested");
+  }
+}
+
+// Reserves the room for `count` more nodes at once, for the builders that know the size of the graph.
+// The nodes are created as usual, without allocating along the way.
+inline void reserve_nodes(node_index_type count) {
+  reserve_within_limits(node_vector_singleton(), static_cast<size_t>(node_vector_singleton().size() + count));
+}
+
+// Creates `count` value-initialized nodes at once, returns the index of the first one.
+inline node_index_type allocate_nodes(node_index_type count) {
+  memory_check_nodes(count);
+  const node_index_type first = node_vector_singleton().size();
+  reserve_within_limits(node_vector_singleton(), static_cast<size_t>(first + count));
+  node_vector_singleton().resize(static_cast<size_t>(first + count));
+  return first;
+}
+
+// for_each_child() calls `callback` with the index of each node the node refers to, in left-to-right order.
+// The body of a loop node is not its child: it is evaluated once per row, see `loop_program`.
+template <typename F> void for_each_child(const node_impl& f, F callback) {
+  if (f.type() == type_t::operation) {
+    callback(f.lhs_index());
+    callback(f.rhs_index());
+  } else if (f.type() == type_t::function) {
+    callback(f.argument_index());
+  } else if (f.type() == type_t::nary) {
+    for (node_index_type j = 0; j < f.children_count(); ++j) {
+      callback(f.child_index(j));
+    }
+  }
+}
+
+// Row elements are only meaningful within the body of a loop over their table, see node::loop(). The passes
+// over a function throw this when they reach one outside of any loop, such as `d[0]` used without sum_over_rows().
+inline void row_element_outside_loop() {
+  throw std::invalid_argument("A row element is used outside of the loops over its table.");
+}
+
+// The body of a loop, split by whether the nodes depend on the current row.
+// Row-invariant nodes are hoisted out of the loop: they are evaluated once, as the regular nodes are.
+// Only the row-dependent nodes are evaluated per row, in the order of `variant_`.
+struct loop_program {
+  // The row-invariant nodes the row-dependent ones refer to, or the body itself if it does not depend on the row.
+  std::vector<node_index_type> invariant_;
+  // The row-dependent nodes in evaluation order, the body, if row-dependent, being the last one.
+  std::vector<node_index_type> variant_;
+  node_index_type max_index_;
+
+  explicit loop_program(const node_impl& loop) : max_index_(loop.body_index()) {
+    const node_index_type body = loop.body_index();
+    // 0: not visited, 1: row-invariant, 2: row-dependent. Only for the nodes of the body, which are few.
+    std::unordered_map<node_index_type, int8_t> state;
+    std::stack<node_index_type> stack;
+    stack.push(body);
+    while (!stack.empty()) {
+      const node_index_type i = stack.top();
+      stack.pop();
+      const node_index_type dependent_i = ~i;
+      if (i > dependent_i) {
+        if (!state[i]) {
+          const node_impl& f = node_vector_singleton()[i];
+          if (f.type() == type_t::row_element) {
+            // Checked by node::loop().
+            assert(f.table() == loop.table());
+            state[i] = 2;
+            variant_.push_back(i);
+          } else if (f.type() == type_t::operation || f.type() == type_t::function || f.type() == type_t::nary) {
+            stack.push(~i);
+            for_each_child(f, [&stack](node_index_type c) { stack.push(c); });
+          } else {
+            state[i] = 1;
+          }
+        }
+      } else if (!state[dependent_i]) {
+        int8_t s = 1;
+        for_each_child(node_vector_singleton()[dependent_i],
+                       [&s, &state](node_index_type c) { s = std::max(s, state[c]); });
+        state[dependent_i] = s;
+        if (s == 2) {
+          variant_.push_back(dependent_i);
+        }
+      }
+    }
+    if (state[body] == 1) {
+      invariant_.push_back(body);
+    } else {
+      for (node_index_type v : variant_) {
+        max_index_ = std::max(max_index_, v);
+        for_each_child(node_vector_singleton()[v], [this, &state](node_index_type c) {
+          if (state[c] == 1) {
+            state[c] = 3;  // Mark as listed.
+            invariant_.push_back(c);
+          }
+        });
+      }
+    }
+  }
+};
+
+// The loop_program of the loop node `i`, built once. The programs are dropped along with the nodes, and by
+// the passes rewriting the nodes in place, see fncas_optimize.h.
+inline const loop_program& loop_program_of(node_index_type i) {
+  std::unordered_map<node_index_type, std::shared_ptr<const loop_program>>& programs =
+      internals_singleton().loop_programs_;
+  std::shared_ptr<const loop_program>& program = programs[i];
+  if (!program) {
+    program = std::make_shared<const loop_program>(node_vector_singleton()[i]);
+  }
+  return *program;
+}
+
+// eval_row_node() evaluates a row-dependent node of the body of a loop, given its children are evaluated.
+// Also evaluates the operation, function and n-ary nodes outside loops, with no `row`.
+// The values `V` are indexed by node, and are usually a std::vector. They are kept in the precision `P`,
+// see `precision_traits`, with the same rounding as tape_view::eval().
+template <typename P = fncas_value_type, typename VALUES>
+inline typename precision_traits<P>::value_type eval_row_node(const node_impl& f,
+                                                              const fncas_value_type* row,
+                                                              const VALUES& V) {
+  typedef typename precision_traits<P>::value_type T;
+  typedef typename precision_traits<P>::accumulator_type A;
+  if (f.type() == type_t::row_element) {
+    // The row elements outside of the loops are rejected beforehand, see row_element_outside_loop().
+    assert(row);
+    return static_cast<T>(row[f.column()]);
+  } else if (f.type() == type_t::operation) {
+    return apply_operation<T>(f.operation(), V[f.lhs_index()], V[f.rhs_index()]);
+  } else if (f.type() == type_t::function) {
+    return static_cast<T>(apply_function<fncas_value_type>(f.function(), V[f.argument_index()]));
+  } else if (f.type() == type_t::nary) {
+    const node_index_type* children = &internals_singleton().nary_children_[f.children_begin()];
+    return static_cast<T>(apply_nary_operation<A>(
+        f.operation(), f.children_count(), [&V, children](size_t j) { return static_cast<A>(V[children[j]]); }));
+  } else {
+    assert(false);
+    return std::numeric_limits<T>::quiet_NaN();
+  }
+}
+
+// The interpreter calls the hook with the index of each node right before computing it, see fncas_profile.h.
+struct no_eval_hook {
+  void operator()(node_index_type) const {
+  }
+};
+
+// eval_loop() sums the body of the loop over the rows of its table, given the row-invariant nodes are evaluated.
+// The values of the row-dependent nodes are scratch: they are left from the last row and never marked computed.
+template <typename VALUES, typename HOOK = no_eval_hook>
+inline fncas_value_type eval_loop(const node_impl& loop,
+                                  const loop_program& program,
+                                  VALUES& V,
+                                  HOOK&& hook = HOOK()) {
+  const table_impl& t = internals_singleton().tables_[loop.table()];
+  const node_index_type body = loop.body_index();
+  fncas_value_type sum = 0.0;
+  for (int64_t r = 0; r < t.rows; ++r) {
+    const fncas_value_type* row = t.data + r * t.cols;
+    for (node_index_type v : program.variant_) {
+      hook(v);
+      V[v] = eval_row_node(node_vector_singleton()[v], row, V);
+    }
+    sum += V[body];
+  }
+  return sum;
+}
+
+// The lowest index of the nodes the value of the node `i` depends on, itself included, found once per node.
+// The interpreter keeps the values of the nodes from there on, so that the nodes before the subgraph of a function,
+// such as the originals of the nodes reordered, see reorder_nodes(), take no space.
+inline node_index_type first_node_of(node_index_type i) {
+  std::unordered_map<node_index_type, node_index_type>& first_nodes = internals_singleton().first_nodes_;
+  const auto cit = first_nodes.find(i);
+  if (cit != first_nodes.end()) {
+    return cit->second;
+  }
+  node_index_type first = i;
+  std::vector<int8_t> visited;
+  std::stack<node_index_type> stack;
+  stack.push(i);
+  while (!stack.empty()) {
+    const node_index_type j = stack.top();
+    stack.pop();
+    if (!growing_vector_access(visited, j, static_cast<int8_t>(false))) {
+      visited[j] = true;
+      first = std::min(first, j);
+      const node_impl& f = node_vector_singleton()[j];
+      for_each_child(f, [&stack](node_index_type c) { stack.push(c); });
+      if (f.type() == type_t::loop) {
+        stack.push(f.body_index());
+      }
+    }
+  }
+  first_nodes[i] = first;
+  return first;
+}
+
+// The values the interpreter keeps per node, indexed by node, of the nodes from `base_` on.
+struct node_values {
+  std::vector<fncas_value_type>& values_;
+  const node_index_type base_;
+  fncas_value_type& operator[](node_index_type i) {
+    return values_[static_cast<size_t>(i - base_)];
+  }
+  const fncas_value_type& operator[](node_index_type i) const {
+    return values_[static_cast<size_t>(i - base_)];
+  }
+};
+
 // eval_node() should use manual stack implementation to avoid SEGFAULT. Using plain recursion
 // will overflow the stack for every formula containing repeated operation on the top level.
+// The values are kept from the first node of the subgraph evaluated, see first_node_of(). Reusing them for a node
+// depending on the earlier nodes moves them to start from there.
 enum class reuse_cache : int8_t { invalidate = 0, reuse = 1 };
-fncas_value_type eval_node(node_index_type index,
-                           const std::vector<fncas_value_type>& x,
-                           reuse_cache reuse = reuse_cache::invalidate) {
-  std::vector<fncas_value_type>& V = internals_singleton().node_value_;
-  std::vector<int8_t>& B = internals_singleton().node_computed_;
+template <typename HOOK>
+fncas_value_type eval_node_with_hook(node_index_type index,
+                                     const std::vector<fncas_value_type>& x,
+                                     reuse_cache reuse,
+                                     HOOK&& hook) {
+  internals_impl& internals = internals_singleton();
+  std::vector<fncas_value_type>& V = internals.node_value_;
+  std::vector<int8_t>& B = internals.node_computed_;
+  const node_index_type first = first_node_of(index);
   if (reuse == reuse_cache::invalidate) {
     B.clear();
+    internals.node_value_base_ = first;
+  } else if (first < internals.node_value_base_) {
+    const size_t shift = static_cast<size_t>(internals.node_value_base_ - first);
+    reserve_within_limits(V, V.size() + shift);
+    reserve_within_limits(B, B.size() + shift);
+    V.insert(V.begin(), shift, 0.0);
+    B.insert(B.begin(), shift, static_cast<int8_t>(false));
+    internals.node_value_base_ = first;
   }
+  const node_index_type base = internals.node_value_base_;
+  node_values values{V, base};
   std::stack<node_index_type> stack;
   stack.push(index);
   while (!stack.empty()) {
@@ -150,17 +712,19 @@ fncas_value_type eval_node(node_index_type index,
     stack.pop();
     const node_index_type dependent_i = ~i;
     if (i > dependent_i) {
-      if (!growing_vector_access(B, i, static_cast<int8_t>(false))) {
+      assert(i >= base);
+      if (!growing_vector_access(B, i - base, static_cast<int8_t>(false))) {
         node_impl& f = node_vector_singleton()[i];
         if (f.type() == type_t::variable) {
+          hook(i);
           int32_t v = f.variable();
           assert(v >= 0 && v < static_cast<int32_t>(x.size()));
-          growing_vector_access(V, i, 0.0) = x[v];
-          growing_vector_access(B, i, static_cast<int8_t>(false)) = true;
-
+          growing_vector_access(V, i - base, 0.0) = x[v];
+          B[i - base] = true;
         } else if (f.type() == type_t::value) {
-          growing_vector_access(V, i, 0.0) = f.value();
-          growing_vector_access(B, i, static_cast<int8_t>(false)) = true;
+          hook(i);
+          growing_vector_access(V, i - base, 0.0) = f.value();
+          B[i - base] = true;
         } else if (f.type() == type_t::operation) {
           stack.push(~i);
           stack.push(f.lhs_index());
@@ -168,29 +732,64 @@ fncas_value_type eval_node(node_index_type index,
         } else if (f.type() == type_t::function) {
           stack.push(~i);
           stack.push(f.argument_index());
+        } else if (f.type() == type_t::nary) {
+          stack.push(~i);
+          for (node_index_type j = 0; j < f.children_count(); ++j) {
+            stack.push(f.child_index(j));
+          }
+        } else if (f.type() == type_t::loop) {
+          stack.push(~i);
+          for (node_index_type c : loop_program_of(i).invariant_) {
+            stack.push(c);
+          }
         } else {
-          assert(false);
-          return std::numeric_limits<fncas_value_type>::quiet_NaN();
+          row_element_outside_loop();
         }
       }
     } else {
       node_impl& f = node_vector_singleton()[dependent_i];
+      hook(dependent_i);
+      fncas_value_type value;
       if (f.type() == type_t::operation) {
-        growing_vector_access(V, dependent_i, 0.0) =
-            apply_operation<fncas_value_type>(f.operation(), V[f.lhs_index()], V[f.rhs_index()]);
-        growing_vector_access(B, dependent_i, static_cast<int8_t>(false)) = true;
+        value = apply_operation<fncas_value_type>(f.operation(), values[f.lhs_index()], values[f.rhs_index()]);
       } else if (f.type() == type_t::function) {
-        growing_vector_access(V, dependent_i, 0.0) =
-            apply_function<fncas_value_type>(f.function(), V[f.argument_index()]);
-        growing_vector_access(B, dependent_i, static_cast<int8_t>(false)) = true;
+        value = apply_function<fncas_value_type>(f.function(), values[f.argument_index()]);
+      } else if (f.type() == type_t::nary) {
+        const node_index_type* children = &internals.nary_children_[f.children_begin()];
+        value = apply_nary_operation<fncas_value_type>(
+            f.operation(), f.children_count(), [&values, children](size_t j) { return values[children[j]]; });
+      } else if (f.type() == type_t::loop) {
+        const loop_program& program = loop_program_of(dependent_i);
+        growing_vector_access(V, program.max_index_ - base, 0.0);
+        value = eval_loop(f, program, values, hook);
       } else {
         assert(false);
         return std::numeric_limits<fncas_value_type>::quiet_NaN();
       }
+      growing_vector_access(V, dependent_i - base, 0.0) = value;
+      growing_vector_access(B, dependent_i - base, static_cast<int8_t>(false)) = true;
     }
   }
-  assert(B[index]);
-  return V[index];
+  assert(B[index - base]);
+  return V[index - base];
+}
+
+fncas_value_type eval_node(node_index_type index,
+                           const std::vector<fncas_value_type>& x,
+                           reuse_cache reuse = reuse_cache::invalidate) {
+  return eval_node_with_hook(index, x, reuse, no_eval_hook());
+}
+
+// eval_nodes() evaluates several nodes in one pass, sharing the values of their common subexpressions.
+std::vector<fncas_value_type> eval_nodes(const std::vector<node_index_type>& indexes,
+                                         const std::vector<fncas_value_type>& x,
+                                         reuse_cache reuse = reuse_cache::invalidate) {
+  std::vector<fncas_value_type> result(indexes.size());
+  for (size_t i = 0; i < indexes.size(); ++i) {
+    const bool keep_cache = (i > 0) || (reuse == reuse_cache::reuse);
+    result[i] = eval_node(indexes[i], x, keep_cache ? reuse_cache::reuse : reuse_cache::invalidate);
+  }
+  return result;
 }
 
 // The code that deals with nodes directly uses class node as a wrapper to node_impl.
@@ -206,7 +805,9 @@ struct node_index_allocator {
   explicit inline node_index_allocator(from_index i) : index_(static_cast<node_index_type>(i)) {
   }
   explicit inline node_index_allocator(allocate_new) : index_(node_vector_singleton().size()) {
-    node_vector_singleton().resize(index_ + 1);
+    memory_check_nodes(1);
+    reserve_within_limits(node_vector_singleton(), static_cast<size_t>(index_ + 1));
+    node_vector_singleton().emplace_back();
   }
   node_index_type index() const {
     return index_;
@@ -261,12 +862,78 @@ struct node : node_index_allocator {
   node argument() const {
     return from_index(node_vector_singleton()[index_].argument_index());
   }
+  node_index_type children_count() const {
+    return node_vector_singleton()[index_].children_count();
+  }
+  node child(node_index_type j) const {
+    return from_index(node_vector_singleton()[index_].child_index(j));
+  }
   static node variable(node_index_type index) {
     node result;
     result.type() = type_t::variable;
     result.variable() = index;
     return result;
   }
+  // N-ary sum or product of the nodes, `operation` should be `add` or `multiply`, or `fma` of three nodes.
+  static node nary(operation_t operation, const std::vector<node_index_type>& children) {
+    assert(operation == operation_t::add || operation == operation_t::multiply ||
+           (operation == operation_t::fma && children.size() == 3));
+    assert(!children.empty());
+    node_index_vector& pool = internals_singleton().nary_children_;
+    reserve_within_limits(pool, pool.size() + children.size());
+    node result;
+    result.type() = type_t::nary;
+    result.operation() = operation;
+    node_vector_singleton()[result.index_].children_begin() = pool.size();
+    node_vector_singleton()[result.index_].children_count() = children.size();
+    pool.insert(pool.end(), children.begin(), children.end());
+    return result;
+  }
+  static node row_element(int32_t table, int32_t column) {
+    node result;
+    result.type() = type_t::row_element;
+    node_vector_singleton()[result.index_].column() = column;
+    node_vector_singleton()[result.index_].table() = table;
+    return result;
+  }
+  // The sum of `body` over the rows of the table. Nested loops are supported as long as each body only refers to
+  // the rows of its own table, throws std::invalid_argument otherwise. The bodies of the nested loops are checked
+  // when they are created, so they are not looked into.
+  static node loop(int32_t table, const node& body) {
+    std::unordered_set<node_index_type> visited;
+    std::stack<node_index_type> stack;
+    stack.push(body.index_);
+    while (!stack.empty()) {
+      const node_index_type i = stack.top();
+      stack.pop();
+      if (visited.insert(i).second) {
+        const node_impl& f = node_vector_singleton()[i];
+        if (f.type() == type_t::row_element && f.table() != table) {
+          throw std::invalid_argument("The body of the loop over the table " + std::to_string(table) +
+                                      " refers to the rows of the table " + std::to_string(f.table()) + ".");
+        }
+        for_each_child(f, [&stack](node_index_type c) { stack.push(c); });
+      }
+    }
+    node result;
+    result.type() = type_t::loop;
+    node_vector_singleton()[result.index_].body_index() = body.index_;
+    node_vector_singleton()[result.index_].table() = table;
+    return result;
+  }
+  static node sum(const std::vector<node>& children) {
+    return nary(operation_t::add, indexes_of(children));
+  }
+  static node product(const std::vector<node>& children) {
+    return nary(operation_t::multiply, indexes_of(children));
+  }
+  static std::vector<node_index_type> indexes_of(const std::vector<node>& nodes) {
+    std::vector<node_index_type> result(nodes.size());
+    for (size_t i = 0; i < nodes.size(); ++i) {
+      result[i] = nodes[i].index_;
+    }
+    return result;
+  }
   std::string debug_as_string() const {
     if (type() == type_t::variable) {
       return "x[" + std::to_string(variable()) + "]";
@@ -275,11 +942,37 @@ struct node : node_index_allocator {
     } else if (type() == type_t::operation) {
       // Note: this recursive call will overflow the stack with SEGFAULT on deep functions.
       // For debugging purposes only.
-      return "(" + lhs().debug_as_string() + operation_as_string(operation()) + rhs().debug_as_string() + ")";
+      if (is_arithmetic_operation(operation())) {
+        return "(" + lhs().debug_as_string() + operation_as_string(operation()) + rhs().debug_as_string() + ")";
+      } else {
+        return std::string(operation_as_string(operation())) + "(" + lhs().debug_as_string() + ", " +
+               rhs().debug_as_string() + ")";
+      }
     } else if (type() == type_t::function) {
       // Note: this recursive call will overflow the stack with SEGFAULT on deep functions.
       // For debugging purposes only.
       return std::string(function_as_string(function())) + "(" + argument().debug_as_string() + ")";
+    } else if (type() == type_t::nary) {
+      // Note: this recursive call will overflow the stack with SEGFAULT on deep functions.
+      // For debugging purposes only.
+      if (operation() == operation_t::fma) {
+        return "fma(" + child(0).debug_as_string() + ", " + child(1).debug_as_string() + ", " +
+               child(2).debug_as_string() + ")";
+      }
+      std::string result = "(";
+      for (node_index_type j = 0; j < children_count(); ++j) {
+        result += (j ? operation_as_string(operation()) : "") + child(j).debug_as_string();
+      }
+      return result + ")";
+    } else if (type() == type_t::row_element) {
+      const node_impl& f = node_vector_singleton()[index_];
+      return "t" + std::to_string(f.table()) + "[" + std::to_string(f.column()) + "]";
+    } else if (type() == type_t::loop) {
+      // Note: this recursive call will overflow the stack with SEGFAULT on deep functions.
+      // For debugging purposes only.
+      const node_impl& f = node_vector_singleton()[index_];
+      return "sum_over_rows(t" + std::to_string(f.table()) + ", " +
+             node(from_index(f.body_index())).debug_as_string() + ")";
     } else {
       return "?";
     }
@@ -342,6 +1035,47 @@ struct x : noncopyable {
   */
 };
 
+// Class "table" registers an external row-major table of data for the loop nodes to iterate over.
+// The data is referred to, not copied, and should outlive the evaluators of the functions that use it.
+// Class "row" is the placeholder for the current row of a table within the body of a loop.
+// Synopsis: node loss = sum_over_rows(table(&data[0], rows, cols), [&x](const row& d) { return sqr(x[0] - d[0]); });
+// The graph, and the generated code, are of the size of the body, regardless of the number of rows.
+
+struct table {
+  int32_t id_;
+  table(const fncas_value_type* data, int64_t rows, int32_t cols)
+      : id_(static_cast<int32_t>(internals_singleton().tables_.size())) {
+    assert(rows >= 0);
+    assert(cols > 0);
+    internals_singleton().tables_.push_back(table_impl{data, rows, cols});
+  }
+  table(const std::vector<fncas_value_type>& data, int32_t cols)
+      : table(data.empty() ? nullptr : &data[0], static_cast<int64_t>(data.size() / cols), cols) {
+    assert(data.size() % cols == 0);
+  }
+  int64_t rows() const {
+    return internals_singleton().tables_[id_].rows;
+  }
+  int32_t cols() const {
+    return static_cast<int32_t>(internals_singleton().tables_[id_].cols);
+  }
+};
+
+struct row {
+  int32_t table_;
+  explicit row(int32_t table) : table_(table) {
+  }
+  node operator[](int32_t column) const {
+    assert(column >= 0);
+    assert(column < internals_singleton().tables_[table_].cols);
+    return node::row_element(table_, column);
+  }
+};
+
+template <typename F> node sum_over_rows(const table& t, F body) {
+  return node::loop(t.id_, body(row(t.id_)));
+}
+
 // Class "f" is the placeholder for function evaluators.
 // One implementation -- f_intermediate -- is provided by default.
 // Compiled implementations using the same interface are defined in fncas_jit.h.
@@ -389,14 +1123,74 @@ struct f_intermediate : f {
   }
 };
 
+// Class "f_vector" is the placeholder for vector-valued function evaluators.
+// All outputs are computed in one pass, so the subexpressions they share are only evaluated once.
+
+struct f_vector : noncopyable {
+  virtual ~f_vector() = default;
+  virtual std::vector<fncas_value_type> operator()(const std::vector<fncas_value_type>& x) const = 0;
+  virtual int32_t dim() const = 0;
+  virtual size_t size() const = 0;
+};
+
+struct f_vector_native : f_vector {
+  std::function<std::vector<fncas_value_type>(const std::vector<fncas_value_type>&)> f_;
+  int32_t d_;
+  size_t n_;
+  f_vector_native(std::function<std::vector<fncas_value_type>(const std::vector<fncas_value_type>&)> f,
+                  int32_t d,
+                  size_t n)
+      : f_(f), d_(d), n_(n) {
+  }
+  virtual std::vector<fncas_value_type> operator()(const std::vector<fncas_value_type>& x) const {
+    return f_(x);
+  }
+  virtual int32_t dim() const {
+    return d_;
+  }
+  virtual size_t size() const {
+    return n_;
+  }
+};
+
+struct f_vector_intermediate : f_vector {
+  const std::vector<node> f_;
+  f_vector_intermediate(const std::vector<node>& f) : f_(f) {
+  }
+  f_vector_intermediate(f_vector_intermediate&& rhs) : f_(rhs.f_) {
+  }
+  std::vector<node_index_type> indexes() const {
+    std::vector<node_index_type> result(f_.size());
+    for (size_t i = 0; i < f_.size(); ++i) {
+      result[i] = f_[i].index();
+    }
+    return result;
+  }
+  virtual std::vector<fncas_value_type> operator()(const std::vector<fncas_value_type>& x) const {
+    assert(static_cast<int32_t>(x.size()) == dim());
+    return eval_nodes(indexes(), x);
+  }
+  virtual int32_t dim() const {
+    return internals_singleton().dim_;
+  }
+  virtual size_t size() const {
+    return f_.size();
+  }
+};
+
 // Helper code to allow writing polymorphic functions that can be both evaluated and recorded.
 // Synopsis: template<typename T> typename fncas::output<T>::type f(const T& x);
+// Vector-valued functions use fncas::output_vector<T>::type instead.
 
 template <typename T> struct output {};
 template <> struct output<std::vector<fncas_value_type>> { typedef fncas_value_type type; };
 // template <> struct output<x> { typedef fncas::node_with_dim type; };
 template <> struct output<x> { typedef fncas::node type; };
 
+template <typename T> struct output_vector {};
+template <> struct output_vector<std::vector<fncas_value_type>> { typedef std::vector<fncas_value_type> type; };
+template <> struct output_vector<x> { typedef std::vector<fncas::node> type; };
+
 }  // namespace fncas
 
 // Arithmetic operations and mathematical functions are defined outside namespace fncas.
@@ -454,5 +1248,57 @@ DECLARE_FUNCTION(tan);
 DECLARE_FUNCTION(asin);
 DECLARE_FUNCTION(acos);
 DECLARE_FUNCTION(atan);
+DECLARE_FUNCTION(sqr);
+DECLARE_FUNCTION(sign);
+
+#define DECLARE_BINARY_FUNCTION(F, NAME)                                 \
+  inline fncas::node F(const fncas::node& lhs, const fncas::node& rhs) { \
+    fncas::node result;                                                  \
+    result.type() = fncas::type_t::operation;                            \
+    result.operation() = fncas::operation_t::NAME;                       \
+    result.lhs_index() = lhs.index_;                                     \
+    result.rhs_index() = rhs.index_;                                     \
+    return result;                                                       \
+  }
+
+DECLARE_BINARY_FUNCTION(pow, pow);
+DECLARE_BINARY_FUNCTION(fmin, min);
+DECLARE_BINARY_FUNCTION(fmax, max);
+
+inline fncas::node operator-(const fncas::node& argument) {
+  fncas::node result;
+  result.type() = fncas::type_t::function;
+  result.function() = fncas::function_t::neg;
+  result.argument_index() = argument.index_;
+  return result;
+}
+
+inline fncas::node fabs(const fncas::node& argument) {
+  fncas::node result;
+  result.type() = fncas::type_t::function;
+  result.function() = fncas::function_t::abs;
+  result.argument_index() = argument.index_;
+  return result;
+}
+
+// The power to a constant exponent. Without this overload, `pow(x, 0.5)` would pick the integer one below.
+inline fncas::node pow(const fncas::node& lhs, fncas::fncas_value_type rhs) {
+  return pow(lhs, fncas::node(rhs));
+}
+
+// The power to an integer exponent, computed by repeated multiplication, see fncas::integer_power().
+inline fncas::node pow(const fncas::node& lhs, int32_t n) {
+  const fncas::node exponent(static_cast<fncas::fncas_value_type>(n));
+  fncas::node result;
+  result.type() = fncas::type_t::operation;
+  result.operation() = fncas::operation_t::powi;
+  result.lhs_index() = lhs.index_;
+  result.rhs_index() = exponent.index_;
+  return result;
+}
+
+inline fncas::node fma(const fncas::node& a, const fncas::node& b, const fncas::node& c) {
+  return fncas::node::nary(fncas::operation_t::fma, {a.index_, b.index_, c.index_});
+}
 
 #endif  // #ifndef FNCAS_NODE_H
@@ -0,0 +1,385 @@
+// https://github.com/dkorolev/fncas
+
+// Defines the optimization passes over the expression graph.
+
+#ifndef FNCAS_OPTIMIZE_H
+#define FNCAS_OPTIMIZE_H
+
+#include <algorithm>
+#include <stack>
+#include <vector>
+
+#include "fncas_base.h"
+#include "fncas_node.h"
+
+namespace fncas {
+
+// node_reference_counts() returns the number of times each node is referred to from within the subgraphs
+// of the given roots, with each root counted as referred to once more. Unreachable nodes have zero count.
+std::vector<node_index_type> node_reference_counts(const std::vector<node_index_type>& roots) {
+  std::vector<node_index_type> count;
+  std::vector<int8_t> visited;
+  std::stack<node_index_type> stack;
+  for (node_index_type root : roots) {
+    ++growing_vector_access(count, root, static_cast<node_index_type>(0));
+    stack.push(root);
+  }
+  while (!stack.empty()) {
+    const node_index_type i = stack.top();
+    stack.pop();
+    if (!growing_vector_access(visited, i, static_cast<int8_t>(false))) {
+      visited[i] = true;
+      node_impl& f = node_vector_singleton()[i];
+      std::vector<node_index_type> children;
+      if (f.type() == type_t::operation) {
+        children.push_back(f.lhs_index());
+        children.push_back(f.rhs_index());
+      } else if (f.type() == type_t::function) {
+        children.push_back(f.argument_index());
+      } else if (f.type() == type_t::nary) {
+        for (node_index_type j = 0; j < f.children_count(); ++j) {
+          children.push_back(f.child_index(j));
+        }
+      } else if (f.type() == type_t::loop) {
+        children.push_back(f.body_index());
+      }
+      for (node_index_type c : children) {
+        ++growing_vector_access(count, c, static_cast<node_index_type>(0));
+        stack.push(c);
+      }
+    }
+  }
+  return count;
+}
+
+// flatten_nodes() rewrites chains of additions and multiplications, such as the ones `r += x[i]` produces,
+// into n-ary sum and product nodes, in place. The value of every node is preserved up to the rounding of
+// reassociation, and so are the node indexes, along with the derivatives cached for them.
+// Intermediate results of a chain referred to more than once are kept as nodes of their own.
+// Graph depth goes from O(n) to O(1) per chain, and the evaluators use independent accumulators for n-ary nodes.
+void flatten_nodes(const std::vector<node_index_type>& roots) {
+  // The bodies of the loops, and the nodes the rewritten ones depend on, may change.
+  internals_singleton().loop_programs_.clear();
+  internals_singleton().first_nodes_.clear();
+  const std::vector<node_index_type> count = node_reference_counts(roots);
+  std::vector<int8_t> visited;
+  std::stack<node_index_type> stack;
+  for (node_index_type root : roots) {
+    stack.push(root);
+  }
+  while (!stack.empty()) {
+    const node_index_type i = stack.top();
+    stack.pop();
+    if (!growing_vector_access(visited, i, static_cast<int8_t>(false))) {
+      visited[i] = true;
+      node_impl& f = node_vector_singleton()[i];
+      if ((f.type() == type_t::operation || f.type() == type_t::nary) &&
+          (f.operation() == operation_t::add || f.operation() == operation_t::multiply)) {
+        const operation_t operation = f.operation();
+        // Collect the terms of the chain in their original left-to-right order.
+        std::vector<node_index_type> terms;
+        std::stack<node_index_type> chain;
+        chain.push(i);
+        while (!chain.empty()) {
+          const node_index_type c = chain.top();
+          chain.pop();
+          node_impl& g = node_vector_singleton()[c];
+          const bool same_operation = (g.type() == type_t::operation || g.type() == type_t::nary) &&
+                                      g.operation() == operation;
+          if (same_operation && (c == i || count[c] == 1)) {
+            if (g.type() == type_t::operation) {
+              chain.push(g.rhs_index());
+              chain.push(g.lhs_index());
+            } else {
+              for (node_index_type j = g.children_count() - 1; j >= 0; --j) {
+                chain.push(g.child_index(j));
+              }
+            }
+          } else {
+            terms.push_back(c);
+          }
+        }
+        if (f.type() == type_t::operation && terms.size() == 2) {
+          // Nothing to flatten.
+        } else {
+          node_index_vector& pool = internals_singleton().nary_children_;
+          const node_index_type begin = pool.size();
+          reserve_within_limits(pool, pool.size() + terms.size());
+          pool.insert(pool.end(), terms.begin(), terms.end());
+          node_impl& rewritten = node_vector_singleton()[i];
+          rewritten.type() = type_t::nary;
+          rewritten.operation() = operation;
+          rewritten.children_begin() = begin;
+          rewritten.children_count() = terms.size();
+        }
+        for (node_index_type t : terms) {
+          stack.push(t);
+        }
+      } else if (f.type() == type_t::operation) {
+        stack.push(f.lhs_index());
+        stack.push(f.rhs_index());
+      } else if (f.type() == type_t::function) {
+        stack.push(f.argument_index());
+      } else if (f.type() == type_t::nary) {
+        for (node_index_type j = 0; j < f.children_count(); ++j) {
+          stack.push(f.child_index(j));
+        }
+      } else if (f.type() == type_t::loop) {
+        stack.push(f.body_index());
+      }
+    }
+  }
+}
+
+inline const node& flatten(const node& f) {
+  flatten_nodes(std::vector<node_index_type>(1, f.index()));
+  return f;
+}
+
+// The floating point semantics the optimization passes may assume.
+// * strict: IEEE 754, the value of every node is preserved bit for bit, which rules out reassociation.
+// * fast: additions and multiplications are associative, as with -ffast-math, the values are preserved up to
+//   the rounding of reassociation.
+enum class fp_mode : int8_t { strict = 0, fast = 1 };
+
+// A term of a chain being rebalanced, `inverse` if it is subtracted or divided by.
+struct chain_term {
+  node_index_type index;
+  bool inverse;
+};
+
+// The balanced tree of the terms [begin, end) of a chain of `additive` or multiplicative operations.
+// Terms of the same sign are added or multiplied, terms of opposite signs are subtracted or divided.
+inline chain_term balanced_chain(const std::vector<chain_term>& terms, size_t begin, size_t end, bool additive) {
+  if (end - begin == 1) {
+    return terms[begin];
+  }
+  const size_t middle = begin + (end - begin) / 2;
+  const chain_term lhs = balanced_chain(terms, begin, middle, additive);
+  const chain_term rhs = balanced_chain(terms, middle, end, additive);
+  node result;
+  result.type() = type_t::operation;
+  if (lhs.inverse == rhs.inverse) {
+    result.operation() = additive ? operation_t::add : operation_t::multiply;
+    result.lhs_index() = lhs.index;
+    result.rhs_index() = rhs.index;
+  } else {
+    result.operation() = additive ? operation_t::subtract : operation_t::divide;
+    result.lhs_index() = lhs.inverse ? rhs.index : lhs.index;
+    result.rhs_index() = lhs.inverse ? lhs.index : rhs.index;
+  }
+  return chain_term{result.index(), lhs.inverse && rhs.inverse};
+}
+
+// rebalance_nodes() rewrites the chains of additions and subtractions, and the chains of multiplications and
+// divisions, such as the ones `r += x[i]` and `r /= x[i]` produce, into balanced trees of the same terms, in place.
+// Unlike flatten_nodes(), the result is made of binary operations only, so the dependency chains of every
+// evaluator and of the generated code get shorter, from O(n) to O(log n) per chain.
+// With fp_mode::strict the nodes are left as they are. Same as flatten_nodes(), the node indexes are preserved,
+// and intermediate results of a chain referred to more than once are kept as nodes of their own.
+void rebalance_nodes(const std::vector<node_index_type>& roots, fp_mode mode) {
+  if (mode == fp_mode::strict) {
+    return;
+  }
+  // The bodies of the loops, and the nodes the rewritten ones depend on, may change.
+  internals_singleton().loop_programs_.clear();
+  internals_singleton().first_nodes_.clear();
+  const std::vector<node_index_type> count = node_reference_counts(roots);
+  std::vector<int8_t> visited;
+  std::stack<node_index_type> stack;
+  for (node_index_type root : roots) {
+    stack.push(root);
+  }
+  while (!stack.empty()) {
+    const node_index_type i = stack.top();
+    stack.pop();
+    if (growing_vector_access(visited, i, static_cast<int8_t>(false))) {
+      continue;
+    }
+    visited[i] = true;
+    const node_impl& f = node_vector_singleton()[i];
+    if (f.type() == type_t::operation && is_arithmetic_operation(f.operation())) {
+      const bool additive = f.operation() == operation_t::add || f.operation() == operation_t::subtract;
+      // Collect the terms of the chain in their original left-to-right order.
+      std::vector<chain_term> terms;
+      std::stack<chain_term> chain;
+      chain.push(chain_term{i, false});
+      while (!chain.empty()) {
+        const chain_term c = chain.top();
+        chain.pop();
+        const node_impl& g = node_vector_singleton()[c.index];
+        const bool same_family = g.type() == type_t::operation && is_arithmetic_operation(g.operation()) &&
+                                 additive == (g.operation() == operation_t::add ||
+                                              g.operation() == operation_t::subtract);
+        if (same_family && (c.index == i || count[c.index] == 1)) {
+          const bool inverse = g.operation() == operation_t::subtract || g.operation() == operation_t::divide;
+          chain.push(chain_term{g.rhs_index(), c.inverse != inverse});
+          chain.push(chain_term{g.lhs_index(), c.inverse});
+        } else {
+          terms.push_back(c);
+        }
+      }
+      if (terms.size() > 2) {
+        // The leftmost term is never inverted, hence neither is the chain as a whole.
+        const size_t middle = terms.size() / 2;
+        const chain_term lhs = balanced_chain(terms, 0, middle, additive);
+        const chain_term rhs = balanced_chain(terms, middle, terms.size(), additive);
+        assert(!lhs.inverse);
+        node_impl& rewritten = node_vector_singleton()[i];
+        if (rhs.inverse) {
+          rewritten.operation() = additive ? operation_t::subtract : operation_t::divide;
+        } else {
+          rewritten.operation() = additive ? operation_t::add : operation_t::multiply;
+        }
+        rewritten.lhs_index() = lhs.index;
+        rewritten.rhs_index() = rhs.index;
+      }
+      for (const chain_term& t : terms) {
+        stack.push(t.index);
+      }
+    } else if (f.type() == type_t::operation) {
+      stack.push(f.lhs_index());
+      stack.push(f.rhs_index());
+    } else if (f.type() == type_t::function) {
+      stack.push(f.argument_index());
+    } else if (f.type() == type_t::nary) {
+      for (node_index_type j = 0; j < f.children_count(); ++j) {
+        stack.push(f.child_index(j));
+      }
+    } else if (f.type() == type_t::loop) {
+      stack.push(f.body_index());
+    }
+  }
+}
+
+inline const node& rebalance(const node& f, fp_mode mode = fp_mode::fast) {
+  rebalance_nodes(std::vector<node_index_type>(1, f.index()), mode);
+  return f;
+}
+
+// The orders reorder_nodes() lays the nodes out in, each node following the nodes it depends on.
+// * evaluation: the order eval_node() computes the nodes in, from the last child to the first one.
+// * min_live: depth first, the child needing the most values kept alive going first, Sethi-Ullman style,
+//   which keeps the number of the values computed but not yet consumed low.
+enum class node_order : int8_t { evaluation = 0, min_live = 1 };
+
+// The nodes the value of the node depends on: its children, and the body of a loop.
+template <typename F> void for_each_dependency(const node_impl& f, F callback) {
+  for_each_child(f, callback);
+  if (f.type() == type_t::loop) {
+    callback(f.body_index());
+  }
+}
+
+// reorder_nodes() copies the subgraphs of the roots into a contiguous block at the end of the node vector,
+// in the `order`, and returns the indexes of the copies of the roots. The subexpressions the roots share are
+// copied once. Nodes are numbered in the order they are created, so the subgraph of a function, and of its
+// derivatives even more so, is scattered over the node vector. Once reordered, the values the interpreter
+// keeps per node, as well as the scratch array `a[]` of the generated code, are accessed mostly sequentially.
+// Both start from the first node of the block, see first_node_of() and scratch_slot(), so the originals, which
+// are left as they are, take no space in them. The derivatives are best taken before reordering, with the function
+// and its derivatives reordered together, so that they share one block.
+std::vector<node_index_type> reorder_nodes(const std::vector<node_index_type>& roots,
+                                           node_order order = node_order::evaluation) {
+  // The scratch indexed by node is allocated the same way as the nodes are, in the file if they are in one.
+  const source_allocator<node_index_type> allocator(node_vector_singleton().source());
+  // The number of values live at once to compute each node, for node_order::min_live.
+  node_index_vector need(allocator);
+  if (order == node_order::min_live) {
+    std::stack<node_index_type> stack;
+    for (node_index_type root : roots) {
+      stack.push(root);
+    }
+    while (!stack.empty()) {
+      const node_index_type i = stack.top();
+      stack.pop();
+      const node_index_type dependent_i = ~i;
+      if (i > dependent_i) {
+        if (!growing_vector_access(need, i, static_cast<node_index_type>(0))) {
+          stack.push(~i);
+          for_each_dependency(node_vector_singleton()[i], [&stack](node_index_type c) { stack.push(c); });
+        }
+      } else if (!need[dependent_i]) {
+        std::vector<node_index_type> children;
+        for_each_dependency(node_vector_singleton()[dependent_i],
+                            [&children, &need](node_index_type c) { children.push_back(need[c]); });
+        std::sort(children.rbegin(), children.rend());
+        node_index_type n = 1;
+        for (size_t k = 0; k < children.size(); ++k) {
+          n = std::max(n, children[k] + static_cast<node_index_type>(k));
+        }
+        need[dependent_i] = n;
+      }
+    }
+  }
+
+  // The post-order of the depth-first traversal, the dependencies of each node visited in the order's order.
+  node_index_vector sequence(allocator);
+  node_index_vector position(allocator);
+  std::stack<node_index_type> stack;
+  for (auto it = roots.rbegin(); it != roots.rend(); ++it) {
+    stack.push(*it);
+  }
+  while (!stack.empty()) {
+    const node_index_type i = stack.top();
+    stack.pop();
+    const node_index_type dependent_i = ~i;
+    if (i > dependent_i) {
+      if (growing_vector_access(position, i, static_cast<node_index_type>(-1)) == -1) {
+        position[i] = -2;  // Being visited.
+        stack.push(~i);
+        std::vector<node_index_type> children;
+        for_each_dependency(node_vector_singleton()[i], [&children](node_index_type c) { children.push_back(c); });
+        if (order == node_order::min_live) {
+          // The child needing the most goes first, hence is pushed last.
+          std::stable_sort(children.begin(), children.end(), [&need](node_index_type a, node_index_type b) {
+            return need[a] < need[b];
+          });
+        }
+        for (node_index_type c : children) {
+          stack.push(c);
+        }
+      }
+    } else if (position[dependent_i] == -2) {
+      position[dependent_i] = static_cast<node_index_type>(sequence.size());
+      sequence.push_back(dependent_i);
+    }
+  }
+
+  const node_index_type base = allocate_nodes(static_cast<node_index_type>(sequence.size()));
+  node_index_vector& pool = internals_singleton().nary_children_;
+  const auto map = [base, &position](node_index_type i) { return base + position[i]; };
+  for (size_t k = 0; k < sequence.size(); ++k) {
+    node_impl f = node_vector_singleton()[sequence[k]];
+    if (f.type() == type_t::operation) {
+      f.lhs_index() = map(f.lhs_index());
+      f.rhs_index() = map(f.rhs_index());
+    } else if (f.type() == type_t::function) {
+      f.argument_index() = map(f.argument_index());
+    } else if (f.type() == type_t::nary) {
+      const node_index_type begin = static_cast<node_index_type>(pool.size());
+      reserve_within_limits(pool, pool.size() + f.children_count());
+      for (node_index_type j = 0; j < f.children_count(); ++j) {
+        pool.push_back(map(f.child_index(j)));
+      }
+      f.children_begin() = begin;
+    } else if (f.type() == type_t::loop) {
+      f.body_index() = map(f.body_index());
+    }
+    node_vector_singleton()[base + k] = f;
+  }
+
+  std::vector<node_index_type> result(roots.size());
+  for (size_t r = 0; r < roots.size(); ++r) {
+    result[r] = map(roots[r]);
+  }
+  return result;
+}
+
+inline node reorder(const node& f, node_order order = node_order::evaluation) {
+  return node(from_index(reorder_nodes(std::vector<node_index_type>(1, f.index()), order).front()));
+}
+
+}  // namespace fncas
+
+#endif  // #ifndef FNCAS_OPTIMIZE_H
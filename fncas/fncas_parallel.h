@@ -0,0 +1,200 @@
+// https://github.com/dkorolev/fncas
+
+// Multithreaded evaluation of a single large function.
+// Requires -pthread.
+
+#ifndef FNCAS_PARALLEL_H
+#define FNCAS_PARALLEL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "fncas_base.h"
+#include "fncas_node.h"
+#include "fncas_tape.h"
+
+namespace fncas {
+
+// A minimalistic work-stealing thread pool. Runs batches of indexed tasks, with the calling thread taking part.
+// Each thread has its own queue of tasks, takes tasks from the back of it, and steals from the front of the others
+// once its own queue is empty.
+class thread_pool : noncopyable {
+ public:
+  explicit thread_pool(size_t threads = std::thread::hardware_concurrency())
+      : stop_(false), generation_(0), task_(nullptr), remaining_(0) {
+    const size_t n = std::max(threads, static_cast<size_t>(1));
+    for (size_t i = 0; i < n; ++i) {
+      queues_.emplace_back(new queue());
+    }
+    for (size_t i = 1; i < n; ++i) {
+      threads_.emplace_back(&thread_pool::worker, this, i);
+    }
+  }
+  ~thread_pool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    condition_.notify_all();
+    for (std::thread& thread : threads_) {
+      thread.join();
+    }
+  }
+  size_t size() const {
+    return queues_.size();
+  }
+  // Runs task(0) ... task(count - 1) and returns once all of them are done.
+  void run(size_t count, const std::function<void(size_t)>& task) {
+    if (queues_.size() == 1 || count <= 1) {
+      for (size_t i = 0; i < count; ++i) {
+        task(i);
+      }
+    } else {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        task_ = &task;
+        remaining_ = count;
+        for (size_t i = 0; i < count; ++i) {
+          queue& q = *queues_[i % queues_.size()];
+          std::lock_guard<std::mutex> queue_lock(q.mutex);
+          q.tasks.push_back(i);
+        }
+        ++generation_;
+      }
+      condition_.notify_all();
+      work(0);
+      while (remaining_.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+ private:
+  struct queue {
+    std::mutex mutex;
+    std::deque<size_t> tasks;
+  };
+  bool pop(size_t self, size_t& task) {
+    for (size_t k = 0; k < queues_.size(); ++k) {
+      queue& q = *queues_[(self + k) % queues_.size()];
+      std::lock_guard<std::mutex> lock(q.mutex);
+      if (!q.tasks.empty()) {
+        if (k == 0) {
+          task = q.tasks.back();
+          q.tasks.pop_back();
+        } else {
+          task = q.tasks.front();
+          q.tasks.pop_front();
+        }
+        return true;
+      }
+    }
+    return false;
+  }
+  void work(size_t self) {
+    size_t task;
+    while (pop(self, task)) {
+      (*task_)(task);
+      remaining_.fetch_sub(1, std::memory_order_release);
+    }
+  }
+  void worker(size_t self) {
+    size_t seen = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        condition_.wait(lock, [this, seen]() { return stop_ || generation_ != seen; });
+        if (stop_) {
+          return;
+        }
+        seen = generation_;
+      }
+      work(self);
+    }
+  }
+
+  std::vector<std::unique_ptr<queue>> queues_;
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  bool stop_;
+  size_t generation_;
+  const std::function<void(size_t)>* task_;
+  std::atomic<size_t> remaining_;
+};
+
+// Level-scheduled parallel evaluator. The tape is laid out by dependency levels, and the nodes of each level
+// wide enough are split into chunks of at least `grain` nodes, evaluated by the threads of the pool.
+// Chunks start on cache line boundaries of the value array, so that no two threads write into the same line.
+// Narrow levels, and functions smaller than `grain` altogether, are evaluated by the calling thread alone.
+struct f_parallel : f {
+  enum { DEFAULT_GRAIN = 4096 };
+  enum { CACHE_LINE_VALUES = 64 / sizeof(fncas_value_type) };
+  const tape tape_;
+  const size_t grain_;
+  mutable thread_pool pool_;
+  mutable std::vector<fncas_value_type> buffer_;
+  fncas_value_type* values_;
+  explicit f_parallel(const node& f,
+                      size_t threads = std::thread::hardware_concurrency(),
+                      size_t grain = DEFAULT_GRAIN)
+      : tape_(std::vector<node_index_type>(1, f.index()), tape_order::levels),
+        grain_(std::max(grain, static_cast<size_t>(CACHE_LINE_VALUES))),
+        pool_(threads),
+        buffer_(tape_.size() + CACHE_LINE_VALUES) {
+    // Align the value array to the cache line.
+    const size_t misalignment = reinterpret_cast<uintptr_t>(&buffer_[0]) % 64;
+    values_ = &buffer_[0] + (misalignment ? (64 - misalignment) / sizeof(fncas_value_type) : 0);
+  }
+  explicit f_parallel(const f_intermediate& f,
+                      size_t threads = std::thread::hardware_concurrency(),
+                      size_t grain = DEFAULT_GRAIN)
+      : f_parallel(f.f_, threads, grain) {
+  }
+  virtual fncas_value_type operator()(const std::vector<fncas_value_type>& x) const {
+    assert(static_cast<int32_t>(x.size()) == dim());
+    const fncas_value_type* px = &x[0];
+    fncas_value_type* values = values_;
+    const std::vector<size_t>& level_begin = tape_.level_begin_;
+    for (size_t l = 0; l + 1 < level_begin.size(); ++l) {
+      const size_t begin = level_begin[l];
+      const size_t end = level_begin[l + 1];
+      const size_t chunks = std::min(pool_.size(), (end - begin) / grain_);
+      if (chunks <= 1) {
+        tape_.eval(px, values, begin, end);
+      } else {
+        const size_t chunk = (end - begin) / chunks;
+        const tape& t = tape_;
+        pool_.run(chunks, [&t, px, values, begin, end, chunk, chunks](size_t i) {
+          const size_t from = aligned_boundary(begin, end, begin + i * chunk);
+          const size_t to = (i + 1 == chunks) ? end : aligned_boundary(begin, end, begin + (i + 1) * chunk);
+          t.eval(px, values, from, to);
+        });
+      }
+    }
+    return values[tape_.roots_.front()];
+  }
+  virtual int32_t dim() const {
+    return tape_.dim_;
+  }
+  // Rounds the boundary between chunks up to the cache line, keeping it within [begin, end].
+  static size_t aligned_boundary(size_t begin, size_t end, size_t boundary) {
+    if (boundary == begin) {
+      return begin;
+    } else {
+      const size_t aligned = (boundary + CACHE_LINE_VALUES - 1) / CACHE_LINE_VALUES * CACHE_LINE_VALUES;
+      return std::min(aligned, end);
+    }
+  }
+};
+
+}  // namespace fncas
+
+#endif  // #ifndef FNCAS_PARALLEL_H
@@ -0,0 +1,252 @@
+// https://github.com/dkorolev/fncas
+
+// The sampling profiler of the interpreter, to tell which subexpressions of a function cost the most. Linux only.
+//
+// f_profiled evaluates the function as f_intermediate does, counting how many times each node is computed,
+// while the SIGPROF timer samples the node being computed every `interval` of CPU time. The costs are reported
+// per opcode, the operator or the function name, and per region, the path from the root to the node.
+// The regions are exported as folded stacks, the input of flamegraph.pl: one line per region, `root;...;node N`.
+// A subexpression shared by several parents belongs to the path the interpreter reaches it through first.
+// A chain of the same opcode, such as the sum of many terms, is one frame, and the paths are cut at MAX_DEPTH.
+// The timer and the signal handler are process-wide, so only one f_profiled may exist at a time.
+// Synopsis:
+//   fncas::f_profiled p(f);
+//   for (...) p(x);
+//   std::ofstream os("f.folded");
+//   p.write_folded(os);  // flamegraph.pl f.folded > f.svg
+
+#ifndef FNCAS_PROFILE_H
+#define FNCAS_PROFILE_H
+
+#include <algorithm>
+#include <atomic>
+#include <csignal>
+#include <cstring>
+#include <map>
+#include <ostream>
+#include <stack>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/time.h>
+
+#include "fncas_base.h"
+#include "fncas_node.h"
+#include "fncas_optimize.h"
+
+namespace fncas {
+
+enum class profile_metric : int8_t { samples = 0, executions = 1 };
+
+// The cost of an opcode or of a region.
+struct profile_entry {
+  std::string name;
+  uint64_t executions;
+  uint64_t samples;
+};
+
+// The name of the frame of the node in the folded stacks.
+inline std::string profile_opcode(const node_impl& f) {
+  if (f.type() == type_t::variable) {
+    return "x";
+  } else if (f.type() == type_t::value) {
+    return "const";
+  } else if (f.type() == type_t::operation) {
+    return operation_as_string(f.operation());
+  } else if (f.type() == type_t::function) {
+    return function_as_string(f.function());
+  } else if (f.type() == type_t::nary) {
+    return std::string("n-ary ") + operation_as_string(f.operation());
+  } else if (f.type() == type_t::row_element) {
+    return "row";
+  } else {
+    return "loop";
+  }
+}
+
+struct f_profiled : f {
+  enum { MAX_DEPTH = 128 };
+  const node f_;
+  const double interval_seconds_;
+  // Per node. The samples and the node being computed are shared with the signal handler, which may run on
+  // any thread of the process, hence the atomics, lock-free to be safe in the handler. The relaxed order suffices,
+  // as the counters are only read once the evaluation is over.
+  mutable std::vector<uint64_t> executions_;
+  mutable std::vector<std::atomic<uint64_t>> samples_;
+  // The node being computed, -1 outside the evaluation.
+  mutable std::atomic<node_index_type> current_;
+  struct sigaction previous_action_;
+  struct itimerval previous_timer_;
+
+  explicit f_profiled(const node& f, double interval_seconds = 0.001)
+      : f_(f),
+        interval_seconds_(interval_seconds),
+        executions_(node_vector_singleton().size()),
+        samples_(node_vector_singleton().size()),
+        current_(-1) {
+    assert(!active());
+    assert(interval_seconds > 0);
+    active() = this;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_sample;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, &previous_action_);
+    struct itimerval timer;
+    timer.it_interval.tv_sec = static_cast<time_t>(interval_seconds);
+    timer.it_interval.tv_usec = static_cast<suseconds_t>((interval_seconds - timer.it_interval.tv_sec) * 1e6);
+    if (!timer.it_interval.tv_sec && !timer.it_interval.tv_usec) {
+      timer.it_interval.tv_usec = 1;
+    }
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, &previous_timer_);
+  }
+  ~f_profiled() {
+    setitimer(ITIMER_PROF, &previous_timer_, nullptr);
+    sigaction(SIGPROF, &previous_action_, nullptr);
+    active() = nullptr;
+  }
+
+  virtual fncas_value_type operator()(const std::vector<fncas_value_type>& x) const {
+    assert(static_cast<int32_t>(x.size()) == dim());
+    const fncas_value_type result =
+        eval_node_with_hook(f_.index(), x, reuse_cache::invalidate, [this](node_index_type i) {
+          current_.store(i, std::memory_order_relaxed);
+          ++executions_[i];
+        });
+    current_.store(-1, std::memory_order_relaxed);
+    return result;
+  }
+  virtual int32_t dim() const {
+    return internals_singleton().dim_;
+  }
+
+  // The samples taken during the evaluation, each standing for `interval_seconds_` of CPU time.
+  uint64_t samples() const {
+    uint64_t result = 0;
+    for (const std::atomic<uint64_t>& s : samples_) {
+      result += s.load(std::memory_order_relaxed);
+    }
+    return result;
+  }
+  // The opcodes, the most sampled first.
+  std::vector<profile_entry> by_opcode() const {
+    std::map<std::string, profile_entry> opcodes;
+    for (size_t i = 0; i < executions_.size(); ++i) {
+      const uint64_t samples = samples_[i].load(std::memory_order_relaxed);
+      if (executions_[i] || samples) {
+        const std::string name = profile_opcode(node_vector_singleton()[i]);
+        profile_entry& entry = opcodes.insert(std::make_pair(name, profile_entry{name, 0, 0})).first->second;
+        entry.executions += executions_[i];
+        entry.samples += samples;
+      }
+    }
+    std::vector<profile_entry> result;
+    for (const auto& cit : opcodes) {
+      result.push_back(cit.second);
+    }
+    sort_by_cost(result);
+    return result;
+  }
+  // The regions, named by their folded stacks, the most sampled first.
+  std::vector<profile_entry> by_region() const {
+    const regions r(f_.index());
+    std::vector<profile_entry> result;
+    for (size_t k = 0; k < r.frames_.size(); ++k) {
+      result.push_back(profile_entry{r.path(k), 0, 0});
+    }
+    for (const auto& cit : r.frame_of_node_) {
+      result[cit.second].executions += executions_[cit.first];
+      result[cit.second].samples += samples_[cit.first].load(std::memory_order_relaxed);
+    }
+    result.erase(std::remove_if(result.begin(),
+                                result.end(),
+                                [](const profile_entry& e) { return !e.executions && !e.samples; }),
+                 result.end());
+    sort_by_cost(result);
+    return result;
+  }
+  void write_folded(std::ostream& os, profile_metric metric = profile_metric::samples) const {
+    for (const profile_entry& e : by_region()) {
+      const uint64_t value = (metric == profile_metric::samples) ? e.samples : e.executions;
+      if (value) {
+        os << e.name << ' ' << value << '\n';
+      }
+    }
+  }
+
+ private:
+  static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "The signal handler needs the lock-free 64-bit atomics.");
+  static f_profiled*& active() {
+    static f_profiled* instance = nullptr;
+    return instance;
+  }
+  static void on_sample(int) {
+    f_profiled* p = active();
+    if (p) {
+      const node_index_type i = p->current_.load(std::memory_order_relaxed);
+      if (i >= 0) {
+        p->samples_[i].fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+  }
+  static void sort_by_cost(std::vector<profile_entry>& entries) {
+    std::stable_sort(entries.begin(), entries.end(), [](const profile_entry& a, const profile_entry& b) {
+      return a.samples != b.samples ? a.samples > b.samples : a.executions > b.executions;
+    });
+  }
+  // The frames of the folded stacks, and the frame of each node reachable from the root.
+  struct regions {
+    // The parent frame, -1 for the root, and the opcode.
+    std::vector<std::pair<int64_t, std::string>> frames_;
+    std::vector<int32_t> depth_;
+    std::map<std::pair<int64_t, std::string>, int64_t> index_;
+    std::map<node_index_type, int64_t> frame_of_node_;
+    explicit regions(node_index_type root) {
+      // The nodes are visited in the order eval_node() reaches them in, each with the parent it is reached from.
+      std::stack<std::pair<node_index_type, node_index_type>> stack;
+      stack.push(std::make_pair(root, static_cast<node_index_type>(-1)));
+      while (!stack.empty()) {
+        const node_index_type i = stack.top().first;
+        const node_index_type parent = stack.top().second;
+        stack.pop();
+        if (!frame_of_node_.count(i)) {
+          const node_impl& f = node_vector_singleton()[i];
+          const std::string opcode = profile_opcode(f);
+          const int64_t parent_frame = parent >= 0 ? frame_of_node_[parent] : -1;
+          if (parent_frame >= 0 && (frames_[parent_frame].second == opcode || depth_[parent_frame] >= MAX_DEPTH)) {
+            frame_of_node_[i] = parent_frame;
+          } else {
+            frame_of_node_[i] = frame(parent_frame, opcode);
+          }
+          for_each_dependency(f, [&stack, i](node_index_type c) { stack.push(std::make_pair(c, i)); });
+        }
+      }
+    }
+    int64_t frame(int64_t parent, const std::string& opcode) {
+      const auto key = std::make_pair(parent, opcode);
+      const auto cit = index_.find(key);
+      if (cit != index_.end()) {
+        return cit->second;
+      }
+      const int64_t k = static_cast<int64_t>(frames_.size());
+      frames_.push_back(key);
+      depth_.push_back(parent >= 0 ? depth_[parent] + 1 : 1);
+      index_[key] = k;
+      return k;
+    }
+    std::string path(int64_t k) const {
+      std::string result = frames_[k].second;
+      for (int64_t p = frames_[k].first; p >= 0; p = frames_[p].first) {
+        result = frames_[p].second + ';' + result;
+      }
+      return result;
+    }
+  };
+};
+
+}  // namespace fncas
+
+#endif  // #ifndef FNCAS_PROFILE_H
@@ -0,0 +1,311 @@
+// https://github.com/dkorolev/fncas
+
+// Binary serialization of tapes, and evaluation of the tapes memory-mapped from files.
+//
+// The file is a header followed by the arrays of the tape, each at an offset aligned by 8 bytes:
+// nodes, n-ary children, loop blocks, roots and level boundaries. The arrays are stored as they are in memory,
+// so a mapped file is evaluated in place, with no parsing and no copying, and can be shared between processes.
+// The format is native-endian. Loop nodes refer to the data tables by their indexes, so the tables should be
+// registered in the same order before a mapped tape with loops is evaluated.
+
+#ifndef FNCAS_SERIALIZE_H
+#define FNCAS_SERIALIZE_H
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fncas_base.h"
+#include "fncas_node.h"
+#include "fncas_tape.h"
+
+namespace fncas {
+
+enum { TAPE_FILE_VERSION = 1 };
+
+struct tape_file_header {
+  char magic[8];
+  uint32_t version;
+  // The sizes the file was written with, should match the ones of the reader.
+  uint32_t node_size;
+  uint32_t value_size;
+  int32_t dim;
+  // The number of elements in each array.
+  uint64_t size;
+  uint64_t main_size;
+  uint64_t children;
+  uint64_t loops;
+  uint64_t roots;
+  uint64_t level_begin;
+};
+static_assert(sizeof(tape_file_header) == 72, "sizeof(tape_file_header) should be 72, it is a file format.");
+static_assert(sizeof(size_t) == sizeof(uint64_t), "Level boundaries are stored as 64-bit.");
+
+inline const char* tape_file_magic() {
+  return "FNCASTAP";
+}
+
+// The offsets of the arrays within the file.
+struct tape_file_layout {
+  uint64_t nodes;
+  uint64_t children;
+  uint64_t loops;
+  uint64_t roots;
+  uint64_t level_begin;
+  uint64_t total;
+  explicit tape_file_layout(const tape_file_header& header) {
+    nodes = aligned(sizeof(tape_file_header));
+    children = aligned(nodes + header.size * sizeof(node_impl));
+    loops = aligned(children + header.children * sizeof(node_index_type));
+    roots = aligned(loops + header.loops * sizeof(tape_loop));
+    level_begin = aligned(roots + header.roots * sizeof(node_index_type));
+    total = level_begin + header.level_begin * sizeof(size_t);
+  }
+  static uint64_t aligned(uint64_t offset) {
+    return (offset + 7) / 8 * 8;
+  }
+};
+
+inline void write_tape_file_array(FILE* f, uint64_t offset, const void* data, size_t bytes) {
+  static const char zeros[8] = {0};
+  const long position = ftell(f);
+  assert(position >= 0 && static_cast<uint64_t>(position) <= offset && offset - position < 8);
+  fwrite(zeros, 1, offset - position, f);
+  if (bytes) {
+    fwrite(data, 1, bytes, f);
+  }
+}
+
+// save_tape() writes the tape to the file, in the format mapped_tape reads.
+void save_tape(const tape& t, const std::string& filename) {
+  tape_file_header header;
+  memcpy(header.magic, tape_file_magic(), sizeof(header.magic));
+  header.version = TAPE_FILE_VERSION;
+  header.node_size = sizeof(node_impl);
+  header.value_size = sizeof(fncas_value_type);
+  header.dim = t.dim_;
+  header.size = t.nodes_.size();
+  header.main_size = t.main_size_;
+  header.children = t.children_.size();
+  header.loops = t.loops_.size();
+  header.roots = t.roots_.size();
+  header.level_begin = t.level_begin_.size();
+  const tape_file_layout layout(header);
+  FILE* f = fopen(filename.c_str(), "wb");
+  if (!f) {
+    throw file_error("Can not create the tape file `" + filename + "`.");
+  }
+  fwrite(&header, sizeof(header), 1, f);
+  write_tape_file_array(f, layout.nodes, t.nodes_.data(), t.nodes_.size() * sizeof(node_impl));
+  write_tape_file_array(f, layout.children, t.children_.data(), t.children_.size() * sizeof(node_index_type));
+  write_tape_file_array(f, layout.loops, t.loops_.data(), t.loops_.size() * sizeof(tape_loop));
+  write_tape_file_array(f, layout.roots, t.roots_.data(), t.roots_.size() * sizeof(node_index_type));
+  write_tape_file_array(f, layout.level_begin, t.level_begin_.data(), t.level_begin_.size() * sizeof(size_t));
+  const bool failed = ferror(f);
+  if (fclose(f) || failed) {
+    throw file_error("Can not write the tape file `" + filename + "`.");
+  }
+}
+
+// The reason the `length` bytes at `base` are not a tape file mapped_tape can evaluate, or an empty string.
+// Beyond the header, every index the nodes, the loops, the roots and the levels hold is checked to be in range,
+// so that evaluating the tape never reads past its arrays. Data tables should be registered by then.
+inline std::string tape_file_error(const char* base, size_t length) {
+  if (length < sizeof(tape_file_header)) {
+    return "truncated header";
+  }
+  const tape_file_header& header = *reinterpret_cast<const tape_file_header*>(base);
+  if (memcmp(header.magic, tape_file_magic(), sizeof(header.magic))) {
+    return "not a tape file";
+  }
+  if (header.version != TAPE_FILE_VERSION) {
+    return "version " + std::to_string(header.version) + ", expected " + std::to_string(TAPE_FILE_VERSION);
+  }
+  if (header.node_size != sizeof(node_impl) || header.value_size != sizeof(fncas_value_type)) {
+    return "written with other sizes of the nodes or of the values";
+  }
+  // The counts are bounded by the length first, so that the offsets computed from them do not overflow.
+  if (header.dim < 0 || header.size > length / sizeof(node_impl) ||
+      header.children > length / sizeof(node_index_type) || header.loops > length / sizeof(tape_loop) ||
+      header.roots > length / sizeof(node_index_type) || header.level_begin > length / sizeof(size_t)) {
+    return "sizes beyond the length of the file";
+  }
+  const tape_file_layout layout(header);
+  if (layout.total > length) {
+    return "truncated arrays";
+  }
+  const uint64_t size = header.size;
+  const uint64_t main_size = header.main_size;
+  if (main_size > size || !header.roots) {
+    return "inconsistent sizes";
+  }
+  const auto in = [](node_index_type i, uint64_t begin, uint64_t end) {
+    return i >= 0 && static_cast<uint64_t>(i) >= begin && static_cast<uint64_t>(i) < end;
+  };
+  const node_impl* nodes = reinterpret_cast<const node_impl*>(base + layout.nodes);
+  const node_index_type* children = reinterpret_cast<const node_index_type*>(base + layout.children);
+  const tape_loop* loops = reinterpret_cast<const tape_loop*>(base + layout.loops);
+  const std::vector<table_impl>& tables = internals_singleton().tables_;
+  for (uint64_t t = 0; t < size; ++t) {
+    const node_impl& f = nodes[t];
+    const std::string where = " at node " + std::to_string(t);
+    if (f.type() == type_t::variable) {
+      if (f.variable() < 0 || f.variable() >= header.dim) {
+        return "variable out of range" + where;
+      }
+    } else if (f.type() == type_t::operation) {
+      if (f.operation() >= operation_t::end || f.operation() == operation_t::fma || !in(f.lhs_index(), 0, t) ||
+          !in(f.rhs_index(), 0, t)) {
+        return "invalid operation" + where;
+      }
+    } else if (f.type() == type_t::function) {
+      if (f.function() >= function_t::end || !in(f.argument_index(), 0, t)) {
+        return "invalid function" + where;
+      }
+    } else if (f.type() == type_t::nary) {
+      const node_index_type begin = f.children_begin();
+      const node_index_type count = f.children_count();
+      if (f.operation() >= operation_t::end || count < 1 || (f.operation() == operation_t::fma && count != 3) ||
+          !in(begin, 0, header.children) || static_cast<uint64_t>(count) > header.children - begin) {
+        return "invalid n-ary node" + where;
+      }
+      for (node_index_type j = 0; j < count; ++j) {
+        if (!in(children[begin + j], 0, t)) {
+          return "child out of range" + where;
+        }
+      }
+    } else if (f.type() == type_t::row_element) {
+      if (t < main_size || f.table() < 0 || static_cast<size_t>(f.table()) >= tables.size() || f.column() < 0 ||
+          f.column() >= tables[f.table()].cols) {
+        return "invalid row element" + where;
+      }
+    } else if (f.type() == type_t::loop) {
+      if (!in(f.body_index(), 0, header.loops) || f.table() < 0 || static_cast<size_t>(f.table()) >= tables.size()) {
+        return "invalid loop" + where;
+      }
+      const tape_loop& loop = loops[f.body_index()];
+      if (!in(loop.begin, main_size, size + 1) || !in(loop.end, loop.begin, size + 1) ||
+          !in(loop.body, 0, loop.end)) {
+        return "invalid loop block" + where;
+      }
+    } else if (f.type() != type_t::value) {
+      return "invalid type" + where;
+    }
+  }
+  const node_index_type* roots = reinterpret_cast<const node_index_type*>(base + layout.roots);
+  for (uint64_t r = 0; r < header.roots; ++r) {
+    if (!in(roots[r], 0, main_size)) {
+      return "root out of range";
+    }
+  }
+  const size_t* level_begin = reinterpret_cast<const size_t*>(base + layout.level_begin);
+  for (uint64_t l = 0; l < header.level_begin; ++l) {
+    if (level_begin[l] > main_size || (l && level_begin[l] < level_begin[l - 1])) {
+      return "level out of range";
+    }
+  }
+  return "";
+}
+
+// A tape mapped read-only from a file written by save_tape(). The pages are shared by all the processes
+// mapping the same file. The tape is validated once, as it is mapped, which reads its arrays through.
+struct mapped_tape : noncopyable {
+  int fd_;
+  void* data_;
+  size_t length_;
+  tape_view view_;
+  // Throws file_error if the file can not be mapped, or is not a valid tape file, see tape_file_error().
+  explicit mapped_tape(const std::string& filename) {
+    fd_ = open(filename.c_str(), O_RDONLY);
+    if (fd_ < 0) {
+      throw file_error("Can not open the tape file `" + filename + "`.");
+    }
+    struct stat st;
+    if (fstat(fd_, &st) || !st.st_size) {
+      close(fd_);
+      throw file_error("Can not read the tape file `" + filename + "`.");
+    }
+    length_ = static_cast<size_t>(st.st_size);
+    data_ = mmap(nullptr, length_, PROT_READ, MAP_SHARED, fd_, 0);
+    if (data_ == MAP_FAILED) {
+      close(fd_);
+      throw file_error("Can not map the tape file `" + filename + "`.");
+    }
+    const char* base = static_cast<const char*>(data_);
+    const std::string error = tape_file_error(base, length_);
+    if (!error.empty()) {
+      munmap(data_, length_);
+      close(fd_);
+      throw file_error("Invalid tape file `" + filename + "`: " + error + ".");
+    }
+    const tape_file_header& header = *reinterpret_cast<const tape_file_header*>(base);
+    const tape_file_layout layout(header);
+    view_.dim_ = header.dim;
+    view_.nodes_ = reinterpret_cast<const node_impl*>(base + layout.nodes);
+    view_.size_ = header.size;
+    view_.main_size_ = header.main_size;
+    view_.children_ = reinterpret_cast<const node_index_type*>(base + layout.children);
+    view_.loops_ = reinterpret_cast<const tape_loop*>(base + layout.loops);
+    view_.roots_ = reinterpret_cast<const node_index_type*>(base + layout.roots);
+    view_.roots_count_ = header.roots;
+    view_.level_begin_ = reinterpret_cast<const size_t*>(base + layout.level_begin);
+    view_.level_begin_count_ = header.level_begin;
+  }
+  ~mapped_tape() {
+    munmap(data_, length_);
+    close(fd_);
+  }
+  const tape_view& view() const {
+    return view_;
+  }
+};
+
+// Evaluators of the mapped tapes. Each holds its own value array, the tape itself is shared.
+struct f_mapped : f {
+  const mapped_tape tape_;
+  mutable std::vector<fncas_value_type> values_;
+  explicit f_mapped(const std::string& filename) : tape_(filename), values_(tape_.view().size()) {
+  }
+  virtual fncas_value_type operator()(const std::vector<fncas_value_type>& x) const {
+    assert(static_cast<int32_t>(x.size()) == dim());
+    tape_.view().eval(&x[0], &values_[0]);
+    return values_[tape_.view().roots_[0]];
+  }
+  virtual int32_t dim() const {
+    return tape_.view().dim_;
+  }
+};
+
+struct f_vector_mapped : f_vector {
+  const mapped_tape tape_;
+  mutable std::vector<fncas_value_type> values_;
+  explicit f_vector_mapped(const std::string& filename) : tape_(filename), values_(tape_.view().size()) {
+  }
+  virtual std::vector<fncas_value_type> operator()(const std::vector<fncas_value_type>& x) const {
+    assert(static_cast<int32_t>(x.size()) == dim());
+    const tape_view& view = tape_.view();
+    view.eval(&x[0], &values_[0]);
+    std::vector<fncas_value_type> result(view.roots_count_);
+    for (size_t i = 0; i < result.size(); ++i) {
+      result[i] = values_[view.roots_[i]];
+    }
+    return result;
+  }
+  virtual int32_t dim() const {
+    return tape_.view().dim_;
+  }
+  virtual size_t size() const {
+    return tape_.view().roots_count_;
+  }
+};
+
+}  // namespace fncas
+
+#endif  // #ifndef FNCAS_SERIALIZE_H
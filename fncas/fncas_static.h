@@ -0,0 +1,484 @@
+// https://github.com/dkorolev/fncas
+
+// Compile-time expressions: small fixed-size functions recorded as C++ types instead of nodes.
+// The compiler sees the whole expression, so its evaluation is inlined in full, with no interpreter,
+// no virtual calls and no allocations. The derivatives are types too, derived at compile time,
+// with the zeros and ones folded away.
+//
+// Synopsis:
+//   using fncas::ct::x;
+//   const auto e = (x<0>() + x<1>() * 2.0) * (x<0>() + x<1>() * 2.0);
+//   const double value = e.eval(p);  // `p` is `const double*`.
+//   const double df_dx1 = fncas::ct::derivative<1>(e).eval(p);
+//
+// A loop over a runtime number of variables can not be recorded as a type, such functions are for the node-based
+// front end. `sum()` and `product()` spell out a fixed number of terms in the order a loop would add them up.
+
+#ifndef FNCAS_STATIC_H
+#define FNCAS_STATIC_H
+
+#include <cassert>
+#include <cmath>
+#include <type_traits>
+#include <vector>
+
+#include "fncas_base.h"
+#include "fncas_node.h"
+#include "fncas_differentiate.h"
+
+namespace fncas {
+namespace ct {
+
+// The base of all compile-time expressions, the operators below are restricted to its descendants.
+struct expression {};
+
+template <typename E> struct is_expression : std::is_base_of<expression, E> {};
+
+// The input variable `I`.
+template <int I> struct x : expression {
+  fncas_value_type eval(const fncas_value_type* p) const {
+    return p[I];
+  }
+};
+
+// Zero and one are types of their own, so that the derivatives can be simplified at compile time.
+struct zero : expression {
+  fncas_value_type eval(const fncas_value_type*) const {
+    return 0.0;
+  }
+};
+
+struct one : expression {
+  fncas_value_type eval(const fncas_value_type*) const {
+    return 1.0;
+  }
+};
+
+struct constant : expression {
+  fncas_value_type value_;
+  explicit constant(fncas_value_type value) : value_(value) {
+  }
+  fncas_value_type eval(const fncas_value_type*) const {
+    return value_;
+  }
+};
+
+template <operation_t OP> struct operation_impl;
+template <> struct operation_impl<operation_t::add> {
+  static fncas_value_type apply(fncas_value_type a, fncas_value_type b) {
+    return a + b;
+  }
+};
+template <> struct operation_impl<operation_t::subtract> {
+  static fncas_value_type apply(fncas_value_type a, fncas_value_type b) {
+    return a - b;
+  }
+};
+template <> struct operation_impl<operation_t::multiply> {
+  static fncas_value_type apply(fncas_value_type a, fncas_value_type b) {
+    return a * b;
+  }
+};
+template <> struct operation_impl<operation_t::divide> {
+  static fncas_value_type apply(fncas_value_type a, fncas_value_type b) {
+    return a / b;
+  }
+};
+
+template <operation_t OP, typename L, typename R> struct operation : expression {
+  L lhs_;
+  R rhs_;
+  operation(const L& lhs, const R& rhs) : lhs_(lhs), rhs_(rhs) {
+  }
+  fncas_value_type eval(const fncas_value_type* p) const {
+    return operation_impl<OP>::apply(lhs_.eval(p), rhs_.eval(p));
+  }
+};
+
+template <function_t F> struct function_impl;
+#define FNCAS_CT_FUNCTION_IMPL(F)                       \
+  template <> struct function_impl<function_t::F> {     \
+    static fncas_value_type apply(fncas_value_type a) { \
+      return std::F(a);                                 \
+    }                                                   \
+  }
+FNCAS_CT_FUNCTION_IMPL(sqrt);
+FNCAS_CT_FUNCTION_IMPL(exp);
+FNCAS_CT_FUNCTION_IMPL(log);
+FNCAS_CT_FUNCTION_IMPL(sin);
+FNCAS_CT_FUNCTION_IMPL(cos);
+FNCAS_CT_FUNCTION_IMPL(tan);
+FNCAS_CT_FUNCTION_IMPL(asin);
+FNCAS_CT_FUNCTION_IMPL(acos);
+FNCAS_CT_FUNCTION_IMPL(atan);
+#undef FNCAS_CT_FUNCTION_IMPL
+
+template <function_t F, typename A> struct function : expression {
+  A argument_;
+  explicit function(const A& argument) : argument_(argument) {
+  }
+  fncas_value_type eval(const fncas_value_type* p) const {
+    return function_impl<F>::apply(argument_.eval(p));
+  }
+};
+
+// fold<OP, L, R> builds `L OP R`, simplified if either side is zero or one.
+template <typename E> struct is_zero : std::is_same<E, zero> {};
+template <typename E> struct is_one : std::is_same<E, one> {};
+
+template <operation_t OP, typename L, typename R> struct no_fold {
+  typedef operation<OP, L, R> type;
+  static type make(const L& lhs, const R& rhs) {
+    return type(lhs, rhs);
+  }
+};
+template <typename L, typename R> struct fold_to_zero {
+  typedef zero type;
+  static type make(const L&, const R&) {
+    return zero();
+  }
+};
+template <typename L, typename R> struct fold_to_lhs {
+  typedef L type;
+  static type make(const L& lhs, const R&) {
+    return lhs;
+  }
+};
+template <typename L, typename R> struct fold_to_rhs {
+  typedef R type;
+  static type make(const L&, const R& rhs) {
+    return rhs;
+  }
+};
+
+template <operation_t OP, typename L, typename R> struct fold : no_fold<OP, L, R> {};
+template <typename L, typename R>
+struct fold<operation_t::add, L, R>
+    : std::conditional<is_zero<L>::value,
+                       fold_to_rhs<L, R>,
+                       typename std::conditional<is_zero<R>::value,
+                                                 fold_to_lhs<L, R>,
+                                                 no_fold<operation_t::add, L, R>>::type>::type {};
+template <typename L, typename R>
+struct fold<operation_t::subtract, L, R>
+    : std::conditional<is_zero<R>::value, fold_to_lhs<L, R>, no_fold<operation_t::subtract, L, R>>::type {};
+template <typename L, typename R>
+struct fold<operation_t::multiply, L, R>
+    : std::conditional<
+          is_zero<L>::value || is_zero<R>::value,
+          fold_to_zero<L, R>,
+          typename std::conditional<
+              is_one<L>::value,
+              fold_to_rhs<L, R>,
+              typename std::conditional<is_one<R>::value, fold_to_lhs<L, R>, no_fold<operation_t::multiply, L, R>>::
+                  type>::type>::type {};
+template <typename L, typename R>
+struct fold<operation_t::divide, L, R>
+    : std::conditional<is_zero<L>::value,
+                       fold_to_zero<L, R>,
+                       typename std::conditional<is_one<R>::value,
+                                                 fold_to_lhs<L, R>,
+                                                 no_fold<operation_t::divide, L, R>>::type>::type {};
+
+template <operation_t OP, typename L, typename R>
+typename fold<OP, L, R>::type make_operation(const L& l, const R& r) {
+  return fold<OP, L, R>::make(l, r);
+}
+
+// Plain numbers mixed into the expressions become constants.
+template <typename T, bool = std::is_arithmetic<T>::value> struct as_expression {
+  typedef T type;
+  static const T& make(const T& e) {
+    return e;
+  }
+};
+template <typename T> struct as_expression<T, true> {
+  typedef constant type;
+  static constant make(T v) {
+    return constant(static_cast<fncas_value_type>(v));
+  }
+};
+
+template <typename L, typename R> struct enable_if_operands {
+  static constexpr bool value = (is_expression<L>::value || is_expression<R>::value) &&
+                                (is_expression<L>::value || std::is_arithmetic<L>::value) &&
+                                (is_expression<R>::value || std::is_arithmetic<R>::value);
+};
+
+#define FNCAS_CT_OPERATION(OP, NAME)                                                                           \
+  template <typename L, typename R>                                                                            \
+  typename std::enable_if<enable_if_operands<L, R>::value,                                                     \
+                          typename fold<operation_t::NAME,                                                     \
+                                        typename as_expression<L>::type,                                       \
+                                        typename as_expression<R>::type>::type>::type                          \
+  operator OP(const L& lhs, const R& rhs) {                                                                    \
+    return make_operation<operation_t::NAME>(as_expression<L>::make(lhs), as_expression<R>::make(rhs));        \
+  }
+FNCAS_CT_OPERATION(+, add);
+FNCAS_CT_OPERATION(-, subtract);
+FNCAS_CT_OPERATION(*, multiply);
+FNCAS_CT_OPERATION(/, divide);
+#undef FNCAS_CT_OPERATION
+
+#define FNCAS_CT_FUNCTION(F)                                                                                   \
+  template <typename A>                                                                                        \
+  typename std::enable_if<is_expression<A>::value, function<function_t::F, A>>::type F(const A& argument) {    \
+    return function<function_t::F, A>(argument);                                                               \
+  }
+FNCAS_CT_FUNCTION(sqrt);
+FNCAS_CT_FUNCTION(exp);
+FNCAS_CT_FUNCTION(log);
+FNCAS_CT_FUNCTION(sin);
+FNCAS_CT_FUNCTION(cos);
+FNCAS_CT_FUNCTION(tan);
+FNCAS_CT_FUNCTION(asin);
+FNCAS_CT_FUNCTION(acos);
+FNCAS_CT_FUNCTION(atan);
+#undef FNCAS_CT_FUNCTION
+
+// chain<OP, A, B, C, ...> builds ((A OP B) OP C) OP ..., the order in which a loop accumulates the terms.
+template <operation_t OP, typename... T> struct chain;
+template <operation_t OP, typename A> struct chain<OP, A> {
+  typedef typename as_expression<A>::type type;
+  static type make(const A& a) {
+    return as_expression<A>::make(a);
+  }
+};
+template <operation_t OP, typename A, typename B, typename... T> struct chain<OP, A, B, T...> {
+  typedef fold<OP, typename as_expression<A>::type, typename as_expression<B>::type> head;
+  typedef chain<OP, typename head::type, T...> tail;
+  typedef typename tail::type type;
+  static type make(const A& a, const B& b, const T&... rest) {
+    return tail::make(head::make(as_expression<A>::make(a), as_expression<B>::make(b)), rest...);
+  }
+};
+
+template <typename... T> typename chain<operation_t::add, T...>::type sum(const T&... terms) {
+  return chain<operation_t::add, T...>::make(terms...);
+}
+template <typename... T> typename chain<operation_t::multiply, T...>::type product(const T&... terms) {
+  return chain<operation_t::multiply, T...>::make(terms...);
+}
+
+// function_derivative<F, A>::make(f) is f'(a) as an expression, given f = F(a).
+// The formulas follow apply_function_derivative(), so that the values match the ones of forward mode.
+template <function_t F, typename A> struct function_derivative;
+template <typename A> struct function_derivative<function_t::sqrt, A> {
+  typedef operation<operation_t::divide, constant, function<function_t::sqrt, A>> type;
+  static type make(const function<function_t::sqrt, A>& f) {
+    return type(constant(0.5), f);
+  }
+};
+template <typename A> struct function_derivative<function_t::exp, A> {
+  typedef function<function_t::exp, A> type;
+  static type make(const function<function_t::exp, A>& f) {
+    return f;
+  }
+};
+template <typename A> struct function_derivative<function_t::log, A> {
+  typedef operation<operation_t::divide, one, A> type;
+  static type make(const function<function_t::log, A>& f) {
+    return type(one(), f.argument_);
+  }
+};
+template <typename A> struct function_derivative<function_t::sin, A> {
+  typedef function<function_t::cos, A> type;
+  static type make(const function<function_t::sin, A>& f) {
+    return type(f.argument_);
+  }
+};
+template <typename A> struct function_derivative<function_t::cos, A> {
+  typedef operation<operation_t::subtract, zero, function<function_t::sin, A>> type;
+  static type make(const function<function_t::cos, A>& f) {
+    return type(zero(), function<function_t::sin, A>(f.argument_));
+  }
+};
+template <typename A> struct function_derivative<function_t::tan, A> {
+  typedef function<function_t::tan, A> tan_type;
+  typedef operation<operation_t::add, one, operation<operation_t::multiply, tan_type, tan_type>> type;
+  static type make(const tan_type& f) {
+    return type(one(), operation<operation_t::multiply, tan_type, tan_type>(f, f));
+  }
+};
+template <typename A> struct function_derivative<function_t::asin, A> {
+  typedef operation<operation_t::subtract, one, operation<operation_t::multiply, A, A>> radicand_type;
+  typedef operation<operation_t::divide, one, function<function_t::sqrt, radicand_type>> type;
+  static type make(const function<function_t::asin, A>& f) {
+    const radicand_type radicand(one(), operation<operation_t::multiply, A, A>(f.argument_, f.argument_));
+    return type(one(), function<function_t::sqrt, radicand_type>(radicand));
+  }
+};
+template <typename A> struct function_derivative<function_t::acos, A> {
+  typedef typename function_derivative<function_t::asin, A>::type asin_type;
+  typedef operation<operation_t::subtract, zero, asin_type> type;
+  static type make(const function<function_t::acos, A>& f) {
+    return type(zero(), function_derivative<function_t::asin, A>::make(function<function_t::asin, A>(f.argument_)));
+  }
+};
+template <typename A> struct function_derivative<function_t::atan, A> {
+  typedef operation<operation_t::add, one, operation<operation_t::multiply, A, A>> denominator_type;
+  typedef operation<operation_t::divide, one, denominator_type> type;
+  static type make(const function<function_t::atan, A>& f) {
+    return type(one(), denominator_type(one(), operation<operation_t::multiply, A, A>(f.argument_, f.argument_)));
+  }
+};
+
+// derivative_impl<J, E> is d(E)/d(x[J]), following the rules of d_op() and d_f().
+template <int J, typename E> struct derivative_impl;
+template <int J, int I> struct derivative_impl<J, x<I>> {
+  typedef typename std::conditional<I == J, one, zero>::type type;
+  static type make(const x<I>&) {
+    return type();
+  }
+};
+template <int J> struct derivative_impl<J, zero> {
+  typedef zero type;
+  static type make(const zero&) {
+    return zero();
+  }
+};
+template <int J> struct derivative_impl<J, one> {
+  typedef zero type;
+  static type make(const one&) {
+    return zero();
+  }
+};
+template <int J> struct derivative_impl<J, constant> {
+  typedef zero type;
+  static type make(const constant&) {
+    return zero();
+  }
+};
+template <int J, typename L, typename R> struct derivative_impl<J, operation<operation_t::add, L, R>> {
+  typedef derivative_impl<J, L> DL;
+  typedef derivative_impl<J, R> DR;
+  typedef fold<operation_t::add, typename DL::type, typename DR::type> result;
+  typedef typename result::type type;
+  static type make(const operation<operation_t::add, L, R>& e) {
+    return result::make(DL::make(e.lhs_), DR::make(e.rhs_));
+  }
+};
+template <int J, typename L, typename R> struct derivative_impl<J, operation<operation_t::subtract, L, R>> {
+  typedef derivative_impl<J, L> DL;
+  typedef derivative_impl<J, R> DR;
+  typedef fold<operation_t::subtract, typename DL::type, typename DR::type> result;
+  typedef typename result::type type;
+  static type make(const operation<operation_t::subtract, L, R>& e) {
+    return result::make(DL::make(e.lhs_), DR::make(e.rhs_));
+  }
+};
+// a * db + b * da.
+template <int J, typename L, typename R> struct derivative_impl<J, operation<operation_t::multiply, L, R>> {
+  typedef derivative_impl<J, L> DL;
+  typedef derivative_impl<J, R> DR;
+  typedef fold<operation_t::multiply, L, typename DR::type> lhs_term;
+  typedef fold<operation_t::multiply, R, typename DL::type> rhs_term;
+  typedef fold<operation_t::add, typename lhs_term::type, typename rhs_term::type> result;
+  typedef typename result::type type;
+  static type make(const operation<operation_t::multiply, L, R>& e) {
+    return result::make(lhs_term::make(e.lhs_, DR::make(e.rhs_)), rhs_term::make(e.rhs_, DL::make(e.lhs_)));
+  }
+};
+// (b * da - a * db) / (b * b).
+template <int J, typename L, typename R> struct derivative_impl<J, operation<operation_t::divide, L, R>> {
+  typedef derivative_impl<J, L> DL;
+  typedef derivative_impl<J, R> DR;
+  typedef fold<operation_t::multiply, R, typename DL::type> lhs_term;
+  typedef fold<operation_t::multiply, L, typename DR::type> rhs_term;
+  typedef fold<operation_t::subtract, typename lhs_term::type, typename rhs_term::type> numerator;
+  typedef operation<operation_t::multiply, R, R> denominator;
+  typedef fold<operation_t::divide, typename numerator::type, denominator> result;
+  typedef typename result::type type;
+  static type make(const operation<operation_t::divide, L, R>& e) {
+    return result::make(
+        numerator::make(lhs_term::make(e.rhs_, DL::make(e.lhs_)), rhs_term::make(e.lhs_, DR::make(e.rhs_))),
+        denominator(e.rhs_, e.rhs_));
+  }
+};
+// da * f'(a).
+template <int J, function_t F, typename A> struct derivative_impl<J, function<F, A>> {
+  typedef derivative_impl<J, A> DA;
+  typedef function_derivative<F, A> FD;
+  typedef fold<operation_t::multiply, typename DA::type, typename FD::type> result;
+  typedef typename result::type type;
+  static type make(const function<F, A>& e) {
+    return result::make(DA::make(e.argument_), FD::make(e));
+  }
+};
+
+template <int J, typename E> typename derivative_impl<J, E>::type derivative(const E& e) {
+  return derivative_impl<J, E>::make(e);
+}
+
+// dim_of<E>::value is the number of the variables the expression depends on, the largest index plus one.
+template <typename E> struct dim_of {
+  static constexpr int value = 0;
+};
+template <typename E> struct dim_of<const E> : dim_of<E> {};
+template <int I> struct dim_of<x<I>> {
+  static constexpr int value = I + 1;
+};
+template <operation_t OP, typename L, typename R> struct dim_of<operation<OP, L, R>> {
+  static constexpr int value = dim_of<L>::value > dim_of<R>::value ? dim_of<L>::value : dim_of<R>::value;
+};
+template <function_t F, typename A> struct dim_of<function<F, A>> {
+  static constexpr int value = dim_of<A>::value;
+};
+
+// gradient_impl<E, J, N>::eval() computes d(E)/d(x[J]) ... d(E)/d(x[N - 1]).
+template <typename E, int J, int N> struct gradient_impl {
+  static void eval(const E& e, const fncas_value_type* p, fncas_value_type* gradient) {
+    gradient[J] = derivative<J>(e).eval(p);
+    gradient_impl<E, J + 1, N>::eval(e, p, gradient);
+  }
+};
+template <typename E, int N> struct gradient_impl<E, N, N> {
+  static void eval(const E&, const fncas_value_type*, fncas_value_type*) {
+  }
+};
+
+// `gradient` should have room for `dim_of<E>::value` values.
+template <typename E> void gradient(const E& e, const fncas_value_type* p, fncas_value_type* gradient) {
+  gradient_impl<E, 0, dim_of<E>::value>::eval(e, p, gradient);
+}
+
+// The compile-time expressions wrapped into the common interfaces of the evaluators. The function may have more
+// variables than the expression depends on, the derivatives by the rest of them are zero.
+template <typename E> struct f_static : fncas::f {
+  const E e_;
+  const int32_t d_;
+  explicit f_static(const E& e, int32_t d = dim_of<E>::value) : e_(e), d_(d) {
+    assert(d_ >= dim_of<E>::value);
+  }
+  virtual fncas_value_type operator()(const std::vector<fncas_value_type>& x) const {
+    assert(static_cast<int32_t>(x.size()) == dim());
+    return e_.eval(&x[0]);
+  }
+  virtual int32_t dim() const {
+    return d_;
+  }
+};
+
+template <typename E> struct g_static : fncas::g {
+  const E e_;
+  const int32_t d_;
+  explicit g_static(const E& e, int32_t d = dim_of<E>::value) : e_(e), d_(d) {
+    assert(d_ >= dim_of<E>::value);
+  }
+  virtual result operator()(const std::vector<fncas_value_type>& x) const {
+    assert(static_cast<int32_t>(x.size()) == dim());
+    result r;
+    r.value = e_.eval(&x[0]);
+    r.gradient.assign(d_, 0.0);
+    gradient(e_, &x[0], &r.gradient[0]);
+    return r;
+  }
+  virtual int32_t dim() const {
+    return d_;
+  }
+};
+
+}  // namespace ct
+}  // namespace fncas
+
+#endif  // #ifndef FNCAS_STATIC_H
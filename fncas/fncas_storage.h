@@ -0,0 +1,432 @@
+// https://github.com/dkorolev/fncas
+
+// Out-of-core storage of the nodes, and the evaluation and the differentiation streaming over them.
+//
+// use_file_backed_storage() moves the chunks of the node pool into a file, created and unlinked right away in the
+// directory given, along with the children of the n-ary nodes and the derivatives found per node, `df_`. Under
+// memory pressure the pages of the file are written back to it rather than to swap, so that a graph larger than RAM
+// degrades to the bandwidth of the disk instead of failing. What is kept per node from then on, the scratch of
+// reorder_nodes() and of the evaluators here included, goes into the file too.
+//
+// The evaluators here never walk the graph depth-first. A streamed_block is the range of the node pool the subgraphs
+// of the roots span, each node following the nodes it depends on, as the nodes are created. f_streamed evaluates
+// the block in one forward pass, and g_streamed computes the gradient with one forward and one backward pass,
+// reverse-mode, creating no derivative nodes. Both read the nodes sequentially, and keep the values and the adjoints
+// per node of the block.
+
+#ifndef FNCAS_STORAGE_H
+#define FNCAS_STORAGE_H
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "fncas_base.h"
+#include "fncas_node.h"
+#include "fncas_differentiate.h"
+#include "fncas_optimize.h"
+
+namespace fncas {
+
+// A chunk_source mapping the chunks from a file. The file is unlinked once created, and is gone once the last
+// chunked_vector using it is. The chunks released are punched out of the file, and their space is reused.
+// Throws file_error if the file can not be created. The file failing to grow, as the disk is full, or a chunk
+// failing to map, is reported as the memory limit exceeded, see memory_limit_exceeded(), before the growth.
+struct file_chunk_source : chunk_source {
+  int fd_;
+  uint64_t size_ = 0;
+  std::map<void*, uint64_t> offsets_;
+  // The offsets of the chunks released, by their length.
+  std::multimap<size_t, uint64_t> released_;
+  // Cleared once the file system turns out not to punch holes, the space of the chunks released is then kept.
+  bool punch_holes_ = true;
+  explicit file_chunk_source(const std::string& directory) {
+    std::string path = directory + "/fncas_storage_XXXXXX";
+    fd_ = mkstemp(&path[0]);
+    if (fd_ < 0) {
+      throw file_error("Can not create the storage file in `" + directory + "`.");
+    }
+    unlink(path.c_str());
+  }
+  ~file_chunk_source() {
+    close(fd_);
+  }
+  // The chunks are mapped at offsets aligned by pages.
+  static size_t mapped_length(size_t bytes) {
+    const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    return (bytes + page - 1) / page * page;
+  }
+  virtual void* allocate_chunk(size_t bytes) {
+    const size_t length = mapped_length(bytes);
+    uint64_t offset;
+    const auto released = released_.find(length);
+    if (released != released_.end()) {
+      offset = released->second;
+      released_.erase(released);
+    } else {
+      offset = size_;
+      // Reserves the blocks, so that a full disk fails here rather than on writing through the mapping.
+      if (posix_fallocate(fd_, static_cast<off_t>(offset), static_cast<off_t>(length))) {
+        memory_limit_exceeded("the storage file can not grow past " + std::to_string(size_) + " bytes");
+      }
+      size_ += length;
+    }
+    void* chunk = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, static_cast<off_t>(offset));
+    if (chunk == MAP_FAILED) {
+      released_.insert(std::make_pair(length, offset));
+      memory_limit_exceeded("can not map " + std::to_string(length) + " more bytes of the storage file");
+    }
+    offsets_[chunk] = offset;
+    return chunk;
+  }
+  virtual void release_chunk(void* chunk, size_t bytes) {
+    const size_t length = mapped_length(bytes);
+    munmap(chunk, length);
+    const uint64_t offset = offsets_.at(chunk);
+    offsets_.erase(chunk);
+    // Frees the disk space, the chunk reads as zeros when reused. Where holes can not be punched, the chunk is
+    // reused all the same: the elements of a chunked_vector are value-initialized as they are appended.
+    if (punch_holes_ && fallocate(fd_,
+                                  FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                                  static_cast<off_t>(offset),
+                                  static_cast<off_t>(length))) {
+      punch_holes_ = false;
+    }
+    released_.insert(std::make_pair(length, offset));
+  }
+};
+
+// Moves the structures kept per node to the `source`, or back to the heap if null.
+inline void set_storage_source(const std::shared_ptr<chunk_source>& source) {
+  internals_impl& internals = internals_singleton();
+  internals.node_vector_.set_source(source);
+  set_source(internals.nary_children_, source);
+  for (node_index_vector& df : internals.df_) {
+    set_source(df, source);
+  }
+}
+
+// Moves the nodes into a file in the `directory`. The nodes keep their indexes, not their addresses.
+inline void use_file_backed_storage(const std::string& directory = "/tmp") {
+  set_storage_source(std::make_shared<file_chunk_source>(directory));
+}
+
+// Moves the nodes back to the heap.
+inline void use_heap_storage() {
+  set_storage_source(nullptr);
+}
+
+// The values or the adjoints of the nodes of a block, indexed by node, allocated the same way as the nodes are.
+template <typename T> struct basic_block_values {
+  node_index_type begin_;
+  chunked_vector<T> values_;
+  basic_block_values(node_index_type begin, node_index_type end) : begin_(begin) {
+    values_.set_source(node_vector_singleton().source());
+    values_.resize(static_cast<size_t>(end - begin));
+  }
+  T& operator[](node_index_type i) {
+    return values_[static_cast<size_t>(i - begin_)];
+  }
+  const T& operator[](node_index_type i) const {
+    return values_[static_cast<size_t>(i - begin_)];
+  }
+};
+
+typedef basic_block_values<fncas_value_type> block_values;
+
+// The subgraphs of the roots, in the block [begin_, end_) of the node pool, each node following the nodes it depends
+// on. Nodes are numbered in the order they are created, which is such an order, so the block is laid out in place:
+// from the first node of the subgraphs to the last root, the nodes of the range outside the subgraphs being skipped.
+// Only once rebalance_nodes() has rewritten some node to depend on a later one are the subgraphs copied into a block
+// at the end of the node pool instead, see reorder_nodes().
+//
+// Each node of the block takes a byte of flags, allocated the same way as the nodes are: whether it is in
+// the subgraphs, and whether it is a row-dependent node of the body of a loop, which only its loop evaluates,
+// row by row.
+//
+// The passes are templated on the values and the adjoints, indexed by node, block_values here. The values are
+// written through the non-const operator[] only for the nodes being computed, and read through the const one.
+// They are kept in the precision `P`, see `precision_traits`, and the adjoints in its accumulator type.
+struct streamed_block {
+  enum : int8_t { reached = 1, row_dependent_node = 2 };
+
+  int32_t dim_;
+  node_index_type begin_;
+  node_index_type end_;
+  std::vector<node_index_type> roots_;
+  // From the last node of the block down, as the subgraphs are found going from their roots.
+  chunked_vector<int8_t> flags_;
+  std::map<node_index_type, loop_program> loops_;
+  uint64_t heap_bytes_ = 0;
+
+  explicit streamed_block(const std::vector<node_index_type>& roots)
+      : dim_(internals_singleton().dim_), roots_(roots) {
+    flags_.set_source(node_vector_singleton().source());
+    if (!lay_out_in_place()) {
+      const size_t children = internals_singleton().nary_children_.size();
+      begin_ = node_vector_singleton().size();
+      roots_ = reorder_nodes(roots, node_order::evaluation);
+      end_ = node_vector_singleton().size();
+      flags_.clear();
+      flags_.resize(static_cast<size_t>(end_ - begin_), reached);
+      if (!node_vector_singleton().source()) {
+        // The copy, and the scratch of reorder_nodes(): at most an index per node of the pool and per node copied.
+        heap_bytes_ += static_cast<uint64_t>(end_ - begin_) * sizeof(node_impl) +
+                       (internals_singleton().nary_children_.size() - children) * sizeof(node_index_type) +
+                       static_cast<uint64_t>(end_) * sizeof(node_index_type);
+      }
+    }
+    if (!flags_.source()) {
+      heap_bytes_ += flags_.capacity() * sizeof(int8_t);
+    }
+    for (node_index_type i = begin_; i < end_; ++i) {
+      if (!(flag(i) & reached)) {
+        continue;
+      }
+      const node_impl& f = node_vector_singleton()[i];
+      bool dependent = f.type() == type_t::row_element;
+      for_each_child(f, [this, &dependent](node_index_type c) { dependent = dependent || row_dependent(c); });
+      if (dependent) {
+        flag(i) |= row_dependent_node;
+      }
+      if (f.type() == type_t::loop) {
+        loops_.insert(std::make_pair(i, loop_program(f)));
+      }
+    }
+    // The loop nodes do not depend on the rows of their bodies, so a root does only through a row element
+    // outside of any loop.
+    for (node_index_type root : roots_) {
+      if (row_dependent(root)) {
+        row_element_outside_loop();
+      }
+    }
+  }
+  bool row_dependent(node_index_type i) const {
+    return flag(i) & row_dependent_node;
+  }
+  // Whether the passes compute the node: it is in the subgraphs, and it is not row-dependent.
+  bool streamed(node_index_type i) const {
+    return flag(i) == reached;
+  }
+  // The bytes held on the heap per node to stream over the block: the flags, and, if the subgraphs were copied,
+  // the copy, which stays, along with the scratch of the layout at the time. None if the nodes are in a file.
+  uint64_t heap_bytes() const {
+    return heap_bytes_;
+  }
+
+  // The forward pass over the nodes [begin, end), computes the values of all of them but the row-dependent ones,
+  // given the values of the nodes before `begin` they depend on.
+  template <typename P = fncas_value_type, typename VALUES>
+  void forward(const std::vector<fncas_value_type>& x, VALUES& V, node_index_type begin, node_index_type end) const {
+    typedef typename precision_traits<P>::value_type T;
+    assert(static_cast<int32_t>(x.size()) == dim_);
+    const VALUES& values = V;
+    for (node_index_type i = begin; i < end; ++i) {
+      if (!streamed(i)) {
+        continue;
+      }
+      const node_impl& f = node_vector_singleton()[i];
+      if (f.type() == type_t::variable) {
+        V[i] = static_cast<T>(x[f.variable()]);
+      } else if (f.type() == type_t::value) {
+        V[i] = static_cast<T>(f.value());
+      } else if (f.type() == type_t::loop) {
+        // Same order of the summation as eval_loop().
+        const loop_program& program = loops_.at(i);
+        const table_impl& t = internals_singleton().tables_[f.table()];
+        typename precision_traits<P>::accumulator_type sum = 0.0;
+        for (int64_t r = 0; r < t.rows; ++r) {
+          eval_row<P>(program, t.data + r * t.cols, V);
+          sum += values[f.body_index()];
+        }
+        V[i] = static_cast<T>(sum);
+      } else {
+        const T value = eval_row_node<P>(f, nullptr, values);
+        V[i] = value;
+      }
+    }
+  }
+  template <typename P = fncas_value_type>
+  void forward(const std::vector<fncas_value_type>& x,
+               basic_block_values<typename precision_traits<P>::value_type>& V) const {
+    forward<P>(x, V, begin_, end_);
+  }
+
+  // The backward pass over the nodes [begin, end), from the last one to the first one, given the forward pass
+  // and the adjoints of these nodes accumulated from the nodes after `end`. Propagates the adjoints to the nodes
+  // these ones depend on, and adds the adjoints of the variables to `gradient`.
+  template <typename P = fncas_value_type, typename VALUES, typename ADJOINTS>
+  void backward(VALUES& V,
+                ADJOINTS& A,
+                std::vector<fncas_value_type>& gradient,
+                node_index_type begin,
+                node_index_type end) const {
+    const VALUES& values = V;
+    for (node_index_type i = end - 1; i >= begin; --i) {
+      if (!streamed(i)) {
+        continue;
+      }
+      const node_impl& f = node_vector_singleton()[i];
+      const fncas_value_type adjoint = A[i];
+      if (f.type() == type_t::variable) {
+        gradient[f.variable()] += adjoint;
+      } else if (f.type() == type_t::loop) {
+        backpropagate_loop<P>(f, loops_.at(i), adjoint, V, A);
+      } else if (f.type() != type_t::value) {
+        backpropagate_node(f, values[i], adjoint, values, A);
+      }
+    }
+  }
+  // The backward pass from the `root`, given the forward pass over the whole block.
+  template <typename P = fncas_value_type>
+  void backward(node_index_type root,
+                basic_block_values<typename precision_traits<P>::value_type>& V,
+                basic_block_values<typename precision_traits<P>::accumulator_type>& A,
+                std::vector<fncas_value_type>& gradient) const {
+    for (node_index_type i = begin_; i < end_; ++i) {
+      A[i] = 0.0;
+    }
+    A[root] = 1.0;
+    backward<P>(V, A, gradient, begin_, root + 1);
+  }
+
+ private:
+  int8_t& flag(node_index_type i) {
+    return flags_[static_cast<size_t>(end_ - 1 - i)];
+  }
+  int8_t flag(node_index_type i) const {
+    return flags_[static_cast<size_t>(end_ - 1 - i)];
+  }
+
+  // Flags the nodes of the subgraphs going from the last root down, each node being reached before the nodes
+  // it depends on. Returns false as soon as a node depends on a node after it.
+  bool lay_out_in_place() {
+    end_ = *std::max_element(roots_.begin(), roots_.end()) + 1;
+    begin_ = end_;
+    const auto reach = [this](node_index_type i) {
+      const size_t k = static_cast<size_t>(end_ - 1 - i);
+      if (k >= flags_.size()) {
+        flags_.resize(k + 1);
+      }
+      flags_[k] = reached;
+      begin_ = std::min(begin_, i);
+    };
+    for (node_index_type root : roots_) {
+      reach(root);
+    }
+    for (node_index_type i = end_ - 1; i >= begin_; --i) {
+      if (flag(i) & reached) {
+        bool ordered = true;
+        for_each_dependency(node_vector_singleton()[i], [i, &ordered, &reach](node_index_type c) {
+          if (c < i) {
+            reach(c);
+          } else {
+            ordered = false;
+          }
+        });
+        if (!ordered) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  template <typename P, typename VALUES>
+  void eval_row(const loop_program& program, const fncas_value_type* row, VALUES& V) const {
+    typedef typename precision_traits<P>::value_type T;
+    const VALUES& values = V;
+    for (node_index_type v : program.variant_) {
+      const T value = eval_row_node<P>(node_vector_singleton()[v], row, values);
+      V[v] = value;
+    }
+  }
+
+  // The adjoint of the sum over the rows flows to the body on each row, and, through the row-dependent nodes
+  // evaluated again for the row, to the row-invariant ones.
+  template <typename P, typename VALUES, typename ADJOINTS>
+  void backpropagate_loop(
+      const node_impl& f, const loop_program& program, fncas_value_type adjoint, VALUES& V, ADJOINTS& A) const {
+    if (adjoint == 0.0) {
+      return;
+    }
+    const table_impl& t = internals_singleton().tables_[f.table()];
+    const node_index_type body = f.body_index();
+    if (program.variant_.empty()) {
+      A[body] += adjoint * static_cast<fncas_value_type>(t.rows);
+      return;
+    }
+    const VALUES& values = V;
+    for (int64_t r = 0; r < t.rows; ++r) {
+      eval_row<P>(program, t.data + r * t.cols, V);
+      for (node_index_type v : program.variant_) {
+        A[v] = 0.0;
+      }
+      A[body] = adjoint;
+      for (auto v = program.variant_.rbegin(); v != program.variant_.rend(); ++v) {
+        const node_impl& variant = node_vector_singleton()[*v];
+        if (variant.type() != type_t::row_element) {
+          backpropagate_node(variant, values[*v], A[*v], values, A);
+        }
+      }
+    }
+  }
+};
+
+// Evaluates the function streaming over the block of its nodes, in the precision `P`.
+template <typename P = fncas_value_type> struct basic_f_streamed : f {
+  const streamed_block block_;
+  mutable basic_block_values<typename precision_traits<P>::value_type> values_;
+  explicit basic_f_streamed(const node& f)
+      : block_(std::vector<node_index_type>(1, f.index())), values_(block_.begin_, block_.end_) {
+  }
+  explicit basic_f_streamed(const f_intermediate& f) : basic_f_streamed(f.f_) {
+  }
+  virtual fncas_value_type operator()(const std::vector<fncas_value_type>& x) const {
+    block_.forward<P>(x, values_);
+    return values_[block_.roots_.front()];
+  }
+  virtual int32_t dim() const {
+    return block_.dim_;
+  }
+};
+
+typedef basic_f_streamed<> f_streamed;
+
+// The gradient by reverse-mode differentiation, streaming over the block of the nodes of the function
+// forward, then backward. Matches the other gradients up to the rounding of the order of the summation.
+// The values are kept in the precision `P`, the adjoints in its accumulator type.
+template <typename P = fncas_value_type> struct basic_g_streamed : g {
+  const streamed_block block_;
+  mutable basic_block_values<typename precision_traits<P>::value_type> values_;
+  mutable basic_block_values<typename precision_traits<P>::accumulator_type> adjoints_;
+  basic_g_streamed(const x& x_ref, const node& f)
+      : block_(std::vector<node_index_type>(1, f.index())),
+        values_(block_.begin_, block_.end_),
+        adjoints_(block_.begin_, block_.end_) {
+    assert(&x_ref == internals_singleton().x_ptr_);
+  }
+  virtual result operator()(const std::vector<fncas_value_type>& x) const {
+    block_.forward<P>(x, values_);
+    result r;
+    r.value = values_[block_.roots_.front()];
+    r.gradient.assign(dim(), 0.0);
+    block_.backward<P>(block_.roots_.front(), values_, adjoints_, r.gradient);
+    return r;
+  }
+  virtual int32_t dim() const {
+    return block_.dim_;
+  }
+};
+
+typedef basic_g_streamed<> g_streamed;
+
+}  // namespace fncas
+
+#endif  // #ifndef FNCAS_STORAGE_H
@@ -0,0 +1,232 @@
+// https://github.com/dkorolev/fncas
+
+// Streaming evaluation of a function, and optionally of its gradient, over large sets of points stored on disk.
+// Requires -pthread.
+//
+// A matrix file is the plain array of its values, native-endian, with no header, either row- or column-major.
+// The points are the rows of the input matrix, the results are the rows of the output matrix: the value of
+// the function, followed by its derivatives if the gradient is requested. Both matrices are memory-mapped.
+// The rows are split into chunks the threads of a pool take in turn, each thread with the value array of its own,
+// so nothing is allocated per row, and the rows of a row-major input are evaluated in place, with no copying.
+
+#ifndef FNCAS_STREAM_H
+#define FNCAS_STREAM_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fncas_base.h"
+#include "fncas_node.h"
+#include "fncas_tape.h"
+#include "fncas_parallel.h"
+
+namespace fncas {
+
+enum class matrix_layout : int8_t { row_major = 0, column_major = 1 };
+
+// The tag of the mapped_matrix constructor creating the file.
+struct create_matrix {};
+
+// A matrix of values mapped from a file. Maps an existing file read-only, with the number of rows deduced
+// from its size, or creates the file of the given size and maps it for writing.
+// Throws file_error if the file can not be opened, created or mapped, or is not of a whole number of rows.
+struct mapped_matrix : noncopyable {
+  int fd_;
+  void* data_;
+  size_t length_;
+  int64_t rows_;
+  int64_t cols_;
+  matrix_layout layout_;
+  mapped_matrix(const std::string& filename, int64_t cols, matrix_layout layout = matrix_layout::row_major)
+      : cols_(cols), layout_(layout) {
+    assert(cols > 0);
+    fd_ = open(filename.c_str(), O_RDONLY);
+    if (fd_ < 0) {
+      throw file_error("Can not open the matrix file `" + filename + "`.");
+    }
+    struct stat st;
+    if (fstat(fd_, &st)) {
+      close(fd_);
+      throw file_error("Can not read the matrix file `" + filename + "`.");
+    }
+    length_ = static_cast<size_t>(st.st_size);
+    if (length_ % (cols * sizeof(fncas_value_type))) {
+      close(fd_);
+      throw file_error("The matrix file `" + filename + "` is not of a whole number of rows of " +
+                       std::to_string(cols) + " values.");
+    }
+    rows_ = static_cast<int64_t>(length_ / (cols * sizeof(fncas_value_type)));
+    map(filename, PROT_READ);
+  }
+  mapped_matrix(create_matrix,
+                const std::string& filename,
+                int64_t rows,
+                int64_t cols,
+                matrix_layout layout = matrix_layout::row_major)
+      : length_(static_cast<size_t>(rows * cols) * sizeof(fncas_value_type)),
+        rows_(rows),
+        cols_(cols),
+        layout_(layout) {
+    assert(rows >= 0 && cols > 0);
+    fd_ = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0) {
+      throw file_error("Can not create the matrix file `" + filename + "`.");
+    }
+    if (ftruncate(fd_, static_cast<off_t>(length_))) {
+      close(fd_);
+      throw file_error("Can not resize the matrix file `" + filename + "`.");
+    }
+    map(filename, PROT_READ | PROT_WRITE);
+  }
+  ~mapped_matrix() {
+    if (length_) {
+      munmap(data_, length_);
+    }
+    close(fd_);
+  }
+  size_t bytes() const {
+    return length_;
+  }
+  const fncas_value_type* data() const {
+    return static_cast<const fncas_value_type*>(data_);
+  }
+  fncas_value_type* data() {
+    return static_cast<fncas_value_type*>(data_);
+  }
+  // The distance between the consecutive rows, and between the consecutive values of one row.
+  int64_t row_stride() const {
+    return layout_ == matrix_layout::row_major ? cols_ : 1;
+  }
+  int64_t column_stride() const {
+    return layout_ == matrix_layout::row_major ? 1 : rows_;
+  }
+  fncas_value_type operator()(int64_t row, int64_t col) const {
+    assert(row >= 0 && row < rows_ && col >= 0 && col < cols_);
+    return data()[row * row_stride() + col * column_stride()];
+  }
+  fncas_value_type& operator()(int64_t row, int64_t col) {
+    assert(row >= 0 && row < rows_ && col >= 0 && col < cols_);
+    return data()[row * row_stride() + col * column_stride()];
+  }
+
+ private:
+  void map(const std::string& filename, int protection) {
+    if (length_) {
+      data_ = mmap(nullptr, length_, protection, MAP_SHARED, fd_, 0);
+      if (data_ == MAP_FAILED) {
+        close(fd_);
+        throw file_error("Can not map the matrix file `" + filename + "`.");
+      }
+      // The rows are read front to back, let the kernel read ahead.
+      madvise(data_, length_, MADV_SEQUENTIAL);
+    } else {
+      data_ = nullptr;
+    }
+  }
+};
+
+// The throughput of one streaming evaluation.
+struct stream_stats {
+  int64_t rows = 0;
+  // Read from the input and written to the output.
+  uint64_t bytes = 0;
+  double seconds = 0.0;
+  double rows_per_second() const {
+    return seconds > 0 ? rows / seconds : 0.0;
+  }
+  double gigabytes_per_second() const {
+    return seconds > 0 ? bytes * 1e-9 / seconds : 0.0;
+  }
+};
+
+// Evaluates the tape of the function, or of the function and its derivatives, for each row of the input.
+struct f_stream : noncopyable {
+  enum { DEFAULT_CHUNK_ROWS = 1024 };
+  const tape tape_;
+  const int64_t chunk_rows_;
+  mutable thread_pool pool_;
+  // The value array, and the point gathered from a column-major input, of each thread.
+  mutable std::vector<std::vector<fncas_value_type>> values_;
+  mutable std::vector<std::vector<fncas_value_type>> x_;
+  f_stream(const std::vector<node_index_type>& roots,
+           size_t threads = std::thread::hardware_concurrency(),
+           int64_t chunk_rows = DEFAULT_CHUNK_ROWS)
+      : tape_(roots), chunk_rows_(std::max(chunk_rows, static_cast<int64_t>(1))), pool_(threads) {
+    for (size_t t = 0; t < pool_.size(); ++t) {
+      values_.emplace_back(tape_.size());
+      x_.emplace_back(tape_.dim_);
+    }
+  }
+  // The value of the function only.
+  explicit f_stream(const node& f,
+                    size_t threads = std::thread::hardware_concurrency(),
+                    int64_t chunk_rows = DEFAULT_CHUNK_ROWS)
+      : f_stream(std::vector<node_index_type>(1, f.index()), threads, chunk_rows) {
+  }
+  // The value of the function followed by its gradient.
+  f_stream(const x& x_ref,
+           const node& f,
+           size_t threads = std::thread::hardware_concurrency(),
+           int64_t chunk_rows = DEFAULT_CHUNK_ROWS)
+      : f_stream(basic_g_tape<>::roots(x_ref, f), threads, chunk_rows) {
+  }
+  int32_t dim() const {
+    return tape_.dim_;
+  }
+  // The number of the columns of the output.
+  size_t size() const {
+    return tape_.roots_.size();
+  }
+  stream_stats operator()(const mapped_matrix& input, mapped_matrix& output) const {
+    assert(input.cols_ == dim());
+    assert(output.rows_ == input.rows_ && output.cols_ == static_cast<int64_t>(size()));
+    const auto begin = std::chrono::steady_clock::now();
+    const int64_t rows = input.rows_;
+    const int64_t chunks = (rows + chunk_rows_ - 1) / chunk_rows_;
+    std::atomic<int64_t> next(0);
+    const std::function<void(size_t)> task = [this, &input, &output, &next, rows, chunks](size_t t) {
+      fncas_value_type* values = values_[t].data();
+      fncas_value_type* x = x_[t].data();
+      const int64_t x_stride = input.column_stride();
+      const int64_t result_stride = output.column_stride();
+      for (int64_t c = next++; c < chunks; c = next++) {
+        const int64_t end = std::min(rows, (c + 1) * chunk_rows_);
+        for (int64_t r = c * chunk_rows_; r < end; ++r) {
+          const fncas_value_type* point = input.data() + r * input.row_stride();
+          if (x_stride != 1) {
+            for (int32_t i = 0; i < tape_.dim_; ++i) {
+              x[i] = point[i * x_stride];
+            }
+            point = x;
+          }
+          tape_.eval(point, values);
+          fncas_value_type* result = output.data() + r * output.row_stride();
+          for (size_t j = 0; j < tape_.roots_.size(); ++j) {
+            result[j * result_stride] = values[tape_.roots_[j]];
+          }
+        }
+      }
+    };
+    pool_.run(std::min(pool_.size(), static_cast<size_t>(chunks)), task);
+    stream_stats stats;
+    stats.rows = rows;
+    stats.bytes = input.bytes() + output.bytes();
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    return stats;
+  }
+};
+
+}  // namespace fncas
+
+#endif  // #ifndef FNCAS_STREAM_H
@@ -0,0 +1,551 @@
+// https://github.com/dkorolev/fncas
+
+// Defines the tape: a self-contained copy of a subgraph with its nodes in evaluation order.
+
+#ifndef FNCAS_TAPE_H
+#define FNCAS_TAPE_H
+
+#include <algorithm>
+#include <map>
+#include <stack>
+#include <vector>
+
+#include "fncas_base.h"
+#include "fncas_node.h"
+#include "fncas_differentiate.h"
+#include "fncas_math.h"
+
+namespace fncas {
+
+// The order of the nodes on the tape.
+// * depth_first: the post-order of the depth-first traversal from the roots, same as the one of eval_node().
+// * levels: grouped by dependency levels, the nodes of each level only depend on the nodes of previous levels.
+//   The nodes within one level are independent and can be evaluated in parallel.
+enum class tape_order : int8_t { depth_first = 0, levels = 1 };
+
+// The row-dependent block of a loop node on a tape. On a tape, `body_index()` of a loop node is its block index.
+struct tape_loop {
+  node_index_type body;
+  node_index_type begin;
+  node_index_type end;
+};
+
+// A read-only view of the arrays of a tape, which can be owned by a `tape`, or mapped from a file,
+// see fncas_serialize.h. Evaluation only needs the view.
+struct tape_view {
+  int32_t dim_;
+  const node_impl* nodes_;
+  size_t size_;
+  size_t main_size_;
+  const node_index_type* children_;
+  const tape_loop* loops_;
+  const node_index_type* roots_;
+  size_t roots_count_;
+  const size_t* level_begin_;
+  size_t level_begin_count_;
+
+  size_t size() const {
+    return size_;
+  }
+
+  // Evaluates the nodes [begin, end) of the tape, given the nodes before `begin` have already been evaluated.
+  // The values are kept in the precision `P`, see `precision_traits`, double by default. Constants, data tables
+  // and math functions are evaluated in double and rounded to the precision, the same as the generated C code does.
+  template <typename P = fncas_value_type>
+  void eval(const typename precision_traits<P>::value_type* x,
+            typename precision_traits<P>::value_type* values,
+            size_t begin,
+            size_t end) const {
+    typedef typename precision_traits<P>::value_type T;
+    typedef typename precision_traits<P>::accumulator_type A;
+    for (size_t t = begin; t < end; ++t) {
+      const node_impl& f = nodes_[t];
+      if (f.type() == type_t::variable) {
+        assert(f.variable() >= 0 && f.variable() < dim_);
+        values[t] = x[f.variable()];
+      } else if (f.type() == type_t::value) {
+        values[t] = static_cast<T>(f.value());
+      } else if (f.type() == type_t::loop) {
+        const tape_loop& block = loops_[f.body_index()];
+        const table_impl& table = internals_singleton().tables_[f.table()];
+        A sum = 0.0;
+        for (int64_t r = 0; r < table.rows; ++r) {
+          const fncas_value_type* row = table.data + r * table.cols;
+          for (node_index_type v = block.begin; v < block.end; ++v) {
+            values[v] = eval_computed<P>(nodes_[v], values, row);
+          }
+          sum += values[block.body];
+        }
+        values[t] = static_cast<T>(sum);
+      } else {
+        values[t] = eval_computed<P>(f, values, nullptr);
+      }
+    }
+  }
+  template <typename P = fncas_value_type>
+  void eval(const typename precision_traits<P>::value_type* x,
+            typename precision_traits<P>::value_type* values) const {
+    eval<P>(x, values, 0, main_size_);
+  }
+
+  // Evaluates the tape for `n` inputs at once, each node being a loop over the inputs the compiler vectorizes.
+  // The arrays are laid out input by input within each variable and node: x[i * n + k] is the variable `i`
+  // of the input `k`, and values[t * n + k] is the value of the node `t` for it. The math functions are
+  // the kernels of fncas_math.h, a few ULPs off libm, the rest is computed in the same order as eval() does.
+  template <typename P = fncas_value_type>
+  void eval_batch(const typename precision_traits<P>::value_type* x,
+                  typename precision_traits<P>::value_type* values,
+                  size_t n) const {
+    typedef typename precision_traits<P>::value_type T;
+    typedef typename precision_traits<P>::accumulator_type A;
+    for (size_t t = 0; t < main_size_; ++t) {
+      const node_impl& f = nodes_[t];
+      T* output = values + t * n;
+      if (f.type() == type_t::variable) {
+        assert(f.variable() >= 0 && f.variable() < dim_);
+        std::copy(x + f.variable() * n, x + (f.variable() + 1) * n, output);
+      } else if (f.type() == type_t::value) {
+        std::fill(output, output + n, static_cast<T>(f.value()));
+      } else if (f.type() == type_t::loop) {
+        const tape_loop& block = loops_[f.body_index()];
+        const table_impl& table = internals_singleton().tables_[f.table()];
+        std::vector<A> sum(n, A(0));
+        for (int64_t r = 0; r < table.rows; ++r) {
+          const fncas_value_type* row = table.data + r * table.cols;
+          for (node_index_type v = block.begin; v < block.end; ++v) {
+            eval_computed_batch<P>(nodes_[v], values, row, n, values + v * n);
+          }
+          const T* body = values + block.body * n;
+          for (size_t k = 0; k < n; ++k) {
+            sum[k] += body[k];
+          }
+        }
+        for (size_t k = 0; k < n; ++k) {
+          output[k] = static_cast<T>(sum[k]);
+        }
+      } else {
+        eval_computed_batch<P>(f, values, nullptr, n, output);
+      }
+    }
+  }
+
+ private:
+  // The inputs of an n-ary node are accumulated this many at a time, to keep the accumulators on the stack.
+  enum { BATCH_BLOCK = 64 };
+
+  template <typename T> static void apply_operation_batch(operation_t op, const T* a, const T* b, T* c, size_t n) {
+    if (op == operation_t::add) {
+      for (size_t k = 0; k < n; ++k) {
+        c[k] = a[k] + b[k];
+      }
+    } else if (op == operation_t::subtract) {
+      for (size_t k = 0; k < n; ++k) {
+        c[k] = a[k] - b[k];
+      }
+    } else if (op == operation_t::multiply) {
+      for (size_t k = 0; k < n; ++k) {
+        c[k] = a[k] * b[k];
+      }
+    } else if (op == operation_t::divide) {
+      for (size_t k = 0; k < n; ++k) {
+        c[k] = a[k] / b[k];
+      }
+    } else if (op == operation_t::pow) {
+      for (size_t k = 0; k < n; ++k) {
+        c[k] = static_cast<T>(std::pow(static_cast<double>(a[k]), static_cast<double>(b[k])));
+      }
+    } else if (op == operation_t::powi) {
+      // The exponent is a value node, the same for all the inputs.
+      const int32_t exponent = n ? static_cast<int32_t>(b[0]) : 0;
+      for (size_t k = 0; k < n; ++k) {
+        c[k] = integer_power<T>(a[k], exponent);
+      }
+    } else if (op == operation_t::min) {
+      for (size_t k = 0; k < n; ++k) {
+        c[k] = static_cast<T>(std::fmin(static_cast<double>(a[k]), static_cast<double>(b[k])));
+      }
+    } else if (op == operation_t::max) {
+      for (size_t k = 0; k < n; ++k) {
+        c[k] = static_cast<T>(std::fmax(static_cast<double>(a[k]), static_cast<double>(b[k])));
+      }
+    } else {
+      assert(false);
+    }
+  }
+
+  // eval_computed() for `n` inputs, into `output`.
+  template <typename P>
+  void eval_computed_batch(const node_impl& f,
+                           typename precision_traits<P>::value_type* values,
+                           const fncas_value_type* row,
+                           size_t n,
+                           typename precision_traits<P>::value_type* output) const {
+    typedef typename precision_traits<P>::value_type T;
+    typedef typename precision_traits<P>::accumulator_type A;
+    if (f.type() == type_t::operation) {
+      apply_operation_batch<T>(f.operation(), values + f.lhs_index() * n, values + f.rhs_index() * n, output, n);
+    } else if (f.type() == type_t::function) {
+      apply_math_kernel<T>(f.function(), values + f.argument_index() * n, output, n);
+    } else if (f.type() == type_t::nary && f.operation() == operation_t::fma) {
+      const node_index_type* children = &children_[f.children_begin()];
+      const T* a = values + children[0] * n;
+      const T* b = values + children[1] * n;
+      const T* c = values + children[2] * n;
+      for (size_t k = 0; k < n; ++k) {
+        output[k] = static_cast<T>(
+            std::fma(static_cast<double>(a[k]), static_cast<double>(b[k]), static_cast<double>(c[k])));
+      }
+    } else if (f.type() == type_t::nary) {
+      // The same accumulators, combined in the same order, as apply_nary_operation() uses.
+      const node_index_type* children = &children_[f.children_begin()];
+      const size_t count = f.children_count();
+      const size_t m = std::min(count, static_cast<size_t>(NARY_ACCUMULATORS));
+      A accumulator[NARY_ACCUMULATORS][BATCH_BLOCK];
+      for (size_t begin = 0; begin < n; begin += BATCH_BLOCK) {
+        const size_t block = std::min(n - begin, static_cast<size_t>(BATCH_BLOCK));
+        for (size_t j = 0; j < m; ++j) {
+          const T* child = values + children[j] * n + begin;
+          std::copy(child, child + block, accumulator[j]);
+        }
+        for (size_t j = m; j < count; ++j) {
+          const T* child = values + children[j] * n + begin;
+          A* a = accumulator[j % m];
+          if (f.operation() == operation_t::add) {
+            for (size_t k = 0; k < block; ++k) {
+              a[k] += child[k];
+            }
+          } else {
+            for (size_t k = 0; k < block; ++k) {
+              a[k] *= child[k];
+            }
+          }
+        }
+        if (m >= 2) {
+          apply_operation_batch<A>(f.operation(), accumulator[0], accumulator[1], accumulator[0], block);
+        }
+        if (m == 4) {
+          apply_operation_batch<A>(f.operation(), accumulator[2], accumulator[3], accumulator[2], block);
+        }
+        if (m >= 3) {
+          apply_operation_batch<A>(f.operation(), accumulator[0], accumulator[2], accumulator[0], block);
+        }
+        for (size_t k = 0; k < block; ++k) {
+          output[begin + k] = static_cast<T>(accumulator[0][k]);
+        }
+      }
+    } else if (f.type() == type_t::row_element) {
+      assert(row);
+      std::fill(output, output + n, static_cast<T>(row[f.column()]));
+    } else {
+      assert(false);
+    }
+  }
+
+  // The value of an operation, function, n-ary or row element node, given the values of its children.
+  template <typename P>
+  typename precision_traits<P>::value_type eval_computed(const node_impl& f,
+                                                         const typename precision_traits<P>::value_type* values,
+                                                         const fncas_value_type* row) const {
+    typedef typename precision_traits<P>::value_type T;
+    typedef typename precision_traits<P>::accumulator_type A;
+    if (f.type() == type_t::operation) {
+      return apply_operation<T>(f.operation(), values[f.lhs_index()], values[f.rhs_index()]);
+    } else if (f.type() == type_t::function) {
+      return static_cast<T>(apply_function<fncas_value_type>(f.function(), values[f.argument_index()]));
+    } else if (f.type() == type_t::nary) {
+      const node_index_type* children = &children_[f.children_begin()];
+      return static_cast<T>(apply_nary_operation<A>(
+          f.operation(), f.children_count(), [values, children](size_t j) { return A(values[children[j]]); }));
+    } else if (f.type() == type_t::row_element) {
+      assert(row);
+      return static_cast<T>(row[f.column()]);
+    } else {
+      assert(false);
+      return std::numeric_limits<T>::quiet_NaN();
+    }
+  }
+};
+
+// A tape is a copy of the subgraph reachable from the roots, with the nodes renumbered so that each node only
+// refers to the nodes preceding it. Evaluating a tape is a single forward pass over a plain array of values.
+// It needs neither the stack nor the singleton value cache, so it is thread-safe given separate value arrays.
+// The row-dependent nodes of the body of each loop, see `loop_program`, are kept past the first `main_size_` nodes,
+// in a block of their own per loop node, and are only evaluated by the loop node, once per row.
+struct tape {
+  int32_t dim_;
+  std::vector<node_impl> nodes_;
+  size_t main_size_;
+  // The children of n-ary nodes, as tape indexes.
+  std::vector<node_index_type> children_;
+  std::vector<tape_loop> loops_;
+  // The tape indexes of the roots.
+  std::vector<node_index_type> roots_;
+  // For tape_order::levels, level `l` is nodes_[level_begin_[l] ... level_begin_[l + 1] - 1].
+  std::vector<size_t> level_begin_;
+
+  tape() : dim_(0), main_size_(0) {
+  }
+  explicit tape(const std::vector<node_index_type>& roots, tape_order order = tape_order::depth_first)
+      : dim_(internals_singleton().dim_) {
+    assert(!roots.empty());
+    // The global indexes of the nodes in tape order, and the reverse mapping, -1 for the nodes not on the tape.
+    std::vector<node_index_type> global;
+    std::vector<node_index_type> local;
+    std::map<node_index_type, loop_program> programs;
+    std::stack<node_index_type> stack;
+    for (node_index_type root : roots) {
+      stack.push(root);
+      while (!stack.empty()) {
+        const node_index_type i = stack.top();
+        stack.pop();
+        const node_index_type dependent_i = ~i;
+        if (i > dependent_i) {
+          if (growing_vector_access(local, i, static_cast<node_index_type>(-1)) == -1) {
+            const node_impl& f = node_vector_singleton()[i];
+            if (f.type() == type_t::row_element) {
+              row_element_outside_loop();
+            }
+            if (f.type() == type_t::variable || f.type() == type_t::value) {
+              local[i] = global.size();
+              global.push_back(i);
+            } else {
+              if (f.type() == type_t::loop && !programs.count(i)) {
+                programs.emplace(i, loop_program(f));
+              }
+              stack.push(~i);
+              for_each_dependency(i, programs, [&stack](node_index_type c) { stack.push(c); });
+            }
+          }
+        } else if (local[dependent_i] == -1) {
+          local[dependent_i] = global.size();
+          global.push_back(dependent_i);
+        }
+      }
+    }
+    if (order == tape_order::levels) {
+      // Stable counting sort of the nodes by their dependency level.
+      std::vector<size_t> level(global.size());
+      size_t levels = 0;
+      for (size_t t = 0; t < global.size(); ++t) {
+        size_t l = 0;
+        for_each_dependency(global[t], programs, [&l, &level, &local](node_index_type c) {
+          l = std::max(l, level[local[c]] + 1);
+        });
+        level[t] = l;
+        levels = std::max(levels, l + 1);
+      }
+      level_begin_.assign(levels + 1, 0);
+      for (size_t t = 0; t < global.size(); ++t) {
+        ++level_begin_[level[t] + 1];
+      }
+      for (size_t l = 0; l < levels; ++l) {
+        level_begin_[l + 1] += level_begin_[l];
+      }
+      std::vector<size_t> position(level_begin_.begin(), level_begin_.end() - 1);
+      std::vector<node_index_type> sorted(global.size());
+      for (size_t t = 0; t < global.size(); ++t) {
+        sorted[position[level[t]]++] = global[t];
+      }
+      global.swap(sorted);
+      for (size_t t = 0; t < global.size(); ++t) {
+        local[global[t]] = t;
+      }
+    }
+    main_size_ = global.size();
+    nodes_.resize(main_size_);
+    for (size_t t = 0; t < main_size_; ++t) {
+      node_impl f = node_vector_singleton()[global[t]];
+      if (f.type() == type_t::loop) {
+        // Each loop gets a copy of its row-dependent nodes, so that the loops can run in parallel.
+        const loop_program& program = programs.at(global[t]);
+        std::map<node_index_type, node_index_type> row_local;
+        const auto map = [&row_local, &local](node_index_type c) {
+          return row_local.count(c) ? row_local[c] : local[c];
+        };
+        tape_loop block;
+        block.begin = nodes_.size();
+        for (node_index_type v : program.variant_) {
+          const node_impl g = remapped(node_vector_singleton()[v], map);
+          row_local[v] = nodes_.size();
+          nodes_.push_back(g);
+        }
+        block.end = nodes_.size();
+        block.body = map(f.body_index());
+        f.body_index() = loops_.size();
+        loops_.push_back(block);
+      } else {
+        f = remapped(f, [&local](node_index_type c) { return local[c]; });
+      }
+      nodes_[t] = f;
+    }
+    for (node_index_type root : roots) {
+      roots_.push_back(local[root]);
+    }
+  }
+
+  size_t size() const {
+    return nodes_.size();
+  }
+
+  tape_view view() const {
+    tape_view v;
+    v.dim_ = dim_;
+    v.nodes_ = nodes_.data();
+    v.size_ = nodes_.size();
+    v.main_size_ = main_size_;
+    v.children_ = children_.data();
+    v.loops_ = loops_.data();
+    v.roots_ = roots_.data();
+    v.roots_count_ = roots_.size();
+    v.level_begin_ = level_begin_.data();
+    v.level_begin_count_ = level_begin_.size();
+    return v;
+  }
+
+  // Evaluates the nodes [begin, end) of the tape, given the nodes before `begin` have already been evaluated.
+  template <typename P = fncas_value_type>
+  void eval(const typename precision_traits<P>::value_type* x,
+            typename precision_traits<P>::value_type* values,
+            size_t begin,
+            size_t end) const {
+    view().eval<P>(x, values, begin, end);
+  }
+  template <typename P = fncas_value_type>
+  void eval(const typename precision_traits<P>::value_type* x,
+            typename precision_traits<P>::value_type* values) const {
+    view().eval<P>(x, values);
+  }
+
+ private:
+  // The copy of the node with its children renumbered by `map`, n-ary children appended to `children_`.
+  template <typename M> node_impl remapped(node_impl f, M map) {
+    if (f.type() == type_t::operation) {
+      f.lhs_index() = map(f.lhs_index());
+      f.rhs_index() = map(f.rhs_index());
+    } else if (f.type() == type_t::function) {
+      f.argument_index() = map(f.argument_index());
+    } else if (f.type() == type_t::nary) {
+      const node_index_type begin = children_.size();
+      for (node_index_type j = 0; j < f.children_count(); ++j) {
+        children_.push_back(map(f.child_index(j)));
+      }
+      f.children_begin() = begin;
+    }
+    return f;
+  }
+  // The nodes the node depends on within the tape: its children, or the row-invariant inputs of a loop.
+  template <typename F>
+  static void for_each_dependency(node_index_type i, const std::map<node_index_type, loop_program>& programs, F f) {
+    const node_impl& node = node_vector_singleton()[i];
+    if (node.type() == type_t::loop) {
+      for (node_index_type c : programs.at(i).invariant_) {
+        f(c);
+      }
+    } else {
+      for_each_child(node, f);
+    }
+  }
+};
+
+// Single-threaded tape evaluator, holds its own value array. The inputs and the result are converted
+// from and to double, the evaluation itself is in the precision `P`, see `precision_traits`.
+template <typename P = fncas_value_type> struct basic_f_tape : f {
+  typedef typename precision_traits<P>::value_type value_type;
+  const tape tape_;
+  // The input converted to the value type, unused for double.
+  mutable std::vector<value_type> x_;
+  mutable std::vector<value_type> values_;
+  explicit basic_f_tape(const node& f)
+      : tape_(std::vector<node_index_type>(1, f.index())), values_(tape_.size()) {
+  }
+  explicit basic_f_tape(const f_intermediate& f) : basic_f_tape(f.f_) {
+  }
+  virtual fncas_value_type operator()(const std::vector<fncas_value_type>& x) const {
+    assert(static_cast<int32_t>(x.size()) == dim());
+    tape_.eval<P>(converted_input(x, x_), values_.data());
+    return values_[tape_.roots_.front()];
+  }
+  virtual int32_t dim() const {
+    return tape_.dim_;
+  }
+};
+
+typedef basic_f_tape<> f_tape;
+
+// The gradient evaluated on the tape of the function and its derivatives, in the precision `P`.
+template <typename P = fncas_value_type> struct basic_g_tape : g {
+  typedef typename precision_traits<P>::value_type value_type;
+  const tape tape_;
+  // The input converted to the value type, unused for double.
+  mutable std::vector<value_type> x_;
+  mutable std::vector<value_type> values_;
+  basic_g_tape(const x& x_ref, const node& f)
+      : tape_(roots(x_ref, f)), values_(tape_.size()) {
+  }
+  virtual result operator()(const std::vector<fncas_value_type>& x) const {
+    assert(static_cast<int32_t>(x.size()) == dim());
+    tape_.eval<P>(converted_input(x, x_), values_.data());
+    result r;
+    r.value = values_[tape_.roots_.front()];
+    r.gradient.resize(dim());
+    for (int32_t i = 0; i < dim(); ++i) {
+      r.gradient[i] = values_[tape_.roots_[i + 1]];
+    }
+    return r;
+  }
+  virtual int32_t dim() const {
+    return tape_.dim_;
+  }
+  // The function followed by its derivatives by each variable.
+  static std::vector<node_index_type> roots(const x& x_ref, const node& f) {
+    std::vector<node_index_type> result(1, f.index());
+    for (int32_t i = 0; i < internals_singleton().dim_; ++i) {
+      result.push_back(f.differentiate(x_ref, i).index());
+    }
+    return result;
+  }
+};
+
+typedef basic_g_tape<> g_tape;
+
+// Evaluates the function for many inputs at once, see tape_view::eval_batch(), in the precision `P`.
+template <typename P = fncas_value_type> struct basic_f_batch : f {
+  typedef typename precision_traits<P>::value_type value_type;
+  const tape tape_;
+  // The inputs and the values, laid out as eval_batch() expects them.
+  mutable std::vector<value_type> x_;
+  mutable std::vector<value_type> values_;
+  explicit basic_f_batch(const node& f) : tape_(std::vector<node_index_type>(1, f.index())) {
+  }
+  explicit basic_f_batch(const f_intermediate& f) : basic_f_batch(f.f_) {
+  }
+  // Evaluates the function for the `n` inputs of dim() values each, stored one after another in `x`.
+  void operator()(const fncas_value_type* x, size_t n, fncas_value_type* result) const {
+    const size_t d = static_cast<size_t>(dim());
+    x_.resize(d * n);
+    values_.resize(tape_.size() * n);
+    for (size_t k = 0; k < n; ++k) {
+      for (size_t i = 0; i < d; ++i) {
+        x_[i * n + k] = static_cast<value_type>(x[k * d + i]);
+      }
+    }
+    tape_.view().eval_batch<P>(x_.data(), values_.data(), n);
+    const value_type* root = values_.data() + tape_.roots_.front() * n;
+    std::copy(root, root + n, result);
+  }
+  virtual fncas_value_type operator()(const std::vector<fncas_value_type>& x) const {
+    assert(static_cast<int32_t>(x.size()) == dim());
+    fncas_value_type result;
+    (*this)(x.data(), 1, &result);
+    return result;
+  }
+  virtual int32_t dim() const {
+    return tape_.dim_;
+  }
+};
+
+typedef basic_f_batch<> f_batch;
+
+}  // namespace fncas
+
+#endif  // #ifndef FNCAS_TAPE_H
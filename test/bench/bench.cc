@@ -0,0 +1,376 @@
+// The benchmark of the phases FNCAS goes through, from building the graph of the function to evaluating it.
+//
+// For each function, each repetition times separately:
+// * construct:     recording the function into the graph.
+// * differentiate: taking the derivatives by the first `--derivatives` variables.
+// * <backend>.generate, <backend>.build, <backend>.load, <backend>.first_call:
+//                  writing the source, running the external compiler, dlopen()-ing and binding the library,
+//                  and the first call, for each of the compiled backends, NASM and C.
+// * <backend>.compile, <backend>.link:
+//                  the build split into running the assembler or the compiler, and the linker, as reported
+//                  by fncas::compile_stats; C is compiled and linked in one step.
+// * <backend>.eval: the steady state evaluation, one call, for the compiled backends, the interpreter and the tape.
+// The first `--warmup` repetitions are discarded. The median, percentiles and extremes of the rest are printed
+// as JSON, in seconds, so that the backends are compared within one run, and the runs can be compared by tools.
+// The sizes of what each compiled backend produced, the source, the object, the library and its machine code,
+// and the scratch array, are printed as `artifacts`, to tell what makes large functions slow to compile.
+// With `--counters`, the medians of the hardware counters of each phase are printed too, see fncas_counters.h,
+// per call for the steady state, which tells whether an evaluator is bound by the memory, branches or decoding.
+//
+// Usage: bench [--warmup=N] [--repetitions=N] [--derivatives=N] [--eval_seconds=S] [--backends=nasm,clang]
+//              [--counters] [--synthetic=SPEC...] [f...]
+// With no functions given, all the functions built in are benchmarked. Each `--synthetic` adds the synthetic
+// function of the parameters SPEC, such as `--synthetic=dim=1000,depth=8`, see synthetic_params in function.h,
+// named `synthetic:SPEC`, so that a sweep along one parameter is a series of flags.
+
+// The code generation of both backends is always compiled in, FNCAS_JIT only selects the default one.
+#ifndef FNCAS_JIT
+#define FNCAS_JIT CLANG
+#endif
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../../fncas/fncas.h"
+
+#include "functions.h"
+
+double now_seconds() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// The timings of one phase, and its counters if counted, over the repetitions.
+struct phase_timings {
+  std::string name;
+  std::vector<double> seconds;
+  // The counts per call, by counter_t, of each repetition.
+  std::vector<std::vector<double>> counters;
+  // The percentile `p` of the timings, interpolated linearly between the closest ranks.
+  static double percentile(const std::vector<double>& sorted, double p) {
+    const double rank = p * (sorted.size() - 1);
+    const size_t lower = static_cast<size_t>(rank);
+    const size_t upper = std::min(lower + 1, sorted.size() - 1);
+    return sorted[lower] + (sorted[upper] - sorted[lower]) * (rank - lower);
+  }
+  void json(std::ostream& os, const fncas::perf_counters* available) const {
+    std::vector<double> sorted(seconds);
+    std::sort(sorted.begin(), sorted.end());
+    double sum = 0.0;
+    for (double s : sorted) {
+      sum += s;
+    }
+    os << '"' << name << "\": {\"repetitions\": " << sorted.size();
+    if (!sorted.empty()) {
+      os << ", \"median\": " << percentile(sorted, 0.5) << ", \"p10\": " << percentile(sorted, 0.1)
+         << ", \"p90\": " << percentile(sorted, 0.9) << ", \"min\": " << sorted.front()
+         << ", \"max\": " << sorted.back() << ", \"mean\": " << sum / sorted.size();
+    }
+    if (available && !counters.empty()) {
+      os << ", \"counters\": {";
+      bool first = true;
+      for (size_t i = 0; i < static_cast<size_t>(fncas::counter_t::end); ++i) {
+        const fncas::counter_t counter = static_cast<fncas::counter_t>(i);
+        if (available->available(counter)) {
+          std::vector<double> values;
+          for (const std::vector<double>& v : counters) {
+            values.push_back(v[i]);
+          }
+          std::sort(values.begin(), values.end());
+          os << (first ? "" : ", ") << '"' << fncas::counter_as_string(counter) << "\": " << percentile(values, 0.5);
+          first = false;
+        }
+      }
+      os << '}';
+    }
+    os << '}';
+  }
+};
+
+struct options {
+  int warmup = 1;
+  int repetitions = 5;
+  int derivatives = 16;
+  // The time of each repetition of the steady state evaluation.
+  double eval_seconds = 0.1;
+  bool nasm = true;
+  bool clang = true;
+  bool counters = false;
+  std::vector<std::string> functions;
+};
+
+// The phases of one function, in the order they are first timed.
+struct function_benchmark {
+  size_t nodes = 0;
+  std::vector<phase_timings> phases;
+  // What each compiled backend produced, from the last repetition, the timings of compile_stats are ignored.
+  std::map<std::string, fncas::compile_stats> artifacts;
+  std::map<std::string, size_t> index;
+  bool record;
+  // Null unless counting.
+  fncas::perf_counters* counters = nullptr;
+  // Times the phase `f`, which returns the number of calls it has made, the time and the counts being per call.
+  template <typename F> void phase(const std::string& name, F f) {
+    fncas::counter_values values;
+    const double begin = now_seconds();
+    uint64_t calls;
+    {
+      fncas::scoped_counters scope(counters, values);
+      calls = f();
+    }
+    const double seconds = now_seconds() - begin;
+    if (record) {
+      timings(name).seconds.push_back(seconds / calls);
+      if (counters) {
+        std::vector<double> per_call(static_cast<size_t>(fncas::counter_t::end));
+        for (size_t i = 0; i < per_call.size(); ++i) {
+          per_call[i] = static_cast<double>(values.value[i]) / calls;
+        }
+        timings(name).counters.push_back(per_call);
+      }
+    }
+  }
+  // Records the phase timed elsewhere, with no counters.
+  void add(const std::string& name, double seconds) {
+    if (record) {
+      timings(name).seconds.push_back(seconds);
+    }
+  }
+  phase_timings& timings(const std::string& name) {
+    if (!index.count(name)) {
+      index[name] = phases.size();
+      phases.push_back(phase_timings{name, std::vector<double>(), std::vector<std::vector<double>>()});
+    }
+    return phases[index[name]];
+  }
+  // Calls `f` for about `seconds` in total, returns the number of calls.
+  template <typename F> static uint64_t steady_state(F f, double seconds) {
+    uint64_t calls = 0;
+    const double begin = now_seconds();
+    do {
+      for (int i = 0; i < 16; ++i) {
+        f();
+      }
+      calls += 16;
+    } while (now_seconds() - begin < seconds);
+    return calls;
+  }
+};
+
+// Times the phases of one compiled backend, given its `generate` and `build` steps.
+template <typename GENERATE, typename BUILD>
+void benchmark_compiled(const std::string& backend,
+                        GENERATE generate,
+                        BUILD build,
+                        const std::vector<fncas::node_index_type>& roots,
+                        const std::vector<double>& x,
+                        const options& opts,
+                        function_benchmark& result) {
+  const std::string filebase = fncas::compile_filebase();
+  fncas::compile_stats stats;
+  result.phase(backend + ".generate", [&]() {
+    generate(filebase, roots, &stats);
+    return 1;
+  });
+  result.phase(backend + ".build", [&]() {
+    build(filebase, &stats);
+    return 1;
+  });
+  result.add(backend + ".compile", stats.compile_seconds);
+  if (stats.link_seconds > 0) {
+    result.add(backend + ".link", stats.link_seconds);
+  }
+  std::unique_ptr<fncas::compiled_expression> c;
+  result.phase(backend + ".load", [&]() {
+    c.reset(new fncas::compiled_expression(filebase + ".so", roots));
+    return 1;
+  });
+  stats.library_bytes = c->stats().library_bytes;
+  stats.text_bytes = c->stats().text_bytes;
+  stats.scratch_size = c->stats().scratch_size;
+  result.artifacts[backend] = stats;
+  volatile double value;
+  result.phase(backend + ".first_call", [&]() {
+    value = (*c)(x);
+    return 1;
+  });
+  result.phase(backend + ".eval", [&]() {
+    return function_benchmark::steady_state([&c, &x, &value]() { value = (*c)(x); }, opts.eval_seconds);
+  });
+  for (const char* extension : {".asm", ".c", ".o", ".so"}) {
+    unlink((filebase + extension).c_str());
+  }
+}
+
+function_benchmark benchmark(F* f, const options& opts, fncas::perf_counters* counters) {
+  function_benchmark result;
+  result.counters = counters;
+  std::vector<double> x(f->dim());
+  f->gen(x);
+  for (int r = 0; r < opts.warmup + opts.repetitions; ++r) {
+    result.record = (r >= opts.warmup);
+    fncas::reset_internals_singleton();
+    fncas::x argument(f->dim());
+    fncas::node_index_type index;
+    result.phase("construct", [&]() {
+      index = f->eval_as_expression(argument).index();
+      return 1;
+    });
+    result.nodes = fncas::node_vector_singleton().size();
+    const fncas::node expression = fncas::node(fncas::from_index(index));
+    const std::vector<fncas::node_index_type> roots(1, index);
+
+    const int32_t derivatives = std::min(opts.derivatives, static_cast<int>(f->dim()));
+    result.phase("differentiate", [&]() {
+      for (int32_t i = 0; i < derivatives; ++i) {
+        expression.differentiate(argument, i);
+      }
+      return 1;
+    });
+
+    if (opts.nasm) {
+      benchmark_compiled("nasm",
+                         [](const std::string& filebase,
+                            const std::vector<fncas::node_index_type>& roots,
+                            fncas::compile_stats* stats) {
+                           fncas::compile_impl::NASM::generate<double>(filebase, roots, fncas::math_t::libm, stats);
+                         },
+                         [](const std::string& filebase, fncas::compile_stats* stats) {
+                           fncas::compile_impl::NASM::build(filebase, stats);
+                         },
+                         roots,
+                         x,
+                         opts,
+                         result);
+    }
+    if (opts.clang) {
+      benchmark_compiled("clang",
+                         [](const std::string& filebase,
+                            const std::vector<fncas::node_index_type>& roots,
+                            fncas::compile_stats* stats) {
+                           fncas::compile_impl::CLANG::generate<double>(filebase, roots, fncas::math_t::libm, stats);
+                         },
+                         [](const std::string& filebase, fncas::compile_stats* stats) {
+                           fncas::compile_impl::CLANG::build(filebase, fncas::math_t::libm, stats);
+                         },
+                         roots,
+                         x,
+                         opts,
+                         result);
+    }
+
+    const fncas::f_intermediate intermediate(expression);
+    volatile double value;
+    result.phase("intermediate.eval", [&]() {
+      return function_benchmark::steady_state([&intermediate, &x, &value]() { value = intermediate(x); },
+                                              opts.eval_seconds);
+    });
+    const fncas::f_tape tape(expression);
+    result.phase("tape.eval", [&]() {
+      return function_benchmark::steady_state([&tape, &x, &value]() { value = tape(x); }, opts.eval_seconds);
+    });
+  }
+  return result;
+}
+
+bool parse_option(const char* arg, const char* name, std::string& value) {
+  const size_t length = strlen(name);
+  if (!strncmp(arg, name, length) && arg[length] == '=') {
+    value = arg + length + 1;
+    return true;
+  } else {
+    return false;
+  }
+}
+
+int main(int argc, char* argv[]) {
+  options opts;
+  for (int i = 1; i < argc; ++i) {
+    std::string value;
+    if (parse_option(argv[i], "--warmup", value)) {
+      opts.warmup = atoi(value.c_str());
+    } else if (parse_option(argv[i], "--repetitions", value)) {
+      opts.repetitions = std::max(atoi(value.c_str()), 1);
+    } else if (parse_option(argv[i], "--derivatives", value)) {
+      opts.derivatives = atoi(value.c_str());
+    } else if (parse_option(argv[i], "--eval_seconds", value)) {
+      opts.eval_seconds = atof(value.c_str());
+    } else if (parse_option(argv[i], "--backends", value)) {
+      opts.nasm = (value.find("nasm") != std::string::npos);
+      opts.clang = (value.find("clang") != std::string::npos);
+    } else if (!strcmp(argv[i], "--counters")) {
+      opts.counters = true;
+    } else if (parse_option(argv[i], "--synthetic", value)) {
+      const std::string name = "synthetic:" + value;
+      try {
+        register_function(name.c_str(), new synthetic_function(value));
+      } catch (const std::invalid_argument& e) {
+        std::cerr << e.what() << std::endl;
+        return -1;
+      }
+      opts.functions.push_back(name);
+    } else if (argv[i][0] == '-') {
+      std::cerr << "Unknown option '" << argv[i] << "'." << std::endl;
+      return -1;
+    } else if (!registered_functions.count(argv[i])) {
+      std::cerr << "Function '" << argv[i] << "' is not defined in functions/*.h." << std::endl;
+      return -1;
+    } else {
+      opts.functions.push_back(argv[i]);
+    }
+  }
+  if (opts.functions.empty()) {
+    for (const auto& cit : registered_functions) {
+      opts.functions.push_back(cit.first);
+    }
+  }
+
+  std::unique_ptr<fncas::perf_counters> counters(opts.counters ? new fncas::perf_counters() : nullptr);
+  if (counters && !counters->any_available()) {
+    std::cerr << "The hardware counters are not available, see /proc/sys/kernel/perf_event_paranoid." << std::endl;
+    counters.reset();
+  }
+
+  std::cout << std::setprecision(6) << std::scientific;
+  std::cout << "{\n  \"warmup\": " << opts.warmup << ",\n  \"repetitions\": " << opts.repetitions
+            << ",\n  \"counters\": " << (counters ? "true" : "false")
+            << ",\n  \"functions\": [";
+  for (size_t k = 0; k < opts.functions.size(); ++k) {
+    const std::string& name = opts.functions[k];
+    std::cerr << name << std::endl;
+    F* f = registered_functions[name];
+    const function_benchmark result = benchmark(f, opts, counters.get());
+    std::cout << (k ? "," : "") << "\n    {\n      \"function\": \"" << name << "\",\n      \"dim\": " << f->dim()
+              << ",\n      \"nodes\": " << result.nodes
+              << ",\n      \"derivatives\": " << std::min(opts.derivatives, static_cast<int>(f->dim()))
+              << ",\n      \"phases\": {";
+    for (size_t p = 0; p < result.phases.size(); ++p) {
+      std::cout << (p ? "," : "") << "\n        ";
+      result.phases[p].json(std::cout, counters.get());
+    }
+    std::cout << "\n      },\n      \"artifacts\": {";
+    for (auto it = result.artifacts.begin(); it != result.artifacts.end(); ++it) {
+      const fncas::compile_stats& stats = it->second;
+      std::cout << (it == result.artifacts.begin() ? "" : ",") << "\n        \"" << it->first
+                << "\": {\"source_bytes\": " << stats.source_bytes << ", \"instructions\": " << stats.instructions
+                << ", \"object_bytes\": " << stats.object_bytes << ", \"library_bytes\": " << stats.library_bytes
+                << ", \"text_bytes\": " << stats.text_bytes << ", \"scratch_size\": " << stats.scratch_size << '}';
+    }
+    std::cout << "\n      }\n    }";
+  }
+  std::cout << "\n  ]\n}" << std::endl;
+}
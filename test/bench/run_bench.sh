@@ -0,0 +1,31 @@
+#!/bin/bash
+#
+# Builds the benchmark of the phases of FNCAS, see bench.cc, with the functions tagged INCLUDE_IN_PERF_TEST,
+# or INCLUDE_IN_SMOKE_TEST if the first argument is `smoke`, and prints its JSON report.
+# The rest of the arguments are passed to the benchmark, e.g. `./run_bench.sh smoke --repetitions=3`.
+
+BINARY=autogen/bench
+
+TAG=INCLUDE_IN_PERF_TEST
+if [ "$1" == "smoke" ] ; then
+  TAG=INCLUDE_IN_SMOKE_TEST
+  shift
+fi
+
+FUNCTIONS_FILES=$(grep $TAG ../f/*.h | cut -f1 -d: | sort -u)
+
+mkdir -p autogen
+cp -f ../function.h autogen/functions.h
+for i in $FUNCTIONS_FILES ; do
+  cat $i >> autogen/functions.h
+done
+for i in $FUNCTIONS_FILES ; do
+  echo 'REGISTER_FUNCTION('$(basename $i .h)');' >>autogen/functions.h
+done
+
+CMDLINE="g++ --std=c++11 -O3 bench.cc -I $PWD/autogen -o $BINARY -ldl -pthread"
+echo $CMDLINE >/dev/stderr
+
+rm -f $BINARY
+$CMDLINE || exit 1
+./$BINARY "$@"
@@ -15,13 +15,20 @@
 #error "FNCAS_JIT should be set to build eval.cc."
 #endif
 
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 #include <ctime>
+#include <fstream>
 #include <functional>
 #include <iomanip>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <random>
 #include <sstream>
+#include <stdexcept>
+#include <thread>
 #include <vector>
 
 #include "../fncas/fncas.h"
@@ -54,7 +61,7 @@ struct action {
     limit_seconds = quantity < 0 ? -quantity : 1e12;
     this->sout = sout;
     this->serr = serr;
-    do_run();
+    return do_run();
   }
   virtual bool do_run() = 0;
 };
@@ -105,7 +112,7 @@ template <typename X> struct action_gen_eval_Xeval : generic_action, X {
     f->gen(x);
     const double golden = f->eval_as_double(x);
     const double test = (*fncas_f)(x);
-    if (test == golden) {
+    if (X::matches(golden, test)) {
       return true;
     } else {
       (*serr) << golden << " != " << test << " @" << iteration;
@@ -125,6 +132,15 @@ struct eval {
     virtual bool steps_done(std::ostream& os) {
       return true;
     }
+    static bool matches(double golden, double test) {
+      return test == golden;
+    }
+  };
+  // Evaluators that reassociate operations can only match the native result up to rounding errors.
+  struct reassociated : base {
+    static bool matches(double golden, double test) {
+      return test == golden || fabs(test - golden) / std::max(1.0, std::max(fabs(golden), fabs(test))) < 1e-9;
+    }
   };
   // Native implementation calls the function natively compiled as part of the binary being run.
   struct native : base {
@@ -140,14 +156,45 @@ struct eval {
       return std::unique_ptr<fncas::f>(new fncas::f_intermediate(f->eval_as_expression(fncas::x(f->dim()))));
     }
   };
+  // Same as `intermediate`, under the sampling profiler. The executions per opcode, per region and in the folded
+  // stacks should add up to the same total; reports the number of samples taken.
+  struct profiled_intermediate : base {
+    const fncas::f_profiled* profiled_;
+    std::unique_ptr<fncas::f> init(const F* f) {
+      fncas::f_profiled* result = new fncas::f_profiled(f->eval_as_expression(fncas::x(f->dim())));
+      profiled_ = result;
+      return std::unique_ptr<fncas::f>(result);
+    }
+    virtual bool steps_done(std::ostream& os) override {
+      uint64_t by_opcode = 0;
+      for (const fncas::profile_entry& e : profiled_->by_opcode()) {
+        by_opcode += e.executions;
+      }
+      uint64_t by_region = 0;
+      for (const fncas::profile_entry& e : profiled_->by_region()) {
+        by_region += e.executions;
+      }
+      std::ostringstream folded;
+      profiled_->write_folded(folded, fncas::profile_metric::executions);
+      uint64_t in_folded = 0;
+      std::string line;
+      std::istringstream is(folded.str());
+      while (std::getline(is, line)) {
+        in_folded += std::stoull(line.substr(line.rfind(' ') + 1));
+      }
+      os << ':' << profiled_->samples();
+      return by_opcode && by_region == by_opcode && in_folded == by_opcode;
+    }
+  };
   // Compiled implementation calls fncas implementation
   // that invokes an externally compiled version of the function.
-  // The compilation takes place upon the construction of this object.
-  struct compiled : base {
+  // The compilation takes place upon the construction of this object, and is timed. `TRANSFORM::compile()`
+  // compiles the expression, transformed or with the options of the flavor, `MATCH` is how close the result is.
+  template <typename TRANSFORM, typename MATCH = base> struct timed_compiled : MATCH {
     double compile_time_;
     std::unique_ptr<fncas::f> init(const F* f) {
       const double begin = get_wall_time_seconds();
-      std::unique_ptr<fncas::f> result(new fncas::f_compiled(f->eval_as_expression(fncas::x(f->dim()))));
+      std::unique_ptr<fncas::f> result(TRANSFORM::compile(f->eval_as_expression(fncas::x(f->dim()))));
       const double end = get_wall_time_seconds();
       compile_time_ = end - begin;
       return result;
@@ -157,16 +204,486 @@ struct eval {
       return true;
     }
   };
+  struct as_is {
+    static fncas::f* compile(const fncas::node& f) {
+      return new fncas::f_compiled(f);
+    }
+  };
+  typedef timed_compiled<as_is> compiled;
+  // Parallel implementation evaluates the function level by level using multiple threads.
+  // The fine-grained flavor forces several threads and tiny tasks, to exercise the scheduler on small functions.
+  template <size_t THREADS, size_t GRAIN> struct parallel : base {
+    std::unique_ptr<fncas::f> init(const F* f) {
+      const size_t threads = THREADS ? THREADS : std::thread::hardware_concurrency();
+      return std::unique_ptr<fncas::f>(
+          new fncas::f_parallel(f->eval_as_expression(fncas::x(f->dim())), threads, GRAIN));
+    }
+  };
+  // Mapped implementation saves the tape of the function into a file, and evaluates it mapped from the file.
+  // The file truncated, or with a root out of range, should be rejected.
+  struct mapped : base {
+    std::string accepted_corrupt_;
+    std::unique_ptr<fncas::f> init(const F* f) {
+      const std::string filename = "/tmp/fncas_eval_" + std::to_string(getpid()) + ".tape";
+      const fncas::node node = f->eval_as_expression(fncas::x(f->dim()));
+      fncas::save_tape(fncas::tape(std::vector<fncas::node_index_type>(1, node.index())), filename);
+      std::string contents;
+      {
+        std::ifstream fi(filename, std::ios::binary);
+        contents.assign(std::istreambuf_iterator<char>(fi), std::istreambuf_iterator<char>());
+      }
+      fncas::tape_file_header header;
+      memcpy(&header, contents.data(), sizeof(header));
+      std::string bad_root = contents;
+      const fncas::node_index_type root = static_cast<fncas::node_index_type>(header.size);
+      memcpy(&bad_root[fncas::tape_file_layout(header).roots], &root, sizeof(root));
+      const std::string corrupt[] = {contents.substr(0, contents.length() / 2), bad_root};
+      for (const std::string& c : corrupt) {
+        std::ofstream(filename, std::ios::binary) << c;
+        try {
+          fncas::f_mapped accepted(filename);
+          accepted_corrupt_ = "Corrupt tape file accepted.";
+        } catch (const fncas::file_error&) {
+        }
+      }
+      std::ofstream(filename, std::ios::binary) << contents;
+      std::unique_ptr<fncas::f> result(new fncas::f_mapped(filename));
+      // The mapping outlives the file.
+      unlink(filename.c_str());
+      return result;
+    }
+    virtual bool steps_done(std::ostream& os) override {
+      os << accepted_corrupt_;
+      return accepted_corrupt_.empty();
+    }
+  };
+  // Static implementation evaluates the function written as a compile-time expression, fully inlined.
+  // The functions not written that way are compared against the native wrapper.
+  struct static_expression : base {
+    std::unique_ptr<fncas::f> init(const F* f) {
+      std::unique_ptr<fncas::f> result;
+      std::unique_ptr<fncas::g> unused;
+      f->eval_as_static(result, unused);
+      return result ? std::move(result) : native().init(f);
+    }
+  };
+  // Reduced precision implementations only match the native result approximately. The largest error is reported
+  // rather than enforced, as ill-conditioned functions lose most of their single precision digits now and then.
+  // The accuracy is checked statistically by `test_precision`.
+  struct reduced_precision : base {
+    double max_error_ = 0.0;
+    bool matches(double golden, double test) {
+      max_error_ = std::max(max_error_, fabs(test - golden) / std::max(1.0, std::max(fabs(golden), fabs(test))));
+      return true;
+    }
+    virtual bool steps_done(std::ostream& os) override {
+      os << ':' << std::scientific << max_error_ << std::fixed;
+      return true;
+    }
+  };
+  // Tape implementation evaluates the tape of the function in the precision `P`.
+  template <typename P>
+  struct tape : std::conditional<std::is_same<P, double>::value, base, reduced_precision>::type {
+    std::unique_ptr<fncas::f> init(const F* f) {
+      return std::unique_ptr<fncas::f>(new fncas::basic_f_tape<P>(f->eval_as_expression(fncas::x(f->dim()))));
+    }
+  };
+  template <typename P> struct compiled_precision : reduced_precision {
+    std::unique_ptr<fncas::f> init(const F* f) {
+      return std::unique_ptr<fncas::f>(new fncas::basic_f_compiled<P>(f->eval_as_expression(fncas::x(f->dim()))));
+    }
+  };
+  // Compiled code calling the math kernels of fncas_math.h instead of libm, a few ULPs off.
+  struct with_kernels {
+    static fncas::f* compile(const fncas::node& f) {
+      return new fncas::f_compiled(f, fncas::math_t::kernels);
+    }
+  };
+  typedef timed_compiled<with_kernels, reassociated> compiled_kernels;
+  // Same as `intermediate` and `compiled`, with the chains of additions and multiplications flattened.
+  struct flattened_intermediate : reassociated {
+    std::unique_ptr<fncas::f> init(const F* f) {
+      return std::unique_ptr<fncas::f>(
+          new fncas::f_intermediate(fncas::flatten(f->eval_as_expression(fncas::x(f->dim())))));
+    }
+  };
+  struct flattened {
+    static fncas::f* compile(const fncas::node& f) {
+      return new fncas::f_compiled(fncas::flatten(f));
+    }
+  };
+  typedef timed_compiled<flattened, reassociated> flattened_compiled;
+  // Same as `intermediate` and `compiled`, with the chains of operations rebalanced into trees of logarithmic depth.
+  struct rebalanced_intermediate : reassociated {
+    std::unique_ptr<fncas::f> init(const F* f) {
+      return std::unique_ptr<fncas::f>(
+          new fncas::f_intermediate(fncas::rebalance(f->eval_as_expression(fncas::x(f->dim())))));
+    }
+  };
+  struct rebalanced {
+    static fncas::f* compile(const fncas::node& f) {
+      return new fncas::f_compiled(fncas::rebalance(f));
+    }
+  };
+  typedef timed_compiled<rebalanced, reassociated> rebalanced_compiled;
+  // Out-of-core implementation keeps the nodes in a file, and evaluates them streaming in one pass, which is exact.
+  struct streamed : base {
+    std::unique_ptr<fncas::f> init(const F* f) {
+      fncas::use_file_backed_storage();
+      return std::unique_ptr<fncas::f>(new fncas::f_streamed(f->eval_as_expression(fncas::x(f->dim()))));
+    }
+  };
+  // Same as `intermediate` and `compiled`, with the nodes reordered into a contiguous block, which is exact.
+  struct reordered_intermediate : base {
+    std::unique_ptr<fncas::f> init(const F* f) {
+      return std::unique_ptr<fncas::f>(
+          new fncas::f_intermediate(fncas::reorder(f->eval_as_expression(fncas::x(f->dim())))));
+    }
+  };
+  struct reordered {
+    static fncas::f* compile(const fncas::node& f) {
+      return new fncas::f_compiled(fncas::reorder(f, fncas::node_order::min_live));
+    }
+  };
+  typedef timed_compiled<reordered> reordered_compiled;
 };
 
 typedef action_gen_eval_Xeval<eval::native> action_gen_eval_eval;
 typedef action_gen_eval_Xeval<eval::intermediate> action_gen_eval_ieval;
 typedef action_gen_eval_Xeval<eval::compiled> action_gen_eval_ceval;
+typedef action_gen_eval_Xeval<eval::profiled_intermediate> action_gen_eval_ieval_profiled;
+typedef action_gen_eval_Xeval<eval::parallel<0, fncas::f_parallel::DEFAULT_GRAIN>> action_gen_eval_peval;
+typedef action_gen_eval_Xeval<eval::parallel<4, 1>> action_gen_eval_peval_fine;
+typedef action_gen_eval_Xeval<eval::mapped> action_gen_eval_meval;
+typedef action_gen_eval_Xeval<eval::static_expression> action_gen_eval_seval;
+typedef action_gen_eval_Xeval<eval::tape<double>> action_gen_eval_teval;
+typedef action_gen_eval_Xeval<eval::tape<float>> action_gen_eval_teval_float;
+typedef action_gen_eval_Xeval<eval::tape<fncas::mixed_precision>> action_gen_eval_teval_mixed;
+typedef action_gen_eval_Xeval<eval::compiled_precision<float>> action_gen_eval_ceval_float;
+typedef action_gen_eval_Xeval<eval::compiled_precision<fncas::mixed_precision>> action_gen_eval_ceval_mixed;
+typedef action_gen_eval_Xeval<eval::compiled_kernels> action_gen_eval_ceval_kernels;
+typedef action_gen_eval_Xeval<eval::flattened_intermediate> action_gen_eval_ieval_flat;
+typedef action_gen_eval_Xeval<eval::flattened_compiled> action_gen_eval_ceval_flat;
+typedef action_gen_eval_Xeval<eval::rebalanced_intermediate> action_gen_eval_ieval_balanced;
+typedef action_gen_eval_Xeval<eval::rebalanced_compiled> action_gen_eval_ceval_balanced;
+typedef action_gen_eval_Xeval<eval::reordered_intermediate> action_gen_eval_ieval_reordered;
+typedef action_gen_eval_Xeval<eval::reordered_compiled> action_gen_eval_ceval_reordered;
+typedef action_gen_eval_Xeval<eval::streamed> action_gen_eval_oeval;
+
+// Evaluates the function for batches of inputs at once, see fncas::f_batch, reports the inputs per second.
+// The math kernels are a few ULPs off libm, so the results only match the native ones up to rounding errors.
+struct action_gen_eval_beval : generic_action {
+  enum { BATCH = 64 };
+  std::unique_ptr<fncas::f_batch> fncas_f;
+  std::vector<std::vector<double>> x;
+  std::vector<double> batch;
+  std::vector<double> result;
+  void start() {
+    fncas_f.reset(new fncas::f_batch(f->eval_as_expression(fncas::x(f->dim()))));
+    x.assign(BATCH, std::vector<double>(f->dim()));
+    batch.resize(BATCH * f->dim());
+    result.resize(BATCH);
+  }
+  bool step() {
+    for (size_t k = 0; k < BATCH; ++k) {
+      f->gen(x[k]);
+      std::copy(x[k].begin(), x[k].end(), batch.begin() + k * f->dim());
+    }
+    (*fncas_f)(batch.data(), BATCH, result.data());
+    for (size_t k = 0; k < BATCH; ++k) {
+      const double golden = f->eval_as_double(x[k]);
+      if (!eval::reassociated::matches(golden, result[k])) {
+        (*serr) << golden << " != " << result[k] << " @" << iteration;
+        return false;
+      }
+    }
+    return true;
+  }
+  virtual bool done() override {
+    (*sout) << iteration * BATCH / duration;
+    return true;
+  }
+};
+
+// Evaluates the function, or the function and its gradient, over the matrix of random points memory-mapped
+// from a file, see fncas::f_stream, reports the rows per second and the gigabytes per second read and written.
+// The points are stored row-major and the results column-major, to cover both layouts. The smoke test streams
+// as many rows as there are iterations once, the perf test streams the points it has generated in a tenth
+// of its time, up to PERF_BYTES of them, over and over.
+struct action_stream_eval : action {
+  enum { PERF_BYTES = 1 << 28 };
+  const bool gradient;
+  explicit action_stream_eval(bool gradient = false) : gradient(gradient) {
+  }
+  virtual bool do_run() {
+    const bool perf = limit_seconds < 1e12;
+    const int64_t dim = static_cast<int64_t>(f->dim());
+    const int64_t max_rows = perf ? std::max(static_cast<int64_t>(PERF_BYTES / (dim * sizeof(double))), INT64_C(1))
+                                  : static_cast<int64_t>(limit_iterations);
+    const std::string prefix = "/tmp/fncas_stream_" + std::to_string(getpid());
+    std::vector<double> golden;
+    {
+      fncas::mapped_matrix points(fncas::create_matrix(), prefix + ".x", max_rows, dim);
+      std::vector<double> x(dim);
+      const double begin = get_wall_time_seconds();
+      for (int64_t r = 0; r < max_rows; ++r) {
+        if (perf && !(r % 1024) && get_wall_time_seconds() - begin > limit_seconds * 0.1) {
+          break;
+        }
+        f->gen(x);
+        std::copy(x.begin(), x.end(), points.data() + r * dim);
+        golden.push_back(f->eval_as_double(x));
+      }
+    }
+    const int64_t rows = static_cast<int64_t>(golden.size());
+    if (truncate((prefix + ".x").c_str(), static_cast<off_t>(rows * dim * sizeof(double)))) {
+      return false;
+    }
+    const fncas::mapped_matrix input(prefix + ".x", dim);
+    fncas::x argument(f->dim());
+    const fncas::node expression = f->eval_as_expression(argument);
+    std::unique_ptr<fncas::f_stream> stream(gradient ? new fncas::f_stream(argument, expression)
+                                                     : new fncas::f_stream(expression));
+    std::unique_ptr<fncas::g_intermediate> golden_gradient(
+        gradient ? new fncas::g_intermediate(argument, expression) : nullptr);
+    fncas::mapped_matrix output(
+        fncas::create_matrix(), prefix + ".y", rows, stream->size(), fncas::matrix_layout::column_major);
+    // Neither the input read as rows of one more value than it has, nor a missing file, are mapped.
+    const auto rejected = [](const std::string& filename, int64_t cols) {
+      try {
+        const fncas::mapped_matrix matrix(filename, cols);
+        return false;
+      } catch (const fncas::file_error&) {
+        return true;
+      }
+    };
+    const bool rejects_invalid = (!rows || rejected(prefix + ".x", rows * dim + 1)) && rejected(prefix + ".z", dim);
+    unlink((prefix + ".x").c_str());
+    unlink((prefix + ".y").c_str());
+    if (!rejects_invalid) {
+      (*serr) << "Mapped an invalid matrix file.";
+      return false;
+    }
+    fncas::stream_stats total;
+    do {
+      const fncas::stream_stats stats = (*stream)(input, output);
+      total.rows += stats.rows;
+      total.bytes += stats.bytes;
+      total.seconds += stats.seconds;
+    } while (total.seconds < limit_seconds && perf);
+    std::vector<double> x(dim);
+    for (int64_t r = 0; r < rows; ++r) {
+      std::copy(input.data() + r * dim, input.data() + (r + 1) * dim, x.begin());
+      if (!eval::base::matches(golden[r], output(r, 0))) {
+        (*serr) << golden[r] << " != " << output(r, 0) << " @" << r;
+        return false;
+      }
+      if (gradient) {
+        const fncas::g::result g = (*golden_gradient)(x);
+        for (int64_t i = 0; i < dim; ++i) {
+          if (!eval::base::matches(g.gradient[i], output(r, i + 1))) {
+            (*serr) << g.gradient[i] << " != " << output(r, i + 1) << " @" << r << ", d/dx[" << i << "]";
+            return false;
+          }
+        }
+      }
+    }
+    (*sout) << total.rows_per_second() << ':' << total.gigabytes_per_second();
+    return true;
+  }
+};
+
+// Confirms memory_stats() accounts for the nodes, the values and the derivatives, and that the limits
+// on the nodes and on the bytes stop the growth before it happens, here by throwing from `on_exceeded`.
+struct action_test_memory : action {
+  virtual bool do_run() {
+    fncas::x argument(f->dim());
+    const fncas::node expression = f->eval_as_expression(argument);
+    std::vector<double> x(f->dim());
+    f->gen(x);
+    expression(x);
+    const fncas::g_intermediate g(argument, expression);
+    g(x);
+    const fncas::memory_report report = fncas::memory_stats();
+    uint64_t by_type = 0;
+    for (uint64_t count : report.nodes_by_type) {
+      by_type += count;
+    }
+    if (report.node_count != fncas::node_vector_singleton().size() || by_type != report.node_count ||
+        report.nodes.used_bytes != report.node_count * sizeof(fncas::node_impl) ||
+        report.nodes_by_type[fncas::type_t::variable] < f->dim() || !report.node_values.used_bytes ||
+        !report.derivatives.used_bytes || report.total_reserved_bytes() < report.total_used_bytes()) {
+      (*serr) << "Inconsistent memory_stats().";
+      return false;
+    }
+    fncas::memory_limits& limits = fncas::memory_limits_singleton();
+    limits.on_exceeded = [](const std::string& what) { throw std::runtime_error(what); };
+    bool ok = true;
+    limits.max_nodes = report.node_count + 10;
+    try {
+      for (int i = 0; i < 11; ++i) {
+        fncas::node(1.0 * i);
+      }
+      ok = false;
+    } catch (const std::runtime_error&) {
+      ok = ok && fncas::node_vector_singleton().size() == limits.max_nodes;
+    }
+    limits.max_nodes = 0;
+    limits.max_bytes = fncas::memory_stats().total_reserved_bytes() + (1 << 20);
+    try {
+      for (int i = 0; i < 10000000; ++i) {
+        fncas::node(1.0 * i);
+      }
+      ok = false;
+    } catch (const std::runtime_error&) {
+      ok = ok && fncas::memory_stats().total_reserved_bytes() <= limits.max_bytes;
+    }
+    limits = fncas::memory_limits();
+    if (!ok) {
+      (*serr) << "The memory limits are not enforced.";
+      return false;
+    }
+    (*sout) << report.total_used_bytes() << ':' << report.total_reserved_bytes();
+    return true;
+  }
+};
+
+// Confirms the nodes keep their addresses while the graph grows past several chunks,
+// and that reserve_nodes() and allocate_nodes() reserve and create the nodes at once.
+struct action_test_arena : action {
+  virtual bool do_run() {
+    fncas::x argument(f->dim());
+    const fncas::node expression = f->eval_as_expression(argument);
+    const fncas::node_impl* address = &fncas::node_vector_singleton()[expression.index()];
+    const fncas::node_impl copy = *address;
+    const size_t chunk = fncas::chunked_vector<fncas::node_impl>::chunk_size;
+    fncas::reserve_nodes(chunk);
+    const size_t capacity = fncas::node_vector_singleton().capacity();
+    bool ok = capacity >= fncas::node_vector_singleton().size() + chunk;
+    for (size_t i = 0; i < chunk; ++i) {
+      fncas::node(1.0 * i);
+    }
+    ok = ok && fncas::node_vector_singleton().capacity() == capacity;
+    const fncas::node_index_type first = fncas::allocate_nodes(3 * chunk);
+    ok = ok && static_cast<size_t>(first + 3 * chunk) == fncas::node_vector_singleton().size();
+    for (size_t i = 0; i < 3 * chunk; ++i) {
+      ok = ok && fncas::node_vector_singleton()[first + i].type() == fncas::type_t::variable;
+    }
+    ok = ok && address == &fncas::node_vector_singleton()[expression.index()] &&
+         !memcmp(address, &copy, sizeof(copy));
+    if (!ok) {
+      (*serr) << "The nodes are not reserved, allocated or kept in place.";
+      return false;
+    }
+    std::vector<double> x(f->dim());
+    f->gen(x);
+    const double golden = f->eval_as_double(x);
+    const double value = expression(x);
+    if (!eval::base::matches(golden, value)) {
+      (*serr) << golden << " != " << value;
+      return false;
+    }
+    (*sout) << value;
+    return true;
+  }
+};
+
+// Confirms the loops over the rows of their own tables nest, that node::loop() rejects the bodies referring to
+// the rows of other tables, and that the evaluators reject the row elements used outside of any loop.
+struct action_test_rows : action {
+  virtual bool do_run() {
+    fncas::x argument(f->dim());
+    const fncas::node expression = f->eval_as_expression(argument);
+    std::vector<double> x(f->dim());
+    f->gen(x);
+    const double golden = f->eval_as_double(x);
+    const std::vector<double> a = {1.0, 2.0, 3.0};
+    const std::vector<double> b = {0.5, -1.5};
+    const fncas::table ta(a, 1);
+    const fncas::table tb(b, 1);
+    // The inner sum is -1 + 2 * f(x), the outer one multiplies it by 6.
+    const fncas::node nested = fncas::sum_over_rows(ta, [&](const fncas::row& ra) {
+      return ra[0] * fncas::sum_over_rows(tb, [&](const fncas::row& rb) { return rb[0] + expression; });
+    });
+    const double value = nested(x);
+    if (!eval::reassociated::matches(6.0 * (2.0 * golden - 1.0), value)) {
+      (*serr) << 6.0 * (2.0 * golden - 1.0) << " != " << value;
+      return false;
+    }
+    int rejected = 0;
+    try {
+      fncas::sum_over_rows(ta, [&](const fncas::row& ra) {
+        return fncas::sum_over_rows(tb, [&](const fncas::row& rb) { return rb[0] * ra[0]; });
+      });
+    } catch (const std::invalid_argument&) {
+      ++rejected;
+    }
+    const fncas::node outside = fncas::row(ta.id_)[0] * expression;
+    try {
+      outside(x);
+    } catch (const std::invalid_argument&) {
+      ++rejected;
+    }
+    try {
+      fncas::f_tape{outside};
+    } catch (const std::invalid_argument&) {
+      ++rejected;
+    }
+    try {
+      fncas::g_streamed(argument, outside);
+    } catch (const std::invalid_argument&) {
+      ++rejected;
+    }
+    if (rejected != 4) {
+      (*serr) << "The rows used outside of their loops are not rejected.";
+      return false;
+    }
+    (*sout) << value;
+    return true;
+  }
+};
+
+// Checks the errors collected at the 95% quantile against the `threshold`, given at least `min_count` of them,
+// and at least one.
+bool errors_within(std::vector<double>& errors,
+                   double threshold,
+                   size_t min_count,
+                   const char* what,
+                   std::ostream& serr) {
+  if (errors.empty() || errors.size() < min_count) {
+    serr << "Not enough datapoints to test " << what << '.';
+    return false;
+  }
+  std::sort(errors.begin(), errors.end());
+  const double quantile = 0.95;
+  const size_t i = static_cast<size_t>(quantile * errors.size());
+  if (errors[i] > threshold) {
+    serr << "Error at quantile " << quantile << " is " << errors[i] << " which is above " << threshold;
+    return false;
+  } else {
+    return true;
+  }
+}
 
 struct action_test_gradient : generic_action {
+  const bool flatten;
+  // Keeps the nodes in a file, see fncas_storage.h.
+  const bool out_of_core;
+  explicit action_test_gradient(bool flatten = false, bool out_of_core = false)
+      : flatten(flatten), out_of_core(out_of_core) {
+  }
   std::vector<double> x;
   fncas::g_approximate ga;
   fncas::g_intermediate gi;
+  std::unique_ptr<fncas::g_forward> gf;
+  std::unique_ptr<fncas::g_streamed> gr;
+  // Within a budget small enough to split the nodes into segments, see fncas_checkpoint.h.
+  std::unique_ptr<fncas::g_checkpointed> gc;
+  // The nodes the two above added, none as the nodes are laid out in place, see fncas_storage.h.
+  size_t layout_nodes = 0;
+  // The compile-time derivatives, for the functions also written as compile-time expressions.
+  std::unique_ptr<fncas::f> sf;
+  std::unique_ptr<fncas::g> sg;
   std::vector<double> errors;
   static double error_between(double a, double b) {
     return fabs(b - a) / std::max(1.0, std::max(fabs(a), fabs(b)));
@@ -177,38 +694,331 @@ struct action_test_gradient : generic_action {
   void start() {
     x = std::vector<double>(f->dim());
     ga = fncas::g_approximate(std::bind(&F::eval_as_double, f, std::placeholders::_1), f->dim());
+    if (out_of_core) {
+      fncas::use_file_backed_storage();
+    }
     fncas::x argument(f->dim());
-    gi = fncas::g_intermediate(argument, f->eval_as_expression(argument));
+    fncas::node expression = f->eval_as_expression(argument);
+    if (flatten) {
+      fncas::flatten(expression);
+    }
+    gi = fncas::g_intermediate(argument, expression);
+    gf.reset(new fncas::g_forward(argument, gi.f_));
+    const size_t nodes_before_layout = fncas::node_vector_singleton().size();
+    gr.reset(new fncas::g_streamed(argument, gi.f_));
+    gc.reset(new fncas::g_checkpointed(argument, gi.f_, 1 << 12));
+    layout_nodes = fncas::node_vector_singleton().size() - nodes_before_layout;
+    f->eval_as_static(sf, sg);
   }
   bool step() {
+    if (layout_nodes) {
+      (*serr) << "The streamed gradients should not copy the nodes.";
+      return false;
+    }
     f->gen(x);
     fncas::g::result ra = ga(x);
     fncas::g::result ri = gi(x);
+    const size_t nodes_before = fncas::node_vector_singleton().size();
+    fncas::g::result rf = (*gf)(x);
+    if (fncas::node_vector_singleton().size() != nodes_before) {
+      (*serr) << "Forward-mode differentiation should not create nodes.";
+      return false;
+    }
+    fncas::g::result rr = (*gr)(x);
+    if (fncas::node_vector_singleton().size() != nodes_before) {
+      (*serr) << "Reverse-mode differentiation should not create nodes.";
+      return false;
+    }
+    fncas::g::result rc = (*gc)(x);
+    if (fncas::node_vector_singleton().size() != nodes_before) {
+      (*serr) << "Checkpointed differentiation should not create nodes.";
+      return false;
+    }
     if (!approximate_compare(ra.value, ri.value)) {
       (*serr) << "V: " << ra.value << " != " << ri.value << " @" << iteration;
       return false;
     }
+    if (rf.value != ri.value) {
+      (*serr) << "Forward-mode V: " << rf.value << " != " << ri.value << " @" << iteration;
+      return false;
+    }
+    if (rr.value != ri.value) {
+      (*serr) << "Reverse-mode V: " << rr.value << " != " << ri.value << " @" << iteration;
+      return false;
+    }
+    if (rc.value != ri.value) {
+      (*serr) << "Checkpointed V: " << rc.value << " != " << ri.value << " @" << iteration;
+      return false;
+    }
     assert(ra.gradient.size() == ri.gradient.size());
+    assert(rf.gradient.size() == ri.gradient.size());
+    assert(rr.gradient.size() == ri.gradient.size());
+    assert(rc.gradient.size() == ri.gradient.size());
     for (size_t i = 0; i < ra.gradient.size(); ++i) {
       errors.push_back(error_between(ra.gradient[i], ri.gradient[i]));
+      errors.push_back(error_between(ra.gradient[i], rf.gradient[i]));
+      errors.push_back(error_between(ra.gradient[i], rr.gradient[i]));
+      errors.push_back(error_between(rr.gradient[i], rc.gradient[i]));
+    }
+    if (sg) {
+      fncas::g::result rs = (*sg)(x);
+      const double golden = f->eval_as_double(x);
+      if (rs.value != golden) {
+        (*serr) << "Compile-time V: " << rs.value << " != " << golden << " @" << iteration;
+        return false;
+      }
+      assert(rs.gradient.size() == ri.gradient.size());
+      for (size_t i = 0; i < ra.gradient.size(); ++i) {
+        errors.push_back(error_between(ra.gradient[i], rs.gradient[i]));
+      }
     }
     return true;
   }
   virtual bool done() override {
-    if (errors.size() < 100) {
-      (*serr) << "Not enough datapoints to test gradient.";
+    return errors_within(errors, 1e-6, 100, "gradient", *serr);
+  }
+};
+
+struct action_test_jacobian : generic_action {
+  // The vector-valued function to test is { f(x), f(x) * x[0], x[0] * x[1], x[1] * x[2], ... }.
+  // Each of the trailing outputs depends on two variables only, so the Jacobian is sparse.
+  enum { PAIRS = 3 };
+  template <typename T, typename V> static std::vector<V> residuals(const V& f, const T& x) {
+    std::vector<V> r(1, f);
+    r.push_back(f * x[0]);
+    for (size_t i = 0; i < PAIRS && i + 1 < x.size(); ++i) {
+      r.push_back(x[i] * x[i + 1]);
+    }
+    return r;
+  }
+  std::vector<double> x;
+  std::unique_ptr<fncas::j_intermediate> ji;
+  std::unique_ptr<fncas::j_compiled> jc;
+  std::vector<double> errors;
+  void start() {
+    x = std::vector<double>(f->dim());
+    fncas::x argument(f->dim());
+    ji.reset(new fncas::j_intermediate(argument, residuals(f->eval_as_expression(argument), argument)));
+    jc.reset(new fncas::j_compiled(*ji));
+  }
+  bool step() {
+    f->gen(x);
+    const std::vector<double> golden = residuals(f->eval_as_double(x), x);
+    fncas::j::result ri = (*ji)(x);
+    fncas::j::result rc = (*jc)(x);
+    if (ri.value != golden || rc.value != golden) {
+      (*serr) << "Values mismatch @" << iteration;
       return false;
     }
-    std::sort(errors.begin(), errors.end());
-    const double quantile = 0.95;
-    const double threshold = 1e-6;
-    const size_t i = static_cast<size_t>(quantile * errors.size());
-    if (errors[i] > threshold) {
-      (*serr) << "Error at quantile " << quantile << " is " << errors[i] << " which is above " << threshold;
+    if (rc.derivative != ri.derivative) {
+      (*serr) << "Compiled and intermediate Jacobians mismatch @" << iteration;
       return false;
+    }
+    for (size_t k = 0; k < golden.size(); ++k) {
+      const size_t begin = ri.row_begin[k];
+      const size_t end = ri.row_begin[k + 1];
+      if (k >= 2 && end - begin != 2) {
+        (*serr) << "Output " << k << " should depend on two variables, not " << end - begin << '.';
+        return false;
+      }
+      for (size_t i = begin; i < end; ++i) {
+        const double approximate = fncas::approximate_derivative([this, k](const std::vector<double>& x) {
+          return residuals(f->eval_as_double(x), x)[k];
+        }, x, ri.column[i]);
+        errors.push_back(action_test_gradient::error_between(approximate, ri.derivative[i]));
+      }
+    }
+    return true;
+  }
+  virtual bool done() override {
+    return errors_within(errors, 1e-6, 100, "Jacobian", *serr);
+  }
+};
+
+// Checks the single and mixed precision evaluators: the compiled code, the tape and the streamed passes should agree
+// bit for bit, all should be close to the native result, and so should the gradients evaluated in the reduced
+// precision, on the tape and reverse-mode, streamed and checkpointed.
+struct action_test_precision : generic_action {
+  template <typename P> struct evaluators {
+    std::unique_ptr<fncas::basic_f_tape<P>> ft;
+    std::unique_ptr<fncas::basic_f_compiled<P>> fc;
+    std::unique_ptr<fncas::basic_f_streamed<P>> fs;
+    std::unique_ptr<fncas::basic_g_tape<P>> gt;
+    std::unique_ptr<fncas::basic_g_streamed<P>> gs;
+    std::unique_ptr<fncas::basic_g_checkpointed<P>> gc;
+  };
+  std::vector<double> x;
+  fncas::g_intermediate gi;
+  evaluators<float> single;
+  evaluators<fncas::mixed_precision> mixed;
+  std::vector<double> errors;
+  template <typename P> static void init(evaluators<P>& e, const fncas::x& argument, const fncas::node& expression) {
+    e.ft.reset(new fncas::basic_f_tape<P>(expression));
+    e.fc.reset(new fncas::basic_f_compiled<P>(expression));
+    e.fs.reset(new fncas::basic_f_streamed<P>(expression));
+    e.gt.reset(new fncas::basic_g_tape<P>(argument, expression));
+    e.gs.reset(new fncas::basic_g_streamed<P>(argument, expression));
+    e.gc.reset(new fncas::basic_g_checkpointed<P>(argument, expression, 1 << 12));
+  }
+  void start() {
+    x = std::vector<double>(f->dim());
+    fncas::x argument(f->dim());
+    fncas::node expression = f->eval_as_expression(argument);
+    gi = fncas::g_intermediate(argument, expression);
+    init(single, argument, expression);
+    init(mixed, argument, expression);
+  }
+  template <typename P> bool check(const evaluators<P>& e, const char* name, const fncas::g::result& golden) {
+    const double vt = (*e.ft)(x);
+    const double vc = (*e.fc)(x);
+    const double vs = (*e.fs)(x);
+    if (vt != vc || vt != vs) {
+      (*serr) << name << " tape, compiled and streamed mismatch: " << vt << ", " << vc << ", " << vs << " @"
+              << iteration;
+      return false;
+    }
+    errors.push_back(action_test_gradient::error_between(golden.value, vt));
+    for (const fncas::g* g : std::vector<const fncas::g*>({e.gt.get(), e.gs.get(), e.gc.get()})) {
+      const fncas::g::result r = (*g)(x);
+      for (size_t i = 0; i < golden.gradient.size(); ++i) {
+        errors.push_back(action_test_gradient::error_between(golden.gradient[i], r.gradient[i]));
+      }
+    }
+    return true;
+  }
+  bool step() {
+    f->gen(x);
+    const fncas::g::result golden = gi(x);
+    return check(single, "Single precision", golden) && check(mixed, "Mixed precision", golden);
+  }
+  virtual bool done() override {
+    return errors_within(errors, 1e-4, 1, "precision", *serr);
+  }
+};
+
+// Checks the math kernels of both precisions against libm, on random arguments over the domain of each function
+// and on the special values, see fncas_math.h, and the packed kernels against the scalar ones.
+// Does not depend on the function.
+struct action_test_math : generic_action {
+  enum { ARGUMENTS = 1000 };
+  std::mt19937 random;
+  std::vector<double> x;
+  std::vector<double> y;
+  std::vector<float> x_single;
+  std::vector<float> y_single;
+  // The difference in the units in the last place of `golden`.
+  template <typename T> static double ulps_between(T golden, T test) {
+    if (test == golden || (std::isnan(test) && std::isnan(golden))) {
+      return 0.0;
+    } else if (!std::isfinite(test) || !std::isfinite(golden)) {
+      return std::numeric_limits<double>::infinity();
     } else {
-      return true;
+      const T ulp = std::nextafter(std::fabs(golden), std::numeric_limits<T>::infinity()) - std::fabs(golden);
+      return std::fabs(static_cast<double>(test) - static_cast<double>(golden)) / ulp;
+    }
+  }
+  // The domains span the finite values of `T`, down to the subnormals.
+  template <typename T> T argument(fncas::function_t function) {
+    const bool single = std::is_same<T, float>::value;
+    std::uniform_real_distribution<double> u(0.0, 1.0);
+    const double sign = u(random) < 0.5 ? -1.0 : 1.0;
+    switch (function) {
+      case fncas::function_t::sqrt:
+        return static_cast<T>(1e10 * u(random));
+      case fncas::function_t::exp:
+        return static_cast<T>(single ? -104.0 + 192.7 * u(random) : -745.0 + 1454.7 * u(random));
+      case fncas::function_t::log:
+        return static_cast<T>(single ? exp(-103.0 + 191.7 * u(random)) : exp(-713.0 + 1403.0 * u(random)));
+      case fncas::function_t::asin:
+      case fncas::function_t::acos:
+        return static_cast<T>(sign * u(random));
+      case fncas::function_t::atan:
+        return static_cast<T>(sign * (single ? exp(-87.0 + 174.0 * u(random)) : exp(-690.0 + 1380.0 * u(random))));
+      case fncas::function_t::neg:
+      case fncas::function_t::sqr:
+      case fncas::function_t::abs:
+      case fncas::function_t::sign:
+        return static_cast<T>(sign * (single ? exp(-87.0 + 174.0 * u(random)) : exp(-700.0 + 1400.0 * u(random))));
+      default:
+        // Half of the trigonometric arguments are within the range the kernels reduce accurately.
+        return static_cast<T>(sign * FNCAS_MATH_TRIG_LIMIT * (u(random) < 0.5 ? u(random) : 1.0 + u(random)));
+    }
+  }
+  // The golden value of single precision is the one of libm in double precision, rounded.
+  template <typename T> bool check(fncas::function_t function, std::vector<T>& x, std::vector<T>& y) {
+    const double special[] = {0.0, -0.0, 1.0, -1.0, 1e-40, 1e-310, 89.0, -105.0, 710.0, -746.0,
+                              std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity(),
+                              std::numeric_limits<double>::quiet_NaN()};
+    x.assign(special, special + sizeof(special) / sizeof(special[0]));
+    while (x.size() < ARGUMENTS) {
+      x.push_back(argument<T>(function));
+    }
+    y.resize(x.size());
+    const double max_ulp = fncas::math_kernel_max_ulp<T>(function);
+    fncas::apply_math_kernel(function, x.data(), y.data(), x.size());
+    for (size_t i = 0; i < x.size(); ++i) {
+      const T golden = static_cast<T>(fncas::apply_function<double>(function, x[i]));
+      if (!(ulps_between(golden, y[i]) <= max_ulp)) {
+        (*serr) << fncas::function_as_string(function) << '(' << std::setprecision(17) << x[i] << ") is " << y[i]
+                << " instead of " << golden << " in " << (std::is_same<T, float>::value ? "single" : "double")
+                << " precision @" << iteration;
+        return false;
+      }
+    }
+    if (!matches_scalar(function, x, y, x.size(), "apply_math_kernel()", false)) {
+      return false;
     }
+#ifdef FNCAS_MATH_PACKED
+    // The packed kernels of the instruction set the CPU does not dispatch to are checked as well. They leave
+    // the trigonometric arguments beyond FNCAS_MATH_TRIG_LIMIT to libm, see apply_math_kernel().
+    const size_t sse2 = fncas::math::sse2::apply_packed_kernel(function, x.data(), y.data(), x.size());
+    if (!matches_scalar(function, x, y, sse2, "the SSE2 kernels", true)) {
+      return false;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+      const size_t avx2 = fncas::math::avx2::apply_packed_kernel(function, x.data(), y.data(), x.size());
+      if (!matches_scalar(function, x, y, avx2, "the AVX2 kernels", true)) {
+        return false;
+      }
+    }
+#endif
+    return true;
+  }
+  // The values computed for arrays match the scalar kernels the NASM code calls bit for bit, NaNs aside. The
+  // `reduced` ones, the packed kernels, are not compared beyond the range of the trigonometric reduction.
+  template <typename T>
+  bool matches_scalar(fncas::function_t function,
+                      const std::vector<T>& x,
+                      const std::vector<T>& y,
+                      size_t n,
+                      const char* what,
+                      bool reduced) {
+    const typename fncas::math_kernel_table<T>::kernel_t kernel =
+        fncas::math_kernel_table<T>::kernels()[static_cast<size_t>(function)];
+    const bool trigonometric = function == fncas::function_t::sin || function == fncas::function_t::cos ||
+                               function == fncas::function_t::tan;
+    for (size_t i = 0; i < n; ++i) {
+      if (reduced && trigonometric && !(std::fabs(static_cast<double>(x[i])) < FNCAS_MATH_TRIG_LIMIT)) {
+        continue;
+      }
+      const T scalar = kernel(x[i]);
+      if (memcmp(&scalar, &y[i], sizeof(T)) && !(std::isnan(scalar) && std::isnan(y[i]))) {
+        (*serr) << fncas::function_as_string(function) << '(' << std::setprecision(17) << x[i] << ") is " << y[i]
+                << " from " << what << " instead of " << scalar << " from the scalar kernel in "
+                << (std::is_same<T, float>::value ? "single" : "double") << " precision @" << iteration;
+        return false;
+      }
+    }
+    return true;
+  }
+  bool step() {
+    for (size_t i = 0; i < static_cast<size_t>(fncas::function_t::end); ++i) {
+      const fncas::function_t function = static_cast<fncas::function_t>(i);
+      if (!check(function, x, y) || !check(function, x_single, y_single)) {
+        return false;
+      }
+    }
+    return true;
   }
 };
 
@@ -231,7 +1041,36 @@ int main(int argc, char* argv[]) {
       actions["gen_eval_eval"].reset(new action_gen_eval_eval());
       actions["gen_eval_ieval"].reset(new action_gen_eval_ieval());
       actions["gen_eval_ceval"].reset(new action_gen_eval_ceval());
+      actions["gen_eval_ieval_profiled"].reset(new action_gen_eval_ieval_profiled());
+      actions["gen_eval_peval"].reset(new action_gen_eval_peval());
+      actions["gen_eval_peval_fine"].reset(new action_gen_eval_peval_fine());
+      actions["gen_eval_meval"].reset(new action_gen_eval_meval());
+      actions["gen_eval_seval"].reset(new action_gen_eval_seval());
+      actions["gen_eval_teval"].reset(new action_gen_eval_teval());
+      actions["gen_eval_teval_float"].reset(new action_gen_eval_teval_float());
+      actions["gen_eval_teval_mixed"].reset(new action_gen_eval_teval_mixed());
+      actions["gen_eval_ceval_float"].reset(new action_gen_eval_ceval_float());
+      actions["gen_eval_ceval_mixed"].reset(new action_gen_eval_ceval_mixed());
+      actions["gen_eval_ceval_kernels"].reset(new action_gen_eval_ceval_kernels());
+      actions["gen_eval_beval"].reset(new action_gen_eval_beval());
+      actions["gen_eval_ieval_flat"].reset(new action_gen_eval_ieval_flat());
+      actions["gen_eval_ceval_flat"].reset(new action_gen_eval_ceval_flat());
+      actions["gen_eval_ieval_balanced"].reset(new action_gen_eval_ieval_balanced());
+      actions["gen_eval_ceval_balanced"].reset(new action_gen_eval_ceval_balanced());
+      actions["gen_eval_ieval_reordered"].reset(new action_gen_eval_ieval_reordered());
+      actions["gen_eval_ceval_reordered"].reset(new action_gen_eval_ceval_reordered());
+      actions["gen_eval_oeval"].reset(new action_gen_eval_oeval());
+      actions["stream_eval"].reset(new action_stream_eval());
+      actions["stream_eval_gradient"].reset(new action_stream_eval(true));
       actions["test_gradient"].reset(new action_test_gradient());
+      actions["test_gradient_flat"].reset(new action_test_gradient(true));
+      actions["test_gradient_out_of_core"].reset(new action_test_gradient(false, true));
+      actions["test_jacobian"].reset(new action_test_jacobian());
+      actions["test_precision"].reset(new action_test_precision());
+      actions["test_math"].reset(new action_test_math());
+      actions["test_memory"].reset(new action_test_memory());
+      actions["test_arena"].reset(new action_test_arena());
+      actions["test_rows"].reset(new action_test_rows());
       action* action_handler = actions[action_name].get();
       if (!action_handler) {
         std::cerr << "Action '" << action_name << "' is not defined." << std::endl;
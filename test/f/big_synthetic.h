@@ -0,0 +1,16 @@
+struct big_synthetic : F {
+  INCLUDE_IN_PERF_TEST;
+  static const synthetic_program& program() {
+    static const synthetic_program program(synthetic_params("dim=1000,depth=16,width=1000"));
+    return program;
+  }
+  template <typename T> static typename fncas::output<T>::type f(const T& x) {
+    return program().eval<typename fncas::output<T>::type>(x);
+  }
+  std::uniform_real_distribution<double> distribution_;
+  big_synthetic() : distribution_(-1.0, 1.0) {
+    for (int32_t i = 0; i < program().dim_; ++i) {
+      add_var(distribution_);
+    }
+  }
+};
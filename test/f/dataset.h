@@ -0,0 +1,37 @@
+struct dataset : F {
+  INCLUDE_IN_SMOKE_TEST;
+  enum { DIM = 3, ROWS = 1000, COLS = 3 };
+  static const std::vector<double>& data() {
+    static std::vector<double> data;
+    if (data.empty()) {
+      std::mt19937 rng(42);
+      std::normal_distribution<double> distribution;
+      for (size_t i = 0; i < ROWS * COLS; ++i) {
+        data.push_back(distribution(rng));
+      }
+    }
+    return data;
+  }
+  // The loss of a single row, as a subexpression of the current row of the loop, or as a plain value.
+  // The sine does not depend on the row, and is only evaluated once per loop.
+  template <typename T, typename R> static typename fncas::output<T>::type loss(const T& x, const R& d) {
+    const typename fncas::output<T>::type e = x[0] * d[0] + x[1] * d[1] - d[2];
+    return e * e + cos(e) * sin(x[2] * x[2]);
+  }
+  static double f(const std::vector<double>& x) {
+    double r = 0.0;
+    for (size_t i = 0; i < ROWS; ++i) {
+      r += loss(x, &data()[i * COLS]);
+    }
+    return r;
+  }
+  static fncas::node f(const fncas::x& x) {
+    return fncas::sum_over_rows(fncas::table(data(), COLS), [&x](const fncas::row& d) { return loss(x, d); });
+  }
+  std::normal_distribution<double> distribution_;
+  dataset() {
+    for (size_t i = 0; i < DIM; ++i) {
+      add_var(distribution_);
+    }
+  }
+};
@@ -0,0 +1,61 @@
+struct operators : F {
+  INCLUDE_IN_SMOKE_TEST;
+  enum { DIM = 100 };
+  // The native counterparts of the operators the standard library has no names for, same order of operations.
+  static double sqr(double x) {
+    return x * x;
+  }
+  static fncas::node sqr(const fncas::node& x) {
+    return ::sqr(x);
+  }
+  static double sign(double x) {
+    return (x > 0) - (x < 0);
+  }
+  static fncas::node sign(const fncas::node& x) {
+    return ::sign(x);
+  }
+  static double powi(double x, int32_t n) {
+    return fncas::integer_power(x, n);
+  }
+  static fncas::node powi(const fncas::node& x, int32_t n) {
+    return pow(x, n);
+  }
+  template <typename T> static typename fncas::output<T>::type f(const T& x) {
+    typename fncas::output<T>::type r = 0.0;
+    for (size_t i = 2; i < DIM; ++i) {
+      switch (i % 8) {
+        case 0:
+          r += sqr(x[i]);
+          break;
+        case 1:
+          r += powi(x[i], 3) + powi(sqr(x[i]) + 1.0, -2);
+          break;
+        case 2:
+          r += pow(sqr(x[i]) + 1.0, 0.7);
+          break;
+        case 3:
+          r += pow(sqr(x[i]) + 1.0, x[i - 1] * 0.1);
+          break;
+        case 4:
+          r += fabs(x[i]) * sign(x[i - 1]);
+          break;
+        case 5:
+          r += -x[i];
+          break;
+        case 6:
+          r += fmin(x[i], x[i - 1]) + fmax(x[i], x[i - 2]);
+          break;
+        case 7:
+          r = fma(x[i], x[i - 1], r);
+          break;
+      }
+    }
+    return r;
+  }
+  std::normal_distribution<double> distribution_;
+  operators() {
+    for (size_t i = 0; i < DIM; ++i) {
+      add_var(distribution_);
+    }
+  }
+};
@@ -0,0 +1,32 @@
+struct product : F {
+  INCLUDE_IN_SMOKE_TEST;
+  enum { DIM = 10 };
+  template <typename T> static typename fncas::output<T>::type f(const T& x) {
+    typename fncas::output<T>::type r = 1.0;
+    for (size_t i = 0; i < DIM; ++i) {
+      r *= x[i] * 0.1 + 1.0;
+    }
+    return r;
+  }
+  static void static_evaluators(std::unique_ptr<fncas::f>& f, std::unique_ptr<fncas::g>& g) {
+    using fncas::ct::x;
+    const auto e = fncas::ct::product(x<0>() * 0.1 + 1.0,
+                                      x<1>() * 0.1 + 1.0,
+                                      x<2>() * 0.1 + 1.0,
+                                      x<3>() * 0.1 + 1.0,
+                                      x<4>() * 0.1 + 1.0,
+                                      x<5>() * 0.1 + 1.0,
+                                      x<6>() * 0.1 + 1.0,
+                                      x<7>() * 0.1 + 1.0,
+                                      x<8>() * 0.1 + 1.0,
+                                      x<9>() * 0.1 + 1.0);
+    f.reset(new fncas::ct::f_static<decltype(e)>(e));
+    g.reset(new fncas::ct::g_static<decltype(e)>(e));
+  }
+  std::normal_distribution<double> distribution_;
+  product() {
+    for (size_t i = 0; i < DIM; ++i) {
+      add_var(distribution_);
+    }
+  }
+};
@@ -8,6 +8,12 @@ struct sum : F {
     }
     return r;
   }
+  static void static_evaluators(std::unique_ptr<fncas::f>& f, std::unique_ptr<fncas::g>& g) {
+    using fncas::ct::x;
+    const auto e = fncas::ct::sum(x<0>(), x<1>(), x<2>(), x<3>(), x<4>(), x<5>(), x<6>(), x<7>(), x<8>(), x<9>());
+    f.reset(new fncas::ct::f_static<decltype(e)>(e));
+    g.reset(new fncas::ct::g_static<decltype(e)>(e));
+  }
   std::normal_distribution<double> distribution_;
   sum() {
     for (size_t i = 0; i < DIM; ++i) {
@@ -0,0 +1,18 @@
+struct synthetic : F {
+  INCLUDE_IN_SMOKE_TEST;
+  // All the operators, the shared subexpressions, the reused variables and a fan-out, small enough to smoke test.
+  static const synthetic_program& program() {
+    static const synthetic_program program(
+        synthetic_params("dim=20,depth=6,width=20,fan_in=3,fan_out=6,sharing=0.5"));
+    return program;
+  }
+  template <typename T> static typename fncas::output<T>::type f(const T& x) {
+    return program().eval<typename fncas::output<T>::type>(x);
+  }
+  std::uniform_real_distribution<double> distribution_;
+  synthetic() : distribution_(-1.0, 1.0) {
+    for (int32_t i = 0; i < program().dim_; ++i) {
+      add_var(distribution_);
+    }
+  }
+};
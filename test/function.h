@@ -49,6 +49,8 @@ class F {
   // To support registration macros.
   virtual double eval_as_double(const std::vector<double>& x) const = 0;
   virtual fncas::output<fncas::x>::type eval_as_expression(const fncas::x& x) const = 0;
+  // Leaves the evaluators empty unless the function is also defined as a compile-time expression.
+  virtual void eval_as_static(std::unique_ptr<fncas::f>& f, std::unique_ptr<fncas::g>& g) const = 0;
 };
 
 std::map<std::string, F*> registered_functions;
@@ -56,6 +58,15 @@ template <typename T> void register_function(const char* name, T* impl) {
   registered_functions[name] = impl;
 }
 
+// Functions also defined as compile-time expressions, see fncas_static.h, provide `static_evaluators()`.
+template <typename T>
+auto call_static_evaluators(std::unique_ptr<fncas::f>& f, std::unique_ptr<fncas::g>& g, int)
+    -> decltype(T::static_evaluators(f, g)) {
+  T::static_evaluators(f, g);
+}
+template <typename T> void call_static_evaluators(std::unique_ptr<fncas::f>&, std::unique_ptr<fncas::g>&, long) {
+}
+
 // To support registration macros.
 #define REGISTER_FUNCTION(F)                                                            \
   struct enhanced_##F : F {                                                             \
@@ -65,6 +76,10 @@ template <typename T> void register_function(const char* name, T* impl) {
     virtual fncas::output<fncas::x>::type eval_as_expression(const fncas::x& x) const { \
       return F::f(x);                                                                   \
     }                                                                                   \
+    virtual void eval_as_static(std::unique_ptr<fncas::f>& f,                           \
+                                std::unique_ptr<fncas::g>& g) const {                   \
+      call_static_evaluators<F>(f, g, 0);                                               \
+    }                                                                                   \
   };                                                                                    \
   static enhanced_##F F##_impl;                                                         \
   static struct F##_registerer {                                                        \
@@ -75,3 +90,223 @@ template <typename T> void register_function(const char* name, T* impl) {
 
 #define INCLUDE_IN_SMOKE_TEST const bool INCLUDE_IN_SMOKE_TEST_ = true
 #define INCLUDE_IN_PERF_TEST const bool INCLUDE_IN_PERF_TEST_ = true
+
+// Synthetic workloads, to see how the evaluators and the differentiator scale along each axis of the function.
+//
+// The function is `depth` layers of `width` nodes over `dim` variables, its value is the mean of the last layer.
+// Each node combines `fan_in` operands. An operand is a variable with the probability `variables`, and always
+// in the first layer, otherwise a node of the previous layer. Variables are taken in turn, or, with
+// the probability `variable_reuse`, at random, so that the same variables are used over and over. The nodes
+// of the previous layer are taken in turn too, from its first `width * fan_in / fan_out`, so that each of those
+// is used `fan_out` times, `fan_in` by default, and the rest of the layer is left out. Or, with the probability
+// `sharing`, a random node of any layer before is taken, so that the subexpressions are shared more.
+// The operators are drawn with the weights `ops` of add:multiply:divide:math. Each operator maps [-1, 1]
+// into itself, so that the values neither overflow nor vanish however deep the function is:
+// the mean for add, a / (1 + b * b) for divide, and sin, cos, log(1 + a * a), sqrt(1 + a * a) - 1 for math,
+// applied to the mean of the operands. The same parameters, `seed` included, generate the same function.
+struct synthetic_params {
+  int32_t dim = 100;
+  int32_t depth = 4;
+  int32_t width = 100;
+  int32_t fan_in = 2;
+  // Zero for `fan_in`, which is also the least it can be, as the layers are of the same width.
+  int32_t fan_out = 0;
+  double variables = 0.25;
+  double variable_reuse = 0.5;
+  double sharing = 0.25;
+  int32_t ops[4] = {4, 3, 1, 2};
+  uint32_t seed = 42;
+  // Overrides the defaults by a comma-separated list, such as "dim=1000,depth=8,sharing=0.5,ops=4:3:1:2".
+  // Throws std::invalid_argument, saying what is wrong, for an unknown or malformed item or a value out of range.
+  explicit synthetic_params(const std::string& spec = "") {
+    const auto fail = [&spec](const std::string& what) {
+      throw std::invalid_argument("Invalid synthetic function '" + spec + "': " + what + ".");
+    };
+    // The numbers should take the whole value: std::stoll() and std::stod() stop at the first character they can not
+    // parse, and throw if there is none, or if the number is out of range.
+    const auto to_integer = [&fail](const std::string& name, const std::string& value, int64_t min, int64_t max) {
+      size_t end = 0;
+      int64_t result = 0;
+      try {
+        result = std::stoll(value, &end);
+      } catch (const std::logic_error&) {
+      }
+      if (value.empty() || end != value.size() || result < min || result > max) {
+        fail("`" + name + "` is '" + value + "', not an integer from " + std::to_string(min) + " to " +
+             std::to_string(max));
+      }
+      return result;
+    };
+    const auto to_double = [&fail](const std::string& name, const std::string& value) {
+      size_t end = 0;
+      double result = 0.0;
+      try {
+        result = std::stod(value, &end);
+      } catch (const std::logic_error&) {
+      }
+      if (value.empty() || end != value.size()) {
+        fail("`" + name + "` is '" + value + "', not a number");
+      }
+      return result;
+    };
+    const int64_t int32_max = std::numeric_limits<int32_t>::max();
+    std::istringstream is(spec);
+    std::string item;
+    while (std::getline(is, item, ',')) {
+      const size_t eq = item.find('=');
+      if (eq == std::string::npos) {
+        fail("'" + item + "' is not `name=value`");
+      }
+      const std::string name = item.substr(0, eq);
+      const std::string value = item.substr(eq + 1);
+      if (name == "dim") {
+        dim = static_cast<int32_t>(to_integer(name, value, 1, int32_max));
+      } else if (name == "depth") {
+        depth = static_cast<int32_t>(to_integer(name, value, 1, int32_max));
+      } else if (name == "width") {
+        width = static_cast<int32_t>(to_integer(name, value, 1, int32_max));
+      } else if (name == "fan_in") {
+        fan_in = static_cast<int32_t>(to_integer(name, value, 1, int32_max));
+      } else if (name == "fan_out") {
+        fan_out = static_cast<int32_t>(to_integer(name, value, 0, int32_max));
+      } else if (name == "variables") {
+        variables = to_double(name, value);
+      } else if (name == "variable_reuse") {
+        variable_reuse = to_double(name, value);
+      } else if (name == "sharing") {
+        sharing = to_double(name, value);
+      } else if (name == "ops") {
+        int length = 0;
+        if (sscanf(value.c_str(), "%d:%d:%d:%d%n", &ops[0], &ops[1], &ops[2], &ops[3], &length) != 4 ||
+            static_cast<size_t>(length) != value.size()) {
+          fail("`ops` is '" + value + "', not four weights such as 4:3:1:2");
+        }
+      } else if (name == "seed") {
+        seed = static_cast<uint32_t>(to_integer(name, value, 0, std::numeric_limits<uint32_t>::max()));
+      } else {
+        fail("`" + name + "` is not a parameter");
+      }
+    }
+    if (fan_out && fan_out < fan_in) {
+      fail("`fan_out` should be at least `fan_in`");
+    }
+    if (!(variables >= 0 && variables <= 1) || !(variable_reuse >= 0 && variable_reuse <= 1) ||
+        !(sharing >= 0 && sharing <= 1)) {
+      fail("`variables`, `variable_reuse` and `sharing` are probabilities, from 0 to 1");
+    }
+    if (ops[0] < 0 || ops[1] < 0 || ops[2] < 0 || ops[3] < 0 || !(ops[0] + ops[1] + ops[2] + ops[3])) {
+      fail("`ops` are weights, non-negative and not all zero");
+    }
+  }
+};
+
+// The generated function, evaluated the same way as a plain double and as a node.
+struct synthetic_program {
+  enum class op_t : int8_t { add = 0, multiply = 1, divide = 2, math = 3 };
+  struct instruction {
+    op_t op;
+    // For op_t::math: sin, cos, log(1 + a * a), sqrt(1 + a * a) - 1.
+    int8_t function;
+    // Variables are [0, dim), the nodes follow them in order.
+    std::vector<int32_t> operands;
+  };
+  int32_t dim_;
+  int32_t width_;
+  std::vector<instruction> instructions_;
+  explicit synthetic_program(const synthetic_params& params) : dim_(params.dim), width_(params.width) {
+    std::mt19937 rng(params.seed);
+    std::uniform_real_distribution<double> coin(0.0, 1.0);
+    std::discrete_distribution<int> op(params.ops, params.ops + 4);
+    std::uniform_int_distribution<int> function(0, 3);
+    int32_t next_variable = 0;
+    const int32_t fan_out = params.fan_out ? params.fan_out : params.fan_in;
+    const int32_t used = std::max(static_cast<int32_t>(static_cast<int64_t>(width_) * params.fan_in / fan_out), 1);
+    for (int32_t layer = 0; layer < params.depth; ++layer) {
+      const int32_t begin = dim_ + layer * width_;
+      int32_t next_node = 0;
+      for (int32_t j = 0; j < width_; ++j) {
+        instruction i;
+        i.op = static_cast<op_t>(op(rng));
+        i.function = static_cast<int8_t>(function(rng));
+        for (int32_t k = 0; k < params.fan_in; ++k) {
+          if (!layer || coin(rng) < params.variables) {
+            i.operands.push_back(coin(rng) < params.variable_reuse ? std::uniform_int_distribution<int32_t>(
+                                                                         0, dim_ - 1)(rng)
+                                                                   : next_variable++ % dim_);
+          } else if (coin(rng) < params.sharing) {
+            i.operands.push_back(std::uniform_int_distribution<int32_t>(dim_, begin - 1)(rng));
+          } else {
+            i.operands.push_back(begin - width_ + next_node++ % used);
+          }
+        }
+        instructions_.push_back(i);
+      }
+    }
+  }
+  // An upper bound of the nodes eval() creates as fncas::node, for reserving them at once.
+  size_t nodes() const {
+    size_t result = dim_ + width_ + 3;
+    for (const instruction& i : instructions_) {
+      result += 4 * (i.operands.size() - 1) + 6;
+    }
+    return result;
+  }
+  template <typename T, typename X> T eval(const X& x) const {
+    std::vector<T> v;
+    v.reserve(dim_ + instructions_.size());
+    for (int32_t i = 0; i < dim_; ++i) {
+      v.push_back(x[i]);
+    }
+    for (const instruction& i : instructions_) {
+      T r = v[i.operands[0]];
+      for (size_t k = 1; k < i.operands.size(); ++k) {
+        const T& b = v[i.operands[k]];
+        if (i.op == op_t::multiply) {
+          r = r * b;
+        } else if (i.op == op_t::divide) {
+          r = r / (1.0 + b * b);
+        } else {
+          r = (r + b) * 0.5;
+        }
+      }
+      if (i.op == op_t::math) {
+        if (i.function == 0) {
+          r = sin(r);
+        } else if (i.function == 1) {
+          r = cos(r);
+        } else if (i.function == 2) {
+          r = log(1.0 + r * r);
+        } else {
+          r = sqrt(1.0 + r * r) - 1.0;
+        }
+      }
+      v.push_back(r);
+    }
+    T result = 0.0;
+    for (size_t i = v.size() - width_; i < v.size(); ++i) {
+      result += v[i];
+    }
+    return result * (1.0 / width_);
+  }
+};
+
+// The synthetic function for the parameters given at runtime, such as the ones of `--synthetic` of the benchmark.
+struct synthetic_function : F {
+  const synthetic_program program_;
+  std::uniform_real_distribution<double> distribution_;
+  explicit synthetic_function(const std::string& spec)
+      : program_(synthetic_params(spec)), distribution_(-1.0, 1.0) {
+    for (int32_t i = 0; i < program_.dim_; ++i) {
+      add_var(distribution_);
+    }
+  }
+  virtual double eval_as_double(const std::vector<double>& x) const {
+    return program_.eval<double>(x);
+  }
+  virtual fncas::output<fncas::x>::type eval_as_expression(const fncas::x& x) const {
+    fncas::reserve_nodes(program_.nodes());
+    return program_.eval<fncas::node>(x);
+  }
+  virtual void eval_as_static(std::unique_ptr<fncas::f>&, std::unique_ptr<fncas::g>&) const {
+  }
+};
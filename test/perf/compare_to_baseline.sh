@@ -0,0 +1,120 @@
+#!/bin/bash
+#
+# Compares the results of a perf test run against the baseline, and adds them to the baseline.
+# Usage: ./compare_to_baseline.sh <results> <baseline>
+#
+# Each line of the results is `host compiler jit function metric value`, tab-separated, the value being
+# a throughput, the higher the better. The baseline keeps the last HISTORY values for each key, which is
+# the line without the value, so that the runs on different hosts and with different compilers are kept apart.
+#
+# A value is a regression if it is below the median of the values kept by more than the threshold. The threshold
+# is noise-aware: the larger of MIN_THRESHOLD and NOISE_SIGMAS times the relative noise of the values kept,
+# estimated as their median absolute deviation, scaled to match the standard deviation. While fewer than
+# three values are kept for the key, DEFAULT_THRESHOLD is used instead.
+#
+# Prints the comparison, and exits with 1 if there are regressions, in which case the baseline is left as it is.
+# The keys not in the baseline yet are added to it.
+
+HISTORY=${HISTORY:-5}
+MIN_THRESHOLD=${MIN_THRESHOLD:-0.05}
+DEFAULT_THRESHOLD=${DEFAULT_THRESHOLD:-0.10}
+NOISE_SIGMAS=${NOISE_SIGMAS:-3}
+
+if [ $# != 2 ] ; then
+  echo "Usage: $0 <results> <baseline>" >/dev/stderr
+  exit 2
+fi
+RESULTS="$1"
+BASELINE="$2"
+touch "$BASELINE"
+
+UPDATED=$(mktemp)
+awk -F '\t' -v history=$HISTORY -v min_threshold=$MIN_THRESHOLD -v default_threshold=$DEFAULT_THRESHOLD \
+    -v noise_sigmas=$NOISE_SIGMAS -v updated="$UPDATED" '
+  function median(a, n,    i, j, t, b) {
+    for (i = 1; i <= n; ++i) {
+      b[i] = a[i];
+    }
+    for (i = 2; i <= n; ++i) {
+      for (j = i; j > 1 && b[j - 1] > b[j]; --j) {
+        t = b[j]; b[j] = b[j - 1]; b[j - 1] = t;
+      }
+    }
+    return (n % 2) ? b[(n + 1) / 2] : (b[n / 2] + b[n / 2 + 1]) / 2;
+  }
+  # The baseline: the key, then the values kept, oldest first.
+  FILENAME == ARGV[1] {
+    key = $1;
+    for (i = 2; i < NF; ++i) {
+      key = key "\t" $i;
+    }
+    kept[key] = $NF;
+    order[++keys] = key;
+    next;
+  }
+  {
+    key = $1;
+    for (i = 2; i < NF; ++i) {
+      key = key "\t" $i;
+    }
+    value = $NF + 0;
+    if (value <= 0) {
+      # The throughputs derived by subtracting the time to generate the inputs are within the noise
+      # for the tiniest functions, and are not kept.
+      printf("UNMEASURED  %s\n", key);
+      next;
+    }
+    if (!(key in kept)) {
+      order[++keys] = key;
+      kept[key] = "";
+      printf("NEW         %s: %.2f\n", key, value);
+    } else {
+      n = split(kept[key], values, " ");
+      m = median(values, n);
+      if (n >= 3) {
+        for (i = 1; i <= n; ++i) {
+          deviations[i] = (values[i] > m) ? values[i] - m : m - values[i];
+        }
+        noise = 1.4826 * median(deviations, n) / m;
+        threshold = noise_sigmas * noise;
+        if (threshold < min_threshold) {
+          threshold = min_threshold;
+        }
+      } else {
+        threshold = default_threshold;
+      }
+      change = value / m - 1;
+      if (change < -threshold) {
+        status = "REGRESSION";
+        ++regressions;
+      } else if (change > threshold) {
+        status = "IMPROVEMENT";
+      } else {
+        status = "OK";
+      }
+      printf("%-11s %s: %.2f vs. %.2f, %+.1f%%, threshold %.1f%%\n",
+             status, key, value, m, 100 * change, 100 * threshold);
+    }
+    n = split(kept[key] " " value, values, " ");
+    kept[key] = "";
+    for (i = (n > history ? n - history + 1 : 1); i <= n; ++i) {
+      kept[key] = kept[key] (kept[key] == "" ? "" : " ") values[i];
+    }
+  }
+  END {
+    for (k = 1; k <= keys; ++k) {
+      print order[k] "\t" kept[order[k]] > updated;
+    }
+    if (regressions) {
+      printf("%d regression(s).\n", regressions);
+      exit 1;
+    }
+  }' "$BASELINE" "$RESULTS"
+RESULT=$?
+
+if [ $RESULT == 0 ] ; then
+  mv -f "$UPDATED" "$BASELINE"
+else
+  rm -f "$UPDATED"
+fi
+exit $RESULT
@@ -5,6 +5,12 @@ BINARY=autogen/eval
 # Half a minute per each QPS measurement.
 TEST_SECONDS=30
 
+# The throughputs measured are compared against the ones of the previous runs on this host kept in the baseline,
+# see compare_to_baseline.sh, and the test fails on significant slowdowns.
+BASELINE=${BASELINE:-baseline.tsv}
+RESULTS=autogen/results.tsv
+HOST=$(hostname)
+
 SAVE_IFS="$IFS"
 
 # Put together the functions to run the perf test against.
@@ -19,6 +25,7 @@ done
 echo 'Functions: '$FUNCTIONS >/dev/stderr
 
 mkdir -p autogen
+rm -f $RESULTS
 cp -f ../function.h autogen/functions.h
 for i in $FUNCTIONS_FILES ; do
   cat $i >> autogen/functions.h
@@ -35,7 +42,7 @@ CMDLINES=''
 for compiler in $COMPILERS ; do
   for options in $OPTIONS ; do
     for jit in $JIT ; do
-      CMDLINES+=$compiler' --std=c++11 '$options' -DFNCAS_JIT='$jit' ../eval.cc -I $PWD/autogen -o $BINARY -ldl:'
+      CMDLINES+=$compiler' --std=c++11 '$options' -DFNCAS_JIT='$jit' ../eval.cc -I $PWD/autogen -o $BINARY -ldl -pthread:'
     done
   done
 done
@@ -47,10 +54,19 @@ echo '<ul>'
 echo '<li>Native: When C (C++, actually) code of the function is compiled by the compiler itself and is being evaluated.</li>'
 echo '<li>Intermediate: When the code of the function is parsed into the intermediate format and evaluated by interpretation.</li>'
 echo '<li>Compiled: When the intermediate code is being converted to a source file, compiled and then linked as an .so library.</li>'
+echo '<li>Parallel: When the intermediate code is evaluated level by level by all the cores of the machine.</li>'
+echo '<li>Tape, float, mixed: When the tape of the function is evaluated in double, single, or single precision with double precision sums, and the same for the compiled code. The largest relative error against native is in parentheses.</li>'
+echo '<li>Kernels, batched: When the compiled code calls the polynomial math kernels instead of libm, and when the tape is evaluated for batches of inputs at once, with the kernels vectorized.</li>'
+echo '<li>Balanced: When the chains of additions and multiplications are rebalanced into trees of logarithmic depth, which shortens the dependency chains at the cost of reassociation.</li>'
+echo '<li>Reordered: When the nodes of the function are copied into a contiguous block in the order they are evaluated in, and in the depth-first order keeping the fewest values live for the compiled code.</li>'
+echo '<li>Streamed: When the function is evaluated by all the cores for the points of a memory-mapped file, the results written into another one, with the input and output throughput in parentheses.</li>'
 echo '</ul>'
 
 for cmdline in $CMDLINES ; do
   echo $cmdline >/dev/stderr
+  compiler=$(echo $cmdline | cut -f1 -d' ')
+  compiler_version=$compiler' '$($compiler -dumpversion)
+  jit=$(echo $cmdline | sed 's/.*-DFNCAS_JIT=\([A-Z]*\).*/\1/')
 
   echo '<h1>'$cmdline'</h1>'
   echo '<pre>'
@@ -64,6 +80,22 @@ for cmdline in $CMDLINES ; do
   echo -n '<td align=right>C/N, %</td>'
   echo -n '<td align=right>C/I, times</td>'
   echo -n '<td align=right>Compilation time, s</td>'
+  echo -n '<td align=right>Parallel (P), kQPS</td>'
+  echo -n '<td align=right>P/I, times</td>'
+  echo -n '<td align=right>Tape (T), kQPS</td>'
+  echo -n '<td align=right>T float, kQPS</td>'
+  echo -n '<td align=right>T mixed, kQPS</td>'
+  echo -n '<td align=right>C float, kQPS</td>'
+  echo -n '<td align=right>C mixed, kQPS</td>'
+  echo -n '<td align=right>C kernels, kQPS</td>'
+  echo -n '<td align=right>Batched (B), kQPS</td>'
+  echo -n '<td align=right>B/T, times</td>'
+  echo -n '<td align=right>I balanced, kQPS</td>'
+  echo -n '<td align=right>C balanced (CB), kQPS</td>'
+  echo -n '<td align=right>CB/C, times</td>'
+  echo -n '<td align=right>I reordered, kQPS</td>'
+  echo -n '<td align=right>C reordered, kQPS</td>'
+  echo -n '<td align=right>Streamed, krows/s</td>'
   echo '</tr>'
 
   rm -f $BINARY
@@ -78,7 +110,10 @@ for cmdline in $CMDLINES ; do
   for function in $FUNCTIONS ; do 
     echo '  '$function >/dev/stderr
     data=''
-    for action in gen gen_eval_eval gen_eval_ieval gen_eval_ceval ; do
+    for action in gen gen_eval_eval gen_eval_ieval gen_eval_ceval gen_eval_peval \
+                  gen_eval_teval gen_eval_teval_float gen_eval_teval_mixed gen_eval_ceval_float gen_eval_ceval_mixed \
+                  gen_eval_ceval_kernels gen_eval_beval gen_eval_ieval_balanced gen_eval_ceval_balanced \
+                  gen_eval_ieval_reordered gen_eval_ceval_reordered stream_eval ; do
       echo -n '    '$action': ' >/dev/stderr
       result=$(./$BINARY $function $action -$TEST_SECONDS)
       if [ $? != 0 ] ; then
@@ -89,17 +124,51 @@ for cmdline in $CMDLINES ; do
       data+=$result':'
       echo $result >/dev/stderr
     done
-    echo $function' '$data | awk '{
+    echo $function' '$data | awk -v results=$RESULTS -v host="$HOST" -v compiler="$compiler_version" -v jit=$jit '
+    function record(metric, value) {
+      printf ("%s\t%s\t%s\t%s\t%s\t%.6f\n", host, compiler, jit, name, metric, value) >> results;
+    }
+    {
       name=$1;
       gen_spq=1/$2;
       gen_eval_eval_spq=1/$3;
       gen_eval_ieval_spq=1/$4;
       gen_eval_ceval_spq=1/$5;
       compile_time=$6;
+      gen_eval_peval_spq=1/$7;
+      gen_eval_teval_spq=1/$8;
+      gen_eval_teval_float_spq=1/$9;
+      teval_float_error=$10;
+      gen_eval_teval_mixed_spq=1/$11;
+      teval_mixed_error=$12;
+      gen_eval_ceval_float_spq=1/$13;
+      ceval_float_error=$14;
+      gen_eval_ceval_mixed_spq=1/$15;
+      ceval_mixed_error=$16;
+      gen_eval_ceval_kernels_spq=1/$17;
+      gen_eval_beval_spq=1/$19;
+      gen_eval_ieval_balanced_spq=1/$20;
+      gen_eval_ceval_balanced_spq=1/$21;
+      gen_eval_ieval_reordered_spq=1/$23;
+      gen_eval_ceval_reordered_spq=1/$24;
+      stream_eval_krows=0.001*$26;
+      stream_eval_gbps=$27;
       gen_eval_spq=(gen_spq+gen_eval_eval_spq)/2;
       eval_kqps=0.001/(gen_eval_spq-gen_spq);
       ieval_kqps=0.001/(gen_eval_ieval_spq-gen_eval_spq);
       ceval_kqps=0.001/(gen_eval_ceval_spq-gen_eval_spq);
+      peval_kqps=0.001/(gen_eval_peval_spq-gen_eval_spq);
+      teval_kqps=0.001/(gen_eval_teval_spq-gen_eval_spq);
+      teval_float_kqps=0.001/(gen_eval_teval_float_spq-gen_eval_spq);
+      teval_mixed_kqps=0.001/(gen_eval_teval_mixed_spq-gen_eval_spq);
+      ceval_float_kqps=0.001/(gen_eval_ceval_float_spq-gen_eval_spq);
+      ceval_mixed_kqps=0.001/(gen_eval_ceval_mixed_spq-gen_eval_spq);
+      ceval_kernels_kqps=0.001/(gen_eval_ceval_kernels_spq-gen_eval_spq);
+      beval_kqps=0.001/(gen_eval_beval_spq-gen_eval_spq);
+      ieval_balanced_kqps=0.001/(gen_eval_ieval_balanced_spq-gen_eval_spq);
+      ceval_balanced_kqps=0.001/(gen_eval_ceval_balanced_spq-gen_eval_spq);
+      ieval_reordered_kqps=0.001/(gen_eval_ieval_reordered_spq-gen_eval_spq);
+      ceval_reordered_kqps=0.001/(gen_eval_ceval_reordered_spq-gen_eval_spq);
       printf ("<tr>\n");
       printf ("<td align=right>%s</td>\n", name);
       printf ("<td align=right>%.2f kqps</td>\n", eval_kqps);
@@ -108,8 +177,40 @@ for cmdline in $CMDLINES ; do
       printf ("<td align=right>%.0f%%</td>\n", 100 * ieval_kqps / eval_kqps);
       printf ("<td align=right>%.0f%%</td>\n", 100 * ceval_kqps / eval_kqps);
       printf ("<td align=right>%.1fx</td>\n", ceval_kqps / ieval_kqps);
-      printf ("<td align=right>%.2fs</td></tr>\n", compile_time);
+      printf ("<td align=right>%.2fs</td>\n", compile_time);
+      printf ("<td align=right>%.2f kqps</td>\n", peval_kqps);
+      printf ("<td align=right>%.1fx</td>\n", peval_kqps / ieval_kqps);
+      printf ("<td align=right>%.2f kqps</td>\n", teval_kqps);
+      printf ("<td align=right>%.2f kqps (%.1e)</td>\n", teval_float_kqps, teval_float_error);
+      printf ("<td align=right>%.2f kqps (%.1e)</td>\n", teval_mixed_kqps, teval_mixed_error);
+      printf ("<td align=right>%.2f kqps (%.1e)</td>\n", ceval_float_kqps, ceval_float_error);
+      printf ("<td align=right>%.2f kqps (%.1e)</td>\n", ceval_mixed_kqps, ceval_mixed_error);
+      printf ("<td align=right>%.2f kqps</td>\n", ceval_kernels_kqps);
+      printf ("<td align=right>%.2f kqps</td>\n", beval_kqps);
+      printf ("<td align=right>%.1fx</td>\n", beval_kqps / teval_kqps);
+      printf ("<td align=right>%.2f kqps</td>\n", ieval_balanced_kqps);
+      printf ("<td align=right>%.2f kqps</td>\n", ceval_balanced_kqps);
+      printf ("<td align=right>%.1fx</td>\n", ceval_balanced_kqps / ceval_kqps);
+      printf ("<td align=right>%.2f kqps</td>\n", ieval_reordered_kqps);
+      printf ("<td align=right>%.2f kqps</td>\n", ceval_reordered_kqps);
+      printf ("<td align=right>%.2f krows/s (%.2f GB/s)</td>\n", stream_eval_krows, stream_eval_gbps);
       printf ("</tr>\n");
+      record("native", eval_kqps);
+      record("intermediate", ieval_kqps);
+      record("compiled", ceval_kqps);
+      record("parallel", peval_kqps);
+      record("tape", teval_kqps);
+      record("tape_float", teval_float_kqps);
+      record("tape_mixed", teval_mixed_kqps);
+      record("compiled_float", ceval_float_kqps);
+      record("compiled_mixed", ceval_mixed_kqps);
+      record("compiled_kernels", ceval_kernels_kqps);
+      record("batched", beval_kqps);
+      record("intermediate_balanced", ieval_balanced_kqps);
+      record("compiled_balanced", ceval_balanced_kqps);
+      record("intermediate_reordered", ieval_reordered_kqps);
+      record("compiled_reordered", ceval_reordered_kqps);
+      record("streamed", stream_eval_krows);
     }'
   done
   echo '</table>' 
@@ -118,7 +219,15 @@ for cmdline in $CMDLINES ; do
   rm -f $BINARY
 done
 
+IFS="$SAVE_IFS"
+
+echo '<h1>Baseline</h1>'
+echo '<pre>'
+./compare_to_baseline.sh $RESULTS $BASELINE | tee /dev/stderr
+BASELINE_STATUS=${PIPESTATUS[0]}
+echo '</pre>'
+
 echo '<h1>Results</h1>'
 echo "The regression test took $SECONDS seconds to run."
 
-IFS="$SAVE_IFS"
+exit $BASELINE_STATUS
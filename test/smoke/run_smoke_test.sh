@@ -34,7 +34,7 @@ CMDLINES=''
 for compiler in $COMPILERS ; do
   for options in $OPTIONS ; do
     for jit in $JIT ; do
-      CMDLINES+=$compiler' --std=c++11 '$options' -DFNCAS_JIT='$jit' ../eval.cc -I $PWD/autogen -o $BINARY -ldl:'
+      CMDLINES+=$compiler' --std=c++11 '$options' -DFNCAS_JIT='$jit' ../eval.cc -I $PWD/autogen -o $BINARY -ldl -pthread:'
     done
   done
 done
@@ -59,9 +59,36 @@ for cmdline in $CMDLINES ; do
     # 1) gen_eval_eval: Diff native vs. `native wrapper`.
     # 2) gen_eval_ieval: Diff native vs. interpreted byte-code computation.
     # 3) gen_eval_ceval: Diff native vs. compiled function compututation.
-    # 4) test_gradient:  Diff approximate vs. analytically derived gradient.
+    # 4) test_gradient:  Diff approximate vs. analytically derived vs. forward-mode vs. reverse-mode gradient,
+    #                    the reverse-mode one both streamed and checkpointed over the nodes in place.
+    # 5) test_jacobian:  Diff native vs. interpreted vs. compiled vector-valued function and its sparse Jacobian.
+    # 6) gen_eval_ieval_flat, gen_eval_ceval_flat, test_gradient_flat: Same as above, with n-ary nodes.
+    # 7) gen_eval_peval_fine: Diff native vs. multithreaded level-scheduled computation.
+    # 8) gen_eval_meval: Diff native vs. the tape saved into a file and computed memory-mapped from it,
+    #                    the file truncated or corrupt being rejected.
+    # 9) gen_eval_seval: Diff native vs. the function written as a compile-time expression, where it is.
+    # 10) test_precision: Diff single and mixed precision tape vs. compiled vs. streamed computation, and all
+    #                     vs. native, the gradients on the tape, streamed and checkpointed as well.
+    # 11) test_math: Diff the polynomial math kernels vs. libm, within their documented ULP errors,
+    #                the packed SSE2 and AVX2 kernels vs. the scalar ones, bit for bit.
+    # 12) gen_eval_beval, gen_eval_ceval_kernels: Diff native vs. batched and compiled computation with the kernels.
+    # 13) gen_eval_ieval_balanced, gen_eval_ceval_balanced: Same as 2) and 3), with the chains rebalanced into trees.
+    # 14) gen_eval_ieval_reordered, gen_eval_ceval_reordered: Same as 2) and 3), with the nodes reordered.
+    # 15) stream_eval, stream_eval_gradient: Diff native vs. the value and the gradient streamed over mapped files,
+    #                                        and confirm the invalid matrix files are rejected.
+    # 16) gen_eval_ieval_profiled: Same as 2), under the sampling profiler, with its counts adding up.
+    # 17) test_memory: Confirm the memory stats add up, and the limits on the nodes and the bytes are enforced.
+    # 18) test_arena: Confirm the nodes keep their addresses as the graph grows, and are reserved in bulk.
+    # 19) gen_eval_oeval, test_gradient_out_of_core: Same as 2) and 4), with the nodes in a file, streamed over.
+    # 20) test_rows: Confirm the loops nest, and the rows used outside of the loops over their tables are rejected.
     # By specifying no extra parameters, the binary runs in the default "smoke test" mode.
-    for action in gen_eval_eval gen_eval_ieval gen_eval_ceval test_gradient ; do
+    for action in gen_eval_eval gen_eval_ieval gen_eval_ceval test_gradient test_jacobian \
+                  gen_eval_ieval_flat gen_eval_ceval_flat test_gradient_flat gen_eval_peval_fine \
+                  gen_eval_meval gen_eval_seval test_precision test_math gen_eval_beval gen_eval_ceval_kernels \
+                  gen_eval_ieval_balanced gen_eval_ceval_balanced \
+                  gen_eval_ieval_reordered gen_eval_ceval_reordered stream_eval stream_eval_gradient \
+                  gen_eval_ieval_profiled test_memory test_arena \
+                  gen_eval_oeval test_gradient_out_of_core test_rows ; do
       result=$(./$BINARY $function $action)
       if [ $? != 0 ] ; then
         echo 'Error '$result' in '$action